@@ -170,7 +170,7 @@ public:
         fMineBlocksOnDemand = false;
         fSkipProofOfWorkCheck = true;
         fTestnetToBeDeprecatedFieldRPC = false;
-        fHeadersFirstSyncingActive = false;
+        fHeadersFirstSyncingActive = true;
 
         nPoolMaxTransactions = 3;
         strSporkKey = "04F46C34FB8CCD09D237067A6A43E8F3BC36D42F5900A31BA64B2E7366F9A5A24F179C2014390B828B5C018635E24EC4C938CA4031EEC97B29D52FE96E0C737ECD";
@@ -342,6 +342,7 @@ public:
     virtual void setDefaultConsistencyChecks(bool afDefaultConsistencyChecks) { fDefaultConsistencyChecks = afDefaultConsistencyChecks; }
     virtual void setAllowMinDifficultyBlocks(bool afAllowMinDifficultyBlocks) { fAllowMinDifficultyBlocks = afAllowMinDifficultyBlocks; }
     virtual void setSkipProofOfWorkCheck(bool afSkipProofOfWorkCheck) { fSkipProofOfWorkCheck = afSkipProofOfWorkCheck; }
+    virtual void setSnapshotAnchors(const MapSnapshotAnchors& amapSnapshotAnchors) { mapSnapshotAnchors = amapSnapshotAnchors; }
 };
 static CUnitTestParams unitTestParams;
 
@@ -15,10 +15,23 @@
 #include "protocol.h"
 #include "uint256.h"
 
+#include <map>
 #include <vector>
 
 typedef unsigned char MessageStartChars[MESSAGE_START_SIZE];
 
+/** A UTXO set snapshot that -loadutxosnapshot trusts: the hashes of the unspent outputs and of the block index at a block */
+struct CSnapshotAnchor {
+    uint256 hashBlock;
+    uint256 hashSerialized;
+    uint256 hashIndex;
+
+    CSnapshotAnchor() : hashBlock(0), hashSerialized(0), hashIndex(0) {}
+    CSnapshotAnchor(const uint256& hashBlockIn, const uint256& hashSerializedIn, const uint256& hashIndexIn) : hashBlock(hashBlockIn), hashSerialized(hashSerializedIn), hashIndex(hashIndexIn) {}
+};
+
+typedef std::map<int, CSnapshotAnchor> MapSnapshotAnchors;
+
 struct CDNSSeedData {
     std::string name, host;
     CDNSSeedData(const std::string& strName, const std::string& strHost) : name(strName), host(strHost) {}
@@ -91,6 +104,8 @@ public:
     const std::vector<unsigned char>& Base58Prefix(Base58Type type) const { return base58Prefixes[type]; }
     const std::vector<CAddress>& FixedSeeds() const { return vFixedSeeds; }
     virtual const Checkpoints::CCheckpointData& Checkpoints() const = 0;
+    /** UTXO set snapshots accepted by -loadutxosnapshot, by height; pinned by a release like the checkpoints */
+    const MapSnapshotAnchors& SnapshotAnchors() const { return mapSnapshotAnchors; }
     int PoolMaxTransactions() const { return nPoolMaxTransactions; }
     std::string SporkKey() const { return strSporkKey; }
     std::string MasternodePoolDummyAddress() const { return strMasternodePoolDummyAddress; }
@@ -139,6 +154,7 @@ protected:
     std::string strMasternodePoolDummyAddress;
     int64_t nStartMasternodePayments;
     int64_t nBudget_Fee_Confirmations;
+    MapSnapshotAnchors mapSnapshotAnchors;
 };
 
 /**
@@ -158,6 +174,7 @@ public:
     virtual void setDefaultConsistencyChecks(bool aDefaultConsistencyChecks) = 0;
     virtual void setAllowMinDifficultyBlocks(bool aAllowMinDifficultyBlocks) = 0;
     virtual void setSkipProofOfWorkCheck(bool aSkipProofOfWorkCheck) = 0;
+    virtual void setSnapshotAnchors(const MapSnapshotAnchors& amapSnapshotAnchors) = 0;
 };
 
 
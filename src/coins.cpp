@@ -7,6 +7,7 @@
 
 #include "random.h"
 
+#include <algorithm>
 #include <assert.h>
 
 /**
@@ -60,6 +61,15 @@ bool CCoins::Spend(int nPos)
 
 
 bool CCoinsView::GetCoins(const uint256& txid, CCoins& coins) const { return false; }
+bool CCoinsView::GetCoinsOutput(const COutPoint& out, CCoins& coins) const
+{
+    // Views that cannot read one output alone read them all
+    CCoins coinsAll;
+    if (!GetCoins(out.hash, coinsAll) || !coinsAll.IsAvailable(out.n))
+        return false;
+    coins.FromOutput(coinsAll, out.n);
+    return true;
+}
 bool CCoinsView::HaveCoins(const uint256& txid) const { return false; }
 uint256 CCoinsView::GetBestBlock() const { return uint256(0); }
 bool CCoinsView::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) { return false; }
@@ -76,28 +86,94 @@ bool CCoinsViewBacked::GetStats(CCoinsStats& stats) const { return base->GetStat
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0) {}
+CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), hashBlock(0), cachedCoinsUsage(0), nAccessClock(0) {}
 
 CCoinsViewCache::~CCoinsViewCache()
 {
     assert(!hasModifier);
 }
 
+size_t CCoinsViewCache::DynamicMemoryUsage() const
+{
+    return memusage::DynamicUsage(cacheCoins) + cachedCoinsUsage;
+}
+
+void CCoinsViewCache::CompleteCoins(CCoinsMap::iterator it) const
+{
+    CCoinsCacheEntry& entry = it->second;
+    CCoins coins;
+    if (!base->GetCoins(it->first, coins))
+        coins.Clear();
+    cachedCoinsUsage -= entry.DynamicMemoryUsage();
+    if (entry.flags & CCoinsCacheEntry::BASE) {
+        // The parent's version is the whole transaction now, without the
+        // outputs spent here
+        CCoinsCacheEntry entryBase;
+        entryBase.coins = coins;
+        entryBase.RecordBase();
+        for (unsigned int i = 0; i < coins.vout.size(); i++) {
+            if (entry.IsBaseUnspent(i) && !entry.coins.IsAvailable(i))
+                coins.vout[i].SetNull();
+        }
+        coins.Cleanup();
+        entry.vBaseUnspent.swap(entryBase.vBaseUnspent);
+        entry.nBaseHeight = entryBase.nBaseHeight;
+    }
+    entry.coins.swap(coins);
+    entry.flags &= ~CCoinsCacheEntry::PARTIAL;
+    cachedCoinsUsage += entry.DynamicMemoryUsage();
+}
+
 CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256& txid) const
 {
     CCoinsMap::iterator it = cacheCoins.find(txid);
-    if (it != cacheCoins.end())
+    if (it != cacheCoins.end()) {
+        it->second.nLastAccess = ++nAccessClock;
+        if (it->second.flags & CCoinsCacheEntry::PARTIAL)
+            CompleteCoins(it);
         return it;
+    }
     CCoins tmp;
     if (!base->GetCoins(txid, tmp))
         return cacheCoins.end();
     CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry())).first;
+    ret->second.nLastAccess = ++nAccessClock;
     tmp.swap(ret->second.coins);
     if (ret->second.coins.IsPruned()) {
         // The parent only has an empty entry for this txid; we can consider our
         // version as fresh.
         ret->second.flags = CCoinsCacheEntry::FRESH;
     }
+    cachedCoinsUsage += ret->second.DynamicMemoryUsage();
+    return ret;
+}
+
+CCoinsMap::iterator CCoinsViewCache::FetchOutput(const COutPoint& out) const
+{
+    CCoinsMap::iterator it = cacheCoins.find(out.hash);
+    if (it != cacheCoins.end()) {
+        CCoinsCacheEntry& entry = it->second;
+        entry.nLastAccess = ++nAccessClock;
+        CCoins tmp;
+        if (!entry.HasOutput(out.n) && base->GetCoinsOutput(out, tmp)) {
+            cachedCoinsUsage -= entry.DynamicMemoryUsage();
+            if (entry.coins.vout.size() <= out.n)
+                entry.coins.vout.resize(out.n + 1);
+            std::swap(entry.coins.vout[out.n], tmp.vout[out.n]);
+            if (entry.flags & CCoinsCacheEntry::BASE)
+                entry.SetBaseUnspent(out.n);
+            cachedCoinsUsage += entry.DynamicMemoryUsage();
+        }
+        return it;
+    }
+    CCoins tmp;
+    if (!base->GetCoinsOutput(out, tmp))
+        return cacheCoins.end();
+    CCoinsMap::iterator ret = cacheCoins.insert(std::make_pair(out.hash, CCoinsCacheEntry())).first;
+    ret->second.nLastAccess = ++nAccessClock;
+    tmp.swap(ret->second.coins);
+    ret->second.flags = CCoinsCacheEntry::PARTIAL;
+    cachedCoinsUsage += ret->second.DynamicMemoryUsage();
     return ret;
 }
 
@@ -111,10 +187,20 @@ bool CCoinsViewCache::GetCoins(const uint256& txid, CCoins& coins) const
     return false;
 }
 
+bool CCoinsViewCache::GetCoinsOutput(const COutPoint& out, CCoins& coins) const
+{
+    CCoinsMap::const_iterator it = FetchOutput(out);
+    if (it == cacheCoins.end() || !it->second.coins.IsAvailable(out.n))
+        return false;
+    coins.FromOutput(it->second.coins, out.n);
+    return true;
+}
+
 CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256& txid)
 {
     assert(!hasModifier);
     std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
+    size_t cachedCoinUsage = 0;
     if (ret.second) {
         if (!base->GetCoins(txid, ret.first->second.coins)) {
             // The parent view does not have this entry; mark it as fresh.
@@ -124,10 +210,16 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256& txid)
             // The parent view only has a pruned entry for this; mark it as fresh.
             ret.first->second.flags = CCoinsCacheEntry::FRESH;
         }
+    } else {
+        if (ret.first->second.flags & CCoinsCacheEntry::PARTIAL)
+            CompleteCoins(ret.first);
+        cachedCoinUsage = ret.first->second.DynamicMemoryUsage();
     }
     // Assume that whenever ModifyCoins is called, the entry will be modified.
+    ret.first->second.RecordBase();
     ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
-    return CCoinsModifier(*this, ret.first);
+    ret.first->second.nLastAccess = ++nAccessClock;
+    return CCoinsModifier(*this, ret.first, cachedCoinUsage);
 }
 
 const CCoins* CCoinsViewCache::AccessCoins(const uint256& txid) const
@@ -140,6 +232,40 @@ const CCoins* CCoinsViewCache::AccessCoins(const uint256& txid) const
     }
 }
 
+const CCoins* CCoinsViewCache::AccessOutput(const COutPoint& out) const
+{
+    CCoinsMap::const_iterator it = FetchOutput(out);
+    if (it == cacheCoins.end()) {
+        return NULL;
+    } else {
+        return &it->second.coins;
+    }
+}
+
+bool CCoinsViewCache::SpendOutput(const COutPoint& out, CTxInUndo& undo)
+{
+    assert(!hasModifier);
+    CCoinsMap::iterator it = FetchOutput(out);
+    if (it == cacheCoins.end() || !it->second.coins.IsAvailable(out.n))
+        return false;
+    CCoinsCacheEntry& entry = it->second;
+    CCoins& coins = entry.coins;
+    cachedCoinsUsage -= entry.DynamicMemoryUsage();
+    entry.RecordBase();
+    entry.flags |= CCoinsCacheEntry::DIRTY;
+    // Whether or not the other outputs are unspent, the undo record can
+    // restore this one on its own
+    undo = CTxInUndo(coins.vout[out.n], coins.fCoinBase, coins.fCoinStake, coins.nHeight, coins.nVersion);
+    coins.vout[out.n].SetNull();
+    coins.Cleanup();
+    if ((entry.flags & CCoinsCacheEntry::FRESH) && coins.IsPruned()) {
+        cacheCoins.erase(it);
+    } else {
+        cachedCoinsUsage += entry.DynamicMemoryUsage();
+    }
+    return true;
+}
+
 bool CCoinsViewCache::HaveCoins(const uint256& txid) const
 {
     CCoinsMap::const_iterator it = FetchCoins(txid);
@@ -169,7 +295,14 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn
         if (it->second.flags & CCoinsCacheEntry::DIRTY) { // Ignore non-dirty entries (optimization).
             CCoinsMap::iterator itUs = cacheCoins.find(it->first);
             if (itUs == cacheCoins.end()) {
-                if (!it->second.coins.IsPruned()) {
+                if (it->second.flags & CCoinsCacheEntry::PARTIAL) {
+                    // We have the grandparent's version, which the child
+                    // recorded; move the entry up as it is.
+                    CCoinsCacheEntry& entry = cacheCoins[it->first];
+                    std::swap(entry, it->second);
+                    cachedCoinsUsage += entry.DynamicMemoryUsage();
+                    entry.nLastAccess = ++nAccessClock;
+                } else if (!it->second.coins.IsPruned()) {
                     // The parent cache does not have an entry, while the child
                     // cache does have (a non-pruned) one. Move the data up, and
                     // mark it as fresh (if the grandparent did have it, we
@@ -177,23 +310,54 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn
                     assert(it->second.flags & CCoinsCacheEntry::FRESH);
                     CCoinsCacheEntry& entry = cacheCoins[it->first];
                     entry.coins.swap(it->second.coins);
+                    cachedCoinsUsage += entry.DynamicMemoryUsage();
                     entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+                    entry.nLastAccess = ++nAccessClock;
+                }
+            } else if (it->second.flags & CCoinsCacheEntry::PARTIAL) {
+                // The child only read some outputs from us; apply its spends
+                // of those to our version, reading back any we dropped since
+                CCoinsCacheEntry& entry = itUs->second;
+                for (unsigned int i = 0; i < it->second.coins.vout.size(); i++) {
+                    if (it->second.IsBaseUnspent(i) && !it->second.coins.IsAvailable(i))
+                        FetchOutput(COutPoint(it->first, i));
+                }
+                cachedCoinsUsage -= entry.DynamicMemoryUsage();
+                entry.RecordBase();
+                for (unsigned int i = 0; i < entry.coins.vout.size(); i++) {
+                    if (it->second.IsBaseUnspent(i) && !it->second.coins.IsAvailable(i))
+                        entry.coins.vout[i].SetNull();
+                }
+                entry.coins.Cleanup();
+                if ((entry.flags & CCoinsCacheEntry::FRESH) && entry.coins.IsPruned()) {
+                    cacheCoins.erase(itUs);
+                } else {
+                    cachedCoinsUsage += entry.DynamicMemoryUsage();
+                    entry.flags |= CCoinsCacheEntry::DIRTY;
+                    entry.nLastAccess = ++nAccessClock;
                 }
             } else {
                 if ((itUs->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
                     // The grandparent does not have an entry, and the child is
                     // modified and being pruned. This means we can just delete
                     // it from the parent.
+                    cachedCoinsUsage -= itUs->second.DynamicMemoryUsage();
                     cacheCoins.erase(itUs);
                 } else {
                     // A normal modification.
+                    cachedCoinsUsage -= itUs->second.DynamicMemoryUsage();
+                    itUs->second.RecordBase();
                     itUs->second.coins.swap(it->second.coins);
+                    cachedCoinsUsage += itUs->second.DynamicMemoryUsage();
                     itUs->second.flags |= CCoinsCacheEntry::DIRTY;
+                    itUs->second.flags &= ~CCoinsCacheEntry::PARTIAL;
+                    itUs->second.nLastAccess = ++nAccessClock;
                 }
             }
+            mapCoins.erase(it++);
+        } else {
+            it++;
         }
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
     }
     hashBlock = hashBlockIn;
     return true;
@@ -203,9 +367,70 @@ bool CCoinsViewCache::Flush()
 {
     bool fOk = base->BatchWrite(cacheCoins, hashBlock);
     cacheCoins.clear();
+    cachedCoinsUsage = 0;
+    return fOk;
+}
+
+bool CCoinsViewCache::Sync()
+{
+    assert(!hasModifier);
+    // The modified entries are written from the cache itself. A base that
+    // takes some over erases them; the others stay here, marked clean.
+    bool fOk = base->BatchWrite(cacheCoins, hashBlock);
+    cachedCoinsUsage = 0;
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end();) {
+        if (fOk && (it->second.flags & CCoinsCacheEntry::DIRTY)) {
+            if (it->second.coins.IsPruned()) {
+                // Spent entries were deleted from (or never reached) the base
+                cacheCoins.erase(it++);
+                continue;
+            }
+            // The base has this version now; a partial entry still misses
+            // the outputs it never read
+            it->second.ClearBase();
+            it->second.flags &= CCoinsCacheEntry::PARTIAL;
+        }
+        cachedCoinsUsage += it->second.DynamicMemoryUsage();
+        it++;
+    }
     return fOk;
 }
 
+namespace
+{
+struct CompareAge {
+    bool operator()(const std::pair<uint32_t, CCoinsMap::iterator>& a, const std::pair<uint32_t, CCoinsMap::iterator>& b) const
+    {
+        return a.first > b.first;
+    }
+};
+}
+
+size_t CCoinsViewCache::Trim(size_t nTargetUsage)
+{
+    assert(!hasModifier);
+    if (DynamicMemoryUsage() <= nTargetUsage)
+        return 0;
+
+    // Order the unmodified entries from the least recently used; ages are
+    // taken relative to the clock so they stay correct when it wraps.
+    std::vector<std::pair<uint32_t, CCoinsMap::iterator> > vEntries;
+    vEntries.reserve(cacheCoins.size());
+    for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+        if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+            vEntries.push_back(std::make_pair(nAccessClock - it->second.nLastAccess, it));
+    }
+    std::sort(vEntries.begin(), vEntries.end(), CompareAge());
+
+    size_t nDropped = 0;
+    for (size_t i = 0; i < vEntries.size() && DynamicMemoryUsage() > nTargetUsage; i++) {
+        cachedCoinsUsage -= vEntries[i].second->second.DynamicMemoryUsage();
+        cacheCoins.erase(vEntries[i].second);
+        nDropped++;
+    }
+    return nDropped;
+}
+
 unsigned int CCoinsViewCache::GetCacheSize() const
 {
     return cacheCoins.size();
@@ -213,7 +438,7 @@ unsigned int CCoinsViewCache::GetCacheSize() const
 
 const CTxOut& CCoinsViewCache::GetOutputFor(const CTxIn& input) const
 {
-    const CCoins* coins = AccessCoins(input.prevout.hash);
+    const CCoins* coins = AccessOutput(input.prevout);
     assert(coins && coins->IsAvailable(input.prevout.n));
     return coins->vout[input.prevout.n];
 }
@@ -235,7 +460,7 @@ bool CCoinsViewCache::HaveInputs(const CTransaction& tx) const
     if (!tx.IsCoinBase()) {
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             const COutPoint& prevout = tx.vin[i].prevout;
-            const CCoins* coins = AccessCoins(prevout.hash);
+            const CCoins* coins = AccessOutput(prevout);
             if (!coins || !coins->IsAvailable(prevout.n)) {
                 return false;
             }
@@ -250,9 +475,8 @@ double CCoinsViewCache::GetPriority(const CTransaction& tx, int nHeight) const
         return 0.0;
     double dResult = 0.0;
     for (const CTxIn& txin:  tx.vin) {
-        const CCoins* coins = AccessCoins(txin.prevout.hash);
-        assert(coins);
-        if (!coins->IsAvailable(txin.prevout.n)) continue;
+        const CCoins* coins = AccessOutput(txin.prevout);
+        if (!coins || !coins->IsAvailable(txin.prevout.n)) continue;
         if (coins->nHeight < nHeight) {
             dResult += coins->vout[txin.prevout.n].nValue * (nHeight - coins->nHeight);
         }
@@ -260,7 +484,7 @@ double CCoinsViewCache::GetPriority(const CTransaction& tx, int nHeight) const
     return tx.ComputePriority(dResult);
 }
 
-CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_) : cache(cache_), it(it_)
+CCoinsModifier::CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage) : cache(cache_), it(it_), cachedCoinUsage(usage)
 {
     assert(!cache.hasModifier);
     cache.hasModifier = true;
@@ -271,7 +495,11 @@ CCoinsModifier::~CCoinsModifier()
     assert(cache.hasModifier);
     cache.hasModifier = false;
     it->second.coins.Cleanup();
+    cache.cachedCoinsUsage -= cachedCoinUsage; // Subtract the old usage
     if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
         cache.cacheCoins.erase(it);
+    } else {
+        // If the coin still exists after the modification, add the new usage
+        cache.cachedCoinsUsage += it->second.DynamicMemoryUsage();
     }
 }
@@ -7,6 +7,7 @@
 #define BITCOIN_COINS_H
 
 #include "compressor.h"
+#include "memusage.h"
 #include "script/standard.h"
 #include "serialize.h"
 #include "uint256.h"
@@ -116,6 +117,18 @@ public:
     //! empty constructor
     CCoins() : fCoinBase(false), fCoinStake(false), vout(0), nHeight(0), nVersion(0) {}
 
+    //! keep the metadata of coinsIn and its output nPos only, leaving the other outputs null
+    void FromOutput(const CCoins& coinsIn, unsigned int nPos)
+    {
+        fCoinBase = coinsIn.fCoinBase;
+        fCoinStake = coinsIn.fCoinStake;
+        nHeight = coinsIn.nHeight;
+        nVersion = coinsIn.nVersion;
+        std::vector<CTxOut>().swap(vout);
+        vout.resize(nPos + 1);
+        vout[nPos] = coinsIn.vout[nPos];
+    }
+
     //!remove spent outputs at the end of vout
     void Cleanup()
     {
@@ -283,6 +296,16 @@ public:
                 return false;
         return true;
     }
+
+    size_t DynamicMemoryUsage() const
+    {
+        size_t ret = memusage::DynamicUsage(vout);
+        BOOST_FOREACH (const CTxOut& out, vout) {
+            const std::vector<unsigned char>* script = &out.scriptPubKey;
+            ret += memusage::DynamicUsage(*script);
+        }
+        return ret;
+    }
 };
 
 class CCoinsKeyHasher
@@ -307,13 +330,67 @@ public:
 struct CCoinsCacheEntry {
     CCoins coins; // The actual cached data.
     unsigned char flags;
+    uint32_t nLastAccess; // Value of the owning cache's access clock when this entry was last used.
+    // With BASE: the outputs the parent view has unspent (one bit each) and
+    // the height of its version, so the entry can be written without reading it.
+    std::vector<unsigned char> vBaseUnspent;
+    int nBaseHeight;
 
     enum Flags {
         DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
         FRESH = (1 << 1), // The parent view does not have this entry (or it is pruned).
+        BASE = (1 << 2),  // vBaseUnspent and nBaseHeight describe the version in the parent view.
+        // Only some outputs were read from the parent view: the ones still unspent here, and with BASE
+        // the ones in vBaseUnspent. The others are null but may be unspent in the parent view.
+        PARTIAL = (1 << 3),
     };
 
-    CCoinsCacheEntry() : coins(), flags(0) {}
+    CCoinsCacheEntry() : coins(), flags(0), nLastAccess(0), nBaseHeight(0) {}
+
+    //! Remember the parent's version of an entry before it first changes
+    void RecordBase()
+    {
+        if (flags & (DIRTY | FRESH | BASE))
+            return;
+        vBaseUnspent.assign((coins.vout.size() + 7) / 8, 0);
+        for (unsigned int i = 0; i < coins.vout.size(); i++) {
+            if (coins.IsAvailable(i))
+                vBaseUnspent[i / 8] |= 1 << (i % 8);
+        }
+        nBaseHeight = coins.nHeight;
+        flags |= BASE;
+    }
+
+    //! Forget the parent's version, once the entry matches it again
+    void ClearBase()
+    {
+        std::vector<unsigned char>().swap(vBaseUnspent);
+        flags &= ~BASE;
+    }
+
+    bool IsBaseUnspent(unsigned int n) const
+    {
+        return n / 8 < vBaseUnspent.size() && (vBaseUnspent[n / 8] & (1 << (n % 8))) != 0;
+    }
+
+    //! Record an output read from the parent after the entry first changed
+    void SetBaseUnspent(unsigned int n)
+    {
+        if (vBaseUnspent.size() <= n / 8)
+            vBaseUnspent.resize(n / 8 + 1, 0);
+        vBaseUnspent[n / 8] |= 1 << (n % 8);
+    }
+
+    //! Whether a partial entry has read output n from the parent
+    bool HasOutput(unsigned int n) const
+    {
+        return !(flags & PARTIAL) || coins.IsAvailable(n) || IsBaseUnspent(n);
+    }
+
+    size_t DynamicMemoryUsage() const
+    {
+        return coins.DynamicMemoryUsage() + memusage::DynamicUsage(vBaseUnspent);
+    }
 };
 
 typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
@@ -338,6 +415,10 @@ public:
     //! Retrieve the CCoins (unspent transaction outputs) for a given txid
     virtual bool GetCoins(const uint256& txid, CCoins& coins) const;
 
+    //! Retrieve the metadata of a transaction and one of its outputs, the
+    //! others left null. Returns false unless that output is unspent.
+    virtual bool GetCoinsOutput(const COutPoint& out, CCoins& coins) const;
+
     //! Just check whether we have data for a given txid.
     //! This may (but cannot always) return true for fully spent transactions
     virtual bool HaveCoins(const uint256& txid) const;
@@ -346,7 +427,8 @@ public:
     virtual uint256 GetBestBlock() const;
 
     //! Do a bulk modification (multiple CCoins changes + BestBlock change).
-    //! The passed mapCoins can be modified.
+    //! Only the dirty entries of mapCoins are written. Entries the view takes
+    //! over are erased from mapCoins; the others are left to the caller.
     virtual bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
 
     //! Calculate statistics about the unspent transaction output set
@@ -398,7 +480,8 @@ class CCoinsModifier
 private:
     CCoinsViewCache& cache;
     CCoinsMap::iterator it;
-    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_);
+    size_t cachedCoinUsage; // Cached memory usage of the CCoins object before modification
+    CCoinsModifier(CCoinsViewCache& cache_, CCoinsMap::iterator it_, size_t usage);
 
 public:
     CCoins* operator->() { return &it->second.coins; }
@@ -421,12 +504,19 @@ protected:
     mutable uint256 hashBlock;
     mutable CCoinsMap cacheCoins;
 
+    /* Cached dynamic memory usage for the inner CCoins objects. */
+    mutable size_t cachedCoinsUsage;
+
+    /* Incremented on every entry access, to find the least recently used ones. */
+    mutable uint32_t nAccessClock;
+
 public:
     CCoinsViewCache(CCoinsView* baseIn);
     ~CCoinsViewCache();
 
     // Standard CCoinsView methods
     bool GetCoins(const uint256& txid, CCoins& coins) const;
+    bool GetCoinsOutput(const COutPoint& out, CCoins& coins) const;
     bool HaveCoins(const uint256& txid) const;
     uint256 GetBestBlock() const;
     void SetBestBlock(const uint256& hashBlock);
@@ -439,6 +529,20 @@ public:
      */
     const CCoins* AccessCoins(const uint256& txid) const;
 
+    /**
+     * Like AccessCoins, but only the metadata and the output out are read
+     * into the cache, not the other outputs of the transaction; they may be
+     * null in the returned CCoins. NULL if the transaction is not found.
+     */
+    const CCoins* AccessOutput(const COutPoint& out) const;
+
+    /**
+     * Mark an output spent, reading only that one into the cache, and
+     * construct undo information that always carries the transaction's
+     * metadata. Returns false if the output is not unspent.
+     */
+    bool SpendOutput(const COutPoint& out, CTxInUndo& undo);
+
     /**
      * Return a modifiable reference to a CCoins. If no entry with the given
      * txid exists, a new one is created. Simultaneous modifications are not
@@ -453,9 +557,28 @@ public:
      */
     bool Flush();
 
+    /**
+     * Push the modifications applied to this cache to its base, like Flush, but
+     * keep the entries the base leaves behind, marked as unmodified. No copy
+     * of the modified entries is made.
+     * If false is returned, the state of this cache (and its backing view) will be undefined.
+     */
+    bool Sync();
+
+    /**
+     * Drop the least recently used unmodified entries until the memory usage is
+     * at most nTargetUsage, or only modified entries are left. Must not be
+     * called while a cache on top of this one has pending modifications.
+     * Returns the number of entries dropped.
+     */
+    size_t Trim(size_t nTargetUsage);
+
     //! Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize() const;
 
+    //! Calculate the size of the cache (in bytes), including the map nodes and the coins they own
+    size_t DynamicMemoryUsage() const;
+
     /** 
      * Amount of hash coming in to a transaction
      * Note that lightweight clients may not know anything besides the hash of previous transactions,
@@ -479,6 +602,9 @@ public:
 private:
     CCoinsMap::iterator FetchCoins(const uint256& txid);
     CCoinsMap::const_iterator FetchCoins(const uint256& txid) const;
+    CCoinsMap::iterator FetchOutput(const COutPoint& out) const;
+    //! Read the outputs a partial entry is missing from the base
+    void CompleteCoins(CCoinsMap::iterator it) const;
 };
 
 #endif // BITCOIN_COINS_H
@@ -0,0 +1,44 @@
+// Copyright (c) 2017-2018 The Bitcoin Core developers
+// Copyright (c) 2018 The Hash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COMPAT_CPUID_H
+#define BITCOIN_COMPAT_CPUID_H
+
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__amd64__) || defined(__i386__)
+#define HAVE_GETCPUID
+
+#include <cpuid.h>
+
+// We can't use cpuid.h's __get_cpuid as it does not support subleafs.
+void static inline GetCPUID(uint32_t leaf, uint32_t subleaf, uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d)
+{
+#ifdef __GNUC__
+    __cpuid_count(leaf, subleaf, a, b, c, d);
+#else
+    __asm__("cpuid"
+            : "=a"(a), "=b"(b), "=c"(c), "=d"(d)
+            : "0"(leaf), "2"(subleaf));
+#endif
+}
+
+/** Whether the OS saves the YMM registers on context switch (required before using AVX). */
+bool static inline AVXEnabled()
+{
+    uint32_t a, b, c, d;
+    GetCPUID(1, 0, a, b, c, d);
+    bool have_xsave = (c >> 27) & 1;
+    bool have_avx = (c >> 28) & 1;
+    if (!have_xsave || !have_avx) return false;
+    uint32_t lo, hi;
+    __asm__("xgetbv"
+            : "=a"(lo), "=d"(hi)
+            : "c"(0));
+    return (lo & 6) == 6;
+}
+
+#endif // defined(__x86_64__) || defined(__amd64__) || defined(__i386__)
+#endif // BITCOIN_COMPAT_CPUID_H
@@ -0,0 +1,585 @@
+// Copyright (c) 2018 The Hash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/hash-config.h"
+#endif
+
+#include "crypto/quark.h"
+
+#include "compat/cpuid.h"
+#include "crypto/common.h"
+#include "crypto/sph_blake.h"
+#include "crypto/sph_groestl.h"
+#include "crypto/sph_jh.h"
+
+#include <string.h>
+#include <vector>
+
+#if defined(ENABLE_AVX2)
+namespace quark_avx2
+{
+void Blake512_4way(unsigned char* const out[4], const unsigned char* const in[4], size_t len);
+void Bmw512_4way(unsigned char* const out[4], const unsigned char* const in[4]);
+void Keccak512_4way(unsigned char* const out[4], const unsigned char* const in[4]);
+void Skein512_4way(unsigned char* const out[4], const unsigned char* const in[4]);
+void Jh512_4way(unsigned char* const out[4], const unsigned char* const in[4]);
+void Jh512(unsigned char* out, const unsigned char* in);
+}
+#endif
+
+#if defined(ENABLE_AESNI)
+namespace quark_aesni
+{
+void Groestl512(unsigned char* out, const unsigned char* in);
+}
+#endif
+
+namespace
+{
+/** Hash a single 64-byte input. The output may alias the input. */
+typedef void (*Hash1Fn)(unsigned char* out, const unsigned char* in);
+/** Hash four independent 64-byte inputs. Each output may alias its input. */
+typedef void (*Hash4Fn)(unsigned char* const out[4], const unsigned char* const in[4]);
+typedef void (*Blake1Fn)(unsigned char* out, const unsigned char* in, size_t len);
+typedef void (*Blake4Fn)(unsigned char* const out[4], const unsigned char* const in[4], size_t len);
+
+void Blake512Generic(unsigned char* out, const unsigned char* in, size_t len)
+{
+    sph_blake512_context ctx;
+    sph_blake512_init(&ctx);
+    sph_blake512(&ctx, in, len);
+    sph_blake512_close(&ctx, out);
+}
+
+// Single block versions of Blake-512, BMW-512, Keccak-512 and Skein-512.
+// The message words are loaded straight from the input with the padding
+// as constants, so the sph buffering and finalization are skipped.
+
+uint64_t inline Rotl64(uint64_t x, int n) { return (x << n) | (x >> (64 - n)); }
+uint64_t inline Rotr64(uint64_t x, int n) { return (x >> n) | (x << (64 - n)); }
+
+/* ----------- Blake-512 ------------------------------------------------- */
+
+const uint64_t blake_iv[8] = {
+    0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL, 0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+    0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL, 0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL};
+
+const uint64_t blake_cb[16] = {
+    0x243F6A8885A308D3ULL, 0x13198A2E03707344ULL, 0xA4093822299F31D0ULL, 0x082EFA98EC4E6C89ULL,
+    0x452821E638D01377ULL, 0xBE5466CF34E90C6CULL, 0xC0AC29B7C97C50DDULL, 0x3F84D5B5B5470917ULL,
+    0x9216D5D98979FB1BULL, 0xD1310BA698DFB5ACULL, 0x2FFD72DBD01ADFB7ULL, 0xB8E1AFED6A267E96ULL,
+    0xBA7C9045F12C7F99ULL, 0x24A19947B3916CF7ULL, 0x0801F2E2858EFC16ULL, 0x636920D871574E69ULL};
+
+const unsigned char blake_sigma[10][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+    {11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+    {7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+    {9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+    {2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+    {12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+    {13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+    {6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+    {10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0}};
+
+/** Blake-512 single block messages may be at most this long */
+const size_t MAX_BLAKE_SINGLE_LEN = 111;
+
+void inline BlakeG(uint64_t& a, uint64_t& b, uint64_t& c, uint64_t& d, const uint64_t* m, const unsigned char* s, int i)
+{
+    a += b + (m[s[i]] ^ blake_cb[s[i + 1]]);
+    d = Rotr64(d ^ a, 32);
+    c += d;
+    b = Rotr64(b ^ c, 25);
+    a += b + (m[s[i + 1]] ^ blake_cb[s[i]]);
+    d = Rotr64(d ^ a, 16);
+    c += d;
+    b = Rotr64(b ^ c, 11);
+}
+
+/** Compress the last and only block m of a message of len bytes */
+void BlakeCompressLast(unsigned char* out, const uint64_t* m, size_t len)
+{
+    uint64_t v[16];
+    for (int i = 0; i < 8; i++)
+        v[i] = blake_iv[i];
+    v[8] = blake_cb[0];
+    v[9] = blake_cb[1];
+    v[10] = blake_cb[2];
+    v[11] = blake_cb[3];
+    v[12] = ((uint64_t)len << 3) ^ blake_cb[4];
+    v[13] = ((uint64_t)len << 3) ^ blake_cb[5];
+    v[14] = blake_cb[6];
+    v[15] = blake_cb[7];
+
+    for (int r = 0; r < 16; r++) {
+        const unsigned char* s = blake_sigma[r % 10];
+        BlakeG(v[0], v[4], v[8], v[12], m, s, 0);
+        BlakeG(v[1], v[5], v[9], v[13], m, s, 2);
+        BlakeG(v[2], v[6], v[10], v[14], m, s, 4);
+        BlakeG(v[3], v[7], v[11], v[15], m, s, 6);
+        BlakeG(v[0], v[5], v[10], v[15], m, s, 8);
+        BlakeG(v[1], v[6], v[11], v[12], m, s, 10);
+        BlakeG(v[2], v[7], v[8], v[13], m, s, 12);
+        BlakeG(v[3], v[4], v[9], v[14], m, s, 14);
+    }
+
+    for (int i = 0; i < 8; i++)
+        WriteBE64(out + 8 * i, blake_iv[i] ^ v[i] ^ v[i + 8]);
+}
+
+void Blake512Fixed(unsigned char* out, const unsigned char* in, size_t len)
+{
+    uint64_t m[16];
+    if (len == 64) {
+        for (int i = 0; i < 8; i++)
+            m[i] = ReadBE64(in + 8 * i);
+        m[8] = 0x8000000000000000ULL;
+        for (int i = 9; i < 13; i++)
+            m[i] = 0;
+        m[13] = 1;
+        m[14] = 0;
+        m[15] = 512;
+    } else if (len <= MAX_BLAKE_SINGLE_LEN) {
+        // Block headers: pad into the one block
+        unsigned char block[128] = {};
+        memcpy(block, in, len);
+        block[len] = 0x80;
+        block[111] |= 1;
+        for (int i = 0; i < 15; i++)
+            m[i] = ReadBE64(block + 8 * i);
+        m[15] = (uint64_t)len << 3;
+    } else {
+        Blake512Generic(out, in, len);
+        return;
+    }
+    BlakeCompressLast(out, m, len);
+}
+
+/* ----------- BMW-512 --------------------------------------------------- */
+
+const uint64_t bmw_iv[16] = {
+    0x8081828384858687ULL, 0x88898A8B8C8D8E8FULL, 0x9091929394959697ULL, 0x98999A9B9C9D9E9FULL,
+    0xA0A1A2A3A4A5A6A7ULL, 0xA8A9AAABACADAEAFULL, 0xB0B1B2B3B4B5B6B7ULL, 0xB8B9BABBBCBDBEBFULL,
+    0xC0C1C2C3C4C5C6C7ULL, 0xC8C9CACBCCCDCECFULL, 0xD0D1D2D3D4D5D6D7ULL, 0xD8D9DADBDCDDDEDFULL,
+    0xE0E1E2E3E4E5E6E7ULL, 0xE8E9EAEBECEDEEEFULL, 0xF0F1F2F3F4F5F6F7ULL, 0xF8F9FAFBFCFDFEFFULL};
+
+uint64_t inline BmwS0(uint64_t x) { return (x >> 1) ^ (x << 3) ^ Rotl64(x, 4) ^ Rotl64(x, 37); }
+uint64_t inline BmwS1(uint64_t x) { return (x >> 1) ^ (x << 2) ^ Rotl64(x, 13) ^ Rotl64(x, 43); }
+uint64_t inline BmwS2(uint64_t x) { return (x >> 2) ^ (x << 1) ^ Rotl64(x, 19) ^ Rotl64(x, 53); }
+uint64_t inline BmwS3(uint64_t x) { return (x >> 2) ^ (x << 2) ^ Rotl64(x, 28) ^ Rotl64(x, 59); }
+uint64_t inline BmwS4(uint64_t x) { return (x >> 1) ^ x; }
+uint64_t inline BmwS5(uint64_t x) { return (x >> 2) ^ x; }
+
+uint64_t inline BmwAddElt(const uint64_t* m, const uint64_t* h, int j)
+{
+    uint64_t t = Rotl64(m[j & 15], (j & 15) + 1) + Rotl64(m[(j + 3) & 15], ((j + 3) & 15) + 1);
+    t -= Rotl64(m[(j + 10) & 15], ((j + 10) & 15) + 1);
+    t += (uint64_t)(j + 16) * 0x0555555555555555ULL;
+    return t ^ h[(j + 7) & 15];
+}
+
+/** One BMW-512 compression of message m under chaining value h. */
+void BmwCompress(const uint64_t* m, const uint64_t* h, uint64_t* dh)
+{
+    uint64_t mh[16], w[16], q[32];
+    for (int i = 0; i < 16; i++)
+        mh[i] = m[i] ^ h[i];
+
+    w[0] = mh[5] - mh[7] + mh[10] + mh[13] + mh[14];
+    w[1] = mh[6] - mh[8] + mh[11] + mh[14] - mh[15];
+    w[2] = mh[0] + mh[7] + mh[9] - mh[12] + mh[15];
+    w[3] = mh[0] - mh[1] + mh[8] - mh[10] + mh[13];
+    w[4] = mh[1] + mh[2] + mh[9] - mh[11] - mh[14];
+    w[5] = mh[3] - mh[2] + mh[10] - mh[12] + mh[15];
+    w[6] = mh[4] - mh[0] - mh[3] - mh[11] + mh[13];
+    w[7] = mh[1] - mh[4] - mh[5] - mh[12] - mh[14];
+    w[8] = mh[2] - mh[5] - mh[6] + mh[13] - mh[15];
+    w[9] = mh[0] - mh[3] + mh[6] - mh[7] + mh[14];
+    w[10] = mh[8] - mh[1] - mh[4] - mh[7] + mh[15];
+    w[11] = mh[8] - mh[0] - mh[2] - mh[5] + mh[9];
+    w[12] = mh[1] + mh[3] - mh[6] - mh[9] + mh[10];
+    w[13] = mh[2] + mh[4] + mh[7] + mh[10] + mh[11];
+    w[14] = mh[3] - mh[5] + mh[8] - mh[11] - mh[12];
+    w[15] = mh[12] - mh[4] - mh[6] - mh[9] + mh[13];
+
+    for (int i = 0; i < 15; i += 5) {
+        q[i + 0] = BmwS0(w[i + 0]) + h[i + 1];
+        q[i + 1] = BmwS1(w[i + 1]) + h[i + 2];
+        q[i + 2] = BmwS2(w[i + 2]) + h[i + 3];
+        q[i + 3] = BmwS3(w[i + 3]) + h[i + 4];
+        q[i + 4] = BmwS4(w[i + 4]) + h[i + 5];
+    }
+    q[15] = BmwS0(w[15]) + h[0];
+
+    for (int i = 16; i < 18; i++) {
+        uint64_t t = BmwAddElt(m, h, i - 16);
+        for (int k = 0; k < 16; k += 4)
+            t += BmwS1(q[i - 16 + k]) + BmwS2(q[i - 15 + k]) + BmwS3(q[i - 14 + k]) + BmwS0(q[i - 13 + k]);
+        q[i] = t;
+    }
+    for (int i = 18; i < 32; i++) {
+        uint64_t t = BmwAddElt(m, h, i - 16);
+        t += q[i - 16] + Rotl64(q[i - 15], 5) + q[i - 14] + Rotl64(q[i - 13], 11);
+        t += q[i - 12] + Rotl64(q[i - 11], 27) + q[i - 10] + Rotl64(q[i - 9], 32);
+        t += q[i - 8] + Rotl64(q[i - 7], 37) + q[i - 6] + Rotl64(q[i - 5], 43);
+        t += q[i - 4] + Rotl64(q[i - 3], 53) + BmwS4(q[i - 2]) + BmwS5(q[i - 1]);
+        q[i] = t;
+    }
+
+    uint64_t xl = q[16] ^ q[17] ^ q[18] ^ q[19] ^ q[20] ^ q[21] ^ q[22] ^ q[23];
+    uint64_t xh = xl ^ q[24] ^ q[25] ^ q[26] ^ q[27] ^ q[28] ^ q[29] ^ q[30] ^ q[31];
+
+    dh[0] = ((xh << 5) ^ (q[16] >> 5) ^ m[0]) + (xl ^ q[24] ^ q[0]);
+    dh[1] = ((xh >> 7) ^ (q[17] << 8) ^ m[1]) + (xl ^ q[25] ^ q[1]);
+    dh[2] = ((xh >> 5) ^ (q[18] << 5) ^ m[2]) + (xl ^ q[26] ^ q[2]);
+    dh[3] = ((xh >> 1) ^ (q[19] << 5) ^ m[3]) + (xl ^ q[27] ^ q[3]);
+    dh[4] = ((xh >> 3) ^ q[20] ^ m[4]) + (xl ^ q[28] ^ q[4]);
+    dh[5] = ((xh << 6) ^ (q[21] >> 6) ^ m[5]) + (xl ^ q[29] ^ q[5]);
+    dh[6] = ((xh >> 4) ^ (q[22] << 6) ^ m[6]) + (xl ^ q[30] ^ q[6]);
+    dh[7] = ((xh >> 11) ^ (q[23] << 2) ^ m[7]) + (xl ^ q[31] ^ q[7]);
+    dh[8] = Rotl64(dh[4], 9) + (xh ^ q[24] ^ m[8]) + ((xl << 8) ^ q[23] ^ q[8]);
+    dh[9] = Rotl64(dh[5], 10) + (xh ^ q[25] ^ m[9]) + ((xl >> 6) ^ q[16] ^ q[9]);
+    dh[10] = Rotl64(dh[6], 11) + (xh ^ q[26] ^ m[10]) + ((xl << 6) ^ q[17] ^ q[10]);
+    dh[11] = Rotl64(dh[7], 12) + (xh ^ q[27] ^ m[11]) + ((xl << 4) ^ q[18] ^ q[11]);
+    dh[12] = Rotl64(dh[0], 13) + (xh ^ q[28] ^ m[12]) + ((xl >> 3) ^ q[19] ^ q[12]);
+    dh[13] = Rotl64(dh[1], 14) + (xh ^ q[29] ^ m[13]) + ((xl >> 4) ^ q[20] ^ q[13]);
+    dh[14] = Rotl64(dh[2], 15) + (xh ^ q[30] ^ m[14]) + ((xl >> 7) ^ q[21] ^ q[14]);
+    dh[15] = Rotl64(dh[3], 16) + (xh ^ q[31] ^ m[15]) + ((xl >> 2) ^ q[22] ^ q[15]);
+}
+
+void Bmw512Fixed(unsigned char* out, const unsigned char* in)
+{
+    uint64_t m[16], h[16], h2[16];
+    for (int i = 0; i < 8; i++)
+        m[i] = ReadLE64(in + 8 * i);
+    m[8] = 0x80;
+    for (int i = 9; i < 15; i++)
+        m[i] = 0;
+    m[15] = 512;
+    BmwCompress(m, bmw_iv, h2);
+
+    // Final compression keyed with the constant 0xaaaaaaaaaaaaaaa0 + i
+    for (int i = 0; i < 16; i++)
+        h[i] = 0xaaaaaaaaaaaaaaa0ULL + i;
+    BmwCompress(h2, h, m);
+    for (int i = 0; i < 8; i++)
+        WriteLE64(out + 8 * i, m[i + 8]);
+}
+
+/* ----------- Keccak-512 ------------------------------------------------ */
+
+const uint64_t keccak_rc[24] = {
+    0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808AULL, 0x8000000080008000ULL,
+    0x000000000000808BULL, 0x0000000080000001ULL, 0x8000000080008081ULL, 0x8000000000008009ULL,
+    0x000000000000008AULL, 0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000AULL,
+    0x000000008000808BULL, 0x800000000000008BULL, 0x8000000000008089ULL, 0x8000000000008003ULL,
+    0x8000000000008002ULL, 0x8000000000000080ULL, 0x000000000000800AULL, 0x800000008000000AULL,
+    0x8000000080008081ULL, 0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL};
+
+void KeccakF1600(uint64_t* a)
+{
+    uint64_t b[25], c[5], d;
+    for (int round = 0; round < 24; round++) {
+        // Theta
+        for (int x = 0; x < 5; x++)
+            c[x] = a[x] ^ a[x + 5] ^ a[x + 10] ^ a[x + 15] ^ a[x + 20];
+        for (int x = 0; x < 5; x++) {
+            d = c[(x + 4) % 5] ^ Rotl64(c[(x + 1) % 5], 1);
+            for (int y = 0; y < 25; y += 5)
+                a[y + x] ^= d;
+        }
+        // Rho and Pi
+        b[0] = a[0];
+        b[1] = Rotl64(a[6], 44);
+        b[2] = Rotl64(a[12], 43);
+        b[3] = Rotl64(a[18], 21);
+        b[4] = Rotl64(a[24], 14);
+        b[5] = Rotl64(a[3], 28);
+        b[6] = Rotl64(a[9], 20);
+        b[7] = Rotl64(a[10], 3);
+        b[8] = Rotl64(a[16], 45);
+        b[9] = Rotl64(a[22], 61);
+        b[10] = Rotl64(a[1], 1);
+        b[11] = Rotl64(a[7], 6);
+        b[12] = Rotl64(a[13], 25);
+        b[13] = Rotl64(a[19], 8);
+        b[14] = Rotl64(a[20], 18);
+        b[15] = Rotl64(a[4], 27);
+        b[16] = Rotl64(a[5], 36);
+        b[17] = Rotl64(a[11], 10);
+        b[18] = Rotl64(a[17], 15);
+        b[19] = Rotl64(a[23], 56);
+        b[20] = Rotl64(a[2], 62);
+        b[21] = Rotl64(a[8], 55);
+        b[22] = Rotl64(a[14], 39);
+        b[23] = Rotl64(a[15], 41);
+        b[24] = Rotl64(a[21], 2);
+        // Chi
+        for (int y = 0; y < 25; y += 5)
+            for (int x = 0; x < 5; x++)
+                a[y + x] = b[y + x] ^ (~b[y + (x + 1) % 5] & b[y + (x + 2) % 5]);
+        // Iota
+        a[0] ^= keccak_rc[round];
+    }
+}
+
+void Keccak512Fixed(unsigned char* out, const unsigned char* in)
+{
+    // 64 bytes and the padding fit the 72-byte rate
+    uint64_t a[25];
+    for (int i = 0; i < 8; i++)
+        a[i] = ReadLE64(in + 8 * i);
+    a[8] = 0x8000000000000001ULL;
+    for (int i = 9; i < 25; i++)
+        a[i] = 0;
+    KeccakF1600(a);
+    for (int i = 0; i < 8; i++)
+        WriteLE64(out + 8 * i, a[i]);
+}
+
+/* ----------- Skein-512 ------------------------------------------------- */
+
+const uint64_t skein_iv[8] = {
+    0x4903ADFF749C51CEULL, 0x0D95DE399746DF03ULL, 0x8FD1934127C79BCEULL, 0x9A255629FF352CB1ULL,
+    0x5DB62599DF6CA7B0ULL, 0xEABE394CA9D5C3F4ULL, 0x991112C71A75B523ULL, 0xAE18A40B660FCC33ULL};
+
+void inline SkeinMix(uint64_t& x0, uint64_t& x1, int r)
+{
+    x0 += x1;
+    x1 = Rotl64(x1, r) ^ x0;
+}
+
+/** Threefish-512 subkey injection number s */
+void inline SkeinInject(uint64_t* x, const uint64_t* ks, const uint64_t* ts, int s)
+{
+    for (int i = 0; i < 8; i++)
+        x[i] += ks[(s + i) % 9];
+    x[5] += ts[s % 3];
+    x[6] += ts[(s + 1) % 3];
+    x[7] += s;
+}
+
+/** Skein UBI: h = Threefish-512(key = h, tweak = (t0, t1), block = m) ^ m */
+void SkeinUBI(uint64_t* h, const uint64_t* m, uint64_t t0, uint64_t t1)
+{
+    uint64_t ks[9], x[8];
+    const uint64_t ts[3] = {t0, t1, t0 ^ t1};
+
+    ks[8] = 0x1BD11BDAA9FC1A22ULL;
+    for (int i = 0; i < 8; i++) {
+        ks[i] = h[i];
+        ks[8] ^= h[i];
+        x[i] = m[i];
+    }
+    SkeinInject(x, ks, ts, 0);
+
+    for (int s = 0; s < 18; s += 2) {
+        SkeinMix(x[0], x[1], 46); SkeinMix(x[2], x[3], 36); SkeinMix(x[4], x[5], 19); SkeinMix(x[6], x[7], 37);
+        SkeinMix(x[2], x[1], 33); SkeinMix(x[4], x[7], 27); SkeinMix(x[6], x[5], 14); SkeinMix(x[0], x[3], 42);
+        SkeinMix(x[4], x[1], 17); SkeinMix(x[6], x[3], 49); SkeinMix(x[0], x[5], 36); SkeinMix(x[2], x[7], 39);
+        SkeinMix(x[6], x[1], 44); SkeinMix(x[0], x[7], 9); SkeinMix(x[2], x[5], 54); SkeinMix(x[4], x[3], 56);
+        SkeinInject(x, ks, ts, s + 1);
+        SkeinMix(x[0], x[1], 39); SkeinMix(x[2], x[3], 30); SkeinMix(x[4], x[5], 34); SkeinMix(x[6], x[7], 24);
+        SkeinMix(x[2], x[1], 13); SkeinMix(x[4], x[7], 50); SkeinMix(x[6], x[5], 10); SkeinMix(x[0], x[3], 17);
+        SkeinMix(x[4], x[1], 25); SkeinMix(x[6], x[3], 29); SkeinMix(x[0], x[5], 39); SkeinMix(x[2], x[7], 43);
+        SkeinMix(x[6], x[1], 8); SkeinMix(x[0], x[7], 35); SkeinMix(x[2], x[5], 56); SkeinMix(x[4], x[3], 22);
+        SkeinInject(x, ks, ts, s + 2);
+    }
+    for (int i = 0; i < 8; i++)
+        h[i] = x[i] ^ m[i];
+}
+
+void Skein512Fixed(unsigned char* out, const unsigned char* in)
+{
+    uint64_t h[8], m[8];
+    for (int i = 0; i < 8; i++) {
+        h[i] = skein_iv[i];
+        m[i] = ReadLE64(in + 8 * i);
+    }
+    // The message is a single final block, then the output block
+    SkeinUBI(h, m, 64, 0xF000000000000000ULL);
+    for (int i = 0; i < 8; i++)
+        m[i] = 0;
+    SkeinUBI(h, m, 8, 0xFF00000000000000ULL);
+    for (int i = 0; i < 8; i++)
+        WriteLE64(out + 8 * i, h[i]);
+}
+
+Blake1Fn Blake512_1 = Blake512Fixed;
+
+void Blake512Lanes(unsigned char* const out[4], const unsigned char* const in[4], size_t len)
+{
+    for (int i = 0; i < 4; i++)
+        Blake512_1(out[i], in[i], len);
+}
+
+template <typename Ctx, void (*Init)(void*), void (*Update)(void*, const void*, size_t), void (*Close)(void*, void*)>
+void Hash64Generic(unsigned char* out, const unsigned char* in)
+{
+    Ctx ctx;
+    Init(&ctx);
+    Update(&ctx, in, 64);
+    Close(&ctx, out);
+}
+
+Hash1Fn Bmw512_1 = Bmw512Fixed;
+Hash1Fn Groestl512_1 = Hash64Generic<sph_groestl512_context, sph_groestl512_init, sph_groestl512, sph_groestl512_close>;
+Hash1Fn Jh512_1 = Hash64Generic<sph_jh512_context, sph_jh512_init, sph_jh512, sph_jh512_close>;
+Hash1Fn Keccak512_1 = Keccak512Fixed;
+Hash1Fn Skein512_1 = Skein512Fixed;
+
+/** Run the selected single input implementation once per lane */
+template <Hash1Fn* fn>
+void Lanes(unsigned char* const out[4], const unsigned char* const in[4])
+{
+    for (int i = 0; i < 4; i++)
+        (*fn)(out[i], in[i]);
+}
+
+Blake4Fn Blake512_4 = Blake512Lanes;
+Hash4Fn Bmw512_4 = Lanes<&Bmw512_1>;
+Hash4Fn Groestl512_4 = Lanes<&Groestl512_1>;
+Hash4Fn Jh512_4 = Lanes<&Jh512_1>;
+Hash4Fn Keccak512_4 = Lanes<&Keccak512_1>;
+Hash4Fn Skein512_4 = Lanes<&Skein512_1>;
+
+void Blake512_4x64(unsigned char* const out[4], const unsigned char* const in[4])
+{
+    Blake512_4(out, in, 64);
+}
+
+/**
+ * Run fn in place over the 64-byte states selected by vIndex, four at a
+ * time. A partial last group is padded with a scratch lane.
+ */
+void RunLanes(Hash4Fn fn, std::vector<unsigned char>& vState, const std::vector<size_t>& vIndex)
+{
+    unsigned char scratch[64] = {};
+    for (size_t i = 0; i < vIndex.size(); i += 4) {
+        unsigned char* lanes[4];
+        for (size_t j = 0; j < 4; j++)
+            lanes[j] = i + j < vIndex.size() ? &vState[vIndex[i + j] * 64] : scratch;
+        fn(lanes, lanes);
+    }
+}
+
+/** Split vIndex on the selector bit HashQuark branches on (hash & 8). */
+void Partition(const std::vector<unsigned char>& vState, const std::vector<size_t>& vIndex, std::vector<size_t>& vSet, std::vector<size_t>& vClear)
+{
+    vSet.clear();
+    vClear.clear();
+    for (size_t i = 0; i < vIndex.size(); i++)
+        (vState[vIndex[i] * 64] & 8 ? vSet : vClear).push_back(vIndex[i]);
+}
+} // namespace
+
+std::string QuarkAutoDetect()
+{
+    std::string ret;
+#if defined(HAVE_GETCPUID)
+    uint32_t eax, ebx, ecx, edx;
+#if defined(ENABLE_AESNI)
+    GetCPUID(1, 0, eax, ebx, ecx, edx);
+    if (((ecx >> 25) & 1) && ((ecx >> 9) & 1)) {
+        Groestl512_1 = quark_aesni::Groestl512;
+        ret = "aesni(groestl)";
+    }
+#endif
+#if defined(ENABLE_AVX2)
+    GetCPUID(7, 0, eax, ebx, ecx, edx);
+    if (((ebx >> 5) & 1) && AVXEnabled()) {
+        Blake512_4 = quark_avx2::Blake512_4way;
+        Bmw512_4 = quark_avx2::Bmw512_4way;
+        Jh512_4 = quark_avx2::Jh512_4way;
+        Keccak512_4 = quark_avx2::Keccak512_4way;
+        Skein512_4 = quark_avx2::Skein512_4way;
+        Jh512_1 = quark_avx2::Jh512;
+        ret += ret.empty() ? "avx2(4way)" : ",avx2(4way)";
+    }
+#endif
+#endif
+    return ret.empty() ? "standard" : ret;
+}
+
+void QuarkBlake512(unsigned char* out, const unsigned char* in, size_t len)
+{
+    Blake512_1(out, in, len);
+}
+
+void QuarkBmw512(unsigned char* out, const unsigned char* in)
+{
+    Bmw512_1(out, in);
+}
+
+void QuarkGroestl512(unsigned char* out, const unsigned char* in)
+{
+    Groestl512_1(out, in);
+}
+
+void QuarkJh512(unsigned char* out, const unsigned char* in)
+{
+    Jh512_1(out, in);
+}
+
+void QuarkKeccak512(unsigned char* out, const unsigned char* in)
+{
+    Keccak512_1(out, in);
+}
+
+void QuarkSkein512(unsigned char* out, const unsigned char* in)
+{
+    Skein512_1(out, in);
+}
+
+void QuarkHashBatch(const unsigned char* const* ppInputs, size_t nLen, size_t nCount, unsigned char* pOut)
+{
+    std::vector<unsigned char> vState(nCount * 64);
+    std::vector<size_t> vAll(nCount), vSet, vClear;
+    for (size_t i = 0; i < nCount; i++)
+        vAll[i] = i;
+
+    // Blake-512 over the raw input
+    for (size_t i = 0; i < nCount; i += 4) {
+        static const unsigned char dummy[MAX_BLAKE_SINGLE_LEN] = {};
+        const unsigned char* in[4];
+        unsigned char* out[4];
+        unsigned char scratch[64];
+        if (nLen > MAX_BLAKE_SINGLE_LEN) {
+            for (size_t j = i; j < nCount && j < i + 4; j++)
+                Blake512_1(&vState[j * 64], ppInputs[j], nLen);
+            continue;
+        }
+        for (size_t j = 0; j < 4; j++) {
+            in[j] = i + j < nCount ? ppInputs[i + j] : dummy;
+            out[j] = i + j < nCount ? &vState[(i + j) * 64] : scratch;
+        }
+        Blake512_4(out, in, nLen);
+    }
+
+    RunLanes(Bmw512_4, vState, vAll);
+
+    Partition(vState, vAll, vSet, vClear);
+    RunLanes(Groestl512_4, vState, vSet);
+    RunLanes(Skein512_4, vState, vClear);
+
+    RunLanes(Groestl512_4, vState, vAll);
+    RunLanes(Jh512_4, vState, vAll);
+
+    Partition(vState, vAll, vSet, vClear);
+    RunLanes(Blake512_4x64, vState, vSet);
+    RunLanes(Bmw512_4, vState, vClear);
+
+    RunLanes(Keccak512_4, vState, vAll);
+    RunLanes(Skein512_4, vState, vAll);
+
+    Partition(vState, vAll, vSet, vClear);
+    RunLanes(Keccak512_4, vState, vSet);
+    RunLanes(Jh512_4, vState, vClear);
+
+    // HashQuark returns the low 256 bits of the final 512-bit state
+    for (size_t i = 0; i < nCount; i++)
+        memcpy(pOut + i * 32, &vState[i * 64], 32);
+}
@@ -0,0 +1,36 @@
+// Copyright (c) 2018 The Hash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_QUARK_H
+#define BITCOIN_CRYPTO_QUARK_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+
+/** Autodetect the best available Quark implementations. Returns a description of the selection. */
+std::string QuarkAutoDetect();
+
+/**
+ * Single input Quark primitives, using the fastest implementation selected
+ * by QuarkAutoDetect(). Apart from Blake-512, which also hashes the raw
+ * input, they take exactly 64 bytes. The output may alias the input.
+ */
+void QuarkBlake512(unsigned char* out, const unsigned char* in, size_t len);
+void QuarkBmw512(unsigned char* out, const unsigned char* in);
+void QuarkGroestl512(unsigned char* out, const unsigned char* in);
+void QuarkJh512(unsigned char* out, const unsigned char* in);
+void QuarkKeccak512(unsigned char* out, const unsigned char* in);
+void QuarkSkein512(unsigned char* out, const unsigned char* in);
+
+/**
+ * Compute the Quark hash of nCount independent inputs of nLen bytes each,
+ * writing 32 bytes per input to pOut. Inputs are pushed through the chain
+ * stage by stage, four at a time on SIMD lanes where the CPU supports it.
+ * The data-dependent stages are handled by partitioning the inputs on
+ * their selector bit, so every lane of a group runs the same primitive.
+ */
+void QuarkHashBatch(const unsigned char* const* ppInputs, size_t nLen, size_t nCount, unsigned char* pOut);
+
+#endif // BITCOIN_CRYPTO_QUARK_H
@@ -0,0 +1,200 @@
+// Copyright (c) 2018 The Hash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// Groestl-512 using the AES-NI instructions.
+// The 8x16 byte state is kept one row per 128-bit register. Groestl uses the
+// AES S-box, so SubBytes is an AESENCLAST with a zero round key; the AES
+// ShiftRows that comes with it is undone by the PSHUFB that also performs
+// Groestl's ShiftBytes. MixBytes is computed with plain SSE2 arithmetic.
+// Only 64-byte messages are supported, which is what HashQuark feeds it.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/hash-config.h"
+#endif
+
+#ifdef ENABLE_AESNI
+
+#include <stdint.h>
+#include <string.h>
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+
+namespace quark_aesni {
+namespace {
+
+/** ShiftBytes rotation of each row, for P1024 and Q1024 */
+const int shift_p[8] = {0, 1, 2, 3, 4, 5, 6, 11};
+const int shift_q[8] = {1, 3, 5, 11, 0, 2, 4, 6};
+
+/** The input byte AES ShiftRows moves to position j (state is 4x4, column-major) */
+int inline ShiftRowsSource(int j)
+{
+    return ((((j >> 2) + (j & 3)) & 3) << 2) | (j & 3);
+}
+
+struct Constants {
+    __m128i shuf_p[8], shuf_q[8];
+    __m128i rc_p, rc_q, all_ff, reduce;
+
+    Constants()
+    {
+        unsigned char b[16];
+        for (int i = 0; i < 8; i++) {
+            // Output byte j of the row must be column j + shift
+            for (int j = 0; j < 16; j++)
+                b[ShiftRowsSource(j)] = (j + shift_p[i]) & 15;
+            shuf_p[i] = _mm_loadu_si128((const __m128i*)b);
+            for (int j = 0; j < 16; j++)
+                b[ShiftRowsSource(j)] = (j + shift_q[i]) & 15;
+            shuf_q[i] = _mm_loadu_si128((const __m128i*)b);
+        }
+        for (int j = 0; j < 16; j++)
+            b[j] = j << 4;
+        rc_p = _mm_loadu_si128((const __m128i*)b);
+        for (int j = 0; j < 16; j++)
+            b[j] = ~(j << 4);
+        rc_q = _mm_loadu_si128((const __m128i*)b);
+        all_ff = _mm_set1_epi8((char)0xff);
+        reduce = _mm_set1_epi8(0x1b);
+    }
+};
+
+const Constants& GetConstants()
+{
+    static const Constants c;
+    return c;
+}
+
+/** Multiply every byte by x in GF(2^8) modulo the AES polynomial */
+__m128i inline Mul2(__m128i x, __m128i reduce)
+{
+    __m128i carry = _mm_cmplt_epi8(x, _mm_setzero_si128());
+    return _mm_xor_si128(_mm_add_epi8(x, x), _mm_and_si128(carry, reduce));
+}
+
+/** SubBytes and ShiftBytes of one row */
+__m128i inline SubShift(__m128i x, __m128i shuf)
+{
+    return _mm_aesenclast_si128(_mm_shuffle_epi8(x, shuf), _mm_setzero_si128());
+}
+
+/**
+ * MixBytes with circ(02,02,03,04,05,03,05,07) for output row i, given input
+ * row i + 2 and the sums t[j] = x[j] ^ x[j + 1] at j = i, i + 3, ..., i + 6.
+ * The output is A ^ 2 * (B ^ 2 * C) for sums of input rows A, B and C.
+ */
+__m128i inline MixRow(__m128i x2, __m128i t0, __m128i t3, __m128i t4, __m128i t5, __m128i t6, __m128i reduce)
+{
+    __m128i u = _mm_xor_si128(x2, t6);
+    __m128i A = _mm_xor_si128(u, t4);
+    __m128i B = _mm_xor_si128(_mm_xor_si128(u, t0), t5);
+    __m128i C = _mm_xor_si128(t3, t6);
+    return _mm_xor_si128(A, Mul2(_mm_xor_si128(B, Mul2(C, reduce)), reduce));
+}
+
+/** One round after AddRoundConstant, written out so the rows stay in registers */
+void inline Round(__m128i* a, const __m128i* shuf, __m128i reduce)
+{
+    __m128i x0 = SubShift(a[0], shuf[0]), x1 = SubShift(a[1], shuf[1]);
+    __m128i x2 = SubShift(a[2], shuf[2]), x3 = SubShift(a[3], shuf[3]);
+    __m128i x4 = SubShift(a[4], shuf[4]), x5 = SubShift(a[5], shuf[5]);
+    __m128i x6 = SubShift(a[6], shuf[6]), x7 = SubShift(a[7], shuf[7]);
+    __m128i t0 = _mm_xor_si128(x0, x1), t1 = _mm_xor_si128(x1, x2);
+    __m128i t2 = _mm_xor_si128(x2, x3), t3 = _mm_xor_si128(x3, x4);
+    __m128i t4 = _mm_xor_si128(x4, x5), t5 = _mm_xor_si128(x5, x6);
+    __m128i t6 = _mm_xor_si128(x6, x7), t7 = _mm_xor_si128(x7, x0);
+    a[0] = MixRow(x2, t0, t3, t4, t5, t6, reduce);
+    a[1] = MixRow(x3, t1, t4, t5, t6, t7, reduce);
+    a[2] = MixRow(x4, t2, t5, t6, t7, t0, reduce);
+    a[3] = MixRow(x5, t3, t6, t7, t0, t1, reduce);
+    a[4] = MixRow(x6, t4, t7, t0, t1, t2, reduce);
+    a[5] = MixRow(x7, t5, t0, t1, t2, t3, reduce);
+    a[6] = MixRow(x0, t6, t1, t2, t3, t4, reduce);
+    a[7] = MixRow(x1, t7, t2, t3, t4, t5, reduce);
+}
+
+void AddConstantP(__m128i* a, const Constants& c, int r)
+{
+    a[0] = _mm_xor_si128(a[0], _mm_xor_si128(c.rc_p, _mm_set1_epi8(r)));
+}
+
+void AddConstantQ(__m128i* a, const Constants& c, int r)
+{
+    for (int i = 0; i < 7; i++)
+        a[i] = _mm_xor_si128(a[i], c.all_ff);
+    a[7] = _mm_xor_si128(a[7], _mm_xor_si128(c.rc_q, _mm_set1_epi8(r)));
+}
+
+/** P and Q of the compression function, interleaved as they are independent */
+void PermPQ(__m128i* p, __m128i* q, const Constants& c)
+{
+    for (int r = 0; r < 14; r++) {
+        AddConstantP(p, c, r);
+        AddConstantQ(q, c, r);
+        Round(p, c.shuf_p, c.reduce);
+        Round(q, c.shuf_q, c.reduce);
+    }
+}
+
+void PermP(__m128i* p, const Constants& c)
+{
+    for (int r = 0; r < 14; r++) {
+        AddConstantP(p, c, r);
+        Round(p, c.shuf_p, c.reduce);
+    }
+}
+
+/** Load a column-major 128-byte block as eight rows */
+void LoadRows(__m128i* a, const unsigned char* in)
+{
+    unsigned char rows[8][16];
+    for (int j = 0; j < 16; j++)
+        for (int i = 0; i < 8; i++)
+            rows[i][j] = in[8 * j + i];
+    for (int i = 0; i < 8; i++)
+        a[i] = _mm_loadu_si128((const __m128i*)rows[i]);
+}
+
+} // namespace
+
+void Groestl512(unsigned char* out, const unsigned char* in)
+{
+    const Constants& c = GetConstants();
+
+    // Padding of a 64-byte message: 0x80, zeros, and a block count of one
+    unsigned char block[128] = {};
+    memcpy(block, in, 64);
+    block[64] = 0x80;
+    block[127] = 1;
+
+    __m128i m[8], h[8], p[8];
+    LoadRows(m, block);
+
+    // The IV encodes the 512-bit output length in the last column
+    for (int i = 0; i < 8; i++)
+        h[i] = _mm_setzero_si128();
+    h[6] = _mm_insert_epi16(h[6], 0x0200, 7);
+
+    // Compression: h = P(h ^ m) ^ Q(m) ^ h
+    for (int i = 0; i < 8; i++)
+        p[i] = _mm_xor_si128(h[i], m[i]);
+    PermPQ(p, m, c);
+    for (int i = 0; i < 8; i++)
+        h[i] = _mm_xor_si128(h[i], _mm_xor_si128(p[i], m[i]));
+
+    // Output transformation: the last eight columns of P(h) ^ h
+    for (int i = 0; i < 8; i++)
+        p[i] = h[i];
+    PermP(p, c);
+    unsigned char rows[8][16];
+    for (int i = 0; i < 8; i++)
+        _mm_storeu_si128((__m128i*)rows[i], _mm_xor_si128(h[i], p[i]));
+    for (int j = 8; j < 16; j++)
+        for (int i = 0; i < 8; i++)
+            out[8 * (j - 8) + i] = rows[i][j];
+}
+
+} // namespace quark_aesni
+
+#endif
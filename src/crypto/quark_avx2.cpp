@@ -0,0 +1,636 @@
+// Copyright (c) 2018 The Hash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// This is a 4-way multi-buffer implementation of the 64-bit Quark
+// primitives (Blake-512, BMW-512, Keccak-512, Skein-512 and JH-512).
+// Every 64-bit lane of a 256-bit register carries an independent message,
+// so four inputs are hashed for the cost of roughly one.
+// Only single block messages are supported, which covers block headers
+// and all of the 64-byte intermediate stages of HashQuark.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/hash-config.h"
+#endif
+
+#ifdef ENABLE_AVX2
+
+#include <stdint.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "crypto/common.h"
+
+namespace quark_avx2 {
+namespace {
+
+__m256i inline K(uint64_t x) { return _mm256_set1_epi64x(x); }
+__m256i inline Add(__m256i x, __m256i y) { return _mm256_add_epi64(x, y); }
+__m256i inline Sub(__m256i x, __m256i y) { return _mm256_sub_epi64(x, y); }
+__m256i inline Xor(__m256i x, __m256i y) { return _mm256_xor_si256(x, y); }
+__m256i inline Xor(__m256i x, __m256i y, __m256i z) { return Xor(Xor(x, y), z); }
+__m256i inline And(__m256i x, __m256i y) { return _mm256_and_si256(x, y); }
+__m256i inline Or(__m256i x, __m256i y) { return _mm256_or_si256(x, y); }
+/** ~x & y */
+__m256i inline AndNot(__m256i x, __m256i y) { return _mm256_andnot_si256(x, y); }
+__m256i inline Not(__m256i x) { return Xor(x, _mm256_set1_epi32(-1)); }
+__m256i inline Shl(__m256i x, int n) { return _mm256_slli_epi64(x, n); }
+__m256i inline Shr(__m256i x, int n) { return _mm256_srli_epi64(x, n); }
+__m256i inline Rotl(__m256i x, int n) { return Or(Shl(x, n), Shr(x, 64 - n)); }
+__m256i inline Rotr(__m256i x, int n) { return Or(Shr(x, n), Shl(x, 64 - n)); }
+
+__m256i inline LoadLE(const unsigned char* const in[4], int offset)
+{
+    return _mm256_set_epi64x(ReadLE64(in[3] + offset), ReadLE64(in[2] + offset), ReadLE64(in[1] + offset), ReadLE64(in[0] + offset));
+}
+
+__m256i inline LoadBE(const unsigned char* const in[4], int offset)
+{
+    return _mm256_set_epi64x(ReadBE64(in[3] + offset), ReadBE64(in[2] + offset), ReadBE64(in[1] + offset), ReadBE64(in[0] + offset));
+}
+
+void inline StoreLE(unsigned char* const out[4], int offset, __m256i v)
+{
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, v);
+    for (int i = 0; i < 4; i++)
+        WriteLE64(out[i] + offset, lanes[i]);
+}
+
+void inline StoreBE(unsigned char* const out[4], int offset, __m256i v)
+{
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, v);
+    for (int i = 0; i < 4; i++)
+        WriteBE64(out[i] + offset, lanes[i]);
+}
+
+/* ----------- Blake-512 ------------------------------------------------- */
+
+const uint64_t blake_iv[8] = {
+    0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL, 0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+    0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL, 0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL};
+
+const uint64_t blake_cb[16] = {
+    0x243F6A8885A308D3ULL, 0x13198A2E03707344ULL, 0xA4093822299F31D0ULL, 0x082EFA98EC4E6C89ULL,
+    0x452821E638D01377ULL, 0xBE5466CF34E90C6CULL, 0xC0AC29B7C97C50DDULL, 0x3F84D5B5B5470917ULL,
+    0x9216D5D98979FB1BULL, 0xD1310BA698DFB5ACULL, 0x2FFD72DBD01ADFB7ULL, 0xB8E1AFED6A267E96ULL,
+    0xBA7C9045F12C7F99ULL, 0x24A19947B3916CF7ULL, 0x0801F2E2858EFC16ULL, 0x636920D871574E69ULL};
+
+const unsigned char blake_sigma[10][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+    {11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+    {7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+    {9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+    {2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+    {12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+    {13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+    {6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+    {10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0}};
+
+void inline BlakeG(__m256i& a, __m256i& b, __m256i& c, __m256i& d, const __m256i* m, const unsigned char* s, int i)
+{
+    a = Add(Add(a, b), Xor(m[s[i]], K(blake_cb[s[i + 1]])));
+    d = Rotr(Xor(d, a), 32);
+    c = Add(c, d);
+    b = Rotr(Xor(b, c), 25);
+    a = Add(Add(a, b), Xor(m[s[i + 1]], K(blake_cb[s[i]])));
+    d = Rotr(Xor(d, a), 16);
+    c = Add(c, d);
+    b = Rotr(Xor(b, c), 11);
+}
+
+/* ----------- BMW-512 --------------------------------------------------- */
+
+const uint64_t bmw_iv[16] = {
+    0x8081828384858687ULL, 0x88898A8B8C8D8E8FULL, 0x9091929394959697ULL, 0x98999A9B9C9D9E9FULL,
+    0xA0A1A2A3A4A5A6A7ULL, 0xA8A9AAABACADAEAFULL, 0xB0B1B2B3B4B5B6B7ULL, 0xB8B9BABBBCBDBEBFULL,
+    0xC0C1C2C3C4C5C6C7ULL, 0xC8C9CACBCCCDCECFULL, 0xD0D1D2D3D4D5D6D7ULL, 0xD8D9DADBDCDDDEDFULL,
+    0xE0E1E2E3E4E5E6E7ULL, 0xE8E9EAEBECEDEEEFULL, 0xF0F1F2F3F4F5F6F7ULL, 0xF8F9FAFBFCFDFEFFULL};
+
+__m256i inline BmwS0(__m256i x) { return Xor(Xor(Shr(x, 1), Shl(x, 3)), Xor(Rotl(x, 4), Rotl(x, 37))); }
+__m256i inline BmwS1(__m256i x) { return Xor(Xor(Shr(x, 1), Shl(x, 2)), Xor(Rotl(x, 13), Rotl(x, 43))); }
+__m256i inline BmwS2(__m256i x) { return Xor(Xor(Shr(x, 2), Shl(x, 1)), Xor(Rotl(x, 19), Rotl(x, 53))); }
+__m256i inline BmwS3(__m256i x) { return Xor(Xor(Shr(x, 2), Shl(x, 2)), Xor(Rotl(x, 28), Rotl(x, 59))); }
+__m256i inline BmwS4(__m256i x) { return Xor(Shr(x, 1), x); }
+__m256i inline BmwS5(__m256i x) { return Xor(Shr(x, 2), x); }
+
+__m256i inline BmwAddElt(const __m256i* m, const __m256i* h, int j)
+{
+    __m256i t = Add(Rotl(m[j & 15], (j & 15) + 1), Rotl(m[(j + 3) & 15], ((j + 3) & 15) + 1));
+    t = Sub(t, Rotl(m[(j + 10) & 15], ((j + 10) & 15) + 1));
+    t = Add(t, K((uint64_t)(j + 16) * 0x0555555555555555ULL));
+    return Xor(t, h[(j + 7) & 15]);
+}
+
+/** One BMW-512 compression of message m under chaining value h. */
+void BmwCompress(const __m256i* m, const __m256i* h, __m256i* dh)
+{
+    __m256i mh[16], w[16], q[32];
+    for (int i = 0; i < 16; i++)
+        mh[i] = Xor(m[i], h[i]);
+
+    w[0] = Add(Add(Add(Sub(mh[5], mh[7]), mh[10]), mh[13]), mh[14]);
+    w[1] = Sub(Add(Add(Sub(mh[6], mh[8]), mh[11]), mh[14]), mh[15]);
+    w[2] = Add(Sub(Add(Add(mh[0], mh[7]), mh[9]), mh[12]), mh[15]);
+    w[3] = Add(Sub(Add(Sub(mh[0], mh[1]), mh[8]), mh[10]), mh[13]);
+    w[4] = Sub(Sub(Add(Add(mh[1], mh[2]), mh[9]), mh[11]), mh[14]);
+    w[5] = Add(Sub(Add(Sub(mh[3], mh[2]), mh[10]), mh[12]), mh[15]);
+    w[6] = Add(Sub(Sub(Sub(mh[4], mh[0]), mh[3]), mh[11]), mh[13]);
+    w[7] = Sub(Sub(Sub(Sub(mh[1], mh[4]), mh[5]), mh[12]), mh[14]);
+    w[8] = Sub(Add(Sub(Sub(mh[2], mh[5]), mh[6]), mh[13]), mh[15]);
+    w[9] = Add(Sub(Add(Sub(mh[0], mh[3]), mh[6]), mh[7]), mh[14]);
+    w[10] = Add(Sub(Sub(Sub(mh[8], mh[1]), mh[4]), mh[7]), mh[15]);
+    w[11] = Add(Sub(Sub(Sub(mh[8], mh[0]), mh[2]), mh[5]), mh[9]);
+    w[12] = Add(Sub(Sub(Add(mh[1], mh[3]), mh[6]), mh[9]), mh[10]);
+    w[13] = Add(Add(Add(Add(mh[2], mh[4]), mh[7]), mh[10]), mh[11]);
+    w[14] = Sub(Sub(Add(Sub(mh[3], mh[5]), mh[8]), mh[11]), mh[12]);
+    w[15] = Add(Sub(Sub(Sub(mh[12], mh[4]), mh[6]), mh[9]), mh[13]);
+
+    for (int i = 0; i < 15; i += 5) {
+        q[i + 0] = Add(BmwS0(w[i + 0]), h[i + 1]);
+        q[i + 1] = Add(BmwS1(w[i + 1]), h[i + 2]);
+        q[i + 2] = Add(BmwS2(w[i + 2]), h[i + 3]);
+        q[i + 3] = Add(BmwS3(w[i + 3]), h[i + 4]);
+        q[i + 4] = Add(BmwS4(w[i + 4]), h[i + 5]);
+    }
+    q[15] = Add(BmwS0(w[15]), h[0]);
+
+    for (int i = 16; i < 18; i++) {
+        __m256i t = BmwAddElt(m, h, i - 16);
+        for (int k = 0; k < 16; k += 4) {
+            t = Add(t, BmwS1(q[i - 16 + k]));
+            t = Add(t, BmwS2(q[i - 15 + k]));
+            t = Add(t, BmwS3(q[i - 14 + k]));
+            t = Add(t, BmwS0(q[i - 13 + k]));
+        }
+        q[i] = t;
+    }
+    for (int i = 18; i < 32; i++) {
+        __m256i t = BmwAddElt(m, h, i - 16);
+        t = Add(t, Add(q[i - 16], Rotl(q[i - 15], 5)));
+        t = Add(t, Add(q[i - 14], Rotl(q[i - 13], 11)));
+        t = Add(t, Add(q[i - 12], Rotl(q[i - 11], 27)));
+        t = Add(t, Add(q[i - 10], Rotl(q[i - 9], 32)));
+        t = Add(t, Add(q[i - 8], Rotl(q[i - 7], 37)));
+        t = Add(t, Add(q[i - 6], Rotl(q[i - 5], 43)));
+        t = Add(t, Add(q[i - 4], Rotl(q[i - 3], 53)));
+        t = Add(t, Add(BmwS4(q[i - 2]), BmwS5(q[i - 1])));
+        q[i] = t;
+    }
+
+    __m256i xl = Xor(Xor(Xor(q[16], q[17]), Xor(q[18], q[19])), Xor(Xor(q[20], q[21]), Xor(q[22], q[23])));
+    __m256i xh = Xor(Xor(Xor(xl, q[24]), Xor(q[25], q[26])), Xor(Xor(q[27], q[28]), Xor(Xor(q[29], q[30]), q[31])));
+
+    dh[0] = Add(Xor(Shl(xh, 5), Shr(q[16], 5), m[0]), Xor(xl, q[24], q[0]));
+    dh[1] = Add(Xor(Shr(xh, 7), Shl(q[17], 8), m[1]), Xor(xl, q[25], q[1]));
+    dh[2] = Add(Xor(Shr(xh, 5), Shl(q[18], 5), m[2]), Xor(xl, q[26], q[2]));
+    dh[3] = Add(Xor(Shr(xh, 1), Shl(q[19], 5), m[3]), Xor(xl, q[27], q[3]));
+    dh[4] = Add(Xor(Shr(xh, 3), q[20], m[4]), Xor(xl, q[28], q[4]));
+    dh[5] = Add(Xor(Shl(xh, 6), Shr(q[21], 6), m[5]), Xor(xl, q[29], q[5]));
+    dh[6] = Add(Xor(Shr(xh, 4), Shl(q[22], 6), m[6]), Xor(xl, q[30], q[6]));
+    dh[7] = Add(Xor(Shr(xh, 11), Shl(q[23], 2), m[7]), Xor(xl, q[31], q[7]));
+    dh[8] = Add(Add(Rotl(dh[4], 9), Xor(xh, q[24], m[8])), Xor(Shl(xl, 8), q[23], q[8]));
+    dh[9] = Add(Add(Rotl(dh[5], 10), Xor(xh, q[25], m[9])), Xor(Shr(xl, 6), q[16], q[9]));
+    dh[10] = Add(Add(Rotl(dh[6], 11), Xor(xh, q[26], m[10])), Xor(Shl(xl, 6), q[17], q[10]));
+    dh[11] = Add(Add(Rotl(dh[7], 12), Xor(xh, q[27], m[11])), Xor(Shl(xl, 4), q[18], q[11]));
+    dh[12] = Add(Add(Rotl(dh[0], 13), Xor(xh, q[28], m[12])), Xor(Shr(xl, 3), q[19], q[12]));
+    dh[13] = Add(Add(Rotl(dh[1], 14), Xor(xh, q[29], m[13])), Xor(Shr(xl, 4), q[20], q[13]));
+    dh[14] = Add(Add(Rotl(dh[2], 15), Xor(xh, q[30], m[14])), Xor(Shr(xl, 7), q[21], q[14]));
+    dh[15] = Add(Add(Rotl(dh[3], 16), Xor(xh, q[31], m[15])), Xor(Shr(xl, 2), q[22], q[15]));
+}
+
+/* ----------- Keccak-512 ------------------------------------------------ */
+
+const uint64_t keccak_rc[24] = {
+    0x0000000000000001ULL, 0x0000000000008082ULL, 0x800000000000808AULL, 0x8000000080008000ULL,
+    0x000000000000808BULL, 0x0000000080000001ULL, 0x8000000080008081ULL, 0x8000000000008009ULL,
+    0x000000000000008AULL, 0x0000000000000088ULL, 0x0000000080008009ULL, 0x000000008000000AULL,
+    0x000000008000808BULL, 0x800000000000008BULL, 0x8000000000008089ULL, 0x8000000000008003ULL,
+    0x8000000000008002ULL, 0x8000000000000080ULL, 0x000000000000800AULL, 0x800000008000000AULL,
+    0x8000000080008081ULL, 0x8000000000008080ULL, 0x0000000080000001ULL, 0x8000000080008008ULL};
+
+void KeccakF1600(__m256i* a)
+{
+    __m256i b[25], c[5], d;
+    for (int round = 0; round < 24; round++) {
+        // Theta
+        for (int x = 0; x < 5; x++)
+            c[x] = Xor(Xor(a[x], a[x + 5]), Xor(Xor(a[x + 10], a[x + 15]), a[x + 20]));
+        for (int x = 0; x < 5; x++) {
+            d = Xor(c[(x + 4) % 5], Rotl(c[(x + 1) % 5], 1));
+            for (int y = 0; y < 25; y += 5)
+                a[y + x] = Xor(a[y + x], d);
+        }
+        // Rho and Pi, with the rotation amounts spelled out so they compile to immediates
+        b[0] = a[0];
+        b[1] = Rotl(a[6], 44);
+        b[2] = Rotl(a[12], 43);
+        b[3] = Rotl(a[18], 21);
+        b[4] = Rotl(a[24], 14);
+        b[5] = Rotl(a[3], 28);
+        b[6] = Rotl(a[9], 20);
+        b[7] = Rotl(a[10], 3);
+        b[8] = Rotl(a[16], 45);
+        b[9] = Rotl(a[22], 61);
+        b[10] = Rotl(a[1], 1);
+        b[11] = Rotl(a[7], 6);
+        b[12] = Rotl(a[13], 25);
+        b[13] = Rotl(a[19], 8);
+        b[14] = Rotl(a[20], 18);
+        b[15] = Rotl(a[4], 27);
+        b[16] = Rotl(a[5], 36);
+        b[17] = Rotl(a[11], 10);
+        b[18] = Rotl(a[17], 15);
+        b[19] = Rotl(a[23], 56);
+        b[20] = Rotl(a[2], 62);
+        b[21] = Rotl(a[8], 55);
+        b[22] = Rotl(a[14], 39);
+        b[23] = Rotl(a[15], 41);
+        b[24] = Rotl(a[21], 2);
+        // Chi
+        for (int y = 0; y < 25; y += 5)
+            for (int x = 0; x < 5; x++)
+                a[y + x] = Xor(b[y + x], AndNot(b[y + (x + 1) % 5], b[y + (x + 2) % 5]));
+        // Iota
+        a[0] = Xor(a[0], K(keccak_rc[round]));
+    }
+}
+
+/* ----------- Skein-512 ------------------------------------------------- */
+
+const uint64_t skein_iv[8] = {
+    0x4903ADFF749C51CEULL, 0x0D95DE399746DF03ULL, 0x8FD1934127C79BCEULL, 0x9A255629FF352CB1ULL,
+    0x5DB62599DF6CA7B0ULL, 0xEABE394CA9D5C3F4ULL, 0x991112C71A75B523ULL, 0xAE18A40B660FCC33ULL};
+
+void inline SkeinMix(__m256i& x0, __m256i& x1, int r)
+{
+    x0 = Add(x0, x1);
+    x1 = Xor(Rotl(x1, r), x0);
+}
+
+/** Threefish-512 subkey injection number s */
+void inline SkeinInject(__m256i* x, const __m256i* ks, const uint64_t* ts, int s)
+{
+    for (int i = 0; i < 8; i++)
+        x[i] = Add(x[i], ks[(s + i) % 9]);
+    x[5] = Add(x[5], K(ts[s % 3]));
+    x[6] = Add(x[6], K(ts[(s + 1) % 3]));
+    x[7] = Add(x[7], K(s));
+}
+
+/** Skein UBI: h = Threefish-512(key = h, tweak = (t0, t1), block = m) ^ m */
+void SkeinUBI(__m256i* h, const __m256i* m, uint64_t t0, uint64_t t1)
+{
+    __m256i ks[9], x[8];
+    const uint64_t ts[3] = {t0, t1, t0 ^ t1};
+
+    ks[8] = K(0x1BD11BDAA9FC1A22ULL);
+    for (int i = 0; i < 8; i++) {
+        ks[i] = h[i];
+        ks[8] = Xor(ks[8], h[i]);
+        x[i] = m[i];
+    }
+    SkeinInject(x, ks, ts, 0);
+
+    // 72 rounds, eight per iteration. The word permutation is applied by
+    // renaming and is the identity again after every four rounds.
+    for (int s = 0; s < 18; s += 2) {
+        SkeinMix(x[0], x[1], 46); SkeinMix(x[2], x[3], 36); SkeinMix(x[4], x[5], 19); SkeinMix(x[6], x[7], 37);
+        SkeinMix(x[2], x[1], 33); SkeinMix(x[4], x[7], 27); SkeinMix(x[6], x[5], 14); SkeinMix(x[0], x[3], 42);
+        SkeinMix(x[4], x[1], 17); SkeinMix(x[6], x[3], 49); SkeinMix(x[0], x[5], 36); SkeinMix(x[2], x[7], 39);
+        SkeinMix(x[6], x[1], 44); SkeinMix(x[0], x[7], 9); SkeinMix(x[2], x[5], 54); SkeinMix(x[4], x[3], 56);
+        SkeinInject(x, ks, ts, s + 1);
+        SkeinMix(x[0], x[1], 39); SkeinMix(x[2], x[3], 30); SkeinMix(x[4], x[5], 34); SkeinMix(x[6], x[7], 24);
+        SkeinMix(x[2], x[1], 13); SkeinMix(x[4], x[7], 50); SkeinMix(x[6], x[5], 10); SkeinMix(x[0], x[3], 17);
+        SkeinMix(x[4], x[1], 25); SkeinMix(x[6], x[3], 29); SkeinMix(x[0], x[5], 39); SkeinMix(x[2], x[7], 43);
+        SkeinMix(x[6], x[1], 8); SkeinMix(x[0], x[7], 35); SkeinMix(x[2], x[5], 56); SkeinMix(x[4], x[3], 22);
+        SkeinInject(x, ks, ts, s + 2);
+    }
+    for (int i = 0; i < 8; i++)
+        h[i] = Xor(x[i], m[i]);
+}
+
+/* ----------- JH-512 ---------------------------------------------------- */
+
+// JH works on a byte-swapped bitsliced state, as in jh.c
+#define C64e(x) ((((x) >> 56) & 0xFFULL) | (((x) >> 40) & 0xFF00ULL) | (((x) >> 24) & 0xFF0000ULL) | (((x) >> 8) & 0xFF000000ULL) | \
+                 (((x) << 8) & 0xFF00000000ULL) | (((x) << 24) & 0xFF0000000000ULL) | (((x) << 40) & 0xFF000000000000ULL) | (((x) << 56) & 0xFF00000000000000ULL))
+
+const uint64_t jh_iv[16] = {
+    C64e(0x6fd14b963e00aa17ULL), C64e(0x636a2e057a15d543ULL), C64e(0x8a225e8d0c97ef0bULL), C64e(0xe9341259f2b3c361ULL),
+    C64e(0x891da0c1536f801eULL), C64e(0x2aa9056bea2b6d80ULL), C64e(0x588eccdb2075baa6ULL), C64e(0xa90f3a76baf83bf7ULL),
+    C64e(0x0169e60541e34a69ULL), C64e(0x46b58a8e2e6fe65aULL), C64e(0x1047a7d0c1843c24ULL), C64e(0x3b6e71b12d5ac199ULL),
+    C64e(0xcf57f6ec9db1f856ULL), C64e(0xa706887c5716b156ULL), C64e(0xe3c2fcdfe68517fbULL), C64e(0x545a4678cc8cdd4bULL)};
+
+/** Round constants: even high, even low, odd high, odd low word for each of the 42 rounds. */
+const uint64_t jh_c[168] = {
+    C64e(0x72d5dea2df15f867ULL), C64e(0x7b84150ab7231557ULL), C64e(0x81abd6904d5a87f6ULL), C64e(0x4e9f4fc5c3d12b40ULL),
+    C64e(0xea983ae05c45fa9cULL), C64e(0x03c5d29966b2999aULL), C64e(0x660296b4f2bb538aULL), C64e(0xb556141a88dba231ULL),
+    C64e(0x03a35a5c9a190edbULL), C64e(0x403fb20a87c14410ULL), C64e(0x1c051980849e951dULL), C64e(0x6f33ebad5ee7cddcULL),
+    C64e(0x10ba139202bf6b41ULL), C64e(0xdc786515f7bb27d0ULL), C64e(0x0a2c813937aa7850ULL), C64e(0x3f1abfd2410091d3ULL),
+    C64e(0x422d5a0df6cc7e90ULL), C64e(0xdd629f9c92c097ceULL), C64e(0x185ca70bc72b44acULL), C64e(0xd1df65d663c6fc23ULL),
+    C64e(0x976e6c039ee0b81aULL), C64e(0x2105457e446ceca8ULL), C64e(0xeef103bb5d8e61faULL), C64e(0xfd9697b294838197ULL),
+    C64e(0x4a8e8537db03302fULL), C64e(0x2a678d2dfb9f6a95ULL), C64e(0x8afe7381f8b8696cULL), C64e(0x8ac77246c07f4214ULL),
+    C64e(0xc5f4158fbdc75ec4ULL), C64e(0x75446fa78f11bb80ULL), C64e(0x52de75b7aee488bcULL), C64e(0x82b8001e98a6a3f4ULL),
+    C64e(0x8ef48f33a9a36315ULL), C64e(0xaa5f5624d5b7f989ULL), C64e(0xb6f1ed207c5ae0fdULL), C64e(0x36cae95a06422c36ULL),
+    C64e(0xce2935434efe983dULL), C64e(0x533af974739a4ba7ULL), C64e(0xd0f51f596f4e8186ULL), C64e(0x0e9dad81afd85a9fULL),
+    C64e(0xa7050667ee34626aULL), C64e(0x8b0b28be6eb91727ULL), C64e(0x47740726c680103fULL), C64e(0xe0a07e6fc67e487bULL),
+    C64e(0x0d550aa54af8a4c0ULL), C64e(0x91e3e79f978ef19eULL), C64e(0x8676728150608dd4ULL), C64e(0x7e9e5a41f3e5b062ULL),
+    C64e(0xfc9f1fec4054207aULL), C64e(0xe3e41a00cef4c984ULL), C64e(0x4fd794f59dfa95d8ULL), C64e(0x552e7e1124c354a5ULL),
+    C64e(0x5bdf7228bdfe6e28ULL), C64e(0x78f57fe20fa5c4b2ULL), C64e(0x05897cefee49d32eULL), C64e(0x447e9385eb28597fULL),
+    C64e(0x705f6937b324314aULL), C64e(0x5e8628f11dd6e465ULL), C64e(0xc71b770451b920e7ULL), C64e(0x74fe43e823d4878aULL),
+    C64e(0x7d29e8a3927694f2ULL), C64e(0xddcb7a099b30d9c1ULL), C64e(0x1d1b30fb5bdc1be0ULL), C64e(0xda24494ff29c82bfULL),
+    C64e(0xa4e7ba31b470bfffULL), C64e(0x0d324405def8bc48ULL), C64e(0x3baefc3253bbd339ULL), C64e(0x459fc3c1e0298ba0ULL),
+    C64e(0xe5c905fdf7ae090fULL), C64e(0x947034124290f134ULL), C64e(0xa271b701e344ed95ULL), C64e(0xe93b8e364f2f984aULL),
+    C64e(0x88401d63a06cf615ULL), C64e(0x47c1444b8752afffULL), C64e(0x7ebb4af1e20ac630ULL), C64e(0x4670b6c5cc6e8ce6ULL),
+    C64e(0xa4d5a456bd4fca00ULL), C64e(0xda9d844bc83e18aeULL), C64e(0x7357ce453064d1adULL), C64e(0xe8a6ce68145c2567ULL),
+    C64e(0xa3da8cf2cb0ee116ULL), C64e(0x33e906589a94999aULL), C64e(0x1f60b220c26f847bULL), C64e(0xd1ceac7fa0d18518ULL),
+    C64e(0x32595ba18ddd19d3ULL), C64e(0x509a1cc0aaa5b446ULL), C64e(0x9f3d6367e4046bbaULL), C64e(0xf6ca19ab0b56ee7eULL),
+    C64e(0x1fb179eaa9282174ULL), C64e(0xe9bdf7353b3651eeULL), C64e(0x1d57ac5a7550d376ULL), C64e(0x3a46c2fea37d7001ULL),
+    C64e(0xf735c1af98a4d842ULL), C64e(0x78edec209e6b6779ULL), C64e(0x41836315ea3adba8ULL), C64e(0xfac33b4d32832c83ULL),
+    C64e(0xa7403b1f1c2747f3ULL), C64e(0x5940f034b72d769aULL), C64e(0xe73e4e6cd2214ffdULL), C64e(0xb8fd8d39dc5759efULL),
+    C64e(0x8d9b0c492b49ebdaULL), C64e(0x5ba2d74968f3700dULL), C64e(0x7d3baed07a8d5584ULL), C64e(0xf5a5e9f0e4f88e65ULL),
+    C64e(0xa0b8a2f436103b53ULL), C64e(0x0ca8079e753eec5aULL), C64e(0x9168949256e8884fULL), C64e(0x5bb05c55f8babc4cULL),
+    C64e(0xe3bb3b99f387947bULL), C64e(0x75daf4d6726b1c5dULL), C64e(0x64aeac28dc34b36dULL), C64e(0x6c34a550b828db71ULL),
+    C64e(0xf861e2f2108d512aULL), C64e(0xe3db643359dd75fcULL), C64e(0x1cacbcf143ce3fa2ULL), C64e(0x67bbd13c02e843b0ULL),
+    C64e(0x330a5bca8829a175ULL), C64e(0x7f34194db416535cULL), C64e(0x923b94c30e794d1eULL), C64e(0x797475d7b6eeaf3fULL),
+    C64e(0xeaa8d4f7be1a3921ULL), C64e(0x5cf47e094c232751ULL), C64e(0x26a32453ba323cd2ULL), C64e(0x44a3174a6da6d5adULL),
+    C64e(0xb51d3ea6aff2c908ULL), C64e(0x83593d98916b3c56ULL), C64e(0x4cf87ca17286604dULL), C64e(0x46e23ecc086ec7f6ULL),
+    C64e(0x2f9833b3b1bc765eULL), C64e(0x2bd666a5efc4e62aULL), C64e(0x06f4b6e8bec1d436ULL), C64e(0x74ee8215bcef2163ULL),
+    C64e(0xfdc14e0df453c969ULL), C64e(0xa77d5ac406585826ULL), C64e(0x7ec1141606e0fa16ULL), C64e(0x7e90af3d28639d3fULL),
+    C64e(0xd2c9f2e3009bd20cULL), C64e(0x5faace30b7d40c30ULL), C64e(0x742a5116f2e03298ULL), C64e(0x0deb30d8e3cef89aULL),
+    C64e(0x4bc59e7bb5f17992ULL), C64e(0xff51e66e048668d3ULL), C64e(0x9b234d57e6966731ULL), C64e(0xcce6a6f3170a7505ULL),
+    C64e(0xb17681d913326cceULL), C64e(0x3c175284f805a262ULL), C64e(0xf42bcbb378471547ULL), C64e(0xff46548223936a48ULL),
+    C64e(0x38df58074e5e6565ULL), C64e(0xf2fc7c89fc86508eULL), C64e(0x31702e44d00bca86ULL), C64e(0xf04009a23078474eULL),
+    C64e(0x65a0ee39d1f73883ULL), C64e(0xf75ee937e42c3abdULL), C64e(0x2197b2260113f86fULL), C64e(0xa344edd1ef9fdee7ULL),
+    C64e(0x8ba0df15762592d9ULL), C64e(0x3c85f7f612dc42beULL), C64e(0xd8a7ec7cab27b07eULL), C64e(0x538d7ddaaa3ea8deULL),
+    C64e(0xaa25ce93bd0269d8ULL), C64e(0x5af643fd1a7308f9ULL), C64e(0xc05fefda174a19a5ULL), C64e(0x974d66334cfd216aULL),
+    C64e(0x35b49831db411570ULL), C64e(0xea1e0fbbedcd549bULL), C64e(0x9ad063a151974072ULL), C64e(0xf6759dbf91476fe2ULL)};
+
+#undef C64e
+
+void inline JhSb(__m256i& x0, __m256i& x1, __m256i& x2, __m256i& x3, __m256i c)
+{
+    x3 = Not(x3);
+    x0 = Xor(x0, AndNot(x2, c));
+    __m256i tmp = Xor(c, And(x0, x1));
+    x0 = Xor(x0, And(x2, x3));
+    x3 = Xor(x3, AndNot(x1, x2));
+    x1 = Xor(x1, And(x0, x2));
+    x2 = Xor(x2, AndNot(x3, x0));
+    x0 = Xor(x0, Or(x1, x3));
+    x3 = Xor(x3, And(x1, x2));
+    x1 = Xor(x1, And(tmp, x0));
+    x2 = Xor(x2, tmp);
+}
+
+void inline JhLb(__m256i& x0, __m256i& x1, __m256i& x2, __m256i& x3, __m256i& x4, __m256i& x5, __m256i& x6, __m256i& x7)
+{
+    x4 = Xor(x4, x1);
+    x5 = Xor(x5, x2);
+    x6 = Xor(x6, x3, x0);
+    x7 = Xor(x7, x0);
+    x0 = Xor(x0, x5);
+    x1 = Xor(x1, x6);
+    x2 = Xor(x2, x7, x4);
+    x3 = Xor(x3, x4);
+}
+
+/** Swap adjacent n-bit groups selected by mask c */
+void inline JhWz(__m256i& x, uint64_t c, int n)
+{
+    x = Or(And(Shr(x, n), K(c)), Shl(And(x, K(c)), n));
+}
+
+/**
+ * The JH-512 E8 permutation. The state is kept as in jh.c: h[2 * i] is the
+ * high and h[2 * i + 1] the low word of the 128-bit bitslice h_i.
+ */
+void JhE8(__m256i* h)
+{
+    static const uint64_t masks[6] = {0x5555555555555555ULL, 0x3333333333333333ULL, 0x0F0F0F0F0F0F0F0FULL,
+                                      0x00FF00FF00FF00FFULL, 0x0000FFFF0000FFFFULL, 0x00000000FFFFFFFFULL};
+    for (int r = 0; r < 42; r++) {
+        for (int w = 0; w < 2; w++) {
+            JhSb(h[0 + w], h[4 + w], h[8 + w], h[12 + w], K(jh_c[4 * r + w]));
+            JhSb(h[2 + w], h[6 + w], h[10 + w], h[14 + w], K(jh_c[4 * r + 2 + w]));
+            JhLb(h[0 + w], h[4 + w], h[8 + w], h[12 + w], h[2 + w], h[6 + w], h[10 + w], h[14 + w]);
+        }
+        int g = r % 7;
+        for (int i = 2; i < 16; i += 4) {
+            if (g < 6) {
+                JhWz(h[i], masks[g], 1 << g);
+                JhWz(h[i + 1], masks[g], 1 << g);
+            } else {
+                __m256i t = h[i];
+                h[i] = h[i + 1];
+                h[i + 1] = t;
+            }
+        }
+    }
+}
+
+/* ----------- Single stream ---------------------------------------------- */
+
+// Of the Quark primitives only JH-512 has enough independent work within one
+// message to fill a 256-bit register, as its S-boxes run on pairs of 128-bit
+// bitslices. The others are serial ARX or Keccak chains where cross-lane
+// permutes end up on the critical path and the 64-bit sph code is as fast.
+
+/** Move the low 128 bits to the high half, zeroing the low half */
+__m256i inline LowToHigh(__m256i x) { return _mm256_permute2x128_si256(x, x, 0x08); }
+/** Move the high 128 bits to the low half, zeroing the high half */
+__m256i inline HighToLow(__m256i x) { return _mm256_permute2x128_si256(x, x, 0x81); }
+
+/**
+ * One JH-512 E8 round with y[k] holding the bitslices 2k (low half) and
+ * 2k + 1 (high half), so one S-box call covers the even and odd groups and
+ * the constants can be loaded straight from jh_c.
+ */
+void inline JhRoundSingle(__m256i* y, int r, int g)
+{
+    static const uint64_t masks[6] = {0x5555555555555555ULL, 0x3333333333333333ULL, 0x0F0F0F0F0F0F0F0FULL,
+                                      0x00FF00FF00FF00FFULL, 0x0000FFFF0000FFFFULL, 0x00000000FFFFFFFFULL};
+    JhSb(y[0], y[1], y[2], y[3], _mm256_loadu_si256((const __m256i*)&jh_c[4 * r]));
+
+    // Linear layer: first the odd bitslices from the even ones, then back
+    y[0] = Xor(y[0], LowToHigh(y[1]));
+    y[1] = Xor(y[1], LowToHigh(y[2]));
+    y[2] = Xor(y[2], LowToHigh(Xor(y[3], y[0])));
+    y[3] = Xor(y[3], LowToHigh(y[0]));
+    y[0] = Xor(y[0], HighToLow(y[1]));
+    y[1] = Xor(y[1], HighToLow(y[2]));
+    y[2] = Xor(y[2], HighToLow(Xor(y[3], y[0])));
+    y[3] = Xor(y[3], HighToLow(y[0]));
+
+    // Bit permutation of the odd bitslices
+    for (int k = 0; k < 4; k++) {
+        if (g < 6) {
+            __m256i t = y[k];
+            JhWz(t, masks[g], 1 << g);
+            y[k] = _mm256_blend_epi32(y[k], t, 0xF0);
+        } else {
+            y[k] = _mm256_permute4x64_epi64(y[k], 0xB4);
+        }
+    }
+}
+
+void JhE8Single(__m256i* y)
+{
+    // Unrolled by the period of the bit permutations so their shifts are constants
+    for (int r = 0; r < 42; r += 7) {
+        JhRoundSingle(y, r, 0);
+        JhRoundSingle(y, r + 1, 1);
+        JhRoundSingle(y, r + 2, 2);
+        JhRoundSingle(y, r + 3, 3);
+        JhRoundSingle(y, r + 4, 4);
+        JhRoundSingle(y, r + 5, 5);
+        JhRoundSingle(y, r + 6, 6);
+    }
+}
+
+} // namespace
+
+void Blake512_4way(unsigned char* const out[4], const unsigned char* const in[4], size_t len)
+{
+    // Pad each message into a single 128-byte block
+    unsigned char buf[4][128];
+    const unsigned char* blocks[4] = {buf[0], buf[1], buf[2], buf[3]};
+    for (int i = 0; i < 4; i++) {
+        memset(buf[i], 0, sizeof(buf[i]));
+        memcpy(buf[i], in[i], len);
+        buf[i][len] = 0x80;
+        buf[i][111] |= 1;
+        WriteBE64(buf[i] + 120, (uint64_t)len << 3);
+    }
+
+    __m256i m[16], v[16];
+    for (int i = 0; i < 16; i++)
+        m[i] = LoadBE(blocks, 8 * i);
+    for (int i = 0; i < 8; i++)
+        v[i] = K(blake_iv[i]);
+    v[8] = K(blake_cb[0]);
+    v[9] = K(blake_cb[1]);
+    v[10] = K(blake_cb[2]);
+    v[11] = K(blake_cb[3]);
+    v[12] = K(((uint64_t)len << 3) ^ blake_cb[4]);
+    v[13] = K(((uint64_t)len << 3) ^ blake_cb[5]);
+    v[14] = K(blake_cb[6]);
+    v[15] = K(blake_cb[7]);
+
+    for (int r = 0; r < 16; r++) {
+        const unsigned char* s = blake_sigma[r % 10];
+        BlakeG(v[0], v[4], v[8], v[12], m, s, 0);
+        BlakeG(v[1], v[5], v[9], v[13], m, s, 2);
+        BlakeG(v[2], v[6], v[10], v[14], m, s, 4);
+        BlakeG(v[3], v[7], v[11], v[15], m, s, 6);
+        BlakeG(v[0], v[5], v[10], v[15], m, s, 8);
+        BlakeG(v[1], v[6], v[11], v[12], m, s, 10);
+        BlakeG(v[2], v[7], v[8], v[13], m, s, 12);
+        BlakeG(v[3], v[4], v[9], v[14], m, s, 14);
+    }
+
+    for (int i = 0; i < 8; i++)
+        StoreBE(out, 8 * i, Xor(K(blake_iv[i]), v[i], v[i + 8]));
+}
+
+void Bmw512_4way(unsigned char* const out[4], const unsigned char* const in[4])
+{
+    __m256i m[16], h[16], h2[16];
+    for (int i = 0; i < 8; i++)
+        m[i] = LoadLE(in, 8 * i);
+    m[8] = K(0x80);
+    for (int i = 9; i < 15; i++)
+        m[i] = _mm256_setzero_si256();
+    m[15] = K(512);
+    for (int i = 0; i < 16; i++)
+        h[i] = K(bmw_iv[i]);
+    BmwCompress(m, h, h2);
+
+    // Final compression keyed with the constant 0xaaaaaaaaaaaaaaa0 + i
+    for (int i = 0; i < 16; i++)
+        h[i] = K(0xaaaaaaaaaaaaaaa0ULL + i);
+    BmwCompress(h2, h, m);
+    for (int i = 0; i < 8; i++)
+        StoreLE(out, 8 * i, m[i + 8]);
+}
+
+void Keccak512_4way(unsigned char* const out[4], const unsigned char* const in[4])
+{
+    __m256i a[25];
+    for (int i = 0; i < 8; i++)
+        a[i] = LoadLE(in, 8 * i);
+    a[8] = K(0x8000000000000001ULL);
+    for (int i = 9; i < 25; i++)
+        a[i] = _mm256_setzero_si256();
+    KeccakF1600(a);
+    for (int i = 0; i < 8; i++)
+        StoreLE(out, 8 * i, a[i]);
+}
+
+void Skein512_4way(unsigned char* const out[4], const unsigned char* const in[4])
+{
+    __m256i h[8], m[8];
+    for (int i = 0; i < 8; i++) {
+        h[i] = K(skein_iv[i]);
+        m[i] = LoadLE(in, 8 * i);
+    }
+    SkeinUBI(h, m, 64, 0xF000000000000000ULL);
+    for (int i = 0; i < 8; i++)
+        m[i] = _mm256_setzero_si256();
+    SkeinUBI(h, m, 8, 0xFF00000000000000ULL);
+    for (int i = 0; i < 8; i++)
+        StoreLE(out, 8 * i, h[i]);
+}
+
+void Jh512_4way(unsigned char* const out[4], const unsigned char* const in[4])
+{
+    __m256i h[16], m[8];
+    for (int i = 0; i < 16; i++)
+        h[i] = K(jh_iv[i]);
+    for (int i = 0; i < 8; i++)
+        m[i] = LoadLE(in, 8 * i);
+
+    // Message block, then the padding block carrying the 512-bit length
+    for (int block = 0; block < 2; block++) {
+        for (int i = 0; i < 8; i++)
+            h[i] = Xor(h[i], m[i]);
+        JhE8(h);
+        for (int i = 0; i < 8; i++)
+            h[i + 8] = Xor(h[i + 8], m[i]);
+        m[0] = K(0x80);
+        for (int i = 1; i < 7; i++)
+            m[i] = _mm256_setzero_si256();
+        m[7] = K(0x0002000000000000ULL);
+    }
+    for (int i = 0; i < 8; i++)
+        StoreLE(out, 8 * i, h[i + 8]);
+}
+
+void Jh512(unsigned char* out, const unsigned char* in)
+{
+    __m256i y[4], m0, m1;
+    for (int k = 0; k < 4; k++)
+        y[k] = _mm256_loadu_si256((const __m256i*)&jh_iv[4 * k]);
+    m0 = _mm256_loadu_si256((const __m256i*)in);
+    m1 = _mm256_loadu_si256((const __m256i*)(in + 32));
+
+    // Message block, then the padding block carrying the 512-bit length
+    for (int block = 0; block < 2; block++) {
+        y[0] = Xor(y[0], m0);
+        y[1] = Xor(y[1], m1);
+        JhE8Single(y);
+        y[2] = Xor(y[2], m0);
+        y[3] = Xor(y[3], m1);
+        m0 = _mm256_set_epi64x(0, 0, 0, 0x80);
+        m1 = _mm256_set_epi64x(0x0002000000000000ULL, 0, 0, 0);
+    }
+    _mm256_storeu_si256((__m256i*)out, y[2]);
+    _mm256_storeu_si256((__m256i*)(out + 32), y[3]);
+}
+
+} // namespace quark_avx2
+
+#endif // ENABLE_AVX2
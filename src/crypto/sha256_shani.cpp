@@ -0,0 +1,284 @@
+// Copyright (c) 2018 The Hash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+// SHA-256 using the Intel SHA extensions. SHA256RNDS2 performs two rounds on
+// a state split in ABEF and CDGH halves, and SHA256MSG1/MSG2 compute the
+// message schedule four words at a time.
+
+#if defined(HAVE_CONFIG_H)
+#include "config/hash-config.h"
+#endif
+
+#ifdef ENABLE_SHANI
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <immintrin.h>
+
+namespace {
+
+/** Byte order of the big-endian message words within each 32-bit lane */
+__m128i inline Mask()
+{
+    return _mm_set_epi64x(0x0c0d0e0f08090a0bull, 0x0405060700010203ull);
+}
+
+/** The initial state in ABEF and CDGH order */
+__m128i inline Init0() { return _mm_set_epi32(0x6a09e667, 0xbb67ae85, 0x510e527f, 0x9b05688c); }
+__m128i inline Init1() { return _mm_set_epi32(0x3c6ef372, 0xa54ff53a, 0x1f83d9ab, 0x5be0cd19); }
+
+/** Four rounds with the message words already added to the round constants */
+void inline __attribute__((always_inline)) QuadRound(__m128i& s0, __m128i& s1, uint64_t k1, uint64_t k0)
+{
+    const __m128i msg = _mm_set_epi64x(k1, k0);
+    s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+    s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(msg, 0x0e));
+}
+
+void inline __attribute__((always_inline)) QuadRound(__m128i& s0, __m128i& s1, __m128i m, uint64_t k1, uint64_t k0)
+{
+    const __m128i msg = _mm_add_epi32(m, _mm_set_epi64x(k1, k0));
+    s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+    s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(msg, 0x0e));
+}
+
+void inline __attribute__((always_inline)) ShiftMessageA(__m128i& m0, __m128i m1)
+{
+    m0 = _mm_sha256msg1_epu32(m0, m1);
+}
+
+void inline __attribute__((always_inline)) ShiftMessageC(__m128i& m0, __m128i m1, __m128i& m2)
+{
+    m2 = _mm_sha256msg2_epu32(_mm_add_epi32(m2, _mm_alignr_epi8(m1, m0, 4)), m1);
+}
+
+void inline __attribute__((always_inline)) ShiftMessageB(__m128i& m0, __m128i m1, __m128i& m2)
+{
+    ShiftMessageC(m0, m1, m2);
+    ShiftMessageA(m0, m1);
+}
+
+/** Two independent streams, interleaved so their round latencies overlap */
+void inline __attribute__((always_inline)) QuadRound(__m128i& as0, __m128i& as1, __m128i& bs0, __m128i& bs1, uint64_t k1, uint64_t k0)
+{
+    const __m128i msg = _mm_set_epi64x(k1, k0);
+    const __m128i msg2 = _mm_shuffle_epi32(msg, 0x0e);
+    as1 = _mm_sha256rnds2_epu32(as1, as0, msg);
+    bs1 = _mm_sha256rnds2_epu32(bs1, bs0, msg);
+    as0 = _mm_sha256rnds2_epu32(as0, as1, msg2);
+    bs0 = _mm_sha256rnds2_epu32(bs0, bs1, msg2);
+}
+
+void inline __attribute__((always_inline)) QuadRound(__m128i& as0, __m128i& as1, __m128i am, __m128i& bs0, __m128i& bs1, __m128i bm, uint64_t k1, uint64_t k0)
+{
+    const __m128i k = _mm_set_epi64x(k1, k0);
+    const __m128i amsg = _mm_add_epi32(am, k);
+    const __m128i bmsg = _mm_add_epi32(bm, k);
+    as1 = _mm_sha256rnds2_epu32(as1, as0, amsg);
+    bs1 = _mm_sha256rnds2_epu32(bs1, bs0, bmsg);
+    as0 = _mm_sha256rnds2_epu32(as0, as1, _mm_shuffle_epi32(amsg, 0x0e));
+    bs0 = _mm_sha256rnds2_epu32(bs0, bs1, _mm_shuffle_epi32(bmsg, 0x0e));
+}
+
+void inline __attribute__((always_inline)) ShiftMessageA(__m128i& am0, __m128i am1, __m128i& bm0, __m128i bm1)
+{
+    ShiftMessageA(am0, am1);
+    ShiftMessageA(bm0, bm1);
+}
+
+void inline __attribute__((always_inline)) ShiftMessageB(__m128i& am0, __m128i am1, __m128i& am2, __m128i& bm0, __m128i bm1, __m128i& bm2)
+{
+    ShiftMessageB(am0, am1, am2);
+    ShiftMessageB(bm0, bm1, bm2);
+}
+
+void inline __attribute__((always_inline)) ShiftMessageC(__m128i& am0, __m128i am1, __m128i& am2, __m128i& bm0, __m128i bm1, __m128i& bm2)
+{
+    ShiftMessageC(am0, am1, am2);
+    ShiftMessageC(bm0, bm1, bm2);
+}
+
+/** Convert between the abcd/efgh word order and the ABEF/CDGH register layout */
+void inline __attribute__((always_inline)) Shuffle(__m128i& s0, __m128i& s1)
+{
+    const __m128i t1 = _mm_shuffle_epi32(s0, 0xB1);
+    const __m128i t2 = _mm_shuffle_epi32(s1, 0x1B);
+    s0 = _mm_alignr_epi8(t1, t2, 0x08);
+    s1 = _mm_blend_epi16(t2, t1, 0xF0);
+}
+
+void inline __attribute__((always_inline)) Unshuffle(__m128i& s0, __m128i& s1)
+{
+    const __m128i t1 = _mm_shuffle_epi32(s0, 0x1B);
+    const __m128i t2 = _mm_shuffle_epi32(s1, 0xB1);
+    s0 = _mm_blend_epi16(t1, t2, 0xF0);
+    s1 = _mm_alignr_epi8(t2, t1, 0x08);
+}
+
+__m128i inline __attribute__((always_inline)) Load(const unsigned char* in)
+{
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)in), Mask());
+}
+
+void inline __attribute__((always_inline)) Save(unsigned char* out, __m128i s)
+{
+    _mm_storeu_si128((__m128i*)out, _mm_shuffle_epi8(s, Mask()));
+}
+
+/** The 64 rounds of a block whose message words are in m0..m3 */
+void inline __attribute__((always_inline)) Rounds(__m128i& s0, __m128i& s1, __m128i m0, __m128i m1, __m128i m2, __m128i m3)
+{
+    QuadRound(s0, s1, m0, 0xe9b5dba5b5c0fbcfull, 0x71374491428a2f98ull);
+    QuadRound(s0, s1, m1, 0xab1c5ed5923f82a4ull, 0x59f111f13956c25bull);
+    ShiftMessageA(m0, m1);
+    QuadRound(s0, s1, m2, 0x550c7dc3243185beull, 0x12835b01d807aa98ull);
+    ShiftMessageA(m1, m2);
+    QuadRound(s0, s1, m3, 0xc19bf1749bdc06a7ull, 0x80deb1fe72be5d74ull);
+    ShiftMessageB(m2, m3, m0);
+    QuadRound(s0, s1, m0, 0x240ca1cc0fc19dc6ull, 0xefbe4786e49b69c1ull);
+    ShiftMessageB(m3, m0, m1);
+    QuadRound(s0, s1, m1, 0x76f988da5cb0a9dcull, 0x4a7484aa2de92c6full);
+    ShiftMessageB(m0, m1, m2);
+    QuadRound(s0, s1, m2, 0xbf597fc7b00327c8ull, 0xa831c66d983e5152ull);
+    ShiftMessageB(m1, m2, m3);
+    QuadRound(s0, s1, m3, 0x1429296706ca6351ull, 0xd5a79147c6e00bf3ull);
+    ShiftMessageB(m2, m3, m0);
+    QuadRound(s0, s1, m0, 0x53380d134d2c6dfcull, 0x2e1b213827b70a85ull);
+    ShiftMessageB(m3, m0, m1);
+    QuadRound(s0, s1, m1, 0x92722c8581c2c92eull, 0x766a0abb650a7354ull);
+    ShiftMessageB(m0, m1, m2);
+    QuadRound(s0, s1, m2, 0xc76c51a3c24b8b70ull, 0xa81a664ba2bfe8a1ull);
+    ShiftMessageB(m1, m2, m3);
+    QuadRound(s0, s1, m3, 0x106aa070f40e3585ull, 0xd6990624d192e819ull);
+    ShiftMessageB(m2, m3, m0);
+    QuadRound(s0, s1, m0, 0x34b0bcb52748774cull, 0x1e376c0819a4c116ull);
+    ShiftMessageB(m3, m0, m1);
+    QuadRound(s0, s1, m1, 0x682e6ff35b9cca4full, 0x4ed8aa4a391c0cb3ull);
+    ShiftMessageC(m0, m1, m2);
+    QuadRound(s0, s1, m2, 0x8cc7020884c87814ull, 0x78a5636f748f82eeull);
+    ShiftMessageC(m1, m2, m3);
+    QuadRound(s0, s1, m3, 0xc67178f2bef9a3f7ull, 0xa4506ceb90befffaull);
+}
+
+void inline __attribute__((always_inline)) Rounds(__m128i& as0, __m128i& as1, __m128i am0, __m128i am1, __m128i am2, __m128i am3,
+                                                  __m128i& bs0, __m128i& bs1, __m128i bm0, __m128i bm1, __m128i bm2, __m128i bm3)
+{
+    QuadRound(as0, as1, am0, bs0, bs1, bm0, 0xe9b5dba5b5c0fbcfull, 0x71374491428a2f98ull);
+    QuadRound(as0, as1, am1, bs0, bs1, bm1, 0xab1c5ed5923f82a4ull, 0x59f111f13956c25bull);
+    ShiftMessageA(am0, am1, bm0, bm1);
+    QuadRound(as0, as1, am2, bs0, bs1, bm2, 0x550c7dc3243185beull, 0x12835b01d807aa98ull);
+    ShiftMessageA(am1, am2, bm1, bm2);
+    QuadRound(as0, as1, am3, bs0, bs1, bm3, 0xc19bf1749bdc06a7ull, 0x80deb1fe72be5d74ull);
+    ShiftMessageB(am2, am3, am0, bm2, bm3, bm0);
+    QuadRound(as0, as1, am0, bs0, bs1, bm0, 0x240ca1cc0fc19dc6ull, 0xefbe4786e49b69c1ull);
+    ShiftMessageB(am3, am0, am1, bm3, bm0, bm1);
+    QuadRound(as0, as1, am1, bs0, bs1, bm1, 0x76f988da5cb0a9dcull, 0x4a7484aa2de92c6full);
+    ShiftMessageB(am0, am1, am2, bm0, bm1, bm2);
+    QuadRound(as0, as1, am2, bs0, bs1, bm2, 0xbf597fc7b00327c8ull, 0xa831c66d983e5152ull);
+    ShiftMessageB(am1, am2, am3, bm1, bm2, bm3);
+    QuadRound(as0, as1, am3, bs0, bs1, bm3, 0x1429296706ca6351ull, 0xd5a79147c6e00bf3ull);
+    ShiftMessageB(am2, am3, am0, bm2, bm3, bm0);
+    QuadRound(as0, as1, am0, bs0, bs1, bm0, 0x53380d134d2c6dfcull, 0x2e1b213827b70a85ull);
+    ShiftMessageB(am3, am0, am1, bm3, bm0, bm1);
+    QuadRound(as0, as1, am1, bs0, bs1, bm1, 0x92722c8581c2c92eull, 0x766a0abb650a7354ull);
+    ShiftMessageB(am0, am1, am2, bm0, bm1, bm2);
+    QuadRound(as0, as1, am2, bs0, bs1, bm2, 0xc76c51a3c24b8b70ull, 0xa81a664ba2bfe8a1ull);
+    ShiftMessageB(am1, am2, am3, bm1, bm2, bm3);
+    QuadRound(as0, as1, am3, bs0, bs1, bm3, 0x106aa070f40e3585ull, 0xd6990624d192e819ull);
+    ShiftMessageB(am2, am3, am0, bm2, bm3, bm0);
+    QuadRound(as0, as1, am0, bs0, bs1, bm0, 0x34b0bcb52748774cull, 0x1e376c0819a4c116ull);
+    ShiftMessageB(am3, am0, am1, bm3, bm0, bm1);
+    QuadRound(as0, as1, am1, bs0, bs1, bm1, 0x682e6ff35b9cca4full, 0x4ed8aa4a391c0cb3ull);
+    ShiftMessageC(am0, am1, am2, bm0, bm1, bm2);
+    QuadRound(as0, as1, am2, bs0, bs1, bm2, 0x8cc7020884c87814ull, 0x78a5636f748f82eeull);
+    ShiftMessageC(am1, am2, am3, bm1, bm2, bm3);
+    QuadRound(as0, as1, am3, bs0, bs1, bm3, 0xc67178f2bef9a3f7ull, 0xa4506ceb90befffaull);
+}
+
+} // namespace
+
+namespace sha256_shani {
+
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    __m128i s0 = _mm_loadu_si128((const __m128i*)s);
+    __m128i s1 = _mm_loadu_si128((const __m128i*)(s + 4));
+    Shuffle(s0, s1);
+
+    while (blocks--) {
+        const __m128i so0 = s0, so1 = s1;
+        Rounds(s0, s1, Load(chunk), Load(chunk + 16), Load(chunk + 32), Load(chunk + 48));
+        s0 = _mm_add_epi32(s0, so0);
+        s1 = _mm_add_epi32(s1, so1);
+        chunk += 64;
+    }
+
+    Unshuffle(s0, s1);
+    _mm_storeu_si128((__m128i*)s, s0);
+    _mm_storeu_si128((__m128i*)(s + 4), s1);
+}
+
+} // namespace sha256_shani
+
+namespace sha256d64_shani {
+
+void Transform_2way(unsigned char* out, const unsigned char* in)
+{
+    // Transform 1: the 64-byte message blocks
+    __m128i as0 = Init0(), as1 = Init1(), bs0 = as0, bs1 = as1;
+    Rounds(as0, as1, Load(in), Load(in + 16), Load(in + 32), Load(in + 48),
+           bs0, bs1, Load(in + 64), Load(in + 80), Load(in + 96), Load(in + 112));
+    as0 = _mm_add_epi32(as0, Init0());
+    as1 = _mm_add_epi32(as1, Init1());
+    bs0 = _mm_add_epi32(bs0, Init0());
+    bs1 = _mm_add_epi32(bs1, Init1());
+    const __m128i aso0 = as0, aso1 = as1, bso0 = bs0, bso1 = bs1;
+
+    // Transform 2: the padding block, whose message schedule is constant
+    QuadRound(as0, as1, bs0, bs1, 0xe9b5dba5b5c0fbcfull, 0x71374491c28a2f98ull);
+    QuadRound(as0, as1, bs0, bs1, 0xab1c5ed5923f82a4ull, 0x59f111f13956c25bull);
+    QuadRound(as0, as1, bs0, bs1, 0x550c7dc3243185beull, 0x12835b01d807aa98ull);
+    QuadRound(as0, as1, bs0, bs1, 0xc19bf3749bdc06a7ull, 0x80deb1fe72be5d74ull);
+    QuadRound(as0, as1, bs0, bs1, 0x240cf2540fe1edc6ull, 0xf0fe4786649b69c1ull);
+    QuadRound(as0, as1, bs0, bs1, 0x16f988fa61b9411eull, 0x6cc984be4fe9346full);
+    QuadRound(as0, as1, bs0, bs1, 0xb9d99ec7b019fc65ull, 0xa88e5a6df2c65152ull);
+    QuadRound(as0, as1, bs0, bs1, 0xc7353eb0fdb1232bull, 0xe70eeaa09a1231c3ull);
+    QuadRound(as0, as1, bs0, bs1, 0xdc1eeefd5a0f118full, 0xcb976d5f3069bad5ull);
+    QuadRound(as0, as1, bs0, bs1, 0xe15d5b1658f4ca9dull, 0xde0b7a040a35b689ull);
+    QuadRound(as0, as1, bs0, bs1, 0x6fab9537a507ea32ull, 0x37088980007f3e86ull);
+    QuadRound(as0, as1, bs0, bs1, 0xc0bbbe37cdaa3b6dull, 0x0d8cd6f117406110ull);
+    QuadRound(as0, as1, bs0, bs1, 0x6fd15ca70b02e931ull, 0xdb48a36383613bdaull);
+    QuadRound(as0, as1, bs0, bs1, 0x6d4378906ed41a95ull, 0x31338431521afacaull);
+    QuadRound(as0, as1, bs0, bs1, 0x532fb63cb5c9a0e6ull, 0x9eccabbdc39c91f2ull);
+    QuadRound(as0, as1, bs0, bs1, 0x4c191d76a4954b68ull, 0x07237ea3d2c741c6ull);
+    as0 = _mm_add_epi32(as0, aso0);
+    as1 = _mm_add_epi32(as1, aso1);
+    bs0 = _mm_add_epi32(bs0, bso0);
+    bs1 = _mm_add_epi32(bs1, bso1);
+
+    // Transform 3: hash the 32-byte results again, the state words become the message
+    Unshuffle(as0, as1);
+    Unshuffle(bs0, bs1);
+    const __m128i pad0 = _mm_set_epi32(0, 0, 0, 0x80000000), pad1 = _mm_set_epi32(0x100, 0, 0, 0);
+    const __m128i am0 = as0, am1 = as1, bm0 = bs0, bm1 = bs1;
+    as0 = bs0 = Init0();
+    as1 = bs1 = Init1();
+    Rounds(as0, as1, am0, am1, pad0, pad1, bs0, bs1, bm0, bm1, pad0, pad1);
+    as0 = _mm_add_epi32(as0, Init0());
+    as1 = _mm_add_epi32(as1, Init1());
+    bs0 = _mm_add_epi32(bs0, Init0());
+    bs1 = _mm_add_epi32(bs1, Init1());
+
+    // Output
+    Unshuffle(as0, as1);
+    Unshuffle(bs0, bs1);
+    Save(out, as0);
+    Save(out + 16, as1);
+    Save(out + 32, bs0);
+    Save(out + 48, bs1);
+}
+
+} // namespace sha256d64_shani
+
+#endif
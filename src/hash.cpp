@@ -3,6 +3,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "hash.h"
+#include "crypto/common.h"
 #include "crypto/hmac_sha512.h"
 #include "crypto/scrypt.h"
 
@@ -69,6 +70,78 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
     return h1;
 }
 
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND                                   \
+    do {                                           \
+        v0 += v1;                                  \
+        v1 = ROTL64(v1, 13);                       \
+        v1 ^= v0;                                  \
+        v0 = ROTL64(v0, 32);                       \
+        v2 += v3;                                  \
+        v3 = ROTL64(v3, 16);                       \
+        v3 ^= v2;                                  \
+        v0 += v3;                                  \
+        v3 = ROTL64(v3, 21);                       \
+        v3 ^= v0;                                  \
+        v2 += v1;                                  \
+        v1 = ROTL64(v1, 17);                       \
+        v1 ^= v2;                                  \
+        v2 = ROTL64(v2, 32);                       \
+    } while (0)
+
+CSipHasher::CSipHasher(uint64_t k0, uint64_t k1)
+{
+    v[0] = 0x736f6d6570736575ULL ^ k0;
+    v[1] = 0x646f72616e646f6dULL ^ k1;
+    v[2] = 0x6c7967656e657261ULL ^ k0;
+    v[3] = 0x7465646279746573ULL ^ k1;
+    count = 0;
+}
+
+CSipHasher& CSipHasher::Write(uint64_t data)
+{
+    uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+
+    v3 ^= data;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= data;
+
+    v[0] = v0;
+    v[1] = v1;
+    v[2] = v2;
+    v[3] = v3;
+
+    count += 8;
+    return *this;
+}
+
+uint64_t CSipHasher::Finalize() const
+{
+    uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+
+    // Only whole words are written, so the final block is just the length
+    uint64_t t = ((uint64_t)count) << 56;
+
+    v3 ^= t;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= t;
+    v2 ^= 0xFF;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val)
+{
+    const unsigned char* p = val.begin();
+    return CSipHasher(k0, k1).Write(ReadLE64(p)).Write(ReadLE64(p + 8)).Write(ReadLE64(p + 16)).Write(ReadLE64(p + 24)).Finalize();
+}
+
 void BIP32Hash(const unsigned char chainCode[32], unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64])
 {
     unsigned char num[4];
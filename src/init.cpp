@@ -17,6 +17,8 @@
 #include "amount.h"
 #include "checkpoints.h"
 #include "compat/sanity.h"
+#include "crypto/quark.h"
+#include "crypto/sha256.h"
 #include "key.h"
 #include "main.h"
 #include "masternode-budget.h"
@@ -36,6 +38,7 @@
 #include "ui_interface.h"
 #include "util.h"
 #include "utilmoneystr.h"
+#include "utxosnapshot.h"
 #include "validationinterface.h"
 #ifdef ENABLE_WALLET
 #include "db.h"
@@ -156,10 +159,20 @@ public:
             abort();
         }
     }
+    bool GetCoinsOutput(const COutPoint& out, CCoins& coins) const
+    {
+        try {
+            return base->GetCoinsOutput(out, coins);
+        } catch (const std::runtime_error& e) {
+            // As in GetCoins
+            uiInterface.ThreadSafeMessageBox(_("Error reading from database, shutting down."), "", CClientUIInterface::MSG_ERROR);
+            LogPrintf("Error reading from database: %s\n", e.what());
+            abort();
+        }
+    }
     // Writes do not need similar protection, as failure to write is handled by the caller.
 };
 
-static CCoinsViewDB* pcoinsdbview = NULL;
 static CCoinsViewErrorCatcher* pcoinscatcher = NULL;
 
 /** Preparing steps before shutting down or restarting the wallet */
@@ -213,6 +226,10 @@ void PrepareShutdown()
         }
         delete pcoinsTip;
         pcoinsTip = NULL;
+        delete pcoinsPrefetch;
+        pcoinsPrefetch = NULL;
+        delete pcoinsAsyncWriter;
+        pcoinsAsyncWriter = NULL;
         delete pcoinscatcher;
         pcoinscatcher = NULL;
         delete pcoinsdbview;
@@ -321,15 +338,23 @@ std::string HelpMessage(HelpMessageMode mode)
         strUsage += HelpMessageOpt("-daemon", _("Run in the background as a daemon and accept commands"));
 #endif
     }
+    strUsage += HelpMessageOpt("-asyncflush", strprintf(_("Write the chainstate to disk on a background thread, so validation continues during the write (default: %u)"), DEFAULT_ASYNC_FLUSH));
+    strUsage += HelpMessageOpt("-coinsprefetch=<n>", strprintf(_("Set the number of threads reading the coins spent by blocks ahead of validation (0 to %d, 0 = disable, default: %d)"), MAX_COINS_PREFETCH_THREADS, DEFAULT_COINS_PREFETCH_THREADS));
     strUsage += HelpMessageOpt("-datadir=<dir>", _("Specify data directory"));
-    strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
+    strUsage += HelpMessageOpt("-dbcache=<n>", strprintf(_("Set database cache size in megabytes, shared by the block index, the coin database and the in-memory UTXO set (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache));
     strUsage += HelpMessageOpt("-loadblock=<file>", _("Imports blocks from external blk000??.dat file") + " " + _("on startup"));
+    strUsage += HelpMessageOpt("-loadutxosnapshot=<file>", _("Bootstrap an empty chain state from a UTXO set snapshot written by dumptxoutset and pinned by this version, then validate blocks from its height on (implies -txindex=0)"));
     strUsage += HelpMessageOpt("-maxreorg=<n>", strprintf(_("Set the Maximum reorg depth (default: %u)"), Params(CBaseChainParams::MAIN).MaxReorganizationDepth()));
     strUsage += HelpMessageOpt("-maxorphantx=<n>", strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS));
     strUsage += HelpMessageOpt("-par=<n>", strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS));
+    strUsage += HelpMessageOpt("-parcheckblock", strprintf(_("Run the transaction checks and Merkle tree hashing of large blocks on the script verification threads (default: %u)"), DEFAULT_PARALLEL_CHECKBLOCK));
 #ifndef WIN32
     strUsage += HelpMessageOpt("-pid=<file>", strprintf(_("Specify pid file (default: %s)"), "hashd.pid"));
 #endif
+    strUsage += HelpMessageOpt("-prune=<n>", strprintf(_("Reduce storage requirements by pruning (deleting) old blocks. This mode disables wallet rescans and is incompatible with -txindex. "
+                                                         "Warning: Reverting this setting requires re-downloading the entire blockchain. "
+                                                         "(default: 0 = disable pruning blocks, >%u = target size in MiB to use for block files)"),
+                                                       MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
     strUsage += HelpMessageOpt("-reindex", _("Rebuild block chain index from current blk000??.dat files") + " " + _("on startup"));
     strUsage += HelpMessageOpt("-resync", _("Delete blockchain folders and resync from scratch") + " " + _("on startup"));
 #if !defined(WIN32)
@@ -464,6 +489,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += HelpMessageGroup(_("Staking options:"));
     strUsage += HelpMessageOpt("-staking=<n>", strprintf(_("Enable staking functionality (0-1, default: %u)"), 1));
     strUsage += HelpMessageOpt("-reservebalance=<amt>", _("Keep the specified amount available for spending at all times (default: 0)"));
+    strUsage += HelpMessageOpt("-stakethreads=<n>", _("Set the number of threads searching for stake kernels (0 = one per core, default: 0)"));
     if (GetBoolArg("-help-debug", false)) {
         strUsage += HelpMessageOpt("-printstakemodifier", _("Display the stake modifier calculations in the debug.log file."));
         strUsage += HelpMessageOpt("-printcoinstake", _("Display verbose coin stake messages in the debug.log file."));
@@ -561,6 +587,9 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 {
     RenameThread("hash-loadblk");
 
+    // Blocks found before their parent, which may be in a later file; freed when the import is done
+    CUnknownParentBlocks unknownParents;
+
     // -reindex
     if (fReindex) {
         CImportingNow imp;
@@ -573,7 +602,7 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
             if (!file)
                 break; // This error is logged in OpenBlockFile
             LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-            LoadExternalBlockFile(file, &pos);
+            LoadExternalBlockFile(file, &pos, &unknownParents);
             nFile++;
         }
         pblocktree->WriteReindexing(false);
@@ -591,7 +620,7 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
             CImportingNow imp;
             filesystem::path pathBootstrapOld = GetDataDir() / "bootstrap.dat.old";
             LogPrintf("Importing bootstrap.dat...\n");
-            LoadExternalBlockFile(file);
+            LoadExternalBlockFile(file, NULL, &unknownParents);
             RenameOver(pathBootstrap, pathBootstrapOld);
         } else {
             LogPrintf("Warning: Could not open bootstrap file %s\n", pathBootstrap.string());
@@ -604,7 +633,7 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
         if (file) {
             CImportingNow imp;
             LogPrintf("Importing blocks file %s...\n", path.string());
-            LoadExternalBlockFile(file);
+            LoadExternalBlockFile(file, NULL, &unknownParents);
         } else {
             LogPrintf("Warning: Could not open blocks file %s\n", path.string());
         }
@@ -764,6 +793,18 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
             LogPrintf("AppInit2 : parameter interaction: -zapwallettxes=<mode> -> setting -rescan=1\n");
     }
 
+    // -prune has no use for a transaction index
+    if (GetArg("-prune", 0) > 0) {
+        if (SoftSetBoolArg("-txindex", false))
+            LogPrintf("AppInit2 : parameter interaction: -prune set -> setting -txindex=0\n");
+    }
+
+    // a UTXO snapshot comes without the blocks to index
+    if (mapArgs.count("-loadutxosnapshot")) {
+        if (SoftSetBoolArg("-txindex", false))
+            LogPrintf("AppInit2 : parameter interaction: -loadutxosnapshot set -> setting -txindex=0\n");
+    }
+
     if (!GetBoolArg("-enableswifttx", fEnableSwiftTX)) {
         if (SoftSetArg("-swifttxdepth", 0))
             LogPrintf("AppInit2 : parameter interaction: -enableswifttx=false -> setting -nSwiftTXDepth=0\n");
@@ -823,6 +864,7 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         nScriptCheckThreads = 0;
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
+    fParallelCheckBlock = GetBoolArg("-parcheckblock", DEFAULT_PARALLEL_CHECKBLOCK);
 
     fServer = GetBoolArg("-server", false);
     setvbuf(stdout, NULL, _IOLBF, 0); /// ***TODO*** do we still need this after -printtoconsole is gone?
@@ -905,6 +947,28 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     if (GetBoolArg("-peerbloomfilters", DEFAULT_PEERBLOOMFILTERS))
         nLocalServices |= NODE_BLOOM;
 
+    // block pruning; get the amount of disk space (in MiB) to allot for block & undo files
+    int64_t nSignedPruneTarget = GetArg("-prune", 0) * 1024 * 1024;
+    if (nSignedPruneTarget < 0) {
+        return InitError(_("Prune cannot be configured with a negative value."));
+    }
+    nPruneTarget = (uint64_t)nSignedPruneTarget;
+    if (nPruneTarget) {
+        if (GetBoolArg("-txindex", true))
+            return InitError(_("Prune mode is incompatible with -txindex."));
+        if (nPruneTarget < MIN_DISK_SPACE_FOR_BLOCK_FILES) {
+            return InitError(strprintf(_("Prune configured below the minimum of %d MiB.  Please use a higher number."), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
+        }
+        LogPrintf("Prune configured to target %uMiB on disk for block and undo files.\n", nPruneTarget / 1024 / 1024);
+        fPruneMode = true;
+        // Pruned nodes cannot serve the full chain
+        nLocalServices &= ~NODE_NETWORK;
+    }
+    if (mapArgs.count("-loadutxosnapshot") && GetBoolArg("-txindex", true))
+        return InitError(_("-loadutxosnapshot is incompatible with -txindex."));
+    if (mapArgs.count("-loadutxosnapshot") && Params().SnapshotAnchors().empty())
+        return InitError(_("-loadutxosnapshot is not available, this version accepts no snapshot on this network."));
+
     // ********************************************************* Step 4: application initialization: dir lock, daemonize, pidfile, debug log
 
     // Sanity check
@@ -950,6 +1014,8 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     LogPrintf("Default data directory %s\n", GetDefaultDataDir().string());
     LogPrintf("Using data directory %s\n", strDataDir);
     LogPrintf("Using config file %s\n", GetConfigFile().string());
+    LogPrintf("Using the '%s' Quark implementation\n", QuarkAutoDetect());
+    LogPrintf("Using the '%s' SHA256 implementation\n", SHA256AutoDetect());
     LogPrintf("Using at most %i connections (%i file descriptors available)\n", nMaxConnections, nFD);
     std::ostringstream strErrors;
 
@@ -1293,7 +1359,16 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
     nTotalCache -= nBlockTreeDBCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
-    nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
+    int nCoinsPrefetchThreads = std::max(0, std::min((int)GetArg("-coinsprefetch", DEFAULT_COINS_PREFETCH_THREADS), MAX_COINS_PREFETCH_THREADS));
+    size_t nCoinsPrefetchCache = nCoinsPrefetchThreads > 0 ? std::min(nTotalCache / COINS_PREFETCH_CACHE_DIVISOR, MAX_COINS_PREFETCH_CACHE) : 0;
+    nTotalCache -= nCoinsPrefetchCache;
+    nCoinCacheUsage = nTotalCache;
+    LogPrintf("Cache configuration:\n");
+    LogPrintf("* Using %.1fMiB for block index database\n", nBlockTreeDBCache * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for chain state database\n", nCoinDBCache * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for in-memory UTXO set\n", nCoinCacheUsage * (1.0 / 1024 / 1024));
+    LogPrintf("* Using %.1fMiB for prefetched coins\n", nCoinsPrefetchCache * (1.0 / 1024 / 1024));
+    bool fAsyncFlush = GetBoolArg("-asyncflush", DEFAULT_ASYNC_FLUSH);
 
     bool fLoaded = false;
     while (!fLoaded) {
@@ -1305,8 +1380,11 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         nStart = GetTimeMillis();
         do {
             try {
-                UnloadBlockIndex();
+                // The prefetch workers are stopped before the block index they read from goes
                 delete pcoinsTip;
+                delete pcoinsPrefetch;
+                delete pcoinsAsyncWriter;
+                UnloadBlockIndex();
                 delete pcoinsdbview;
                 delete pcoinscatcher;
                 delete pblocktree;
@@ -1317,8 +1395,29 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
+                if (!pcoinsdbview->Upgrade()) {
+                    strLoadError = _("Error upgrading chainstate database");
+                    break;
+                }
+
+                // Bootstrap an empty chain state from a UTXO snapshot
+                if (mapArgs.count("-loadutxosnapshot") && !fReindex && pcoinsdbview->GetBestBlock() == uint256(0)) {
+                    uiInterface.InitMessage(_("Loading UTXO snapshot..."));
+                    std::string strSnapshotError;
+                    if (!LoadUTXOSnapshot(GetArg("-loadutxosnapshot", ""), *pcoinsdbview, *pblocktree, strSnapshotError)) {
+                        strLoadError = strprintf("%s: %s", _("Error loading UTXO snapshot"), strSnapshotError);
+                        break;
+                    }
+                }
                 pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
-                pcoinsTip = new CCoinsViewCache(pcoinscatcher);
+                CCoinsView* pcoinsbase = pcoinscatcher;
+                pcoinsAsyncWriter = fAsyncFlush ? new CCoinsViewAsyncWriter(pcoinsbase) : NULL;
+                if (pcoinsAsyncWriter)
+                    pcoinsbase = pcoinsAsyncWriter;
+                pcoinsPrefetch = nCoinsPrefetchThreads > 0 ? new CCoinsViewPrefetch(pcoinsbase, nCoinsPrefetchThreads, nCoinsPrefetchCache) : NULL;
+                if (pcoinsPrefetch)
+                    pcoinsbase = pcoinsPrefetch;
+                pcoinsTip = new CCoinsViewCache(pcoinsbase);
 
                 if (fReindex)
                     pblocktree->WriteReindexing(true);
@@ -1352,8 +1451,27 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                     break;
                 }
 
+                // Check for changed -prune state.  What we are concerned about is a user who has pruned blocks
+                // in the past, but is now trying to run unpruned.  A node bootstrapped from a UTXO snapshot
+                // is missing the blocks below it either way, and may keep all blocks from there on.
+                bool fFromSnapshot = false;
+                pblocktree->ReadFlag("utxosnapshot", fFromSnapshot);
+                if (fHavePruned && !fPruneMode && !fFromSnapshot) {
+                    strLoadError = _("You need to rebuild the database using -reindex to go back to unpruned mode.  This will redownload the entire blockchain");
+                    break;
+                }
+                // Nodes missing blocks cannot serve the full chain
+                if (fHavePruned)
+                    nLocalServices &= ~NODE_NETWORK;
+
                 uiInterface.InitMessage(_("Verifying blocks..."));
 
+                // VerifyDB reads the coin database directly
+                if (pcoinsAsyncWriter && !pcoinsAsyncWriter->WaitForWrite()) {
+                    strLoadError = _("Error writing to coin database");
+                    break;
+                }
+
                 if (!CVerifyDB().VerifyDB(pcoinsdbview, GetArg("-checklevel", 4), GetArg("-checkblocks", 100))) {
                     strLoadError = _("Corrupted block database detected");
                     break;
@@ -1493,6 +1611,19 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
                 pindexRescan = chainActive.Genesis();
         }
         if (chainActive.Tip() && chainActive.Tip() != pindexRescan) {
+            // We can't rescan blocks that were pruned. This happens when an old
+            // wallet is loaded into a pruned node, or after running with
+            // -disablewallet for a long time. Blocks below a UTXO snapshot
+            // are missing the same way.
+            if (fHavePruned) {
+                CBlockIndex* block = chainActive.Tip();
+                while (block && block->pprev && (block->pprev->nStatus & BLOCK_HAVE_DATA) && pindexRescan != block)
+                    block = block->pprev;
+
+                if (pindexRescan != block)
+                    return InitError(_("Prune: last wallet synchronisation goes beyond pruned data. You need to -reindex (download the whole blockchain again in case of pruned node)"));
+            }
+
             uiInterface.InitMessage(_("Rescanning..."));
             LogPrintf("Rescanning last %i blocks (from block %i)...\n", chainActive.Height() - pindexRescan->nHeight, pindexRescan->nHeight);
             nStart = GetTimeMillis();
@@ -1525,6 +1656,14 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
 #else  // ENABLE_WALLET
     LogPrintf("No wallet compiled in!\n");
 #endif // !ENABLE_WALLET
+
+    // Perform the initial blockstore prune after any wallet rescanning has taken place
+    if (fPruneMode) {
+        uiInterface.InitMessage(_("Pruning blockstore..."));
+        if (!fReindex)
+            PruneAndFlush();
+    }
+
     // ********************************************************* Step 9: import blocks
 
     if (mapArgs.count("-blocknotify"))
@@ -1562,6 +1701,8 @@ bool AppInit2(boost::thread_group& threadGroup, CScheduler& scheduler)
         else
             LogPrintf("file format is unknown or invalid, please fix it manually\n");
     }
+    // the masternode collaterals follow the UTXO set from here on
+    RegisterValidationInterface(&mnodeman);
 
     uiInterface.InitMessage(_("Loading budget cache..."));
 
@@ -5,9 +5,13 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/assign/list_of.hpp>
+#include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
 
+#include "crypto/common.h"
 #include "db.h"
+#include "hash.h"
 #include "kernel.h"
 #include "script/interpreter.h"
 #include "timedata.h"
@@ -62,7 +66,7 @@ static int64_t GetStakeModifierSelectionIntervalSection(int nSection)
 }
 
 // Get stake modifier selection interval (in seconds)
-static int64_t GetStakeModifierSelectionInterval()
+static int64_t ComputeStakeModifierSelectionInterval()
 {
     int64_t nSelectionInterval = 0;
     for (int nSection = 0; nSection < 64; nSection++) {
@@ -71,6 +75,12 @@ static int64_t GetStakeModifierSelectionInterval()
     return nSelectionInterval;
 }
 
+int64_t GetStakeModifierSelectionInterval()
+{
+    static const int64_t nSelectionInterval = ComputeStakeModifierSelectionInterval();
+    return nSelectionInterval;
+}
+
 // select a block from the candidate blocks in vSortedByTimestamp, excluding
 // already selected blocks in vSelectedBlocks, and with timestamp up to
 // nSelectionIntervalStop.
@@ -240,43 +250,133 @@ bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeMod
     return true;
 }
 
+// Kernel stake modifiers of the blocks of the active chain, by height: the
+// block whose stake modifier a kernel from that block hashes with. An entry
+// holds for as long as that block is on the active chain, the chain up to it
+// from the kernel's block being unchanged then, so reorganizations need no
+// bookkeeping. Guarded by cs_main, and only written by the validation path.
+struct CKernelModifierEntry {
+    const CBlockIndex* pindexFrom;
+    const CBlockIndex* pindexModifier;
+};
+static std::vector<CKernelModifierEntry> vKernelModifiers;
+// Lowest height whose entry may still be filled in by UpdateKernelStakeModifiers
+static int nKernelModifiersPending = -1;
+
+static bool IsKernelModifierValid(const CKernelModifierEntry& entry, const CBlockIndex* pindexFrom)
+{
+    return entry.pindexFrom == pindexFrom && entry.pindexModifier && chainActive.Contains(entry.pindexModifier);
+}
+
+static void SetKernelModifier(const CBlockIndex* pindexFrom, const CBlockIndex* pindexModifier)
+{
+    if ((int)vKernelModifiers.size() <= pindexFrom->nHeight) {
+        CKernelModifierEntry entryNull = {NULL, NULL};
+        vKernelModifiers.resize(pindexFrom->nHeight + 1, entryNull);
+    }
+    vKernelModifiers[pindexFrom->nHeight].pindexFrom = pindexFrom;
+    vKernelModifiers[pindexFrom->nHeight].pindexModifier = pindexModifier;
+}
+
+void UpdateKernelStakeModifiers(const CBlockIndex* pindexNew)
+{
+    AssertLockHeld(cs_main);
+
+    // Every block from the new tip up has all the later modifiers seen here
+    if (nKernelModifiersPending < 0 || pindexNew->nHeight < nKernelModifiersPending)
+        nKernelModifiersPending = pindexNew->nHeight;
+    if (!pindexNew->GeneratedStakeModifier())
+        return;
+
+    // The new modifier is the kernel modifier of the blocks that it is the
+    // first one to be a selection interval later than
+    int64_t nSelectionInterval = GetStakeModifierSelectionInterval();
+    bool fFilled = true;
+    for (int nHeight = nKernelModifiersPending; nHeight < pindexNew->nHeight; nHeight++) {
+        const CBlockIndex* pindexFrom = chainActive[nHeight];
+        if (nHeight >= (int)vKernelModifiers.size() || !IsKernelModifierValid(vKernelModifiers[nHeight], pindexFrom)) {
+            if (pindexNew->GetBlockTime() < pindexFrom->GetBlockTime() + nSelectionInterval) {
+                fFilled = false;
+                continue;
+            }
+            SetKernelModifier(pindexFrom, pindexNew);
+        }
+        if (fFilled)
+            nKernelModifiersPending = nHeight + 1;
+    }
+}
+
 // The stake modifier used to hash for a stake kernel is chosen as the stake
 // modifier about a selection interval later than the coin generating the kernel
-bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake)
+bool GetKernelStakeModifier(const CBlockIndex* pindexFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake, bool fRecord)
 {
+    AssertLockHeld(cs_main);
     nStakeModifier = 0;
-    if (!mapBlockIndex.count(hashBlockFrom))
-        return error("GetKernelStakeModifier() : block not indexed");
-    const CBlockIndex* pindexFrom = mapBlockIndex[hashBlockFrom];
-    nStakeModifierHeight = pindexFrom->nHeight;
-    nStakeModifierTime = pindexFrom->GetBlockTime();
-    int64_t nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
-    const CBlockIndex* pindex = pindexFrom;
-    CBlockIndex* pindexNext = chainActive[pindexFrom->nHeight + 1];
-
-    // loop to find the stake modifier later by a selection interval
-    while (nStakeModifierTime < pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval) {
-        if (!pindexNext) {
-            // Should never happen
-            return error("Null pindexNext\n");
+    const CBlockIndex* pindex = NULL;
+    if (pindexFrom->nHeight < (int)vKernelModifiers.size() && IsKernelModifierValid(vKernelModifiers[pindexFrom->nHeight], pindexFrom))
+        pindex = vKernelModifiers[pindexFrom->nHeight].pindexModifier;
+
+    if (!pindex) {
+        nStakeModifierTime = pindexFrom->GetBlockTime();
+        int64_t nStakeModifierSelectionInterval = GetStakeModifierSelectionInterval();
+        pindex = pindexFrom;
+        CBlockIndex* pindexNext = chainActive[pindexFrom->nHeight + 1];
+
+        // loop to find the stake modifier later by a selection interval
+        while (nStakeModifierTime < pindexFrom->GetBlockTime() + nStakeModifierSelectionInterval) {
+            if (!pindexNext) {
+                // Should never happen
+                return error("Null pindexNext\n");
+            }
+
+            pindex = pindexNext;
+            pindexNext = chainActive[pindexNext->nHeight + 1];
+            if (pindex->GeneratedStakeModifier())
+                nStakeModifierTime = pindex->GetBlockTime();
         }
 
-        pindex = pindexNext;
-        pindexNext = chainActive[pindexNext->nHeight + 1];
-        if (pindex->GeneratedStakeModifier()) {
-            nStakeModifierHeight = pindex->nHeight;
-            nStakeModifierTime = pindex->GetBlockTime();
-        }
+        if (fRecord && chainActive.Contains(pindexFrom))
+            SetKernelModifier(pindexFrom, pindex);
     }
+
     nStakeModifier = pindex->nStakeModifier;
+    nStakeModifierHeight = pindex->nHeight;
+    nStakeModifierTime = pindex->GetBlockTime();
     return true;
 }
 
-uint256 stakeHash(unsigned int nTimeTx, CDataStream ss, unsigned int prevoutIndex, uint256 prevoutHash, unsigned int nTimeBlockFrom)
+// The kernel hash commits to the stake modifier, the time of the block of the
+// kernel input, the input and the coinstake time, serialized in that order.
+// All but the coinstake time are fixed for a coin, so they are hashed once.
+void InitStakeKernelHasher(uint64_t nStakeModifier, unsigned int nTimeBlockFrom, const COutPoint& prevout, CHash256& hasher)
 {
-    // Hash will hash in the transaction hash and the index number in order to make sure each hash is unique
-    ss << nTimeBlockFrom << prevoutIndex << prevoutHash << nTimeTx;
-    return Hash(ss.begin(), ss.end());
+    unsigned char vchPrefix[8 + 4 + 4 + 32];
+    WriteLE64(vchPrefix, nStakeModifier);
+    WriteLE32(vchPrefix + 8, nTimeBlockFrom);
+    WriteLE32(vchPrefix + 12, prevout.n);
+    memcpy(vchPrefix + 16, prevout.hash.begin(), 32);
+    hasher.Reset().Write(vchPrefix, sizeof(vchPrefix));
+}
+
+static bool GetStakeKernelHasher(const CBlockIndex* pindexFrom, const COutPoint& prevout, CHash256& hasher, bool fPrintProofOfStake, bool fRecord)
+{
+    uint64_t nStakeModifier = 0;
+    int nStakeModifierHeight = 0;
+    int64_t nStakeModifierTime = 0;
+    if (!GetKernelStakeModifier(pindexFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake, fRecord))
+        return false;
+
+    InitStakeKernelHasher(nStakeModifier, (unsigned int)pindexFrom->GetBlockTime(), prevout, hasher);
+    return true;
+}
+
+uint256 GetStakeKernelHash(const CHash256& hasherPrefix, unsigned int nTimeTx)
+{
+    unsigned char vchTime[4];
+    WriteLE32(vchTime, nTimeTx);
+    uint256 hash;
+    CHash256(hasherPrefix).Write(vchTime, sizeof(vchTime)).Finalize((unsigned char*)&hash);
+    return hash;
 }
 
 //test hash vs target
@@ -289,118 +389,200 @@ bool stakeTargetHit(uint256 hashProofOfStake, int64_t nValueIn, uint256 bnTarget
     return (uint256(hashProofOfStake) < bnCoinDayWeight * bnTargetPerCoinDay);
 }
 
-//instead of looping outside and reinitializing variables many times, we will give a nTimeTx and also search interval so that we can do all the hashing here
-bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTransaction txPrev, const COutPoint prevout, unsigned int& nTimeTx, unsigned int nHashDrift, bool fCheck, uint256& hashProofOfStake, bool fPrintProofOfStake)
+bool CheckStakeKernelHash(unsigned int nBits, const CBlockIndex* pindexFrom, int64_t nValueIn, const COutPoint prevout, unsigned int& nTimeTx, unsigned int nHashDrift, bool fCheck, uint256& hashProofOfStake, bool fPrintProofOfStake)
 {
-    //assign new variables to make it easier to read
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
-    unsigned int nTimeBlockFrom = blockFrom.GetBlockTime();
+    //if wallet is searching for a kernel rather than checking one
+    if (!fCheck) {
+        std::vector<CStakeCoin> vCoins(1, CStakeCoin(pindexFrom, prevout, nValueIn));
+        return FindStakeKernel(nBits, vCoins, nTimeTx, nHashDrift, 1, hashProofOfStake) == 0;
+    }
 
-    if (nTimeTx < nTimeBlockFrom) // Transaction timestamp violation
+    if (nTimeTx < pindexFrom->GetBlockTime()) // Transaction timestamp violation
         return error("CheckStakeKernelHash() : nTime violation");
 
-    // if (nTimeBlockFrom + nStakeMinAge > nTimeTx) // Min age requirement
-    //     return error("CheckStakeKernelHash() : min age violation - nTimeBlockFrom=%d nStakeMinAge=%d nTimeTx=%d", nTimeBlockFrom, nStakeMinAge, nTimeTx);
-
     //grab difficulty
     uint256 bnTargetPerCoinDay;
     bnTargetPerCoinDay.SetCompact(nBits);
 
-    //grab stake modifier
-    uint64_t nStakeModifier = 0;
-    int nStakeModifierHeight = 0;
-    int64_t nStakeModifierTime = 0;
-    if (!GetKernelStakeModifier(blockFrom.GetHash(), nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake)) {
+    // Checking a kernel is part of validation, which records its modifier
+    CHash256 hasher;
+    if (!GetStakeKernelHasher(pindexFrom, prevout, hasher, fPrintProofOfStake, true)) {
         LogPrintf("CheckStakeKernelHash(): failed to get kernel stake modifier \n");
         return false;
     }
 
-    //create data stream once instead of repeating it in the loop
-    CDataStream ss(SER_GETHASH, 0);
-    ss << nStakeModifier;
-
-    //if wallet is simply checking to make sure a hash is valid
-    if (fCheck) {
-        hashProofOfStake = stakeHash(nTimeTx, ss, prevout.n, prevout.hash, nTimeBlockFrom);
-        return stakeTargetHit(hashProofOfStake, nValueIn, bnTargetPerCoinDay);
-    }
+    hashProofOfStake = GetStakeKernelHash(hasher, nTimeTx);
+    return stakeTargetHit(hashProofOfStake, nValueIn, bnTargetPerCoinDay);
+}
 
-    bool fSuccess = false;
-    unsigned int nTryTime = 0;
-    unsigned int i;
-    int nHeightStart = chainActive.Height();
-    for (i = 0; i < (nHashDrift); i++) //iterate the hashing
-    {
-        //new block came in, move on
-        if (chainActive.Height() != nHeightStart)
-            break;
+// A coin prepared for the kernel search: the hash state over everything but
+// the coinstake time, and the target scaled by the coin's value
+struct CStakeKernelCandidate {
+    CHash256 hasher;
+    uint256 bnTarget;
+};
+
+// State shared by the threads of a kernel search. The coins are claimed in
+// order, and the kernel of the first coin that has one is taken, as with a
+// search through the coins one by one.
+struct CStakeKernelSearch {
+    const std::vector<CStakeKernelCandidate>& vCandidates;
+    const unsigned int nTimeTx;
+    const unsigned int nHashDrift;
+    const int nHeightStart;
+
+    CCriticalSection cs;
+    size_t nNext;
+    size_t nFound;
+    unsigned int nTimeFound;
+    uint256 hashFound;
+
+    CStakeKernelSearch(const std::vector<CStakeKernelCandidate>& vCandidatesIn, unsigned int nTimeTxIn, unsigned int nHashDriftIn)
+        : vCandidates(vCandidatesIn), nTimeTx(nTimeTxIn), nHashDrift(nHashDriftIn), nHeightStart(chainActive.Height()),
+          nNext(0), nFound(vCandidatesIn.size()), nTimeFound(0), hashFound(0) {}
+};
+
+static void ThreadSearchStakeKernel(CStakeKernelSearch* search)
+{
+    while (true) {
+        size_t nCandidate;
+        {
+            LOCK(search->cs);
+            // Coins after one with a kernel need no search
+            if (search->nNext >= search->nFound)
+                return;
+            nCandidate = search->nNext++;
+        }
 
-        //hash this iteration
-        nTryTime = nTimeTx + nHashDrift - i;
-        hashProofOfStake = stakeHash(nTryTime, ss, prevout.n, prevout.hash, nTimeBlockFrom);
+        const CStakeKernelCandidate& candidate = search->vCandidates[nCandidate];
+        for (unsigned int i = 0; i < search->nHashDrift; i++) {
+            //new block came in, move on
+            if (chainActive.Height() != search->nHeightStart)
+                return;
+
+            // The latest time is tried first
+            unsigned int nTryTime = search->nTimeTx + search->nHashDrift - i;
+            uint256 hashProofOfStake = GetStakeKernelHash(candidate.hasher, nTryTime);
+            if (hashProofOfStake < candidate.bnTarget) {
+                LOCK(search->cs);
+                if (nCandidate < search->nFound) {
+                    search->nFound = nCandidate;
+                    search->nTimeFound = nTryTime;
+                    search->hashFound = hashProofOfStake;
+                }
+                break;
+            }
+        }
+    }
+}
 
-        // if stake hash does not meet the target then continue to next iteration
-        if (!stakeTargetHit(hashProofOfStake, nValueIn, bnTargetPerCoinDay))
-            continue;
+int FindStakeKernel(unsigned int nBits, const std::vector<CStakeCoin>& vCoins, unsigned int& nTimeTx, unsigned int nHashDrift, int nThreads, uint256& hashProofOfStake)
+{
+    uint256 bnTargetPerCoinDay;
+    bnTargetPerCoinDay.SetCompact(nBits);
 
-        fSuccess = true; // if we make it this far then we have successfully created a stake hash
-        nTimeTx = nTryTime;
-
-        if (fDebug || fPrintProofOfStake) {
-            LogPrintf("CheckStakeKernelHash() : using modifier %s at height=%d timestamp=%s for block from height=%d timestamp=%s\n",
-                boost::lexical_cast<std::string>(nStakeModifier).c_str(), nStakeModifierHeight,
-                DateTimeStrFormat("%Y-%m-%d %H:%M:%S", nStakeModifierTime).c_str(),
-                mapBlockIndex[blockFrom.GetHash()]->nHeight,
-                DateTimeStrFormat("%Y-%m-%d %H:%M:%S", blockFrom.GetBlockTime()).c_str());
-            LogPrintf("CheckStakeKernelHash() : pass protocol=%s modifier=%s nTimeBlockFrom=%u prevoutHash=%s nTimeTxPrev=%u nPrevout=%u nTimeTx=%u hashProof=%s\n",
-                "0.3",
-                boost::lexical_cast<std::string>(nStakeModifier).c_str(),
-                nTimeBlockFrom, prevout.hash.ToString().c_str(), nTimeBlockFrom, prevout.n, nTryTime,
-                hashProofOfStake.ToString().c_str());
+    // Everything but the hashing is done once per coin, before the search.
+    // A coin without a kernel stake modifier yet is left out. The modifiers
+    // are only looked up here; validation alone records them.
+    std::vector<CStakeKernelCandidate> vCandidates;
+    std::vector<int> vCoinIndex;
+    vCandidates.reserve(vCoins.size());
+    vCoinIndex.reserve(vCoins.size());
+    {
+        LOCK(cs_main);
+        for (size_t i = 0; i < vCoins.size(); i++) {
+            if (nTimeTx < vCoins[i].pindexFrom->GetBlockTime()) // Transaction timestamp violation
+                continue;
+            CStakeKernelCandidate candidate;
+            if (!GetStakeKernelHasher(vCoins[i].pindexFrom, vCoins[i].prevout, candidate.hasher, false, false)) {
+                if (fDebug)
+                    LogPrintf("FindStakeKernel() : failed to get kernel stake modifier for %s\n", vCoins[i].prevout.ToString());
+                continue;
+            }
+            candidate.bnTarget = uint256(vCoins[i].nValue) / 100 * bnTargetPerCoinDay;
+            vCandidates.push_back(candidate);
+            vCoinIndex.push_back(i);
         }
-        break;
+    }
+
+    CStakeKernelSearch search(vCandidates, nTimeTx, nHashDrift);
+    nThreads = std::min(nThreads, (int)vCandidates.size());
+    if (nThreads <= 1) {
+        ThreadSearchStakeKernel(&search);
+    } else {
+        // The workers use the search on this stack, so they are always waited for
+        boost::this_thread::disable_interruption di;
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&ThreadSearchStakeKernel, &search));
+        threadGroup.join_all();
     }
 
     mapHashedBlocks.clear();
     mapHashedBlocks[chainActive.Tip()->nHeight] = GetTime(); //store a time stamp of when we last hashed on this block
-    return fSuccess;
+
+    if (search.nFound == vCandidates.size())
+        return -1;
+
+    const CStakeCoin& coin = vCoins[vCoinIndex[search.nFound]];
+    nTimeTx = search.nTimeFound;
+    hashProofOfStake = search.hashFound;
+    if (fDebug) {
+        LogPrintf("FindStakeKernel() : pass nTimeBlockFrom=%u prevout=%s nTimeTx=%u hashProof=%s\n",
+            coin.pindexFrom->GetBlockTime(), coin.prevout.ToString(), nTimeTx, hashProofOfStake.ToString());
+    }
+    return vCoinIndex[search.nFound];
+}
+
+// Find the kernel input and the block index entry of the block containing
+// it, which is all the kernel checks use. The UTXO set holds both the output
+// and the height of its block on the active chain, without any disk read.
+// A block of another branch may stake an output spent on the active chain;
+// that one is looked up with the transaction index.
+static bool GetStakeInput(const COutPoint& prevout, CTxOut& txoutPrev, const CBlockIndex*& pindexFrom)
+{
+    LOCK(cs_main);
+    const CCoins* coins = pcoinsTip->AccessCoins(prevout.hash);
+    if (coins && coins->IsAvailable(prevout.n) && coins->nHeight <= chainActive.Height()) {
+        txoutPrev = coins->vout[prevout.n];
+        pindexFrom = chainActive[coins->nHeight];
+        return true;
+    }
+
+    uint256 hashBlock;
+    CTransaction txPrev;
+    if (!GetTransaction(prevout.hash, txPrev, hashBlock, true) || prevout.n >= txPrev.vout.size())
+        return false;
+    BlockMap::iterator it = mapBlockIndex.find(hashBlock);
+    if (it == mapBlockIndex.end())
+        return false;
+    txoutPrev = txPrev.vout[prevout.n];
+    pindexFrom = it->second;
+    return true;
 }
 
 // Check kernel hash target and coinstake signature
-bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake)
+bool CheckProofOfStake(const CBlock& block, uint256& hashProofOfStake)
 {
-    const CTransaction tx = block.vtx[1];
+    const CTransaction& tx = block.vtx[1];
     if (!tx.IsCoinStake())
         return error("CheckProofOfStake() : called on non-coinstake %s", tx.GetHash().ToString().c_str());
 
     // Kernel (input 0) must match the stake hash target per coin age (nBits)
     const CTxIn& txin = tx.vin[0];
 
-    // First try finding the previous transaction in database
-    uint256 hashBlock;
-    CTransaction txPrev;
-    if (!GetTransaction(txin.prevout.hash, txPrev, hashBlock, true))
+    CTxOut txoutPrev;
+    const CBlockIndex* pindexFrom = NULL;
+    if (!GetStakeInput(txin.prevout, txoutPrev, pindexFrom))
         return error("CheckProofOfStake() : INFO: read txPrev failed");
 
     //verify signature and script
-    if (!VerifyScript(txin.scriptSig, txPrev.vout[txin.prevout.n].scriptPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, 0)))
+    if (!VerifyScript(txin.scriptSig, txoutPrev.scriptPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, 0)))
         return error("CheckProofOfStake() : VerifySignature failed on coinstake %s", tx.GetHash().ToString().c_str());
 
-    CBlockIndex* pindex = NULL;
-    BlockMap::iterator it = mapBlockIndex.find(hashBlock);
-    if (it != mapBlockIndex.end())
-        pindex = it->second;
-    else
-        return error("CheckProofOfStake() : read block failed");
-
-    // Read block header
-    CBlock blockprev;
-    if (!ReadBlockFromDisk(blockprev, pindex->GetBlockPos()))
-        return error("CheckProofOfStake(): INFO: failed to find block");
-
     unsigned int nInterval = 0;
     unsigned int nTime = block.nTime;
-    if (!CheckStakeKernelHash(block.nBits, blockprev, txPrev, txin.prevout, nTime, nInterval, true, hashProofOfStake, fDebug))
+    if (!CheckStakeKernelHash(block.nBits, pindexFrom, txoutPrev.nValue, txin.prevout, nTime, nInterval, true, hashProofOfStake, fDebug))
         return error("CheckProofOfStake() : INFO: check kernel failed on coinstake %s, hashProof=%s \n", tx.GetHash().ToString().c_str(), hashProofOfStake.ToString().c_str()); // may occur during initial download or if behind on block chain sync
 
     return true;
@@ -5,6 +5,7 @@
 #ifndef BITCOIN_KERNEL_H
 #define BITCOIN_KERNEL_H
 
+#include "hash.h"
 #include "main.h"
 
 
@@ -18,18 +19,49 @@ extern unsigned int getIntervalVersion(bool fTestNet);
 // ratio of group interval length between the last group and the first group
 static const int MODIFIER_INTERVAL_RATIO = 3;
 
+// Get stake modifier selection interval (in seconds)
+int64_t GetStakeModifierSelectionInterval();
+
 // Compute the hash modifier for proof-of-stake
 bool ComputeNextStakeModifier(const CBlockIndex* pindexPrev, uint64_t& nStakeModifier, bool& fGeneratedStakeModifier);
 
+// Record the kernel stake modifiers that a new tip of the active chain provides
+void UpdateKernelStakeModifiers(const CBlockIndex* pindexNew);
+
+// Get the stake modifier that a kernel from the given block hashes with.
+// Requires cs_main; with fRecord, which only validation sets, the result is
+// kept for later lookups.
+bool GetKernelStakeModifier(const CBlockIndex* pindexFrom, uint64_t& nStakeModifier, int& nStakeModifierHeight, int64_t& nStakeModifierTime, bool fPrintProofOfStake, bool fRecord = false);
+
+// Start the kernel hash of a coin: everything but the coinstake time
+void InitStakeKernelHasher(uint64_t nStakeModifier, unsigned int nTimeBlockFrom, const COutPoint& prevout, CHash256& hasher);
+
+// Finish a kernel hash started by InitStakeKernelHasher with the coinstake time
+uint256 GetStakeKernelHash(const CHash256& hasherPrefix, unsigned int nTimeTx);
+
 // Check whether stake kernel meets hash target
 // Sets hashProofOfStake on success return
-uint256 stakeHash(unsigned int nTimeTx, CDataStream ss, unsigned int prevoutIndex, uint256 prevoutHash, unsigned int nTimeBlockFrom);
 bool stakeTargetHit(uint256 hashProofOfStake, int64_t nValueIn, uint256 bnTargetPerCoinDay);
-bool CheckStakeKernelHash(unsigned int nBits, const CBlock blockFrom, const CTransaction txPrev, const COutPoint prevout, unsigned int& nTimeTx, unsigned int nHashDrift, bool fCheck, uint256& hashProofOfStake, bool fPrintProofOfStake = false);
+bool CheckStakeKernelHash(unsigned int nBits, const CBlockIndex* pindexFrom, int64_t nValueIn, const COutPoint prevout, unsigned int& nTimeTx, unsigned int nHashDrift, bool fCheck, uint256& hashProofOfStake, bool fPrintProofOfStake = false);
+
+// A coin to search for a stake kernel with
+struct CStakeCoin {
+    const CBlockIndex* pindexFrom;
+    COutPoint prevout;
+    int64_t nValue;
+
+    CStakeCoin(const CBlockIndex* pindexFromIn, const COutPoint& prevoutIn, int64_t nValueIn) : pindexFrom(pindexFromIn), prevout(prevoutIn), nValue(nValueIn) {}
+};
+
+// Search the coins for a stake kernel at the nHashDrift times after nTimeTx,
+// on up to nThreads threads, until the tip changes. Returns the position of
+// the first coin with a kernel, or -1; sets nTimeTx and hashProofOfStake to
+// those of the kernel.
+int FindStakeKernel(unsigned int nBits, const std::vector<CStakeCoin>& vCoins, unsigned int& nTimeTx, unsigned int nHashDrift, int nThreads, uint256& hashProofOfStake);
 
 // Check kernel hash target and coinstake signature
 // Sets hashProofOfStake on success return
-bool CheckProofOfStake(const CBlock block, uint256& hashProofOfStake);
+bool CheckProofOfStake(const CBlock& block, uint256& hashProofOfStake);
 
 // Check whether the coinstake timestamp meets protocol
 bool CheckCoinStakeTimestamp(int64_t nTimeBlock, int64_t nTimeTx);
@@ -168,6 +168,12 @@ public:
     {
         return pdb->NewIterator(iteroptions);
     }
+
+    //! Iterator for short range reads, which fill the block cache like point reads do
+    leveldb::Iterator* NewReadIterator() const
+    {
+        return pdb->NewIterator(readoptions);
+    }
 };
 
 #endif // BITCOIN_LEVELDBWRAPPER_H
@@ -10,6 +10,7 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -34,12 +35,14 @@
 #include "wallet.h"
 #endif
 
+#include <limits>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace boost;
@@ -69,12 +72,16 @@ int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+bool fParallelCheckBlock = DEFAULT_PARALLEL_CHECKBLOCK;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = true;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
-unsigned int nCoinCacheSize = 5000;
+size_t nCoinCacheUsage = 5000 * 300;
+bool fHavePruned = false;
+bool fPruneMode = false;
+uint64_t nPruneTarget = 0;
 bool fAlerts = DEFAULT_ALERTS;
 
 unsigned int nStakeMinAge = 60 * 60;
@@ -96,7 +103,15 @@ map<uint256, COrphanTx> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 map<uint256, int64_t> mapRejectedBlocks;
 
+/** A proof-of-stake block whose stake cannot be checked until its parent is connected, see AcceptBlock */
+struct CStakePendingBlock {
+    boost::shared_ptr<CBlock> pblock;
+    NodeId fromPeer;
+};
+map<uint256, CStakePendingBlock> mapStakePendingBlocks;
+
 void EraseOrphansFor(NodeId peer);
+void EraseStakePendingBlocksFor(NodeId peer);
 
 static void CheckBlockIndex();
 
@@ -144,6 +159,11 @@ multimap<CBlockIndex*, CBlockIndex*> mapBlocksUnlinked;
 CCriticalSection cs_LastBlockFile;
 std::vector<CBlockFileInfo> vinfoBlockFile;
 int nLastBlockFile = 0;
+/** Global flag to indicate we should check to see if there are
+ *  block/undo files that should be deleted.  Set on startup
+ *  or if we allocate more file space when we're in prune mode
+ */
+bool fCheckForPruning = false;
 
 /**
      * Every received block is assigned a unique and increasing identifier, so we
@@ -192,6 +212,8 @@ set<int> setDirtyFileInfo;
 namespace
 {
 struct CMainSignals {
+    /** Notifies listeners of updated block chain tip */
+    boost::signals2::signal<void(const CBlockIndex*)> UpdatedBlockTip;
     /** Notifies listeners of updated transaction data (transaction, and optionally the block it is found in. */
     boost::signals2::signal<void(const CTransaction&, const CBlock*)> SyncTransaction;
     /** Notifies listeners of an erased transaction (currently disabled, requires transaction replacement). */
@@ -212,6 +234,7 @@ struct CMainSignals {
 
 void RegisterValidationInterface(CValidationInterface* pwalletIn)
 {
+    g_signals.UpdatedBlockTip.connect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1));
     g_signals.SyncTransaction.connect(boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2));
 // XX42 g_signals.EraseTransaction.connect(boost::bind(&CValidationInterface::EraseFromWallet, pwalletIn, _1));
     g_signals.UpdatedTransaction.connect(boost::bind(&CValidationInterface::UpdatedTransaction, pwalletIn, _1));
@@ -230,6 +253,7 @@ void UnregisterValidationInterface(CValidationInterface* pwalletIn)
     g_signals.UpdatedTransaction.disconnect(boost::bind(&CValidationInterface::UpdatedTransaction, pwalletIn, _1));
 // XX42    g_signals.EraseTransaction.disconnect(boost::bind(&CValidationInterface::EraseFromWallet, pwalletIn, _1));
     g_signals.SyncTransaction.disconnect(boost::bind(&CValidationInterface::SyncTransaction, pwalletIn, _1, _2));
+    g_signals.UpdatedBlockTip.disconnect(boost::bind(&CValidationInterface::UpdatedBlockTip, pwalletIn, _1));
 }
 
 void UnregisterAllValidationInterfaces()
@@ -241,6 +265,7 @@ void UnregisterAllValidationInterfaces()
     g_signals.UpdatedTransaction.disconnect_all_slots();
 // XX42    g_signals.EraseTransaction.disconnect_all_slots();
     g_signals.SyncTransaction.disconnect_all_slots();
+    g_signals.UpdatedBlockTip.disconnect_all_slots();
 }
 
 void SyncWithWallets(const CTransaction& tx, const CBlock* pblock)
@@ -363,12 +388,21 @@ struct CNodeState {
     CBlockIndex* pindexLastCommonBlock;
     //! Whether we've started headers synchronization with this peer.
     bool fSyncStarted;
+    //! When to potentially disconnect peer for stalling headers download
+    int64_t nHeadersSyncTimeout;
     //! Since when we're stalling block download progress (in microseconds), or 0.
     int64_t nStallingSince;
     list<QueuedBlock> vBlocksInFlight;
     int nBlocksInFlight;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! The compact block from this peer waiting for its missing transactions (blocktxn).
+    boost::shared_ptr<PartiallyDownloadedBlock> pPartialBlock;
+    uint256 hashPartialBlock;
+    //! Proof-of-stake headers this peer added to the block index whose block is not checked yet.
+    std::vector<CBlockIndex*> vUnverifiedHeaders;
+    //! Whether headers sync with this peer waits for the blocks to catch up with its headers.
+    bool fHeadersThrottled;
 
     CNodeBlocks nodeBlocks;
     CNodeState()
@@ -380,15 +414,30 @@ struct CNodeState {
         hashLastUnknownBlock = uint256(0);
         pindexLastCommonBlock = NULL;
         fSyncStarted = false;
+        nHeadersSyncTimeout = 0;
         nStallingSince = 0;
         nBlocksInFlight = 0;
         fPreferredDownload = false;
+        hashPartialBlock = uint256(0);
+        fHeadersThrottled = false;
     }
 };
 
 /** Map maintaining per-node state. Requires cs_main. */
 map<NodeId, CNodeState> mapNodeState;
 
+/** Whether blocks are synced from this peer headers-first, rather than from block inventories. */
+bool UseHeadersFirst(const CNode* pnode)
+{
+    return Params().HeadersFirstSyncingActive() && pnode->nVersion >= HEADERS_FIRST_VERSION;
+}
+
+/** Whether new blocks are relayed to and from this peer as compact blocks. */
+bool UseCompactBlocks(const CNode* pnode)
+{
+    return UseHeadersFirst(pnode) && pnode->nVersion >= COMPACT_BLOCKS_VERSION;
+}
+
 // Requires cs_main.
 CNodeState* State(NodeId pnode)
 {
@@ -443,6 +492,7 @@ void FinalizeNode(NodeId nodeid)
     BOOST_FOREACH (const QueuedBlock& entry, state->vBlocksInFlight)
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
+    EraseStakePendingBlocksFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
 
     mapNodeState.erase(nodeid);
@@ -458,6 +508,10 @@ void MarkBlockAsReceived(const uint256& hash)
         state->vBlocksInFlight.erase(itInFlight->second.second);
         state->nBlocksInFlight--;
         state->nStallingSince = 0;
+        if (state->hashPartialBlock == hash) {
+            state->pPartialBlock.reset();
+            state->hashPartialBlock = uint256(0);
+        }
         mapBlocksInFlight.erase(itInFlight);
     }
 }
@@ -570,6 +624,8 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
     // linked block we have in common with this peer. The +1 is so we can detect stalling, namely if we would be able to
     // download that next block if the window were 1 larger.
     int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
+    // Proof-of-stake blocks ahead of the tip wait in mapStakePendingBlocks, so fetch no more of them than it keeps.
+    nWindowEnd = std::min(nWindowEnd, std::max(Params().LAST_POW_BLOCK(), state->pindexLastCommonBlock->nHeight) + (int)MAX_STAKE_PENDING_BLOCKS_PER_PEER);
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
     while (pindexWalk->nHeight < nMaxHeight) {
@@ -592,9 +648,12 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                 // We consider the chain that this peer is on invalid.
                 return;
             }
-            if (pindex->nStatus & BLOCK_HAVE_DATA) {
+            if (pindex->nStatus & BLOCK_HAVE_DATA || chainActive.Contains(pindex)) {
                 if (pindex->nChainTx)
                     state->pindexLastCommonBlock = pindex;
+            } else if (mapStakePendingBlocks.count(pindex->GetBlockHash())) {
+                // Received; it is stored once its stake can be checked
+                continue;
             } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
                 // The block is not already downloaded, and not yet in flight.
                 if (pindex->nHeight > nWindowEnd) {
@@ -619,6 +678,45 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
 
 } // anon namespace
 
+/** Forget the headers whose block has since been checked, or found invalid, and count the others. */
+unsigned int CountUnverifiedHeaders(std::vector<CBlockIndex*>& vHeaders)
+{
+    std::vector<CBlockIndex*>::iterator itEnd = vHeaders.begin();
+    BOOST_FOREACH (CBlockIndex* pindex, vHeaders) {
+        if (pindex->nTx == 0 && !(pindex->nStatus & BLOCK_FAILED_MASK))
+            *itEnd++ = pindex;
+    }
+    vHeaders.erase(itEnd, vHeaders.end());
+    return vHeaders.size();
+}
+
+/**
+ * Accept a header from a peer. Past the last proof-of-work block only the
+ * difficulty of a header is checked until its block comes with the stake
+ * (see AcceptBlock), so a peer may only add MAX_UNVERIFIED_HEADERS_PER_PEER
+ * such headers ahead of their blocks. At that bound this returns false and
+ * leaves the state valid. Requires cs_main.
+ */
+bool static AcceptHeaderFromPeer(NodeId nodeid, const CBlockHeader& header, CValidationState& state, CBlockIndex** ppindex)
+{
+    CNodeState* nodestate = State(nodeid);
+    bool fUnverified = false;
+    if (!mapBlockIndex.count(header.GetHash())) {
+        BlockMap::iterator mi = mapBlockIndex.find(header.hashPrevBlock);
+        fUnverified = mi != mapBlockIndex.end() && mi->second->nHeight >= Params().LAST_POW_BLOCK();
+        if (fUnverified && nodestate->vUnverifiedHeaders.size() >= MAX_UNVERIFIED_HEADERS_PER_PEER &&
+            CountUnverifiedHeaders(nodestate->vUnverifiedHeaders) >= MAX_UNVERIFIED_HEADERS_PER_PEER)
+            return false;
+    }
+
+    // A CBlock without transactions: AcceptBlockHeader checks it as a header only
+    if (!AcceptBlockHeader(CBlock(header), state, ppindex))
+        return false;
+    if (fUnverified)
+        nodestate->vUnverifiedHeaders.push_back(*ppindex);
+    return true;
+}
+
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats)
 {
     LOCK(cs_main);
@@ -668,6 +766,9 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache* pcoinsTip = NULL;
+CCoinsViewPrefetch* pcoinsPrefetch = NULL;
+CCoinsViewAsyncWriter* pcoinsAsyncWriter = NULL;
+CCoinsViewDB* pcoinsdbview = NULL;
 CBlockTreeDB* pblocktree = NULL;
 CSporkDB* pSporkDB = NULL;
 
@@ -751,6 +852,89 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
     return nEvicted;
 }
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// mapStakePendingBlocks
+//
+
+bool AddStakePendingBlock(const CBlock& block, NodeId peer)
+{
+    AssertLockHeld(cs_main);
+    uint256 hash = block.GetHash();
+    if (mapStakePendingBlocks.count(hash))
+        return false;
+
+    // A peer keeps at most as many blocks here as it may have in flight; the
+    // others are downloaded again when their stake can be checked
+    unsigned int nFromPeer = 0;
+    for (map<uint256, CStakePendingBlock>::const_iterator it = mapStakePendingBlocks.begin(); it != mapStakePendingBlocks.end(); ++it)
+        nFromPeer += it->second.fromPeer == peer;
+    if (nFromPeer >= MAX_STAKE_PENDING_BLOCKS_PER_PEER || mapStakePendingBlocks.size() >= MAX_STAKE_PENDING_BLOCKS) {
+        LogPrint("net", "ignoring block %s until its stake can be checked (mapsz %u)\n", hash.ToString(), mapStakePendingBlocks.size());
+        return false;
+    }
+
+    CStakePendingBlock& pending = mapStakePendingBlocks[hash];
+    pending.pblock.reset(new CBlock(block));
+    pending.fromPeer = peer;
+    LogPrint("net", "stored block %s until its stake can be checked (mapsz %u)\n", hash.ToString(), mapStakePendingBlocks.size());
+    return true;
+}
+
+void EraseStakePendingBlocksFor(NodeId peer)
+{
+    int nErased = 0;
+    map<uint256, CStakePendingBlock>::iterator iter = mapStakePendingBlocks.begin();
+    while (iter != mapStakePendingBlocks.end()) {
+        map<uint256, CStakePendingBlock>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
+        if (maybeErase->second.fromPeer == peer) {
+            mapStakePendingBlocks.erase(maybeErase);
+            ++nErased;
+        }
+    }
+    if (nErased > 0) LogPrint("net", "Erased %d stake-pending blocks from peer %d\n", nErased, peer);
+}
+
+void ProcessStakePendingBlocks()
+{
+    // Each block processed here changes the tip, which calls back in; only
+    // the first call drains the map, and it is left only once found empty
+    static bool fDraining = false;
+    {
+        LOCK(cs_main);
+        if (fDraining)
+            return;
+        fDraining = true;
+    }
+    while (true) {
+        CStakePendingBlock pending;
+        {
+            LOCK(cs_main);
+            // The next block whose parent is connected, or known invalid
+            map<uint256, CStakePendingBlock>::iterator it = mapStakePendingBlocks.begin();
+            for (; it != mapStakePendingBlocks.end(); ++it) {
+                BlockMap::iterator mi = mapBlockIndex.find(it->second.pblock->hashPrevBlock);
+                if (mi != mapBlockIndex.end() && (chainActive.Contains(mi->second) || (mi->second->nStatus & BLOCK_FAILED_MASK)))
+                    break;
+            }
+            if (it == mapStakePendingBlocks.end()) {
+                fDraining = false;
+                return;
+            }
+            pending = it->second;
+            mapStakePendingBlocks.erase(it);
+        }
+
+        CValidationState state;
+        ProcessNewBlock(state, NULL, pending.pblock.get());
+        int nDoS;
+        if (state.IsInvalid(nDoS) && nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pending.fromPeer, nDoS);
+        }
+    }
+}
+
 bool IsStandardTx(const CTransaction& tx, string& reason)
 {
     AssertLockHeld(cs_main);
@@ -1578,6 +1762,10 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
             return false;
         }
 
+        // Budget collaterals are kept apart when there is no index
+        if (pblocktree->ReadBudgetCollateral(hash, txOut, hashBlock))
+            return true;
+
         if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
             int nHeight = -1;
             {
@@ -1586,7 +1774,8 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
                 if (coins)
                     nHeight = coins->nHeight;
             }
-            if (nHeight > 0)
+            // Pruned nodes no longer have the old blocks
+            if (nHeight > 0 && (chainActive[nHeight]->nStatus & BLOCK_HAVE_DATA))
                 pindexSlow = chainActive[nHeight];
         }
     }
@@ -1916,7 +2105,7 @@ void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCach
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH (const CTxIn& txin, tx.vin) {
             txundo.vprevout.push_back(CTxInUndo());
-            bool ret = inputs.ModifyCoins(txin.prevout.hash)->Spend(txin.prevout, txundo.vprevout.back());
+            bool ret = inputs.SpendOutput(txin.prevout, txundo.vprevout.back());
             assert(ret);
         }
     }
@@ -1927,6 +2116,8 @@ void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCach
 
 bool CScriptCheck::operator()()
 {
+    if (fnCheck)
+        return fnCheck();
     const CScript& scriptSig = ptxTo->vin[nIn].scriptSig;
     if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore), &error)) {
         return ::error("CScriptCheck(): %s:%d VerifySignature failed: %s", ptxTo->GetHash().ToString(), nIn, ScriptErrorString(error));
@@ -1953,7 +2144,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         CAmount nFees = 0;
         for (unsigned int i = 0; i < tx.vin.size(); i++) {
             const COutPoint& prevout = tx.vin[i].prevout;
-            const CCoins* coins = inputs.AccessCoins(prevout.hash);
+            const CCoins* coins = inputs.AccessOutput(prevout);
             assert(coins);
 
             // If prev is coinbase, check that it's matured
@@ -1997,7 +2188,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         if (fScriptChecks) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint& prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
+                const CCoins* coins = inputs.AccessOutput(prevout);
                 assert(coins);
 
                 // Verify signature
@@ -2092,13 +2283,19 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
                 const CTxInUndo& undo = txundo.vprevout[j];
                 CCoinsModifier coins = view.ModifyCoins(out.hash);
                 if (undo.nHeight != 0) {
-                    // undo data contains height: this is the last output of the prevout tx being spent
-                    if (!coins->IsPruned())
-                        fClean = fClean && error("DisconnectBlock() : undo data overwriting existing transaction");
-                    coins->Clear();
-                    coins->fCoinBase = undo.fCoinBase;
-                    coins->nHeight = undo.nHeight;
-                    coins->nVersion = undo.nVersion;
+                    // undo data contains the metadata: it does for every output since SpendOutput, and
+                    // before only for the last output of the prevout tx being spent
+                    if (!coins->IsPruned()) {
+                        if (coins->fCoinBase != undo.fCoinBase || coins->fCoinStake != undo.fCoinStake ||
+                            coins->nHeight != (int)undo.nHeight || coins->nVersion != undo.nVersion)
+                            fClean = fClean && error("DisconnectBlock() : undo data overwriting existing transaction");
+                    } else {
+                        coins->Clear();
+                        coins->fCoinBase = undo.fCoinBase;
+                        coins->fCoinStake = undo.fCoinStake;
+                        coins->nHeight = undo.nHeight;
+                        coins->nVersion = undo.nVersion;
+                    }
                 } else {
                     if (coins->IsPruned())
                         fClean = fClean && error("DisconnectBlock() : undo data adding output to missing transaction");
@@ -2149,6 +2346,8 @@ void static FlushBlockFile(bool fFinalize = false)
 bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigned int nAddSize);
 
 static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+/** Held while scriptcheckqueue is in use, CheckBlock may run without cs_main */
+static CCriticalSection cs_scriptcheckqueue;
 
 void ThreadScriptCheck()
 {
@@ -2227,6 +2426,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     CBlockUndo blockundo;
 
+    LOCK(cs_scriptcheckqueue);
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
     int64_t nTimeStart = GetTimeMicros();
@@ -2236,6 +2436,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(block.vtx.size());
+    std::vector<CTransaction> vBudgetCollaterals;
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
     CAmount nValueOut = 0;
     CAmount nValueIn = 0;
@@ -2283,6 +2484,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
         vPos.push_back(std::make_pair(tx.GetHash(), pos));
         pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+        if (IsBudgetCollateralTx(tx))
+            vBudgetCollaterals.push_back(tx);
     }
 
     // track money supply and mint amount info
@@ -2340,6 +2543,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         if (!pblocktree->WriteTxIndex(vPos))
             return state.Abort("Failed to write transaction index");
 
+    // Keep the budget collaterals apart from their blocks, which may be
+    // pruned, and for UTXO snapshots
+    if (!vBudgetCollaterals.empty())
+        if (!pblocktree->WriteBudgetCollaterals(vBudgetCollaterals, pindex->GetBlockHash()))
+            return state.Abort("Failed to write budget collaterals");
+
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
@@ -2359,6 +2568,136 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     return true;
 }
 
+/** Share of -dbcache's coins budget kept after the cache has grown past it */
+static const int COINS_CACHE_TRIM_PERCENT = 50;
+
+uint64_t CalculateCurrentUsage()
+{
+    uint64_t retval = 0;
+    BOOST_FOREACH (const CBlockFileInfo& file, vinfoBlockFile) {
+        retval += file.nSize + file.nUndoSize;
+    }
+    return retval;
+}
+
+void PruneBlockFileIndex(const BlockMap& mapIndex, const int fileNumber, std::vector<CBlockIndex*>& vPruned)
+{
+    for (BlockMap::const_iterator it = mapIndex.begin(); it != mapIndex.end(); ++it) {
+        CBlockIndex* pindex = it->second;
+        if (pindex->nFile == fileNumber) {
+            pindex->nStatus &= ~BLOCK_HAVE_DATA;
+            pindex->nStatus &= ~BLOCK_HAVE_UNDO;
+            pindex->nFile = 0;
+            pindex->nDataPos = 0;
+            pindex->nUndoPos = 0;
+            vPruned.push_back(pindex);
+        }
+    }
+}
+
+/** Mark the blocks of a block file as pruned and forget the file's info (does not delete the files) */
+void static PruneOneBlockFile(const int fileNumber)
+{
+    std::vector<CBlockIndex*> vPruned;
+    PruneBlockFileIndex(mapBlockIndex, fileNumber, vPruned);
+    BOOST_FOREACH (CBlockIndex* pindex, vPruned) {
+        setDirtyBlockIndex.insert(pindex);
+
+        // Prune from mapBlocksUnlinked -- any block we prune would have
+        // to be downloaded again in order to consider its chain, at which
+        // point it would be considered as a candidate for
+        // mapBlocksUnlinked or setBlockIndexCandidates.
+        std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex->pprev);
+        while (range.first != range.second) {
+            std::multimap<CBlockIndex*, CBlockIndex*>::iterator itUnlinked = range.first;
+            range.first++;
+            if (itUnlinked->second == pindex) {
+                mapBlocksUnlinked.erase(itUnlinked);
+            }
+        }
+    }
+
+    vinfoBlockFile[fileNumber].SetNull();
+    setDirtyFileInfo.insert(fileNumber);
+}
+
+void static UnlinkPrunedFiles(const std::set<int>& setFilesToPrune)
+{
+    for (std::set<int>::const_iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
+        CDiskBlockPos pos(*it, 0);
+        boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
+        boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
+        LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
+    }
+}
+
+void FindFilesToPrune(const std::vector<CBlockFileInfo>& vinfo, const int nLastFile, const unsigned int nLastBlockWeCanPrune, const uint64_t nTarget, std::set<int>& setFilesToPrune)
+{
+    uint64_t nCurrentUsage = 0;
+    BOOST_FOREACH (const CBlockFileInfo& file, vinfo) {
+        nCurrentUsage += file.nSize + file.nUndoSize;
+    }
+    // We don't check to prune until after we've allocated new space for files,
+    // so we should leave a buffer under our target to account for another allocation
+    // before the next pruning.
+    uint64_t nBuffer = BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE;
+    uint64_t nBytesToPrune;
+
+    if (nCurrentUsage + nBuffer >= nTarget) {
+        for (int fileNumber = 0; fileNumber < nLastFile; fileNumber++) {
+            nBytesToPrune = vinfo[fileNumber].nSize + vinfo[fileNumber].nUndoSize;
+
+            if (vinfo[fileNumber].nSize == 0)
+                continue;
+
+            if (nCurrentUsage + nBuffer < nTarget) // are we below our target?
+                break;
+
+            // don't prune files that could have a block within the blocks to keep of the main chain's tip
+            if (vinfo[fileNumber].nHeightLast > nLastBlockWeCanPrune)
+                continue;
+
+            // Queue up the files for removal
+            setFilesToPrune.insert(fileNumber);
+            nCurrentUsage -= nBytesToPrune;
+        }
+    }
+}
+
+/**
+ * Pick the oldest block files to delete until the block and undo files fit in
+ * nPruneTarget again, and mark them as pruned. Files holding any block within
+ * MIN_BLOCKS_TO_KEEP (or -maxreorg) of the tip are kept, so that
+ * reorganizations still find their undo data. The stake modifiers are
+ * computed from the block index alone and do not need the pruned data.
+ */
+void static FindFilesToPrune(std::set<int>& setFilesToPrune)
+{
+    LOCK2(cs_main, cs_LastBlockFile);
+    if (chainActive.Tip() == NULL || nPruneTarget == 0) {
+        return;
+    }
+
+    int nBlocksToKeep = std::max((int)MIN_BLOCKS_TO_KEEP, (int)GetArg("-maxreorg", Params().MaxReorganizationDepth()));
+    if (chainActive.Tip()->nHeight <= nBlocksToKeep) {
+        return;
+    }
+
+    unsigned int nLastBlockWeCanPrune = chainActive.Tip()->nHeight - nBlocksToKeep;
+    std::set<int> setChosen;
+    FindFilesToPrune(vinfoBlockFile, nLastBlockFile, nLastBlockWeCanPrune, nPruneTarget, setChosen);
+    BOOST_FOREACH (int fileNumber, setChosen) {
+        PruneOneBlockFile(fileNumber);
+        setFilesToPrune.insert(fileNumber);
+    }
+
+    uint64_t nCurrentUsage = CalculateCurrentUsage();
+    LogPrint("prune", "Prune: target=%dMiB actual=%dMiB diff=%dMiB max_prune_height=%d removed %d blk/rev pairs\n",
+        nPruneTarget / 1024 / 1024, nCurrentUsage / 1024 / 1024,
+        ((int64_t)nPruneTarget - (int64_t)nCurrentUsage) / 1024 / 1024,
+        nLastBlockWeCanPrune, setChosen.size());
+}
+
 enum FlushStateMode {
     FLUSH_STATE_IF_NEEDED,
     FLUSH_STATE_PERIODIC,
@@ -2374,9 +2713,29 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
 {
     LOCK(cs_main);
     static int64_t nLastWrite = 0;
+    std::set<int> setFilesToPrune;
+    bool fFlushForPrune = false;
     try {
-        if ((mode == FLUSH_STATE_ALWAYS) ||
-            ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
+        if (fPruneMode && fCheckForPruning && !fReindex) {
+            FindFilesToPrune(setFilesToPrune);
+            fCheckForPruning = false;
+            if (!setFilesToPrune.empty()) {
+                fFlushForPrune = true;
+                if (!fHavePruned) {
+                    pblocktree->WriteFlag("prunedblockfiles", true);
+                    fHavePruned = true;
+                }
+            }
+        }
+        // A batch still being written by -asyncflush takes up the cache too
+        size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+        if (pcoinsAsyncWriter)
+            cacheSize += pcoinsAsyncWriter->DynamicMemoryUsage();
+        // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
+        bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0 / 9) > nCoinCacheUsage;
+        // The cache is over the limit, we have to write now.
+        bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCoinCacheUsage;
+        if ((mode == FLUSH_STATE_ALWAYS) || fCacheLarge || fCacheCritical || fFlushForPrune ||
             (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
             // Typical CCoins structures on disk are around 100 bytes in size.
             // Pushing a new one to the database can cause it to be written
@@ -2407,8 +2766,22 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
             }
             pblocktree->Sync();
             // Finally flush the chainstate (which may refer to block index entries).
-            if (!pcoinsTip->Flush())
+            // Only modified coins are written; the rest of the cache stays warm
+            // unless it is over budget, then the least recently used are dropped.
+            // With -asyncflush the coins are written on a background thread,
+            // after the block index entries they refer to are on disk.
+            if (!pcoinsTip->Sync())
+                return state.Abort("Failed to write to coin database");
+            // The chainstate must not refer to the blocks about to be deleted
+            if ((mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && pcoinsAsyncWriter && !pcoinsAsyncWriter->WaitForWrite())
                 return state.Abort("Failed to write to coin database");
+            if (fCacheLarge || fCacheCritical) {
+                size_t nDropped = pcoinsTip->Trim(nCoinCacheUsage * COINS_CACHE_TRIM_PERCENT / 100);
+                LogPrint("coindb", "Dropped %u least recently used transactions from the coins cache\n", (unsigned int)nDropped);
+            }
+            // The pruned block index entries are on disk now, delete the files.
+            if (fFlushForPrune)
+                UnlinkPrunedFiles(setFilesToPrune);
             // Update best block in wallet (so we can detect restored wallets).
             if (mode != FLUSH_STATE_IF_NEEDED) {
                 g_signals.SetBestChain(chainActive.GetLocator());
@@ -2427,6 +2800,13 @@ void FlushStateToDisk()
     FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
 }
 
+void PruneAndFlush()
+{
+    CValidationState state;
+    fCheckForPruning = true;
+    FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED);
+}
+
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex* pindexNew)
 {
@@ -2436,10 +2816,10 @@ void static UpdateTip(CBlockIndex* pindexNew)
     nTimeBestReceived = GetTime();
     mempool.AddTransactionsUpdated(1);
 
-    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%u\n",
+    LogPrintf("UpdateTip: new best=%s  height=%d  log2_work=%.8g  tx=%lu  date=%s progress=%f  cache=%.1fMiB(%utx)\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(), log(chainActive.Tip()->nChainWork.getdouble()) / log(2.0), (unsigned long)chainActive.Tip()->nChainTx,
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
-        Checkpoints::GuessVerificationProgress(chainActive.Tip()), (unsigned int)pcoinsTip->GetCacheSize());
+        Checkpoints::GuessVerificationProgress(chainActive.Tip()), pcoinsTip->DynamicMemoryUsage() * (1.0 / (1 << 20)), (unsigned int)pcoinsTip->GetCacheSize());
 
     cvBlockChange.notify_all();
 
@@ -2573,6 +2953,7 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
     mempool.check(pcoinsTip);
     // Update chainActive & related variables.
     UpdateTip(pindexNew);
+    UpdateKernelStakeModifiers(pindexNew);
     // Tell wallet about transactions that went from mempool
     // to conflicted:
     BOOST_FOREACH (const CTransaction& tx, txConflicted) {
@@ -2747,6 +3128,38 @@ static void PruneBlockIndexCandidates()
     assert(!setBlockIndexCandidates.empty());
 }
 
+/** Last block handed to the coins prefetcher */
+static const CBlockIndex* pindexLastPrefetched = NULL;
+
+/**
+ * Queue the inputs of the blocks about to be connected on the coins
+ * prefetcher, each block at most once. vpindexToConnect is ordered from the
+ * highest block down.
+ */
+static void PrefetchBlockInputs(const std::vector<CBlockIndex*>& vpindexToConnect, CBlockIndex* pindexMostWork, const CBlock* pblock)
+{
+    AssertLockHeld(cs_main);
+    if (!pcoinsPrefetch || vpindexToConnect.empty())
+        return;
+
+    int nFromHeight = vpindexToConnect.back()->nHeight;
+    if (pindexLastPrefetched && pindexMostWork->GetAncestor(pindexLastPrefetched->nHeight) == pindexLastPrefetched)
+        nFromHeight = std::max(nFromHeight, pindexLastPrefetched->nHeight + 1);
+
+    std::vector<CDiskBlockPos> vpos;
+    BOOST_REVERSE_FOREACH (const CBlockIndex* pindex, vpindexToConnect) {
+        if (pindex->nHeight < nFromHeight)
+            continue;
+        if (pindex == pindexMostWork && pblock)
+            pcoinsPrefetch->PrefetchBlock(*pblock);
+        else if (pindex->nStatus & BLOCK_HAVE_DATA)
+            vpos.push_back(pindex->GetBlockPos());
+    }
+    pcoinsPrefetch->PrefetchBlocks(vpos);
+    if (vpindexToConnect.front()->nHeight >= nFromHeight)
+        pindexLastPrefetched = vpindexToConnect.front();
+}
+
 /**
  * Try to make some progress towards making pindexMostWork the active block.
  * pblock is either NULL or a pointer to a CBlock corresponding to pindexMostWork.
@@ -2782,6 +3195,7 @@ static bool ActivateBestChainStep(CValidationState& state, CBlockIndex* pindexMo
             pindexIter = pindexIter->pprev;
         }
         nHeight = nTargetHeight;
+        PrefetchBlockInputs(vpindexToConnect, pindexMostWork, pblock);
 
         // Connect new blocks.
         BOOST_REVERSE_FOREACH (CBlockIndex* pindexConnect, vpindexToConnect) {
@@ -2858,13 +3272,29 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock, bool fAlreadyChe
             uint256 hashNewTip = pindexNewTip->GetBlockHash();
             // Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
+            // The block just processed goes out as a compact block, to the peers that relay them
+            boost::scoped_ptr<CBlockHeaderAndShortTxIDs> pcmpctblock;
+            if (pblock && pblock->GetHash() == hashNewTip)
+                pcmpctblock.reset(new CBlockHeaderAndShortTxIDs(*pblock));
             {
                 LOCK(cs_vNodes);
-                BOOST_FOREACH (CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                BOOST_FOREACH (CNode* pnode, vNodes) {
+                    if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                        continue;
+                    if (pcmpctblock && UseCompactBlocks(pnode)) {
+                        bool fKnown;
+                        {
+                            LOCK(pnode->cs_inventory);
+                            fKnown = !pnode->setInventoryKnown.insert(CInv(MSG_BLOCK, hashNewTip)).second;
+                        }
+                        if (!fKnown)
+                            pnode->PushMessage("cmpctblock", *pcmpctblock);
+                    } else
                         pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                }
             }
             // Notify external listeners about the new tip.
+            g_signals.UpdatedBlockTip(pindexNewTip);
             uiInterface.NotifyBlockTip(hashNewTip);
         }
     } while (pindexMostWork != chainActive.Tip());
@@ -2875,6 +3305,9 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock, bool fAlreadyChe
         return false;
     }
 
+    // The stake of blocks waiting on the new tip can be checked now
+    ProcessStakePendingBlocks();
+
     return true;
 }
 
@@ -2975,6 +3408,11 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
         pindexNew->BuildSkip();
 
+        // Headers carry no coinstake; past the last proof-of-work block every
+        // block is a proof-of-stake block (see ConnectBlock)
+        if (block.vtx.empty() && pindexNew->nHeight > Params().LAST_POW_BLOCK())
+            pindexNew->SetProofOfStake();
+
         //update previous block pointer
         pindexNew->pprev->pnext = pindexNew;
 
@@ -2986,7 +3424,7 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
             LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
 
         // ppcoin: record proof-of-stake hash value
-        if (pindexNew->IsProofOfStake()) {
+        if (pindexNew->IsProofOfStake() && !block.vtx.empty()) {
             if (!mapProofOfStake.count(hash))
                 LogPrintf("AddToBlockIndex() : hashProofOfStake not found in map \n");
             pindexNew->hashProofOfStake = mapProofOfStake[hash];
@@ -3019,8 +3457,18 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
 /** Mark a block as having its data received and checked (up to BLOCK_VALID_TRANSACTIONS). */
 bool ReceivedBlockTransactions(const CBlock& block, CValidationState& state, CBlockIndex* pindexNew, const CDiskBlockPos& pos)
 {
-    if (block.IsProofOfStake())
+    if (block.IsProofOfStake()) {
         pindexNew->SetProofOfStake();
+        // Entries added from a header learn their stake with the block
+        if (pindexNew->prevoutStake.IsNull()) {
+            pindexNew->prevoutStake = block.vtx[1].vin[0].prevout;
+            pindexNew->nStakeTime = block.nTime;
+            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+        }
+        std::map<uint256, uint256>::iterator it = mapProofOfStake.find(block.GetHash());
+        if (pindexNew->hashProofOfStake == 0 && it != mapProofOfStake.end())
+            pindexNew->hashProofOfStake = it->second;
+    }
     pindexNew->nTx = block.vtx.size();
     pindexNew->nChainTx = 0;
     pindexNew->nFile = pos.nFile;
@@ -3097,6 +3545,8 @@ bool FindBlockPos(CValidationState& state, CDiskBlockPos& pos, unsigned int nAdd
         unsigned int nOldChunks = (pos.nPos + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
         unsigned int nNewChunks = (vinfoBlockFile[nFile].nSize + BLOCKFILE_CHUNK_SIZE - 1) / BLOCKFILE_CHUNK_SIZE;
         if (nNewChunks > nOldChunks) {
+            if (fPruneMode)
+                fCheckForPruning = true;
             if (CheckDiskSpace(nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos)) {
                 FILE* file = OpenBlockFile(pos);
                 if (file) {
@@ -3127,6 +3577,8 @@ bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigne
     unsigned int nOldChunks = (pos.nPos + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
     unsigned int nNewChunks = (nNewSize + UNDOFILE_CHUNK_SIZE - 1) / UNDOFILE_CHUNK_SIZE;
     if (nNewChunks > nOldChunks) {
+        if (fPruneMode)
+            fCheckForPruning = true;
         if (CheckDiskSpace(nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos)) {
             FILE* file = OpenUndoFile(pos);
             if (file) {
@@ -3151,6 +3603,78 @@ bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool f
     return true;
 }
 
+/** Number of transactions checked by one CheckBlock task */
+static const unsigned int CHECKBLOCK_BATCH_TXS = 64;
+/** Number of Merkle tree levels hashed by one CheckBlock task, above as many txids */
+static const int CHECKBLOCK_MERKLE_LEVELS = 8;
+
+static bool CheckTransactionRange(const CBlock* pblock, unsigned int nBegin, unsigned int nEnd, unsigned int* pnSigOps)
+{
+    CValidationState state;
+    unsigned int nSigOps = 0;
+    for (unsigned int i = nBegin; i < nEnd; i++) {
+        if (!CheckTransaction(pblock->vtx[i], state))
+            return false;
+        nSigOps += GetLegacySigOpCount(pblock->vtx[i]);
+    }
+    *pnSigOps = nSigOps;
+    return true;
+}
+
+static bool HashMerkleSubtree(const CBlock* pblock, unsigned int nBegin, unsigned int nEnd)
+{
+    pblock->HashMerkleLevels(0, CHECKBLOCK_MERKLE_LEVELS, nBegin, nEnd);
+    return true;
+}
+
+/**
+ * Run the context-free transaction checks and the Merkle tree hashing of a
+ * block on the script-checking threads. Returns false if the threads are not
+ * available or any check failed; the caller then does the work serially, so
+ * errors are reported in transaction order exactly as before.
+ */
+static bool CheckBlockParallel(const CBlock& block, bool fCheckMerkleRoot, uint256& hashMerkleRoot, bool& fMutated, unsigned int& nSigOps)
+{
+    const unsigned int nTx = block.vtx.size();
+    if (!fParallelCheckBlock || !nScriptCheckThreads || nTx < 2 * CHECKBLOCK_BATCH_TXS)
+        return false;
+    // ConnectBlock may be using the queue, never wait for it here
+    TRY_LOCK(cs_scriptcheckqueue, lockQueue);
+    if (!lockQueue)
+        return false;
+
+    std::vector<CScriptCheck> vChecks;
+    if (fCheckMerkleRoot) {
+        block.InitMerkleTree();
+        const unsigned int nSubtree = 1 << CHECKBLOCK_MERKLE_LEVELS;
+        for (unsigned int i = 0; i < nTx; i += nSubtree)
+            vChecks.push_back(CScriptCheck(boost::bind(HashMerkleSubtree, &block, i, std::min(i + nSubtree, nTx))));
+    }
+    std::vector<unsigned int> vSigOps((nTx + CHECKBLOCK_BATCH_TXS - 1) / CHECKBLOCK_BATCH_TXS);
+    for (unsigned int i = 0; i < vSigOps.size(); i++) {
+        unsigned int nBegin = i * CHECKBLOCK_BATCH_TXS;
+        vChecks.push_back(CScriptCheck(boost::bind(CheckTransactionRange, &block, nBegin, std::min(nBegin + CHECKBLOCK_BATCH_TXS, nTx), &vSigOps[i])));
+    }
+
+    CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue);
+    control.Add(vChecks);
+    if (!control.Wait())
+        return false;
+
+    if (fCheckMerkleRoot) {
+        // The levels above the subtrees are few and small
+        unsigned int nSize = nTx;
+        for (int i = 0; i < CHECKBLOCK_MERKLE_LEVELS; i++)
+            nSize = (nSize + 1) / 2;
+        block.HashMerkleLevels(CHECKBLOCK_MERKLE_LEVELS, std::numeric_limits<int>::max(), 0, nSize);
+        hashMerkleRoot = block.FinishMerkleTree(&fMutated);
+    }
+    nSigOps = 0;
+    BOOST_FOREACH (unsigned int n, vSigOps)
+        nSigOps += n;
+    return true;
+}
+
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig)
 {
     // These are checks that are independent of context.
@@ -3167,10 +3691,21 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         return state.Invalid(error("CheckBlock() : block timestamp too far in the future"),
             REJECT_INVALID, "time-too-new");
 
+    // Transaction checks and Merkle tree hashing, fanned out to the script-checking
+    // threads for big blocks. The results are evaluated in the usual order below.
+    // A Merkle tree built beforehand, as by the block import workers, is reused.
+    uint256 hashMerkleRoot2;
+    bool mutated = false;
+    unsigned int nSigOps = 0;
+    bool fMerkleTreeBuilt = fCheckMerkleRoot && block.IsMerkleTreeBuilt();
+    bool fCheckedParallel = CheckBlockParallel(block, fCheckMerkleRoot && !fMerkleTreeBuilt, hashMerkleRoot2, mutated, nSigOps);
+
     // Check the merkle root.
     if (fCheckMerkleRoot) {
-        bool mutated;
-        uint256 hashMerkleRoot2 = block.BuildMerkleTree(&mutated);
+        if (fMerkleTreeBuilt)
+            hashMerkleRoot2 = block.FinishMerkleTree(&mutated);
+        else if (!fCheckedParallel)
+            hashMerkleRoot2 = block.BuildMerkleTree(&mutated);
         if (block.hashMerkleRoot != hashMerkleRoot2)
             return state.DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"),
                 REJECT_INVALID, "bad-txnmrklroot", true);
@@ -3267,13 +3802,14 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     }
 
     // Check transactions
-    for (const CTransaction& tx : block.vtx)
-        if (!CheckTransaction(tx, state))
-            return error("CheckBlock() : CheckTransaction failed");
+    if (!fCheckedParallel) {
+        for (const CTransaction& tx : block.vtx)
+            if (!CheckTransaction(tx, state))
+                return error("CheckBlock() : CheckTransaction failed");
 
-    unsigned int nSigOps = 0;
-    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
-        nSigOps += GetLegacySigOpCount(tx);
+        BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+            nSigOps += GetLegacySigOpCount(tx);
+        }
     }
     if (nSigOps > MAX_BLOCK_SIGOPS)
         return state.DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"),
@@ -3282,14 +3818,12 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     return true;
 }
 
-bool CheckWork(const CBlock block, CBlockIndex* const pindexPrev)
+/** Check the difficulty of a block, which is a proof-of-work block if fProofOfWork */
+static bool CheckBlockBits(const CBlockHeader& block, bool fProofOfWork, CBlockIndex* const pindexPrev)
 {
-    if (pindexPrev == NULL)
-        return error("%s : null pindexPrev for block %s", __func__, block.GetHash().ToString().c_str());
-
     unsigned int nBitsRequired = GetNextWorkRequired(pindexPrev, &block);
 
-    if (block.IsProofOfWork() && (pindexPrev->nHeight + 1 <= 68589)) {
+    if (fProofOfWork && (pindexPrev->nHeight + 1 <= 68589)) {
         double n1 = ConvertBitsToDouble(block.nBits);
         double n2 = ConvertBitsToDouble(nBitsRequired);
 
@@ -3302,7 +3836,18 @@ bool CheckWork(const CBlock block, CBlockIndex* const pindexPrev)
     if (block.nBits != nBitsRequired)
         return error("%s : incorrect proof of work at %d", __func__, pindexPrev->nHeight + 1);
 
-    if (block.IsProofOfStake()) {
+    return true;
+}
+
+bool CheckWork(const CBlock& block, CBlockIndex* const pindexPrev, bool fCheckStake)
+{
+    if (pindexPrev == NULL)
+        return error("%s : null pindexPrev for block %s", __func__, block.GetHash().ToString().c_str());
+
+    if (!CheckBlockBits(block, block.IsProofOfWork(), pindexPrev))
+        return false;
+
+    if (block.IsProofOfStake() && fCheckStake) {
         uint256 hashProofOfStake;
         uint256 hash = block.GetHash();
 
@@ -3442,6 +3987,18 @@ bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex
     if (!ContextualCheckBlockHeader(block, state, pindexPrev))
         return false;
 
+    // A header received ahead of its block carries no coinstake. Every block
+    // after the last proof-of-work block is a proof-of-stake block, so all
+    // that can be checked here is the proof of work or, past it, the
+    // difficulty; the stake is checked with the block.
+    if (block.vtx.empty() && pindexPrev) {
+        bool fProofOfWork = pindexPrev->nHeight + 1 <= Params().LAST_POW_BLOCK();
+        if (fProofOfWork && !CheckProofOfWork(hash, block.nBits))
+            return state.DoS(50, error("%s : proof of work failed", __func__), REJECT_INVALID, "high-hash");
+        if (!CheckBlockBits(block, fProofOfWork, pindexPrev))
+            return state.DoS(100, error("%s : incorrect difficulty for header %s", __func__, hash.ToString()), REJECT_INVALID, "bad-diffbits");
+    }
+
     if (pindex == NULL)
         pindex = AddToBlockIndex(block);
 
@@ -3480,8 +4037,16 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
         }
     }
 
-    if (block.GetHash() != Params().HashGenesisBlock() && !CheckWork(block, pindexPrev))
+    // The stake of a block is checked before the block is stored. Off the
+    // active chain the staked output or the stake modifier may not be known
+    // yet: such a block is handed back as stake-pending, to be kept in memory
+    // until its parent is connected (see ProcessStakePendingBlocks).
+    if (block.GetHash() != Params().HashGenesisBlock() && !CheckWork(block, pindexPrev)) {
+        if (block.IsProofOfStake() && !chainActive.Contains(pindexPrev) && CheckWork(block, pindexPrev, false))
+            return state.DoS(0, error("%s : stake of block %s cannot be checked yet", __func__, block.GetHash().ToString()),
+                             0, "stake-pending");
         return false;
+    }
 
     if (!AcceptBlockHeader(block, state, &pindex))
         return false;
@@ -3492,6 +4057,10 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
         return true;
     }
 
+    // Blocks of the active chain that were pruned are not stored again
+    if (fHavePruned && pindex->nTx != 0 && chainActive.Contains(pindex))
+        return true;
+
     if ((!fAlreadyCheckedBlock && !CheckBlock(block, state)) || !ContextualCheckBlock(block, state, pindex->pprev)) {
         if (state.IsInvalid() && !state.CorruptionPossible()) {
             pindex->nStatus |= BLOCK_FAILED_VALID;
@@ -3800,7 +4369,9 @@ bool static LoadBlockIndexDB(string& strError)
     BOOST_FOREACH (const PAIRTYPE(int, CBlockIndex*) & item, vSortedByHeight) {
         CBlockIndex* pindex = item.second;
         pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
-        if (pindex->nStatus & BLOCK_HAVE_DATA) {
+        // We can link the chain of blocks for which we've received transactions at some point.
+        // Pruned nodes may have deleted the block.
+        if (pindex->nTx > 0) {
             if (pindex->pprev) {
                 if (pindex->pprev->nChainTx) {
                     pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
@@ -3839,6 +4410,11 @@ bool static LoadBlockIndexDB(string& strError)
         }
     }
 
+    // Check whether we have ever pruned block & undo files
+    pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
+    if (fHavePruned)
+        LogPrintf("LoadBlockIndexDB(): Block files have previously been pruned\n");
+
     // Check presence of blk files
     LogPrintf("Checking all blk files are present...\n");
     set<int> setBlkDataFiles;
@@ -3987,6 +4563,11 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
         uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
         if (pindex->nHeight < chainActive.Height() - nCheckDepth)
             break;
+        if (fHavePruned && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            // If pruned or bootstrapped from a UTXO snapshot, only go back as far as we have data.
+            LogPrintf("VerifyDB(): block verification stopping at height %d (pruning, no data)\n", pindex->nHeight);
+            break;
+        }
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex))
@@ -4004,7 +4585,7 @@ bool CVerifyDB::VerifyDB(CCoinsView* coinsview, int nCheckLevel, int nCheckDepth
             }
         }
         // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.GetCacheSize() + pcoinsTip->GetCacheSize()) <= nCoinCacheSize) {
+        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
             bool fClean = true;
             if (!DisconnectBlock(block, state, pindex, coins, &fClean))
                 return error("VerifyDB() : *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
@@ -4047,6 +4628,7 @@ void UnloadBlockIndex()
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
     pindexBestInvalid = NULL;
+    pindexLastPrefetched = NULL;
 }
 
 bool LoadBlockIndex(string& strError)
@@ -4098,65 +4680,293 @@ bool InitBlockIndex()
 }
 
 
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
+namespace
+{
+/** Bytes of serialized blocks read ahead of the block being connected */
+static const uint64_t MAX_IMPORT_BYTES_QUEUED = 16 * MAX_BLOCK_SIZE;
+/** Bytes of out-of-order blocks kept in memory; beyond this they are read from disk again */
+static const uint64_t MAX_IMPORT_UNKNOWN_PARENT_BYTES = 32 * MAX_BLOCK_SIZE;
+
+/** A block read from an import file, deserialized by the workers */
+struct CImportBlock {
+    //! The serialized block, its framed size and where it was found
+    CDataStream ssBlock;
+    unsigned int nSize;
+    uint64_t nBlockPos;
+    //! Where the scan resumes if the block turns out to be corrupt: right after its magic byte
+    uint64_t nRewindOnError;
+
+    bool fDone;
+    boost::shared_ptr<CBlock> pblock;
+    //! Number of bytes taken up by the block, if it could be deserialized
+    uint64_t nBlockSize;
+    std::string strError;
+
+    CImportBlock() : ssBlock(SER_DISK, CLIENT_VERSION), nSize(0), nBlockPos(0), nRewindOnError(0), fDone(false), nBlockSize(0) {}
+};
+
+/**
+ * Reads an import file ahead on one thread and deserializes its blocks on
+ * others, computing the block and Merkle tree hashes, while the caller
+ * connects them in file order.
+ *
+ * The reader frames blocks by their magic and size. Should a block turn out to
+ * be corrupt or shorter than its size, the caller rewinds the reader to where
+ * a serial scan would have continued, and the blocks read past it are dropped.
+ */
+class CBlockFileImporter
+{
+private:
+    CBufferedFile& blkdat;
+
+    //! Protects everything below
+    boost::mutex cs;
+    boost::condition_variable cond;
+    boost::thread_group threadGroup;
+    bool fStop;
+
+    //! Blocks in file order, and those not yet picked up by a worker
+    std::deque<boost::shared_ptr<CImportBlock> > queueBlocks;
+    std::deque<boost::shared_ptr<CImportBlock> > queueWork;
+    uint64_t nBytesQueued;
+    //! Set by the reader at the end of the file, cleared by a rewind
+    bool fReadDone;
+    bool fRewind;
+    uint64_t nRewindPos;
+    //! Incremented by each rewind, so the reader drops what it read before
+    uint64_t nGeneration;
+
+    void ThreadRead();
+    void SetReadDone(uint64_t nReadGeneration);
+    void ThreadDeserialize();
+
+public:
+    CBlockFileImporter(CBufferedFile& blkdatIn, int nThreads);
+    ~CBlockFileImporter();
+
+    //! Wait for the next block in file order. Returns NULL at the end of the file.
+    boost::shared_ptr<CImportBlock> Next();
+};
+
+CBlockFileImporter::CBlockFileImporter(CBufferedFile& blkdatIn, int nThreads) : blkdat(blkdatIn), fStop(false), nBytesQueued(0), fReadDone(false), fRewind(false), nRewindPos(0), nGeneration(0)
+{
+    threadGroup.create_thread(boost::bind(&CBlockFileImporter::ThreadRead, this));
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&CBlockFileImporter::ThreadDeserialize, this));
+}
+
+CBlockFileImporter::~CBlockFileImporter()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fStop = true;
+    }
+    cond.notify_all();
+    threadGroup.join_all();
+}
+
+void CBlockFileImporter::SetReadDone(uint64_t nReadGeneration)
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (nReadGeneration == nGeneration)
+        fReadDone = true;
+    cond.notify_all();
+}
+
+void CBlockFileImporter::ThreadRead()
+{
+    RenameThread("hash-loadblkread");
+    uint64_t nRewind = blkdat.GetPos();
+    while (true) {
+        uint64_t nReadGeneration;
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            while (!fStop && !fRewind && (fReadDone || (nBytesQueued >= MAX_IMPORT_BYTES_QUEUED && !queueBlocks.empty())))
+                cond.wait(lock);
+            if (fStop)
+                return;
+            if (fRewind) {
+                nRewind = nRewindPos;
+                fRewind = false;
+                fReadDone = false;
+            }
+            nReadGeneration = nGeneration;
+        }
+
+        // A rewind may go back further than the buffer holds
+        if (!blkdat.SetPos(nRewind) && !blkdat.Seek(nRewind)) {
+            LogPrintf("%s : Failed to seek to position %u\n", __func__, nRewind);
+            SetReadDone(nReadGeneration);
+            continue;
+        }
+        nRewind++;         // start one byte further next time, in case of failure
+        blkdat.SetLimit(); // remove former limit
+        unsigned int nSize = 0;
+        try {
+            // locate a header
+            unsigned char buf[MESSAGE_START_SIZE];
+            blkdat.FindByte(Params().MessageStart()[0]);
+            nRewind = blkdat.GetPos() + 1;
+            blkdat >> FLATDATA(buf);
+            if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+                continue;
+            // read size
+            blkdat >> nSize;
+            if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                continue;
+        } catch (const std::exception&) {
+            // no valid block header found; don't complain
+            SetReadDone(nReadGeneration);
+            continue;
+        }
+
+        boost::shared_ptr<CImportBlock> pimport(new CImportBlock());
+        try {
+            // read block
+            uint64_t nBlockPos = blkdat.GetPos();
+            blkdat.SetLimit(nBlockPos + nSize);
+            pimport->ssBlock.resize(nSize);
+            blkdat.read(&pimport->ssBlock[0], nSize);
+            pimport->nSize = nSize;
+            pimport->nBlockPos = nBlockPos;
+            pimport->nRewindOnError = nRewind;
+            nRewind = blkdat.GetPos();
+        } catch (const std::exception& e) {
+            LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+            continue;
+        }
+
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (nReadGeneration != nGeneration)
+            continue;
+        queueBlocks.push_back(pimport);
+        queueWork.push_back(pimport);
+        nBytesQueued += nSize;
+        cond.notify_all();
+    }
+}
+
+void CBlockFileImporter::ThreadDeserialize()
+{
+    RenameThread("hash-loadblkwork");
+    while (true) {
+        boost::shared_ptr<CImportBlock> pimport;
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            while (!fStop && queueWork.empty())
+                cond.wait(lock);
+            if (fStop)
+                return;
+            pimport = queueWork.front();
+            queueWork.pop_front();
+        }
+
+        boost::shared_ptr<CBlock> pblock(new CBlock());
+        uint64_t nBlockSize = 0;
+        std::string strError;
+        try {
+            pimport->ssBlock >> *pblock;
+            nBlockSize = pimport->nSize - pimport->ssBlock.size();
+            // Both are memoized in the block for the checks made when connecting it
+            pblock->GetHash();
+            pblock->BuildMerkleTree();
+        } catch (const std::exception& e) {
+            pblock.reset();
+            strError = e.what();
+        }
+        pimport->ssBlock.clear();
+
+        boost::unique_lock<boost::mutex> lock(cs);
+        pimport->pblock = pblock;
+        pimport->nBlockSize = nBlockSize;
+        pimport->strError = strError;
+        pimport->fDone = true;
+        cond.notify_all();
+    }
+}
+
+boost::shared_ptr<CImportBlock> CBlockFileImporter::Next()
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (!(fReadDone && !fRewind && queueBlocks.empty()) && (queueBlocks.empty() || !queueBlocks.front()->fDone))
+        cond.wait(lock);
+    if (queueBlocks.empty())
+        return boost::shared_ptr<CImportBlock>();
+
+    boost::shared_ptr<CImportBlock> pimport = queueBlocks.front();
+    queueBlocks.pop_front();
+    nBytesQueued -= pimport->nSize;
+
+    // Resume where a serial scan would have: after the magic byte of a corrupt
+    // block, or at the actual end of a block shorter than its size.
+    uint64_t nNext = pimport->pblock ? pimport->nBlockPos + pimport->nBlockSize : pimport->nRewindOnError;
+    if (nNext != pimport->nBlockPos + pimport->nSize) {
+        queueBlocks.clear();
+        queueWork.clear();
+        nBytesQueued = 0;
+        fReadDone = false;
+        fRewind = true;
+        nRewindPos = nNext;
+        nGeneration++;
+    }
+    cond.notify_all();
+    return pimport;
+}
+} // anon namespace
+
+bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp, CUnknownParentBlocks* pUnknownParents)
 {
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
     int64_t nStart = GetTimeMillis();
 
+    // Without a caller to keep them for its next file, they go with this one
+    CUnknownParentBlocks unknownParentsLocal;
+    std::multimap<uint256, CUnknownParentBlock>& mapBlocksUnknownParent = (pUnknownParents ? pUnknownParents : &unknownParentsLocal)->mapBlocks;
+    uint64_t& nUnknownParentBytes = (pUnknownParents ? pUnknownParents : &unknownParentsLocal)->nBytes;
+
     int nLoaded = 0;
     try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SIZE, MAX_BLOCK_SIZE + 8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
+        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor.
+        // Blocks are read at once, so the buffer holds one besides the rewind margin.
+        CBufferedFile blkdat(fileIn, 3 * MAX_BLOCK_SIZE, MAX_BLOCK_SIZE + 8, SER_DISK, CLIENT_VERSION);
+        // Stops its threads before blkdat is closed, including when this thread is interrupted
+        CBlockFileImporter importer(blkdat, std::max(nScriptCheckThreads, 1));
+        while (true) {
             boost::this_thread::interruption_point();
 
-            blkdat.SetPos(nRewind);
-            nRewind++;         // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos() + 1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
-                    continue;
-            } catch (const std::exception&) {
-                // no valid block header found; don't complain
+            boost::shared_ptr<CImportBlock> pimport = importer.Next();
+            if (!pimport)
                 break;
+            if (!pimport->pblock) {
+                LogPrintf("%s : Deserialize or I/O error - %s", __func__, pimport->strError);
+                continue;
             }
-            try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
+            CBlock& block = *pimport->pblock;
+            CDiskBlockPos pos;
+            if (dbp)
+                pos = CDiskBlockPos(dbp->nFile, pimport->nBlockPos);
 
+            try {
                 // detect out of order blocks, and store them for later
                 uint256 hash = block.GetHash();
                 if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
                     LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
                         block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+                    CUnknownParentBlock unknown;
+                    unknown.nSize = pimport->nBlockSize;
+                    unknown.pos = pos;
+                    if (nUnknownParentBytes + unknown.nSize <= MAX_IMPORT_UNKNOWN_PARENT_BYTES) {
+                        unknown.pblock = pimport->pblock;
+                        nUnknownParentBytes += unknown.nSize;
+                    }
+                    if (unknown.pblock || dbp)
+                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, unknown));
                     continue;
                 }
 
                 // process in case the block isn't known yet
                 if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
                     CValidationState state;
-                    if (ProcessNewBlock(state, NULL, &block, dbp))
+                    if (ProcessNewBlock(state, NULL, &block, dbp ? &pos : NULL))
                         nLoaded++;
                     if (state.IsError())
                         break;
@@ -4170,16 +4980,24 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp)
                 while (!queue.empty()) {
                     uint256 head = queue.front();
                     queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+                    std::pair<std::multimap<uint256, CUnknownParentBlock>::iterator, std::multimap<uint256, CUnknownParentBlock>::iterator> range = mapBlocksUnknownParent.equal_range(head);
                     while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second)) {
-                            LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
+                        std::multimap<uint256, CUnknownParentBlock>::iterator it = range.first;
+                        boost::shared_ptr<CBlock> pblockChild = it->second.pblock;
+                        if (pblockChild) {
+                            nUnknownParentBytes -= it->second.nSize;
+                        } else {
+                            pblockChild.reset(new CBlock());
+                            if (!ReadBlockFromDisk(*pblockChild, it->second.pos))
+                                pblockChild.reset();
+                        }
+                        if (pblockChild) {
+                            LogPrintf("%s: Processing out of order child %s of %s\n", __func__, pblockChild->GetHash().ToString(),
                                 head.ToString());
                             CValidationState dummy;
-                            if (ProcessNewBlock(dummy, NULL, &block, &it->second)) {
+                            if (ProcessNewBlock(dummy, NULL, pblockChild.get(), it->second.pos.IsNull() ? NULL : &it->second.pos)) {
                                 nLoaded++;
-                                queue.push_back(block.GetHash());
+                                queue.push_back(pblockChild->GetHash());
                             }
                         }
                         range.first++;
@@ -4234,6 +5052,7 @@ void static CheckBlockIndex()
     int nHeight = 0;
     CBlockIndex* pindexFirstInvalid = NULL;         // Oldest ancestor of pindex which is invalid.
     CBlockIndex* pindexFirstMissing = NULL;         // Oldest ancestor of pindex which does not have BLOCK_HAVE_DATA.
+    CBlockIndex* pindexFirstNeverProcessed = NULL;  // Oldest ancestor of pindex for which nTx == 0.
     CBlockIndex* pindexFirstNotTreeValid = NULL;    // Oldest ancestor of pindex which does not have BLOCK_VALID_TREE (regardless of being valid or not).
     CBlockIndex* pindexFirstNotChainValid = NULL;   // Oldest ancestor of pindex which does not have BLOCK_VALID_CHAIN (regardless of being valid or not).
     CBlockIndex* pindexFirstNotScriptsValid = NULL; // Oldest ancestor of pindex which does not have BLOCK_VALID_SCRIPTS (regardless of being valid or not).
@@ -4241,6 +5060,7 @@ void static CheckBlockIndex()
         nNodes++;
         if (pindexFirstInvalid == NULL && pindex->nStatus & BLOCK_FAILED_VALID) pindexFirstInvalid = pindex;
         if (pindexFirstMissing == NULL && !(pindex->nStatus & BLOCK_HAVE_DATA)) pindexFirstMissing = pindex;
+        if (pindexFirstNeverProcessed == NULL && pindex->nTx == 0) pindexFirstNeverProcessed = pindex;
         if (pindex->pprev != NULL && pindexFirstNotTreeValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_TREE) pindexFirstNotTreeValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotChainValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_CHAIN) pindexFirstNotChainValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotScriptsValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS) pindexFirstNotScriptsValid = pindex;
@@ -4251,12 +5071,21 @@ void static CheckBlockIndex()
             assert(pindex->GetBlockHash() == Params().HashGenesisBlock()); // Genesis block's hash must match.
             assert(pindex == chainActive.Genesis());                       // The current active chain's genesis block must be this block.
         }
-        // HAVE_DATA is equivalent to VALID_TRANSACTIONS and equivalent to nTx > 0 (we stored the number of transactions in the block)
-        assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
-        assert(((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS) == (pindex->nTx > 0));
         if (pindex->nChainTx == 0) assert(pindex->nSequenceId == 0); // nSequenceId can't be set for blocks that aren't linked
-        // All parents having data is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
-        assert((pindexFirstMissing != NULL) == (pindex->nChainTx == 0));                                             // nChainTx == 0 is used to signal that all parent block's transaction data is available.
+        // VALID_TRANSACTIONS is equivalent to nTx > 0 for all nodes (whether or not pruning has occurred).
+        // HAVE_DATA is only equivalent to nTx > 0 (or VALID_TRANSACTIONS) if no pruning has occurred.
+        if (!fHavePruned) {
+            // If we've never pruned, then HAVE_DATA should be equivalent to nTx > 0
+            assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+            assert(pindexFirstMissing == pindexFirstNeverProcessed);
+        } else {
+            // If we have pruned, then we can only say that HAVE_DATA implies nTx > 0
+            if (pindex->nStatus & BLOCK_HAVE_DATA) assert(pindex->nTx > 0);
+        }
+        if (pindex->nStatus & BLOCK_HAVE_UNDO) assert(pindex->nStatus & BLOCK_HAVE_DATA);
+        assert(((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS) == (pindex->nTx > 0)); // This is pruning-independent.
+        // All parents having had data (at some point) is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
+        assert((pindexFirstNeverProcessed != NULL) == (pindex->nChainTx == 0));                                     // nChainTx != 0 is used to signal that all parent blocks have been processed (but may have been pruned).
         assert(pindex->nHeight == nHeight);                                                                          // nHeight must be consistent.
         assert(pindex->pprev == NULL || pindex->nChainWork >= pindex->pprev->nChainWork);                            // For every block except the genesis block, the chainwork must be larger than the parent's.
         assert(nHeight < 2 || (pindex->pskip && (pindex->pskip->nHeight < nHeight)));                                // The pskip pointer must point back for all but the first 2 blocks.
@@ -4268,9 +5097,18 @@ void static CheckBlockIndex()
             // Checks for not-invalid blocks.
             assert((pindex->nStatus & BLOCK_FAILED_MASK) == 0); // The failed mask cannot be set for blocks without invalid parents.
         }
-        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstMissing == NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block sorts at least as good as the current tip and is valid, it must be in setBlockIndexCandidates.
-                assert(setBlockIndexCandidates.count(pindex));
+        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstNeverProcessed == NULL) {
+            if (pindexFirstInvalid == NULL) {
+                // If this block sorts at least as good as the current tip and
+                // is valid and we have all data for its parents, it must be in
+                // setBlockIndexCandidates.  chainActive.Tip() must also be there
+                // even if some data has been pruned.
+                if (pindexFirstMissing == NULL || pindex == chainActive.Tip()) {
+                    assert(setBlockIndexCandidates.count(pindex));
+                }
+                // If some parent is missing, then it could be that this block was in
+                // setBlockIndexCandidates but had to be removed because of the missing data.
+                // In this case it must be in mapBlocksUnlinked -- see test below.
             }
         } else { // If this block sorts worse than the current tip, it cannot be in setBlockIndexCandidates.
             assert(setBlockIndexCandidates.count(pindex) == 0);
@@ -4286,12 +5124,25 @@ void static CheckBlockIndex()
             }
             rangeUnlinked.first++;
         }
-        if (pindex->pprev && pindex->nStatus & BLOCK_HAVE_DATA && pindexFirstMissing != NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block has block data available, some parent doesn't, and has no invalid parents, it must be in mapBlocksUnlinked.
-                assert(foundInUnlinked);
+        if (pindex->pprev && (pindex->nStatus & BLOCK_HAVE_DATA) && pindexFirstNeverProcessed != NULL && pindexFirstInvalid == NULL) {
+            // If this block has block data available, some parent was never received, and has no invalid parents, it must be in mapBlocksUnlinked.
+            assert(foundInUnlinked);
+        }
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA)) assert(!foundInUnlinked); // Can't be in mapBlocksUnlinked if we don't HAVE_DATA
+        if (pindexFirstMissing == NULL) assert(!foundInUnlinked);          // We aren't missing data for any parent -- cannot be in mapBlocksUnlinked.
+        if (pindex->pprev && (pindex->nStatus & BLOCK_HAVE_DATA) && pindexFirstNeverProcessed == NULL && pindexFirstMissing != NULL) {
+            // We HAVE_DATA for this block, have received data for all parents at some point, but we're currently missing data for some parent.
+            assert(fHavePruned); // We must have pruned.
+            // This block may have entered mapBlocksUnlinked if:
+            //  - it has a descendant that at some point had more work than the tip, and
+            //  - we tried switching to that descendant but were missing data for some intermediate block between chainActive and the tip.
+            // So if this block is itself better than chainActive.Tip() and it wasn't in
+            // setBlockIndexCandidates, then it must be in mapBlocksUnlinked.
+            if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && setBlockIndexCandidates.count(pindex) == 0) {
+                if (pindexFirstInvalid == NULL) {
+                    assert(foundInUnlinked);
+                }
             }
-        } else { // If this block does not have block data available, or all parents do, it cannot be in mapBlocksUnlinked.
-            assert(!foundInUnlinked);
         }
         // assert(pindex->GetBlockHash() == pindex->GetBlockHeader().GetHash()); // Perhaps too slow
         // End: actual consistency checks.
@@ -4311,6 +5162,7 @@ void static CheckBlockIndex()
             // If pindex was the first with a certain property, unset the corresponding variable.
             if (pindex == pindexFirstInvalid) pindexFirstInvalid = NULL;
             if (pindex == pindexFirstMissing) pindexFirstMissing = NULL;
+            if (pindex == pindexFirstNeverProcessed) pindexFirstNeverProcessed = NULL;
             if (pindex == pindexFirstNotTreeValid) pindexFirstNotTreeValid = NULL;
             if (pindex == pindexFirstNotChainValid) pindexFirstNotChainValid = NULL;
             if (pindex == pindexFirstNotScriptsValid) pindexFirstNotScriptsValid = NULL;
@@ -4496,8 +5348,14 @@ void static ProcessGetData(CNode* pfrom)
                         }
                     }
                 }
-                // Don't send not-validated blocks
-                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
+                // Don't send not-validated blocks. Pruned nodes may have deleted
+                // the block, so check whether it's available before trying to send.
+                if (send && !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+                    if (mi->second->nTx > 0)
+                        LogPrint("net", "ProcessGetData(): ignoring request from peer=%i for pruned block %s\n", pfrom->GetId(), inv.hash.ToString());
+                    send = false;
+                }
+                if (send) {
                     // Send block from disk
                     CBlock block;
                     if (!ReadBlockFromDisk(block, (*mi).second))
@@ -4681,6 +5539,40 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+/** Process a block received from a peer, whole or rebuilt from a compact block, and report it if invalid. */
+void static ProcessBlockFromPeer(CNode* pfrom, CBlock& block)
+{
+    CValidationState state;
+    ProcessNewBlock(state, pfrom, &block);
+    if (state.GetRejectReason() == "stake-pending") {
+        {
+            LOCK(cs_main);
+            AddStakePendingBlock(block, pfrom->GetId());
+        }
+        // Its parent may have been connected since
+        ProcessStakePendingBlocks();
+        return;
+    }
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", (string) "block", state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
+        if (nDoS > 0) {
+            TRY_LOCK(cs_main, lockMain);
+            if (lockMain) Misbehaving(pfrom->GetId(), nDoS);
+        }
+    }
+}
+
+/** Request a block in full from a peer, unless it is in flight already. Requires cs_main. */
+void static RequestFullBlock(CNode* pfrom, CBlockIndex* pindex)
+{
+    if (mapBlocksInFlight.count(pindex->GetBlockHash()))
+        return;
+    MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), pindex);
+    pfrom->PushMessage("getdata", std::vector<CInv>(1, CInv(MSG_BLOCK, pindex->GetBlockHash())));
+}
+
 bool fRequestedSporksIDB = false;
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
@@ -4916,9 +5808,28 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (inv.type == MSG_BLOCK) {
                 UpdateBlockAvailability(pfrom->GetId(), inv.hash);
                 if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
-                    // Add this to the list of blocks to request
-                    vToFetch.push_back(inv);
-                    LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    if (UseHeadersFirst(pfrom)) {
+                        // First request the headers preceding the announced block. In the normal fully-synced
+                        // case where a new block is announced that succeeds the current tip (no reorganization),
+                        // there are no such headers.
+                        // Secondly, and only when we are close to being synced, we request the announced block
+                        // directly, to avoid an extra round-trip. Note that we must *first* ask for the headers,
+                        // so by the time the block arrives, the header chain leading up to it is already validated.
+                        pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
+                        CNodeState* nodestate = State(pfrom->GetId());
+                        if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - Params().TargetSpacing() * 20 &&
+                            nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                            vToFetch.push_back(inv);
+                            // Mark block as in flight already, even though the actual "getdata" message only goes out
+                            // later (within the same cs_main lock, though).
+                            MarkBlockAsInFlight(pfrom->GetId(), inv.hash);
+                        }
+                        LogPrint("net", "getheaders (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    } else {
+                        // Add this to the list of blocks to request
+                        vToFetch.push_back(inv);
+                        LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    }
                 }
             }
 
@@ -4955,7 +5866,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "getblocks" || strCommand == "getheaders") {
+    else if (strCommand == "getblocks") {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -4987,7 +5898,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive()) {
+    else if (strCommand == "getheaders") {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -5146,6 +6057,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
+        // Hash the whole message at once; AcceptBlockHeader then hits the memoized hashes
+        CBlockHeader::PrecomputeHashes(headers.data(), headers.size());
+
         LOCK(cs_main);
 
         if (nCount == 0) {
@@ -5160,10 +6074,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 return error("non-continuous headers sequence");
             }
 
-            /*TODO: this has a CBlock cast on it so that it will compile. There should be a solution for this
-             * before headers are reimplemented on mainnet
-             */
-            if (!AcceptBlockHeader((CBlock)header, state, &pindexLast)) {
+            if (!AcceptHeaderFromPeer(pfrom->GetId(), header, state, &pindexLast)) {
                 int nDoS;
                 if (state.IsInvalid(nDoS)) {
                     if (nDoS > 0)
@@ -5171,13 +6082,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     std::string strError = "invalid header received " + header.GetHash().ToString();
                     return error(strError.c_str());
                 }
+                // The rest is asked for again once the blocks catch up (see SendMessages)
+                LogPrint("net", "too many unverified headers from peer=%d, pausing headers sync\n", pfrom->id);
+                State(pfrom->GetId())->fHeadersThrottled = true;
+                break;
             }
         }
 
         if (pindexLast)
             UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
 
-        if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
+        if (nCount == MAX_HEADERS_RESULTS && pindexLast && !State(pfrom->GetId())->fHeadersThrottled) {
             // Headers message had its maximum size; the peer may have more headers.
             // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
             // from there instead.
@@ -5198,7 +6113,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         //sometimes we will be sent their most recent block and its not the one we want, in that case tell where we are
         if (!mapBlockIndex.count(block.hashPrevBlock)) {
-            if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
+            if (UseHeadersFirst(pfrom)) {
+                // Sync the headers leading to it; the block is then downloaded again
+                LOCK(cs_main);
+                MarkBlockAsReceived(hashBlock);
+                pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), hashBlock);
+            } else if (find(pfrom->vBlockRequested.begin(), pfrom->vBlockRequested.end(), hashBlock) != pfrom->vBlockRequested.end()) {
                 //we already asked for this block, so lets work backwards and ask for the previous block
                 pfrom->PushMessage("getblocks", chainActive.GetLocator(), block.hashPrevBlock);
                 pfrom->vBlockRequested.push_back(block.hashPrevBlock);
@@ -5210,18 +6130,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         } else {
             pfrom->AddInventoryKnown(inv);
 
-            CValidationState state;
-            if (!mapBlockIndex.count(block.GetHash())) {
-                ProcessNewBlock(state, pfrom, &block);
-                int nDoS;
-                if(state.IsInvalid(nDoS)) {
-                    pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                                       state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-                    if(nDoS > 0) {
-                        TRY_LOCK(cs_main, lockMain);
-                        if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
-                    }
-                }
+            // With headers-first sync the index entry exists before the block arrives
+            bool fHaveData;
+            {
+                LOCK(cs_main);
+                BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
+                fHaveData = mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA);
+                if (fHaveData)
+                    MarkBlockAsReceived(hashBlock);
+            }
+
+            if (!fHaveData) {
+                ProcessBlockFromPeer(pfrom, block);
                 //disconnect this node if its old protocol version
                 pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
             } else {
@@ -5231,6 +6151,173 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == "cmpctblock" && UseCompactBlocks(pfrom) && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hashBlock));
+        LogPrint("net", "received cmpctblock %s (%u txn) peer=%d\n", hashBlock.ToString(), cmpctblock.BlockTxCount(), pfrom->id);
+
+        CBlock block;
+        bool fBlockReconstructed = false;
+        {
+            LOCK(cs_main);
+
+            if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock)) {
+                // Sync the headers leading to it; the block is then downloaded in full
+                if (!IsInitialBlockDownload())
+                    pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), hashBlock);
+                return true;
+            }
+
+            // The header counts against the unverified headers of the peer
+            // like one sent in a headers message
+            CBlockIndex* pindex = NULL;
+            CValidationState state;
+            if (!AcceptHeaderFromPeer(pfrom->GetId(), cmpctblock.header, state, &pindex)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS)) {
+                    if (nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS);
+                    return error("invalid header received in cmpctblock %s", hashBlock.ToString());
+                }
+                LogPrint("net", "too many unverified headers from peer=%d, ignoring cmpctblock %s\n", pfrom->id, hashBlock.ToString());
+                return true;
+            }
+            if (pindex == NULL)
+                return true;
+            UpdateBlockAvailability(pfrom->GetId(), hashBlock);
+
+            if ((pindex->nStatus & BLOCK_HAVE_DATA) || pindex->nChainWork <= chainActive.Tip()->nChainWork)
+                return true;
+
+            // Only a block on top of the tip can be rebuilt from the mempool
+            if (pindex->pprev != chainActive.Tip()) {
+                RequestFullBlock(pfrom, pindex);
+                return true;
+            }
+
+            // A block in flight from another peer is only taken from here
+            // if it needs no round-trip
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hashBlock);
+            bool fInFlightElsewhere = itInFlight != mapBlocksInFlight.end() && itInFlight->second.first != pfrom->GetId();
+
+            std::vector<CTransaction> vOrphans;
+            vOrphans.reserve(mapOrphanTransactions.size());
+            for (map<uint256, COrphanTx>::const_iterator mi = mapOrphanTransactions.begin(); mi != mapOrphanTransactions.end(); ++mi)
+                vOrphans.push_back(mi->second.tx);
+
+            boost::shared_ptr<PartiallyDownloadedBlock> pPartialBlock(new PartiallyDownloadedBlock(&mempool));
+            ReadStatus status = pPartialBlock->InitData(cmpctblock, vOrphans);
+            if (status == READ_STATUS_INVALID) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("invalid cmpctblock %s from peer=%d", hashBlock.ToString(), pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                if (!fInFlightElsewhere)
+                    RequestFullBlock(pfrom, pindex);
+                return true;
+            }
+
+            BlockTransactionsRequest req;
+            req.blockhash = hashBlock;
+            for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                if (!pPartialBlock->IsTxAvailable(i))
+                    req.indexes.push_back(i);
+            }
+
+            if (req.indexes.empty()) {
+                status = pPartialBlock->FillBlock(block, std::vector<CTransaction>());
+                if (status == READ_STATUS_OK)
+                    fBlockReconstructed = true;
+                else if (!fInFlightElsewhere)
+                    RequestFullBlock(pfrom, pindex);
+            } else if (!fInFlightElsewhere) {
+                MarkBlockAsInFlight(pfrom->GetId(), hashBlock, pindex);
+                CNodeState* nodestate = State(pfrom->GetId());
+                nodestate->pPartialBlock = pPartialBlock;
+                nodestate->hashPartialBlock = hashBlock;
+                LogPrint("net", "requesting %u txn of cmpctblock %s from peer=%d\n", req.indexes.size(), hashBlock.ToString(), pfrom->id);
+                pfrom->PushMessage("getblocktxn", req);
+            }
+        }
+
+        if (fBlockReconstructed)
+            ProcessBlockFromPeer(pfrom, block);
+    }
+
+
+    else if (strCommand == "getblocktxn" && UseCompactBlocks(pfrom)) {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        {
+            LOCK(cs_main);
+
+            BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+            if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+                LogPrint("net", "peer=%d sent getblocktxn for block %s that we do not have\n", pfrom->id, req.blockhash.ToString());
+                return true;
+            }
+
+            // Older blocks are sent in full: answering with a small blocktxn
+            // would make disk reads cheap to trigger
+            if (mi->second->nHeight >= chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+                CBlock block;
+                if (!ReadBlockFromDisk(block, mi->second))
+                    return error("%s : cannot load block %s from disk", __func__, req.blockhash.ToString());
+
+                BlockTransactions resp(req);
+                for (size_t i = 0; i < req.indexes.size(); i++) {
+                    if (req.indexes[i] >= block.vtx.size()) {
+                        Misbehaving(pfrom->GetId(), 100);
+                        return error("peer=%d sent getblocktxn with out-of-bounds tx indexes", pfrom->id);
+                    }
+                    resp.txn[i] = block.vtx[req.indexes[i]];
+                }
+                pfrom->PushMessage("blocktxn", resp);
+                return true;
+            }
+        }
+
+        pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+        ProcessGetData(pfrom);
+    }
+
+
+    else if (strCommand == "blocktxn" && UseCompactBlocks(pfrom) && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+
+            CNodeState* nodestate = State(pfrom->GetId());
+            if (!nodestate->pPartialBlock || nodestate->hashPartialBlock != resp.blockhash) {
+                LogPrint("net", "peer=%d sent blocktxn for block %s that we did not request\n", pfrom->id, resp.blockhash.ToString());
+                return true;
+            }
+
+            ReadStatus status = nodestate->pPartialBlock->FillBlock(block, resp.txn);
+            nodestate->pPartialBlock.reset();
+            nodestate->hashPartialBlock = uint256(0);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(resp.blockhash);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent blocktxn not matching cmpctblock %s", pfrom->id, resp.blockhash.ToString());
+            } else if (status == READ_STATUS_FAILED) {
+                // Probably a short ID collision; the block stays in flight from this peer
+                pfrom->PushMessage("getdata", std::vector<CInv>(1, CInv(MSG_BLOCK, resp.blockhash)));
+                return true;
+            }
+        }
+
+        ProcessBlockFromPeer(pfrom, block);
+    }
+
+
     // This asymmetric behavior for inbound and outbound connections was introduced
     // to prevent a fingerprinting attack: an attacker can send specific fake addresses
     // to users' AddrMan and later request them by sending getaddr messages.
@@ -5695,13 +6782,30 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             if (nSyncStarted == 0 || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 6 * 60 * 60) { // NOTE: was "close to today" and 24h in Bitcoin
                 state.fSyncStarted = true;
                 nSyncStarted++;
-                //CBlockIndex *pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
-                //LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
-                //pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
-                pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                if (UseHeadersFirst(pto)) {
+                    // The headers sync must progress at the pace of the headers still missing up to now
+                    state.nHeadersSyncTimeout = GetTimeMicros() + HEADERS_DOWNLOAD_TIMEOUT_BASE +
+                        HEADERS_DOWNLOAD_TIMEOUT_PER_HEADER * (GetAdjustedTime() - pindexBestHeader->GetBlockTime()) / Params().TargetSpacing();
+                    CBlockIndex* pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
+                    LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
+                    pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
+                } else {
+                    state.nHeadersSyncTimeout = std::numeric_limits<int64_t>::max();
+                    pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                }
             }
         }
 
+        // Resume headers sync once the blocks caught up with the headers of this peer
+        if (state.fHeadersThrottled && CountUnverifiedHeaders(state.vUnverifiedHeaders) <= MAX_UNVERIFIED_HEADERS_PER_PEER / 2) {
+            state.fHeadersThrottled = false;
+            if (state.nHeadersSyncTimeout < std::numeric_limits<int64_t>::max())
+                state.nHeadersSyncTimeout = GetTimeMicros() + HEADERS_DOWNLOAD_TIMEOUT_BASE +
+                    HEADERS_DOWNLOAD_TIMEOUT_PER_HEADER * (GetAdjustedTime() - pindexBestHeader->GetBlockTime()) / Params().TargetSpacing();
+            LogPrint("net", "resuming getheaders (%d) to peer=%d\n", pindexBestHeader->nHeight, pto->id);
+            pto->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256(0));
+        }
+
         // Resend wallet transactions that haven't gotten in a block yet
         // Except during reindex, importing and IBD, when old wallet
         // transactions become unconfirmed and spams other nodes.
@@ -5770,6 +6874,31 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             LogPrintf("Timeout downloading block %s from peer=%d, disconnecting\n", state.vBlocksInFlight.front().hash.ToString(), pto->id);
             pto->fDisconnect = true;
         }
+        // Check for headers sync timeouts
+        if (!pto->fDisconnect && state.fSyncStarted && !state.fHeadersThrottled && state.nHeadersSyncTimeout < std::numeric_limits<int64_t>::max()) {
+            // Detect whether this is a stalling initial-headers-sync peer
+            if (pindexBestHeader->GetBlockTime() <= GetAdjustedTime() - 6 * 60 * 60) {
+                if (nNow > state.nHeadersSyncTimeout && nSyncStarted == 1 && (nPreferredDownload - state.fPreferredDownload >= 1)) {
+                    // Disconnect a (non-whitelisted) peer if it is our only sync peer,
+                    // and we have others we could be using instead.
+                    if (!pto->fWhitelisted) {
+                        LogPrintf("Timeout downloading headers from peer=%d, disconnecting\n", pto->id);
+                        pto->fDisconnect = true;
+                    } else {
+                        LogPrintf("Timeout downloading headers from whitelisted peer=%d, not disconnecting\n", pto->id);
+                        // Reset the headers sync state so that we have a
+                        // chance to try downloading from a different peer.
+                        state.fSyncStarted = false;
+                        nSyncStarted--;
+                        state.nHeadersSyncTimeout = 0;
+                    }
+                }
+            } else {
+                // After we've caught up once, reset the timeout so we can't trigger
+                // disconnect later.
+                state.nHeadersSyncTimeout = std::numeric_limits<int64_t>::max();
+            }
+        }
 
         //
         // Message: getdata (blocks)
@@ -42,12 +42,18 @@
 #include <utility>
 #include <vector>
 
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/unordered_map.hpp>
 
+class CBlockFileInfo;
 class CBlockIndex;
 class CBlockTreeDB;
 class CSporkDB;
 class CBloomFilter;
+class CCoinsViewAsyncWriter;
+class CCoinsViewDB;
+class CCoinsViewPrefetch;
 class CInv;
 class CScriptCheck;
 class CValidationInterface;
@@ -79,6 +85,10 @@ static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** Block files containing a block within this many blocks of the tip (or -maxreorg, if larger) are never pruned */
+static const unsigned int MIN_BLOCKS_TO_KEEP = 288;
+/** Minimum -prune target: the last block file, its undo file and the pre-allocation headroom must fit */
+static const uint64_t MIN_DISK_SPACE_FOR_BLOCK_FILES = 550 * 1024 * 1024;
 /** Coinbase transaction outputs can only be spent after this number of new blocks (network rule) */
 static const int COINBASE_MATURITY = 100;
 /** Default for -blockspamfilter, use header spam filter */
@@ -89,17 +99,29 @@ static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Default for -parcheckblock, run the context-free block checks on the script-checking threads */
+static const bool DEFAULT_PARALLEL_CHECKBLOCK = true;
 /** Number of blocks that can be requested at any given time from a single peer. */
-static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 512;
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Default for -blockspamfiltermaxsize, maximum size of the list of indexes in the block spam filter */
 static const unsigned int DEFAULT_BLOCK_SPAM_FILTER_MAX_SIZE = COINBASE_MATURITY;
 /** Default for -blockspamfiltermaxavg, maximum average size of an index occurrence in the block spam filter */
 static const unsigned int DEFAULT_BLOCK_SPAM_FILTER_MAX_AVG = 10;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
+/** Headers download timeout expressed in microseconds
+ *  Timeout = base + per_header * (expected number of headers) */
+static const int64_t HEADERS_DOWNLOAD_TIMEOUT_BASE = 15 * 60 * 1000000; // 15 minutes
+static const int64_t HEADERS_DOWNLOAD_TIMEOUT_PER_HEADER = 1000; // 1ms/header
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached their tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Number of proof-of-stake headers a single peer may add ahead of their blocks, whose stake is not checked yet. */
+static const unsigned int MAX_UNVERIFIED_HEADERS_PER_PEER = 2 * MAX_HEADERS_RESULTS;
+/** Number of proof-of-stake blocks from a single peer kept in memory until their stake can be checked. */
+static const unsigned int MAX_STAKE_PENDING_BLOCKS_PER_PEER = MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+/** Number of proof-of-stake blocks from all peers kept in memory until their stake can be checked. */
+static const unsigned int MAX_STAKE_PENDING_BLOCKS = 4 * MAX_BLOCKS_IN_TRANSIT_PER_PEER;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
@@ -107,6 +129,8 @@ static const unsigned int MAX_HEADERS_RESULTS = 2000;
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 /** Time to wait (in seconds) between writing blockchain state to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 3600;
+/** Depth up to which getblocktxn requests are answered with blocktxn, rather than with the full block. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 
@@ -141,10 +165,17 @@ extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+extern bool fParallelCheckBlock;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
-extern unsigned int nCoinCacheSize;
+extern size_t nCoinCacheUsage;
+/** True if any block files have ever been pruned. */
+extern bool fHavePruned;
+/** True if we're running in -prune mode. */
+extern bool fPruneMode;
+/** Number of bytes of block and undo files that we try to stay below. */
+extern uint64_t nPruneTarget;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
 
@@ -200,8 +231,29 @@ FILE* OpenBlockFile(const CDiskBlockPos& pos, bool fReadOnly = false);
 FILE* OpenUndoFile(const CDiskBlockPos& pos, bool fReadOnly = false);
 /** Translation to a filesystem path */
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos& pos, const char* prefix);
-/** Import blocks from an external file */
-bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp = NULL);
+/** A block read by an import before its parent: in memory, or else its position in a block file */
+struct CUnknownParentBlock {
+    boost::shared_ptr<CBlock> pblock;
+    uint64_t nSize;
+    CDiskBlockPos pos;
+
+    CUnknownParentBlock() : nSize(0) {}
+};
+
+/**
+ * The blocks an import read before their parents, by parent hash, and the
+ * bytes of those kept in memory. An import shares them across its files and
+ * frees them when it is done.
+ */
+struct CUnknownParentBlocks {
+    std::multimap<uint256, CUnknownParentBlock> mapBlocks;
+    uint64_t nBytes;
+
+    CUnknownParentBlocks() : nBytes(0) {}
+};
+
+/** Import blocks from an external file; blocks still missing their parent at the end stay in pUnknownParents, if given */
+bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos* dbp = NULL, CUnknownParentBlocks* pUnknownParents = NULL);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
@@ -254,6 +306,17 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats& stats);
 void Misbehaving(NodeId nodeid, int howmuch);
 /** Flush all state, indexes and buffers to disk. */
 void FlushStateToDisk();
+/** Prune block files and flush state to disk. */
+void PruneAndFlush();
+/** Calculate the amount of disk space the block & undo files currently use */
+uint64_t CalculateCurrentUsage();
+/**
+ * Choose the oldest block files, below nLastFile, to delete until the files in
+ * vinfo fit in nTarget again. Files with a block above nLastBlockWeCanPrune are kept.
+ */
+void FindFilesToPrune(const std::vector<CBlockFileInfo>& vinfo, const int nLastFile, const unsigned int nLastBlockWeCanPrune, const uint64_t nTarget, std::set<int>& setFilesToPrune);
+/** Mark the blocks of a block file in mapIndex as pruned and return them in vPruned */
+void PruneBlockFileIndex(const BlockMap& mapIndex, const int fileNumber, std::vector<CBlockIndex*>& vPruned);
 
 
 /** (try to) add transaction to memory pool **/
@@ -402,11 +465,14 @@ private:
     unsigned int nFlags;
     bool cacheStore;
     ScriptError error;
+    boost::function<bool()> fnCheck;
 
 public:
     CScriptCheck() : ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
     CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) : scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
                                                                                                                                 ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
+    /** A context-free block check to run on the script-checking threads instead of a script */
+    explicit CScriptCheck(const boost::function<bool()>& fnCheckIn) : ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR), fnCheck(fnCheckIn) {}
 
     bool operator()();
 
@@ -418,6 +484,7 @@ public:
         std::swap(nFlags, check.nFlags);
         std::swap(cacheStore, check.cacheStore);
         std::swap(error, check.error);
+        fnCheck.swap(check.fnCheck);
     }
 
     ScriptError GetScriptError() const { return error; }
@@ -447,7 +514,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 /** Context-independent validity checks */
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true, bool fCheckSig = true);
-bool CheckWork(const CBlock block, CBlockIndex* const pindexPrev);
+bool CheckWork(const CBlock& block, CBlockIndex* const pindexPrev, bool fCheckStake = true);
 
 /** Context-dependent validity checks */
 bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex* pindexPrev);
@@ -458,7 +525,7 @@ bool TestBlockValidity(CValidationState& state, const CBlock& block, CBlockIndex
 
 /** Store block on disk. If dbp is provided, the file is known to already reside on disk */
 bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** pindex, CDiskBlockPos* dbp = NULL, bool fAlreadyCheckedBlock = false);
-bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex = NULL);
+bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex** ppindex = NULL);
 
 
 class CBlockFileInfo
@@ -616,6 +683,15 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache* pcoinsTip;
 
+/** Global variable that points to the coins prefetcher below pcoinsTip, if enabled (protected by cs_main) */
+extern CCoinsViewPrefetch* pcoinsPrefetch;
+
+/** Global variable that points to the background chainstate writer below pcoinsTip, if enabled (protected by cs_main) */
+extern CCoinsViewAsyncWriter* pcoinsAsyncWriter;
+
+/** Global variable that points to the coin database at the bottom of the view chain (protected by cs_main) */
+extern CCoinsViewDB* pcoinsdbview;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB* pblocktree;
 
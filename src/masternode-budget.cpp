@@ -39,6 +39,18 @@ int GetBudgetPaymentCycleBlocks()
     return 144; //ten times per day
 }
 
+bool IsBudgetCollateralTx(const CTransaction& tx)
+{
+    BOOST_FOREACH (const CTxOut& o, tx.vout) {
+        // OP_RETURN followed by a push of the 32 byte hash
+        const CScript& script = o.scriptPubKey;
+        if (script.size() == 34 && script[0] == OP_RETURN && script[1] == 32 &&
+            o.nValue >= std::min(PROPOSAL_FEE_TX, BUDGET_FEE_TX))
+            return true;
+    }
+    return false;
+}
+
 bool IsBudgetCollateralValid(uint256 nTxCollateralHash, uint256 nExpectedHash, std::string& strError, int64_t& nTime, int& nConf)
 {
     CTransaction txCollateral;
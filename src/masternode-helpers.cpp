@@ -55,12 +55,14 @@ bool CMasternodeSigner::IsVinAssociatedWithPubkey(CTxIn& vin, CPubKey& pubkey)
 
     CAmount collateral = 7500 * COIN;
 
-    CTransaction txVin;
-    uint256 hash;
-    if (GetTransaction(vin.prevout.hash, txVin, hash, true)) {
-        BlockMap::iterator iter = mapBlockIndex.find(hash);
-        if (iter != mapBlockIndex.end()) {
-                int txnheight = iter->second->nHeight;
+    // The collateral is looked up in the UTXO set, which pruned nodes keep
+    // too, and otherwise in the mempool
+    std::vector<CTxOut> vout;
+    {
+        LOCK(cs_main);
+        const CCoins* coins = pcoinsTip->AccessCoins(vin.prevout.hash);
+        if (coins != NULL) {
+                int txnheight = coins->nHeight;
 
                 if (txnheight <= GetSporkValue(SPORK_19_COLLAT_01)) {
                     collateral = 10000 * COIN;
@@ -106,12 +108,18 @@ bool CMasternodeSigner::IsVinAssociatedWithPubkey(CTxIn& vin, CPubKey& pubkey)
                     collateral = 200000 * COIN;
                 }
 
+                vout = coins->vout;
+        } else {
+            CTransaction txVin;
+            if (!mempool.lookup(vin.prevout.hash, txVin))
+                return false;
+            vout = txVin.vout;
         }
+    }
 
-        BOOST_FOREACH (CTxOut out, txVin.vout) {
-            if (out.nValue == collateral) {
-                if (out.scriptPubKey == payee2) return true;
-            }
+    BOOST_FOREACH (const CTxOut& out, vout) {
+        if (out.nValue == collateral) {
+            if (out.scriptPubKey == payee2) return true;
         }
     }
 
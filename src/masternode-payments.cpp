@@ -504,13 +504,60 @@ bool CMasternodePayments::AddWinningMasternode(CMasternodePaymentWinner& winnerI
             CMasternodeBlockPayees blockPayees(winnerIn.nBlockHeight);
             mapMasternodeBlocks[winnerIn.nBlockHeight] = blockPayees;
         }
-    }
 
-    mapMasternodeBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, 1);
+        mapMasternodeBlocks[winnerIn.nBlockHeight].AddPayee(winnerIn.payee, 1);
+        if (mapMasternodeBlocks[winnerIn.nBlockHeight].HasPayeeWithVotes(winnerIn.payee, 2))
+            mapPayeeBlocks[winnerIn.payee].insert(winnerIn.nBlockHeight);
+    }
 
     return true;
 }
 
+int CMasternodePayments::GetLastPaidHeight(const CScript& payee, int nHeightMax, int nHeightMin)
+{
+    LOCK(cs_mapMasternodeBlocks);
+
+    std::map<CScript, std::set<int> >::const_iterator it = mapPayeeBlocks.find(payee);
+    if (it == mapPayeeBlocks.end())
+        return -1;
+
+    // the first height above nHeightMax, then the one before it
+    std::set<int>::const_iterator itHeight = it->second.upper_bound(nHeightMax);
+    if (itHeight == it->second.begin() || *--itHeight <= nHeightMin)
+        return -1;
+    return *itHeight;
+}
+
+void CMasternodePayments::IndexBlockPayees(int nBlockHeight)
+{
+    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.find(nBlockHeight);
+    if (it == mapMasternodeBlocks.end())
+        return;
+
+    LOCK(cs_vecPayments);
+    BOOST_FOREACH (CMasternodePayee& payee, it->second.vecPayments) {
+        if (payee.nVotes >= 2)
+            mapPayeeBlocks[payee.scriptPubKey].insert(nBlockHeight);
+    }
+}
+
+void CMasternodePayments::UnindexBlockPayees(int nBlockHeight)
+{
+    std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.find(nBlockHeight);
+    if (it == mapMasternodeBlocks.end())
+        return;
+
+    LOCK(cs_vecPayments);
+    BOOST_FOREACH (CMasternodePayee& payee, it->second.vecPayments) {
+        std::map<CScript, std::set<int> >::iterator itPayee = mapPayeeBlocks.find(payee.scriptPubKey);
+        if (itPayee == mapPayeeBlocks.end())
+            continue;
+        itPayee->second.erase(nBlockHeight);
+        if (itPayee->second.empty())
+            mapPayeeBlocks.erase(itPayee);
+    }
+}
+
 bool CMasternodeBlockPayees::IsTransactionValid(const CTransaction& txNew)
 {
     LOCK(cs_vecPayments);
@@ -638,6 +685,7 @@ void CMasternodePayments::CleanPaymentList()
             LogPrint("mnpayments", "CMasternodePayments::CleanPaymentList - Removing old Masternode payment - block %d\n", winner.nBlockHeight);
             masternodeSync.mapSeenSyncMNW.erase((*it).first);
             mapMasternodePayeeVotes.erase(it++);
+            UnindexBlockPayees(winner.nBlockHeight);
             mapMasternodeBlocks.erase(winner.nBlockHeight);
         } else {
             ++it;
@@ -242,6 +242,8 @@ public:
     std::map<uint256, CMasternodePaymentWinner> mapMasternodePayeeVotes;
     std::map<int, CMasternodeBlockPayees> mapMasternodeBlocks;
     std::map<uint256, int> mapMasternodesLastVote; //prevout.hash + prevout.n, nBlockHeight
+    // the heights at which each payee is scheduled with at least two votes, from mapMasternodeBlocks
+    std::map<CScript, std::set<int> > mapPayeeBlocks;
 
     CMasternodePayments()
     {
@@ -253,6 +255,7 @@ public:
     {
         LOCK2(cs_mapMasternodeBlocks, cs_mapMasternodePayeeVotes);
         mapMasternodeBlocks.clear();
+        mapPayeeBlocks.clear();
         mapMasternodePayeeVotes.clear();
     }
 
@@ -262,6 +265,10 @@ public:
     void Sync(CNode* node, int nCountNeeded);
     void CleanPaymentList();
     int LastPayment(CMasternode& mn);
+    /// The last height in (nHeightMin, nHeightMax] at which the payee is scheduled with at least two votes, or -1
+    int GetLastPaidHeight(const CScript& payee, int nHeightMax, int nHeightMin);
+    void IndexBlockPayees(int nBlockHeight);
+    void UnindexBlockPayees(int nBlockHeight);
 
     bool GetBlockPayee(int nBlockHeight, CScript& payee);
     bool IsTransactionValid(const CTransaction& txNew, int nBlockHeight);
@@ -297,6 +304,12 @@ public:
     {
         READWRITE(mapMasternodePayeeVotes);
         READWRITE(mapMasternodeBlocks);
+        if (ser_action.ForRead()) {
+            LOCK(cs_mapMasternodeBlocks);
+            mapPayeeBlocks.clear();
+            for (std::map<int, CMasternodeBlockPayees>::iterator it = mapMasternodeBlocks.begin(); it != mapMasternodeBlocks.end(); ++it)
+                IndexBlockPayees(it->first);
+        }
     }
 };
 
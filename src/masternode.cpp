@@ -19,48 +19,69 @@
 
 // keep track of the scanning errors I've seen
 map<uint256, int> mapSeenMasternodeScanningErrors;
-// cache block hashes as we calculate them
-std::map<int64_t, uint256> mapCacheBlockHashes;
+// cache block hashes as we calculate them, for the tip they were calculated on
+static CCriticalSection cs_mapCacheBlockHashes;
+static uint256 hashCacheBlockHashesTip = 0;
+static std::map<int64_t, uint256> mapCacheBlockHashes;
 
-//Get the last hash that matches the modulus given. Processed in reverse order
+//Get the hash of the block before the given height, or before the tip for height 0
 bool GetBlockHash(uint256& hash, int nBlockHeight)
 {
-    if (chainActive.Tip() == NULL) return false;
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    if (pindexTip == NULL || pindexTip->nHeight == 0 || pindexTip->nHeight + 1 < nBlockHeight) return false;
 
     if (nBlockHeight == 0)
-        nBlockHeight = chainActive.Tip()->nHeight;
+        nBlockHeight = pindexTip->nHeight;
 
-    if (mapCacheBlockHashes.count(nBlockHeight)) {
-        hash = mapCacheBlockHashes[nBlockHeight];
-        return true;
-    }
-
-    const CBlockIndex* BlockLastSolved = chainActive.Tip();
-    const CBlockIndex* BlockReading = chainActive.Tip();
+    LOCK(cs_mapCacheBlockHashes);
 
-    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || chainActive.Tip()->nHeight + 1 < nBlockHeight) return false;
+    // A new tip may have reorganized any of the blocks
+    if (hashCacheBlockHashesTip != pindexTip->GetBlockHash()) {
+        hashCacheBlockHashesTip = pindexTip->GetBlockHash();
+        mapCacheBlockHashes.clear();
+    }
 
-    int nBlocksAgo = 0;
-    if (nBlockHeight > 0) nBlocksAgo = (chainActive.Tip()->nHeight + 1) - nBlockHeight;
-    assert(nBlocksAgo >= 0);
+    std::map<int64_t, uint256>::iterator it = mapCacheBlockHashes.find(nBlockHeight);
+    if (it != mapCacheBlockHashes.end()) {
+        hash = it->second;
+        return true;
+    }
 
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if (n >= nBlocksAgo) {
-            hash = BlockReading->GetBlockHash();
-            mapCacheBlockHashes[nBlockHeight] = hash;
-            return true;
-        }
-        n++;
+    // The genesis block never counts
+    int nHeight = nBlockHeight > 0 ? nBlockHeight - 1 : pindexTip->nHeight;
+    if (nHeight <= 0) return false;
 
-        if (BlockReading->pprev == NULL) {
-            assert(BlockReading);
-            break;
-        }
-        BlockReading = BlockReading->pprev;
-    }
+    hash = pindexTip->GetAncestor(nHeight)->GetBlockHash();
+    mapCacheBlockHashes[nBlockHeight] = hash;
+    return true;
+}
 
-    return false;
+CAmount GetMasternodeCollateral(int nHeight)
+{
+    if (nHeight <= GetSporkValue(SPORK_19_COLLAT_01)) {
+        return 10000 * COIN;
+    } else if (nHeight <= GetSporkValue(SPORK_20_COLLAT_02)) {
+        return 15000 * COIN;
+    } else if (nHeight <= GetSporkValue(SPORK_21_COLLAT_03)) {
+        return 20000 * COIN;
+    } else if (nHeight <= GetSporkValue(SPORK_22_COLLAT_04)) {
+        return 30000 * COIN;
+    } else if (nHeight <= GetSporkValue(SPORK_23_COLLAT_05)) {
+        return 40000 * COIN;
+    } else if (nHeight <= GetSporkValue(SPORK_24_COLLAT_06)) {
+        return 50000 * COIN;
+    } else if (nHeight <= GetSporkValue(SPORK_25_COLLAT_07)) {
+        return 60000 * COIN;
+    } else if (nHeight <= GetSporkValue(SPORK_26_COLLAT_08)) {
+        return 70000 * COIN;
+    } else if (nHeight <= GetSporkValue(SPORK_27_COLLAT_09)) {
+        return 80000 * COIN;
+    } else if (nHeight <= GetSporkValue(SPORK_28_COLLAT_10)) {
+        return 90000 * COIN;
+    } else if (nHeight <= GetSporkValue(SPORK_29_COLLAT_11)) {
+        return 100000 * COIN;
+    }
+    return 7500 * COIN;
 }
 
 CMasternode::CMasternode()
@@ -144,8 +165,12 @@ CMasternode::CMasternode(const CMasternodeBroadcast& mnb)
 bool CMasternode::UpdateFromNewBroadcast(CMasternodeBroadcast& mnb)
 {
     if (mnb.sigTime > sigTime) {
+        // the masternode list indexes its entries by these keys
+        bool fIndexed = mnodeman.UnindexKeys(*this);
         pubKeyMasternode = mnb.pubKeyMasternode;
         pubKeyCollateralAddress = mnb.pubKeyCollateralAddress;
+        if (fIndexed)
+            mnodeman.IndexKeys(*this);
         sigTime = mnb.sigTime;
         sig = mnb.sig;
         protocolVersion = mnb.protocolVersion;
@@ -215,66 +240,21 @@ void CMasternode::Check(bool forceCheck)
     }
 
     if (!unitTest) {
-        CValidationState state;
-        CMutableTransaction tx = CMutableTransaction();
-
-        CAmount collateral = 7500 * COIN;
-        CTransaction wtx2;
-        uint256 hashBlock2;
-        if(GetTransaction(vin.prevout.hash, wtx2, hashBlock2, true)) {
-            BlockMap::iterator iter = mapBlockIndex.find(hashBlock2);
-            if (iter != mapBlockIndex.end()) {
-                int txnheight = iter->second->nHeight;
-                if (txnheight <= GetSporkValue(SPORK_19_COLLAT_01)) {
-                    collateral = 10000 * COIN;
-                } else if (txnheight <= GetSporkValue(SPORK_20_COLLAT_02)) {
-                    collateral = 15000 * COIN;
-                } else if (txnheight <= GetSporkValue(SPORK_21_COLLAT_03)) {
-                    collateral = 20000 * COIN;
-                } else if (txnheight <= GetSporkValue(SPORK_22_COLLAT_04)) {
-                    collateral = 30000 * COIN;
-                } else if (txnheight <= GetSporkValue(SPORK_23_COLLAT_05)) {
-                    collateral = 40000 * COIN;
-                } else if (txnheight <= GetSporkValue(SPORK_24_COLLAT_06)) {
-                    collateral = 50000 * COIN;
-                } else if (txnheight <= GetSporkValue(SPORK_25_COLLAT_07)) {
-                    collateral = 60000 * COIN;
-                } else if (txnheight <= GetSporkValue(SPORK_26_COLLAT_08)) {
-                    collateral = 70000 * COIN;
-                } else if (txnheight <= GetSporkValue(SPORK_27_COLLAT_09)) {
-                    collateral = 80000 * COIN;
-                } else if (txnheight <= GetSporkValue(SPORK_28_COLLAT_10)) {
-                    collateral = 90000 * COIN;
-                } else if (txnheight <= GetSporkValue(SPORK_29_COLLAT_11)) {
-                    collateral = 100000 * COIN;
-                }
-            }
-        }
-
-        CTxOut vout = CTxOut(collateral - 0.01, masternodeSigner.collateralPubKey);
-        tx.vin.push_back(vin);
-        tx.vout.push_back(vout);
-
-        {
-            TRY_LOCK(cs_main, lockMain);
-            if (!lockMain) return;
+        CMasternodeCollateral collateral;
+        if (!mnodeman.GetCollateral(vin.prevout, collateral)) return;
 
-            if (!AcceptableInputs(mempool, state, CTransaction(tx), false, NULL)) {
-                activeState = MASTERNODE_VIN_SPENT;
-                return;
-            }
+        if (!collateral.fAvailable || collateral.nValue < GetMasternodeCollateral(collateral.nHeight)) {
+            activeState = MASTERNODE_VIN_SPENT;
+            return;
         }
     }
 
     activeState = MASTERNODE_ENABLED; // OK
 }
 
-int64_t CMasternode::SecondsSincePayment()
+int64_t CMasternode::SecondsSincePayment(int nMnCount)
 {
-    CScript pubkeyScript;
-    pubkeyScript = GetScriptForDestination(pubKeyCollateralAddress.GetID());
-
-    int64_t sec = (GetAdjustedTime() - GetLastPaid());
+    int64_t sec = (GetAdjustedTime() - GetLastPaid(nMnCount));
     int64_t month = 60 * 60 * 24 * 30;
     if (sec < month) return sec; //if it's less than 30 days, give seconds
 
@@ -287,7 +267,7 @@ int64_t CMasternode::SecondsSincePayment()
     return month + hash.GetCompact(false);
 }
 
-int64_t CMasternode::GetLastPaid()
+int64_t CMasternode::GetLastPaid(int nMnCount)
 {
     CBlockIndex* pindexPrev = chainActive.Tip();
     if (pindexPrev == NULL) return false;
@@ -303,36 +283,18 @@ int64_t CMasternode::GetLastPaid()
     // use a deterministic offset to break a tie -- 2.5 minutes
     int64_t nOffset = hash.GetCompact(false) % 150;
 
-    if (chainActive.Tip() == NULL) return false;
-
-    const CBlockIndex* BlockReading = chainActive.Tip();
+    if (nMnCount < 0)
+        nMnCount = mnodeman.CountEnabled();
+    int nBlocks = nMnCount * 1.25;
 
-    int nMnCount = mnodeman.CountEnabled() * 1.25;
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if (n >= nMnCount) {
-            return 0;
-        }
-        n++;
-
-        if (masternodePayments.mapMasternodeBlocks.count(BlockReading->nHeight)) {
-            /*
-                Search for this payee, with at least 2 votes. This will aid in consensus allowing the network
-                to converge on the same payees quickly, then keep the same schedule.
-            */
-            if (masternodePayments.mapMasternodeBlocks[BlockReading->nHeight].HasPayeeWithVotes(mnpayee, 2)) {
-                return BlockReading->nTime + nOffset;
-            }
-        }
+    /*
+        Search for this payee, with at least 2 votes. This will aid in consensus allowing the network
+        to converge on the same payees quickly, then keep the same schedule.
+    */
+    int nHeight = masternodePayments.GetLastPaidHeight(mnpayee, pindexPrev->nHeight, std::max(pindexPrev->nHeight - nBlocks, 0));
+    if (nHeight < 0) return 0;
 
-        if (BlockReading->pprev == NULL) {
-            assert(BlockReading);
-            break;
-        }
-        BlockReading = BlockReading->pprev;
-    }
-
-    return 0;
+    return pindexPrev->GetAncestor(nHeight)->nTime + nOffset;
 }
 
 std::string CMasternode::GetStatus()
@@ -612,39 +574,19 @@ bool CMasternodeBroadcast::CheckInputsAndAdd(int& nDoS)
     CValidationState state;
     CMutableTransaction tx = CMutableTransaction();
 
-    CAmount collateral = 7500 * COIN;
-    CTransaction wtx2;
-    uint256 hashBlock2;
-    if(GetTransaction(vin.prevout.hash, wtx2, hashBlock2, true)) {
-        BlockMap::iterator iter = mapBlockIndex.find(hashBlock2);
-        if (iter != mapBlockIndex.end()) {
-            int txnheight = iter->second->nHeight;
-                if (txnheight <= GetSporkValue(SPORK_19_COLLAT_01)) {
-                    collateral = 10000 * COIN;
-                } else if (txnheight <= GetSporkValue(SPORK_20_COLLAT_02)) {
-                    collateral = 15000 * COIN;
-                } else if (txnheight <= GetSporkValue(SPORK_21_COLLAT_03)) {
-                    collateral = 20000 * COIN;
-                } else if (txnheight <= GetSporkValue(SPORK_22_COLLAT_04)) {
-                    collateral = 30000 * COIN;
-                } else if (txnheight <= GetSporkValue(SPORK_23_COLLAT_05)) {
-                    collateral = 40000 * COIN;
-                } else if (txnheight <= GetSporkValue(SPORK_24_COLLAT_06)) {
-                    collateral = 50000 * COIN;
-                } else if (txnheight <= GetSporkValue(SPORK_25_COLLAT_07)) {
-                    collateral = 60000 * COIN;
-                } else if (txnheight <= GetSporkValue(SPORK_26_COLLAT_08)) {
-                    collateral = 70000 * COIN;
-                } else if (txnheight <= GetSporkValue(SPORK_27_COLLAT_09)) {
-                    collateral = 80000 * COIN;
-                } else if (txnheight <= GetSporkValue(SPORK_28_COLLAT_10)) {
-                    collateral = 90000 * COIN;
-                } else if (txnheight <= GetSporkValue(SPORK_29_COLLAT_11)) {
-                    collateral = 100000 * COIN;
-                }
-        }
+    // The collateral is looked up in the UTXO set, which pruned nodes keep too
+    CMasternodeCollateral mnCollateral;
+    if (!mnodeman.GetCollateral(vin.prevout, mnCollateral)) {
+        // not mnb fault, let it to be checked again later
+        mnodeman.mapSeenMasternodeBroadcast.erase(GetHash());
+        masternodeSync.mapSeenSyncMNB.erase(GetHash());
+        return false;
     }
 
+    CAmount collateral = 7500 * COIN;
+    if (mnCollateral.nHeight > 0)
+        collateral = GetMasternodeCollateral(mnCollateral.nHeight);
+
     CTxOut vout = CTxOut(collateral - 0.01, masternodeSigner.collateralPubKey);
     tx.vin.push_back(vin);
     tx.vout.push_back(vout);
@@ -677,14 +619,10 @@ bool CMasternodeBroadcast::CheckInputsAndAdd(int& nDoS)
 
     // verify that sig time is legit in past
     // should be at least not earlier than block when 1000 HASH tx got MASTERNODE_MIN_CONFIRMATIONS
-    uint256 hashBlock = 0;
-    CTransaction tx2;
-    GetTransaction(vin.prevout.hash, tx2, hashBlock, true);
-    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
-    if (mi != mapBlockIndex.end() && (*mi).second) {
-        CBlockIndex* pMNIndex = (*mi).second;                                                        // block for 1000 PIVX tx -> 1 confirmation
-        CBlockIndex* pConfIndex = chainActive[pMNIndex->nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
-        if (pConfIndex->GetBlockTime() > sigTime) {
+    if (mnCollateral.nHeight > 0) {
+        // the collateral's block is 1 confirmation
+        CBlockIndex* pConfIndex = chainActive[mnCollateral.nHeight + MASTERNODE_MIN_CONFIRMATIONS - 1]; // block where tx got MASTERNODE_MIN_CONFIRMATIONS
+        if (pConfIndex != NULL && pConfIndex->GetBlockTime() > sigTime) {
             LogPrint("masternode","mnb - Bad sigTime %d for Masternode %s (%i conf block is at %d)\n",
                 sigTime, vin.prevout.hash.ToString(), MASTERNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
             return false;
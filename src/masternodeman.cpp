@@ -196,6 +196,78 @@ CMasternodeMan::CMasternodeMan()
 {
 }
 
+void CMasternodeMan::AddMasternode(const CMasternode& mn)
+{
+    mapRanksCache.clear();
+    if (mapMasternodesByVin.count(mn.vin.prevout))
+        return;
+    std::list<CMasternode>::iterator it = listMasternodes.insert(listMasternodes.end(), mn);
+    mapMasternodesByVin[mn.vin.prevout] = it;
+    IndexKeys(*it);
+}
+
+void CMasternodeMan::RemoveMasternode(std::list<CMasternode>::iterator it)
+{
+    mapRanksCache.clear();
+    UnindexKeys(*it);
+    mapMasternodesByVin.erase(it->vin.prevout);
+    {
+        LOCK(cs_collaterals);
+        mapCollaterals.erase(it->vin.prevout);
+    }
+    listMasternodes.erase(it);
+}
+
+void CMasternodeMan::ClearMasternodes()
+{
+    mapRanksCache.clear();
+    listMasternodes.clear();
+    mapMasternodesByVin.clear();
+    mapMasternodesByPayee.clear();
+    mapMasternodesByPubKey.clear();
+    LOCK(cs_collaterals);
+    mapCollaterals.clear();
+}
+
+static void EraseMasternodeFromIndex(boost::unordered_multimap<CKeyID, CMasternode*, MasternodeKeyIDHasher>& mapIndex, const CKeyID& keyID, const CMasternode* pmn)
+{
+    typedef boost::unordered_multimap<CKeyID, CMasternode*, MasternodeKeyIDHasher>::iterator Iterator;
+    std::pair<Iterator, Iterator> range = mapIndex.equal_range(keyID);
+    for (Iterator it = range.first; it != range.second; ++it) {
+        if (it->second == pmn) {
+            mapIndex.erase(it);
+            return;
+        }
+    }
+}
+
+bool CMasternodeMan::UnindexKeys(const CMasternode& mn)
+{
+    LOCK(cs);
+
+    // Only entries of the list are indexed, not copies of them
+    boost::unordered_map<COutPoint, std::list<CMasternode>::iterator, MasternodeOutPointHasher>::iterator it = mapMasternodesByVin.find(mn.vin.prevout);
+    if (it == mapMasternodesByVin.end() || &*it->second != &mn)
+        return false;
+
+    EraseMasternodeFromIndex(mapMasternodesByPayee, mn.pubKeyCollateralAddress.GetID(), &mn);
+    EraseMasternodeFromIndex(mapMasternodesByPubKey, mn.pubKeyMasternode.GetID(), &mn);
+    return true;
+}
+
+void CMasternodeMan::IndexKeys(const CMasternode& mn)
+{
+    LOCK(cs);
+
+    boost::unordered_map<COutPoint, std::list<CMasternode>::iterator, MasternodeOutPointHasher>::iterator it = mapMasternodesByVin.find(mn.vin.prevout);
+    if (it == mapMasternodesByVin.end() || &*it->second != &mn)
+        return;
+
+    CMasternode* pmn = &*it->second;
+    mapMasternodesByPayee.insert(std::make_pair(mn.pubKeyCollateralAddress.GetID(), pmn));
+    mapMasternodesByPubKey.insert(std::make_pair(mn.pubKeyMasternode.GetID(), pmn));
+}
+
 bool CMasternodeMan::Add(CMasternode& mn)
 {
     LOCK(cs);
@@ -206,7 +278,7 @@ bool CMasternodeMan::Add(CMasternode& mn)
     CMasternode* pmn = Find(mn.vin);
     if (pmn == NULL) {
         LogPrint("masternode", "CMasternodeMan: Adding new Masternode %s - %i now\n", mn.vin.prevout.hash.ToString(), size() + 1);
-        vMasternodes.push_back(mn);
+        AddMasternode(mn);
         return true;
     }
 
@@ -233,7 +305,7 @@ void CMasternodeMan::Check()
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
     }
 }
@@ -245,8 +317,8 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
     LOCK(cs);
 
     //remove inactive and outdated
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
+    std::list<CMasternode>::iterator it = listMasternodes.begin();
+    while (it != listMasternodes.end()) {
         if ((*it).activeState == CMasternode::MASTERNODE_REMOVE ||
             (*it).activeState == CMasternode::MASTERNODE_VIN_SPENT ||
             (forceExpiredRemoval && (*it).activeState == CMasternode::MASTERNODE_EXPIRED) ||
@@ -267,16 +339,9 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
             }
 
             // allow us to ask for this masternode again if we see another ping
-            map<COutPoint, int64_t>::iterator it2 = mWeAskedForMasternodeListEntry.begin();
-            while (it2 != mWeAskedForMasternodeListEntry.end()) {
-                if ((*it2).first == (*it).vin.prevout) {
-                    mWeAskedForMasternodeListEntry.erase(it2++);
-                } else {
-                    ++it2;
-                }
-            }
+            mWeAskedForMasternodeListEntry.erase((*it).vin.prevout);
 
-            it = vMasternodes.erase(it);
+            RemoveMasternode(it++);
         } else {
             ++it;
         }
@@ -337,7 +402,7 @@ void CMasternodeMan::CheckAndRemove(bool forceExpiredRemoval)
 void CMasternodeMan::Clear()
 {
     LOCK(cs);
-    vMasternodes.clear();
+    ClearMasternodes();
     mAskedUsForMasternodeList.clear();
     mWeAskedForMasternodeList.clear();
     mWeAskedForMasternodeListEntry.clear();
@@ -352,7 +417,7 @@ int CMasternodeMan::stable_size ()
     int64_t nMasternode_Min_Age = GetSporkValue(SPORK_16_MN_WINNER_MINIMUM_AGE);
     int64_t nMasternode_Age = 0;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < nMinProtocol) {
             continue; // Skip obsolete versions
         }
@@ -377,7 +442,7 @@ int CMasternodeMan::CountEnabled(int protocolVersion)
     int i = 0;
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         i++;
@@ -390,7 +455,7 @@ void CMasternodeMan::CountNetworks(int protocolVersion, int& ipv4, int& ipv6, in
 {
     protocolVersion = protocolVersion == -1 ? masternodePayments.GetMinMasternodePaymentsProto() : protocolVersion;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         std::string strHost;
         int port;
@@ -435,12 +500,17 @@ void CMasternodeMan::DsegUpdate(CNode* pnode)
 CMasternode* CMasternodeMan::Find(const CScript& payee)
 {
     LOCK(cs);
-    CScript payee2;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        payee2 = GetScriptForDestination(mn.pubKeyCollateralAddress.GetID());
-        if (payee2 == payee)
-            return &mn;
+    // Masternodes are paid to the address of their collateral
+    CTxDestination dest;
+    if (!ExtractDestination(payee, dest) || !boost::get<CKeyID>(&dest))
+        return NULL;
+
+    typedef boost::unordered_multimap<CKeyID, CMasternode*, MasternodeKeyIDHasher>::iterator Iterator;
+    std::pair<Iterator, Iterator> range = mapMasternodesByPayee.equal_range(boost::get<CKeyID>(dest));
+    for (Iterator it = range.first; it != range.second; ++it) {
+        if (GetScriptForDestination(it->second->pubKeyCollateralAddress.GetID()) == payee)
+            return it->second;
     }
     return NULL;
 }
@@ -449,11 +519,10 @@ CMasternode* CMasternodeMan::Find(const CTxIn& vin)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.vin.prevout == vin.prevout)
-            return &mn;
-    }
-    return NULL;
+    boost::unordered_map<COutPoint, std::list<CMasternode>::iterator, MasternodeOutPointHasher>::iterator it = mapMasternodesByVin.find(vin.prevout);
+    if (it == mapMasternodesByVin.end())
+        return NULL;
+    return &*it->second;
 }
 
 
@@ -461,9 +530,11 @@ CMasternode* CMasternodeMan::Find(const CPubKey& pubKeyMasternode)
 {
     LOCK(cs);
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.pubKeyMasternode == pubKeyMasternode)
-            return &mn;
+    typedef boost::unordered_multimap<CKeyID, CMasternode*, MasternodeKeyIDHasher>::iterator Iterator;
+    std::pair<Iterator, Iterator> range = mapMasternodesByPubKey.equal_range(pubKeyMasternode.GetID());
+    for (Iterator it = range.first; it != range.second; ++it) {
+        if (it->second->pubKeyMasternode == pubKeyMasternode)
+            return it->second;
     }
     return NULL;
 }
@@ -483,7 +554,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     */
 
     int nMnCount = CountEnabled();
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (!mn.IsEnabled()) continue;
 
@@ -499,7 +570,7 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
         //make sure it has as many confirmations as there are masternodes
         if (mn.GetMasternodeInputAge() < nMnCount) continue;
 
-        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(), mn.vin));
+        vecMasternodeLastPaid.push_back(make_pair(mn.SecondsSincePayment(nMnCount), mn.vin));
     }
 
     nCount = (int)vecMasternodeLastPaid.size();
@@ -532,6 +603,85 @@ CMasternode* CMasternodeMan::GetNextMasternodeInQueueForPayment(int nBlockHeight
     return pBestMasternode;
 }
 
+// Look a collateral up in the UTXO set and the mempool, with cs_main and mempool.cs held
+static CMasternodeCollateral ReadCollateral(const COutPoint& outpoint)
+{
+    CMasternodeCollateral collateral;
+    const CCoins* coins = pcoinsTip->AccessCoins(outpoint.hash);
+    if (coins == NULL || !coins->IsAvailable(outpoint.n))
+        return collateral;
+
+    collateral.nHeight = coins->nHeight;
+    collateral.nValue = coins->vout[outpoint.n].nValue;
+    collateral.fSpentInMempool = mempool.mapNextTx.count(outpoint) > 0;
+    collateral.fAvailable = !collateral.fSpentInMempool;
+    // a coinbase or coinstake output cannot be spent until mature
+    if (coins->IsCoinBase() || coins->IsCoinStake())
+        collateral.fAvailable &= chainActive.Height() + 1 - coins->nHeight >= Params().COINBASE_MATURITY();
+    return collateral;
+}
+
+bool CMasternodeMan::GetCollateral(const COutPoint& outpoint, CMasternodeCollateral& collateral)
+{
+    bool fKnown = false;
+    {
+        LOCK(cs_collaterals);
+        boost::unordered_map<COutPoint, CMasternodeCollateral, MasternodeOutPointHasher>::const_iterator it = mapCollaterals.find(outpoint);
+        if (it != mapCollaterals.end()) {
+            collateral = it->second;
+            // the spending transaction may have been evicted or conflicted since
+            if (!collateral.fSpentInMempool)
+                return true;
+            fKnown = true;
+        }
+    }
+
+    // an entry added since the last tip, or spent in the mempool
+    TRY_LOCK(cs_main, lockMain);
+    if (!lockMain) return fKnown;
+    {
+        LOCK(mempool.cs);
+        collateral = ReadCollateral(outpoint);
+    }
+    LOCK(cs_collaterals);
+    mapCollaterals[outpoint] = collateral;
+    return true;
+}
+
+void CMasternodeMan::UpdatedBlockTip(const CBlockIndex* pindex)
+{
+    std::vector<COutPoint> vOutPoints;
+    {
+        LOCK(cs);
+        vOutPoints.reserve(mapMasternodesByVin.size());
+        for (boost::unordered_map<COutPoint, std::list<CMasternode>::iterator, MasternodeOutPointHasher>::const_iterator it = mapMasternodesByVin.begin(); it != mapMasternodesByVin.end(); ++it)
+            vOutPoints.push_back(it->first);
+    }
+
+    boost::unordered_map<COutPoint, CMasternodeCollateral, MasternodeOutPointHasher> mapCollateralsNew(vOutPoints.size());
+    LOCK2(cs_main, mempool.cs);
+    BOOST_FOREACH (const COutPoint& outpoint, vOutPoints)
+        mapCollateralsNew[outpoint] = ReadCollateral(outpoint);
+
+    LOCK(cs_collaterals);
+    mapCollaterals.swap(mapCollateralsNew);
+}
+
+void CMasternodeMan::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
+{
+    LOCK(cs_collaterals);
+    if (mapCollaterals.empty()) return;
+
+    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+        boost::unordered_map<COutPoint, CMasternodeCollateral, MasternodeOutPointHasher>::iterator it = mapCollaterals.find(txin.prevout);
+        if (it != mapCollaterals.end()) {
+            it->second.fAvailable = false;
+            // only a spend in a block is final until the next tip
+            it->second.fSpentInMempool = pblock == NULL;
+        }
+    }
+}
+
 CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude, int protocolVersion)
 {
     LOCK(cs);
@@ -546,7 +696,7 @@ CMasternode* CMasternodeMan::FindRandomNotInVec(std::vector<CTxIn>& vecToExclude
     LogPrint("masternode", "CMasternodeMan::FindRandomNotInVec - rand %d\n", rand);
     bool found;
 
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < protocolVersion || !mn.IsEnabled()) continue;
         found = false;
         BOOST_FOREACH (CTxIn& usedVin, vecToExclude) {
@@ -570,7 +720,7 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
     CMasternode* winner = NULL;
 
     // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
         if (mn.protocolVersion < minProtocol || !mn.IsEnabled()) continue;
 
@@ -588,24 +738,45 @@ CMasternode* CMasternodeMan::GetCurrentMasterNode(int mod, int64_t nBlockHeight,
     return winner;
 }
 
-int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+const CMasternodeRanks* CMasternodeMan::GetRanks(int64_t nBlockHeight, int minProtocol, bool fOnlyActive, bool fMinAge)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
-    int64_t nMasternode_Min_Age = GetSporkValue(SPORK_16_MN_WINNER_MINIMUM_AGE);
-    int64_t nMasternode_Age = 0;
+    LOCK(cs);
 
     //make sure we know about this block
     uint256 hash = 0;
-    if (!GetBlockHash(hash, nBlockHeight)) return -1;
+    if (!GetBlockHash(hash, nBlockHeight)) return NULL;
+
+    MasternodeRanksKey key = make_pair(nBlockHeight, make_pair(minProtocol, (fOnlyActive ? 1 : 0) | (fMinAge ? 2 : 0)));
+    std::map<MasternodeRanksKey, CMasternodeRanks>::iterator it = mapRanksCache.find(key);
+    if (it != mapRanksCache.end() && it->second.hashBlock == hash && GetTime() - it->second.nTime < MASTERNODE_CHECK_SECONDS)
+        return &it->second;
+
+    // drop expired ranks
+    if (mapRanksCache.size() >= MASTERNODE_RANKS_CACHE_SIZE) {
+        std::map<MasternodeRanksKey, CMasternodeRanks>::iterator it2 = mapRanksCache.begin();
+        while (it2 != mapRanksCache.end()) {
+            if (GetTime() - (*it2).second.nTime >= MASTERNODE_CHECK_SECONDS) {
+                mapRanksCache.erase(it2++);
+            } else {
+                ++it2;
+            }
+        }
+        if (mapRanksCache.size() >= MASTERNODE_RANKS_CACHE_SIZE)
+            mapRanksCache.clear();
+    }
+
+    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
+    int64_t nMasternode_Min_Age = GetSporkValue(SPORK_16_MN_WINNER_MINIMUM_AGE);
+    int64_t nMasternode_Age = 0;
 
     // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         if (mn.protocolVersion < minProtocol) {
             LogPrint("masternode","Skipping Masternode with obsolete version %d\n", mn.protocolVersion);
             continue;                                                       // Skip obsolete versions
         }
 
-        if (IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
+        if (fMinAge && IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)) {
             nMasternode_Age = GetAdjustedTime() - mn.sigTime;
             if ((nMasternode_Age) < nMasternode_Min_Age) {
                 if (fDebug) LogPrint("masternode","Skipping just activated Masternode. Age: %ld\n", nMasternode_Age);
@@ -624,15 +795,29 @@ int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, in
 
     sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
 
-    int rank = 0;
+    CMasternodeRanks& ranks = mapRanksCache[key];
+    ranks.hashBlock = hash;
+    ranks.nTime = GetTime();
+    ranks.vRanked.clear();
+    ranks.mapRank.clear();
     BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
-        rank++;
-        if (s.second.prevout == vin.prevout) {
-            return rank;
-        }
+        ranks.vRanked.push_back(s.second.prevout);
+        ranks.mapRank.insert(make_pair(s.second.prevout, (int)ranks.vRanked.size()));
     }
 
-    return -1;
+    return &ranks;
+}
+
+int CMasternodeMan::GetMasternodeRank(const CTxIn& vin, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
+{
+    LOCK(cs);
+
+    const CMasternodeRanks* pranks = GetRanks(nBlockHeight, minProtocol, fOnlyActive, true);
+    if (!pranks) return -1;
+
+    boost::unordered_map<COutPoint, int, MasternodeOutPointHasher>::const_iterator it = pranks->mapRank.find(vin.prevout);
+    if (it == pranks->mapRank.end()) return -1;
+    return it->second;
 }
 
 std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t nBlockHeight, int minProtocol)
@@ -645,7 +830,7 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
     if (!GetBlockHash(hash, nBlockHeight)) return vecMasternodeRanks;
 
     // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+    BOOST_FOREACH (CMasternode& mn, listMasternodes) {
         mn.Check();
 
         if (mn.protocolVersion < minProtocol) continue;
@@ -674,33 +859,12 @@ std::vector<pair<int, CMasternode> > CMasternodeMan::GetMasternodeRanks(int64_t
 
 CMasternode* CMasternodeMan::GetMasternodeByRank(int nRank, int64_t nBlockHeight, int minProtocol, bool fOnlyActive)
 {
-    std::vector<pair<int64_t, CTxIn> > vecMasternodeScores;
-
-    // scan for winner
-    BOOST_FOREACH (CMasternode& mn, vMasternodes) {
-        if (mn.protocolVersion < minProtocol) continue;
-        if (fOnlyActive) {
-            mn.Check();
-            if (!mn.IsEnabled()) continue;
-        }
-
-        uint256 n = mn.CalculateScore(1, nBlockHeight);
-        int64_t n2 = n.GetCompact(false);
+    LOCK(cs);
 
-        vecMasternodeScores.push_back(make_pair(n2, mn.vin));
-    }
+    const CMasternodeRanks* pranks = GetRanks(nBlockHeight, minProtocol, fOnlyActive, false);
+    if (!pranks || nRank < 1 || nRank > (int)pranks->vRanked.size()) return NULL;
 
-    sort(vecMasternodeScores.rbegin(), vecMasternodeScores.rend(), CompareScoreTxIn());
-
-    int rank = 0;
-    BOOST_FOREACH (PAIRTYPE(int64_t, CTxIn) & s, vecMasternodeScores) {
-        rank++;
-        if (rank == nRank) {
-            return Find(s.second);
-        }
-    }
-
-    return NULL;
+    return Find(CTxIn(pranks->vRanked[nRank - 1]));
 }
 
 void CMasternodeMan::ProcessMasternodeConnections()
@@ -818,7 +982,7 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
         int nInvCount = 0;
 
-        BOOST_FOREACH (CMasternode& mn, vMasternodes) {
+        BOOST_FOREACH (CMasternode& mn, listMasternodes) {
             if (mn.addr.IsRFC1918()) continue; //local network
 
             if (mn.IsEnabled()) {
@@ -850,14 +1014,10 @@ void CMasternodeMan::Remove(CTxIn vin)
 {
     LOCK(cs);
 
-    vector<CMasternode>::iterator it = vMasternodes.begin();
-    while (it != vMasternodes.end()) {
-        if ((*it).vin == vin) {
-            LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", (*it).vin.prevout.hash.ToString(), size() - 1);
-            vMasternodes.erase(it);
-            break;
-        }
-        ++it;
+    boost::unordered_map<COutPoint, std::list<CMasternode>::iterator, MasternodeOutPointHasher>::iterator it = mapMasternodesByVin.find(vin.prevout);
+    if (it != mapMasternodesByVin.end() && (*it->second).vin == vin) {
+        LogPrint("masternode", "CMasternodeMan: Removing Masternode %s - %i now\n", vin.prevout.hash.ToString(), size() - 1);
+        RemoveMasternode(it->second);
     }
 }
 
@@ -884,7 +1044,7 @@ std::string CMasternodeMan::ToString() const
 {
     std::ostringstream info;
 
-    info << "Masternodes: " << (int)vMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size();
+    info << "Masternodes: " << (int)listMasternodes.size() << ", peers who asked us for Masternode list: " << (int)mAskedUsForMasternodeList.size() << ", peers we asked for Masternode list: " << (int)mWeAskedForMasternodeList.size() << ", entries in Masternode list we asked for: " << (int)mWeAskedForMasternodeListEntry.size();
 
     return info.str();
 }
@@ -14,8 +14,13 @@
 #include "sync.h"
 #include "util.h"
 
+#include <list>
+
+#include <boost/unordered_map.hpp>
+
 #define MASTERNODES_DUMP_SECONDS (15 * 60)
 #define MASTERNODES_DSEG_SECONDS (3 * 60 * 60)
+#define MASTERNODE_RANKS_CACHE_SIZE 64
 
 using namespace std;
 
@@ -48,7 +53,40 @@ public:
     ReadResult Read(CMasternodeMan& mnodemanToLoad, bool fDryRun = false);
 };
 
-class CMasternodeMan
+struct MasternodeOutPointHasher {
+    size_t operator()(const COutPoint& outpoint) const { return outpoint.hash.GetLow64() ^ outpoint.n; }
+};
+
+struct MasternodeKeyIDHasher {
+    size_t operator()(const CKeyID& keyID) const { return keyID.GetLow64(); }
+};
+
+/** The masternodes ranked by their score for a block, best first */
+struct CMasternodeRanks {
+    // the block scored, which a reorganization replaces
+    uint256 hashBlock;
+    // when ranked, as masternodes age and change state over time
+    int64_t nTime;
+    std::vector<COutPoint> vRanked;
+    boost::unordered_map<COutPoint, int, MasternodeOutPointHasher> mapRank;
+};
+
+// block height, minimum protocol and filters ranked by
+typedef std::pair<int64_t, std::pair<int, int> > MasternodeRanksKey;
+
+/** A masternode's collateral output, as found in the UTXO set */
+struct CMasternodeCollateral {
+    int nHeight;
+    CAmount nValue;
+    // unspent in the chain and the mempool, and mature
+    bool fAvailable;
+    // spent by a mempool transaction, which may still leave the mempool
+    bool fSpentInMempool;
+
+    CMasternodeCollateral() : nHeight(0), nValue(0), fAvailable(false), fSpentInMempool(false) {}
+};
+
+class CMasternodeMan : public CValidationInterface
 {
 private:
     // critical section to protect the inner data structures
@@ -57,14 +95,40 @@ private:
     // critical section to protect the inner data structures specifically on messaging
     mutable CCriticalSection cs_process_message;
 
-    // map to hold all MNs
-    std::vector<CMasternode> vMasternodes;
+    // list to hold all MNs; its entries never move, so pointers to them stay valid until removed
+    std::list<CMasternode> listMasternodes;
+    // the MNs by collateral outpoint, collateral address and masternode key
+    boost::unordered_map<COutPoint, std::list<CMasternode>::iterator, MasternodeOutPointHasher> mapMasternodesByVin;
+    boost::unordered_multimap<CKeyID, CMasternode*, MasternodeKeyIDHasher> mapMasternodesByPayee;
+    boost::unordered_multimap<CKeyID, CMasternode*, MasternodeKeyIDHasher> mapMasternodesByPubKey;
     // who's asked for the Masternode list and the last time
     std::map<CNetAddr, int64_t> mAskedUsForMasternodeList;
     // who we asked for the Masternode list and the last time
     std::map<CNetAddr, int64_t> mWeAskedForMasternodeList;
     // which Masternodes we've asked for
     std::map<COutPoint, int64_t> mWeAskedForMasternodeListEntry;
+    // recent ranks, reused until the list changes or they expire
+    std::map<MasternodeRanksKey, CMasternodeRanks> mapRanksCache;
+
+    // critical section to protect the collaterals, taken after cs_main and cs
+    mutable CCriticalSection cs_collaterals;
+    // the collaterals of the MNs as of the tip, less those spent since;
+    // those spent in the mempool are looked up again while they are used
+    boost::unordered_map<COutPoint, CMasternodeCollateral, MasternodeOutPointHasher> mapCollaterals;
+
+    /// Add an entry to the list and the indexes, or remove it from both
+    void AddMasternode(const CMasternode& mn);
+    void RemoveMasternode(std::list<CMasternode>::iterator it);
+    void ClearMasternodes();
+
+    /// Rank the masternodes for a block, or reuse the ranks while current; NULL for an unknown block
+    const CMasternodeRanks* GetRanks(int64_t nBlockHeight, int minProtocol, bool fOnlyActive, bool fMinAge);
+
+protected:
+    /// Look up the collaterals of all MNs again, once per new tip
+    void UpdatedBlockTip(const CBlockIndex* pindex);
+    /// Mark the collaterals a transaction spends
+    void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
 
 public:
     // Keep track of all broadcasts I've seen
@@ -78,7 +142,16 @@ public:
     inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
     {
         LOCK(cs);
-        READWRITE(vMasternodes);
+        if (ser_action.ForRead()) {
+            std::vector<CMasternode> vMasternodes;
+            READWRITE(vMasternodes);
+            ClearMasternodes();
+            for (unsigned int i = 0; i < vMasternodes.size(); i++)
+                AddMasternode(vMasternodes[i]);
+        } else {
+            std::vector<CMasternode> vMasternodes(listMasternodes.begin(), listMasternodes.end());
+            READWRITE(vMasternodes);
+        }
         READWRITE(mAskedUsForMasternodeList);
         READWRITE(mWeAskedForMasternodeList);
         READWRITE(mWeAskedForMasternodeListEntry);
@@ -119,6 +192,9 @@ public:
     /// Find an entry in the masternode list that is next to be paid
     CMasternode* GetNextMasternodeInQueueForPayment(int nBlockHeight, bool fFilterSigTime, int& nCount);
 
+    /// Get the collateral of an entry, looking it up if not known yet or spent in the mempool; false while cs_main is busy and it is not known
+    bool GetCollateral(const COutPoint& outpoint, CMasternodeCollateral& collateral);
+
     /// Find a random entry
     CMasternode* FindRandomNotInVec(std::vector<CTxIn>& vecToExclude, int protocolVersion = -1);
 
@@ -128,7 +204,8 @@ public:
     std::vector<CMasternode> GetFullMasternodeVector()
     {
         Check();
-        return vMasternodes;
+        LOCK(cs);
+        return std::vector<CMasternode>(listMasternodes.begin(), listMasternodes.end());
     }
 
     std::vector<pair<int, CMasternode> > GetMasternodeRanks(int64_t nBlockHeight, int minProtocol = 0);
@@ -140,7 +217,7 @@ public:
     void ProcessMessage(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 
     /// Return the number of (unique) Masternodes
-    int size() { return vMasternodes.size(); }
+    int size() { return mapMasternodesByVin.size(); }
 
     /// Return the number of Masternodes older than (default) 8000 seconds
     int stable_size ();
@@ -149,6 +226,10 @@ public:
 
     void Remove(CTxIn vin);
 
+    /// Drop an entry's keys from the indexes before they change, and add them back after
+    bool UnindexKeys(const CMasternode& mn);
+    void IndexKeys(const CMasternode& mn);
+
     /// Update masternode list and maps using provided CMasternodeBroadcast
     void UpdateMasternodeList(CMasternodeBroadcast mnb);
 };
@@ -25,6 +25,8 @@
 #include "masternode-payments.h"
 #include "spork.h"
 
+#include <boost/scoped_ptr.hpp>
+#include <boost/signals2/signal.hpp>
 #include <boost/thread.hpp>
 #include <boost/tuple/tuple.hpp>
 
@@ -460,6 +462,62 @@ bool fGenerateBitcoins = false;
 
 // ***TODO*** that part changed in bitcoin, we are using a mix with old one here for now
 
+// The stake minter sleeps until something it waits for happens: a new tip,
+// a wallet transaction or the wallet being unlocked. The wallet events make
+// it check again for coins that can stake.
+static boost::mutex csStakeMinterWake;
+static boost::condition_variable condStakeMinterWake;
+static bool fStakeMinterWake = false;
+static bool fStakeMinterWalletChanged = false;
+
+static void WakeStakeMinter(bool fWalletChanged)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(csStakeMinterWake);
+        fStakeMinterWake = true;
+        fStakeMinterWalletChanged |= fWalletChanged;
+    }
+    condStakeMinterWake.notify_all();
+}
+
+static void NotifyStakeMinterTransactionChanged(CWallet* wallet, const uint256& hashTx, ChangeType status)
+{
+    WakeStakeMinter(true);
+}
+
+static void NotifyStakeMinterStatusChanged(CCryptoKeyStore* wallet)
+{
+    WakeStakeMinter(true);
+}
+
+// Wait to be woken up, for at most nMilliseconds; returns whether the wallet changed
+static bool WaitForStakeMinterWake(int64_t nMilliseconds)
+{
+    boost::unique_lock<boost::mutex> lock(csStakeMinterWake);
+    boost::posix_time::ptime timeout = boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(nMilliseconds);
+    while (!fStakeMinterWake) {
+        if (!condStakeMinterWake.timed_wait(lock, timeout))
+            break;
+    }
+    bool fWalletChanged = fStakeMinterWalletChanged;
+    fStakeMinterWake = false;
+    fStakeMinterWalletChanged = false;
+    return fWalletChanged;
+}
+
+class CStakeMinterListener : public CValidationInterface
+{
+public:
+    CStakeMinterListener() { RegisterValidationInterface(this); }
+    ~CStakeMinterListener() { UnregisterValidationInterface(this); }
+
+protected:
+    void UpdatedBlockTip(const CBlockIndex* pindex) { WakeStakeMinter(false); }
+};
+
+// Longest the stake minter sleeps, for what no event wakes it up for, such as peers connecting
+static const int64_t STAKE_MINTER_MAX_WAIT = 30000;
+
 void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
 {
     LogPrintf("HashMiner started\n");
@@ -471,35 +529,47 @@ void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
     unsigned int nExtraNonce = 0;
 
     //control the amount of times the client will check for mintable coins
-    static bool fMintableCoins = false;
-    static int nMintableLastCheck = 0;
+    bool fMintableCoins = false;
+    bool fCheckMintableCoins = true;
+    int64_t nMintableTime = 0;
 
-    while (fGenerateBitcoins || fProofOfStake) {
-        if (fProofOfStake && (GetTime() - nMintableLastCheck > 5 * 60)) // 5 minute check time
-        {
-            nMintableLastCheck = GetTime();
-            fMintableCoins = pwallet->MintableCoins();
-        }
+    boost::scoped_ptr<CStakeMinterListener> pStakeMinterListener;
+    boost::signals2::scoped_connection connTransactionChanged, connStatusChanged;
+    if (fProofOfStake) {
+        pStakeMinterListener.reset(new CStakeMinterListener());
+        connTransactionChanged = pwallet->NotifyTransactionChanged.connect(boost::bind(&NotifyStakeMinterTransactionChanged, _1, _2, _3));
+        connStatusChanged = pwallet->NotifyStatusChanged.connect(boost::bind(&NotifyStakeMinterStatusChanged, _1));
+    }
 
+    while (fGenerateBitcoins || fProofOfStake) {
         if (fProofOfStake) {
-	    if (chainActive.Tip()->nHeight < Params().LAST_POW_BLOCK()) {
-                MilliSleep(5000);
-                continue;
+            if (fCheckMintableCoins || (nMintableTime && GetAdjustedTime() >= nMintableTime)) {
+                fMintableCoins = pwallet->MintableCoins(&nMintableTime);
+                fCheckMintableCoins = false;
             }
 
-            if (chainActive.Tip()->nTime < Params().GenesisBlock().nTime || vNodes.empty() || pwallet->IsLocked() || !fMintableCoins || nReserveBalance >= pwallet->GetBalance()) {
+            // Until when staking cannot succeed, unless something changes
+            int64_t nWait = 0;
+            if (chainActive.Tip()->nHeight < Params().LAST_POW_BLOCK()) {
+                nWait = STAKE_MINTER_MAX_WAIT;
+            } else if (chainActive.Tip()->nTime < Params().GenesisBlock().nTime || vNodes.empty() || pwallet->IsLocked() || !fMintableCoins || nReserveBalance >= pwallet->GetBalance()) {
                 nLastCoinStakeSearchInterval = 0;
-                MilliSleep(30000);
-                continue;
+                nWait = STAKE_MINTER_MAX_WAIT;
+                if (!fMintableCoins && nMintableTime)
+                    nWait = std::min(nWait, (nMintableTime - GetAdjustedTime()) * 1000);
+            } else if (GetAdjustedTime() <= chainActive.Tip()->nTime) {
+                //prevent staking a time that won't be accepted
+                nWait = (chainActive.Tip()->nTime + 1 - GetAdjustedTime()) * 1000;
+            } else if (mapHashedBlocks.count(chainActive.Tip()->nHeight)) {
+                //search our map of hashed blocks, see if bestblock has been hashed yet
+                int64_t nNextHashTime = mapHashedBlocks[chainActive.Tip()->nHeight] + max(pwallet->nHashInterval, (unsigned int)1);
+                nWait = (nNextHashTime - GetTime()) * 1000;
             }
 
-            if (mapHashedBlocks.count(chainActive.Tip()->nHeight)) //search our map of hashed blocks, see if bestblock has been hashed yet
-            {
-                if (GetTime() - mapHashedBlocks[chainActive.Tip()->nHeight] < max(pwallet->nHashInterval, (unsigned int)1)) // wait half of the nHashDrift with max wait of 3 minutes
-                {
-                    MilliSleep(30000);
-                    continue;
-                }
+            if (nWait > 0) {
+                if (WaitForStakeMinterWake(nWait))
+                    fCheckMintableCoins = true;
+                continue;
             }
         }
 
@@ -512,8 +582,12 @@ void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
             continue;
 
         unique_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey, pwallet, fProofOfStake));
-        if (!pblocktemplate.get())
+        if (!pblocktemplate.get()) {
+            // Not all failures mark the tip as hashed; do not retry at once
+            if (fProofOfStake && !mapHashedBlocks.count(pindexPrev->nHeight) && WaitForStakeMinterWake(max(pwallet->nHashInterval, (unsigned int)1) * 1000))
+                fCheckMintableCoins = true;
             continue;
+        }
 
         CBlock* pblock = &pblocktemplate->block;
         IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
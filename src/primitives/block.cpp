@@ -6,6 +6,7 @@
 
 #include "primitives/block.h"
 
+#include "crypto/sha256.h"
 #include "hash.h"
 #include "script/standard.h"
 #include "script/sign.h"
@@ -13,9 +14,77 @@
 #include "utilstrencodings.h"
 #include "util.h"
 
+#include <atomic>
+#include <limits>
+
+// Only read for getblockchaininfo, so they need no ordering with the memo
+static std::atomic<uint64_t> nHashCacheHits(0);
+static std::atomic<uint64_t> nHashCacheMisses(0);
+
+CBlockHeader& CBlockHeader::operator=(const CBlockHeader& other)
+{
+    nVersion = other.nVersion;
+    hashPrevBlock = other.hashPrevBlock;
+    hashMerkleRoot = other.hashMerkleRoot;
+    nTime = other.nTime;
+    nBits = other.nBits;
+    nNonce = other.nNonce;
+
+    // carry the memoized hash over, when the other header has one
+    nHashState.store(HASH_EMPTY, std::memory_order_relaxed);
+    if (this != &other && other.nHashState.load(std::memory_order_acquire) == HASH_READY) {
+        hashCached = other.hashCached;
+        memcpy(vchHashedHeader, other.vchHashedHeader, sizeof(vchHashedHeader));
+        nHashState.store(HASH_READY, std::memory_order_release);
+    }
+    return *this;
+}
+
+void CBlockHeader::SetCachedHash(const uint256& hash) const
+{
+    int nState = nHashState.load(std::memory_order_relaxed);
+    if (nState == HASH_WRITING || !nHashState.compare_exchange_strong(nState, HASH_WRITING, std::memory_order_acquire))
+        return;
+
+    hashCached = hash;
+    memcpy(vchHashedHeader, BEGIN(nVersion), sizeof(vchHashedHeader));
+    nHashState.store(HASH_READY, std::memory_order_release);
+}
+
 uint256 CBlockHeader::GetHash() const
 {
-    return HashQuark(BEGIN(nVersion), END(nNonce));
+    assert(END(nNonce) - BEGIN(nVersion) == sizeof(vchHashedHeader));
+    if (nHashState.load(std::memory_order_acquire) == HASH_READY && memcmp(vchHashedHeader, BEGIN(nVersion), sizeof(vchHashedHeader)) == 0) {
+        nHashCacheHits.fetch_add(1, std::memory_order_relaxed);
+        return hashCached;
+    }
+
+    nHashCacheMisses.fetch_add(1, std::memory_order_relaxed);
+    uint256 hash = HashQuark(BEGIN(nVersion), END(nNonce));
+    SetCachedHash(hash);
+    return hash;
+}
+
+void CBlockHeader::PrecomputeHashes(const CBlockHeader* pheaders, size_t nCount)
+{
+    if (nCount == 0)
+        return;
+
+    std::vector<const unsigned char*> vInputs(nCount);
+    std::vector<uint256> vHashes(nCount);
+    for (size_t i = 0; i < nCount; i++)
+        vInputs[i] = (const unsigned char*)BEGIN(pheaders[i].nVersion);
+    HashQuarkBatch(&vInputs[0], sizeof(pheaders[0].vchHashedHeader), nCount, &vHashes[0]);
+
+    nHashCacheMisses.fetch_add(nCount, std::memory_order_relaxed);
+    for (size_t i = 0; i < nCount; i++)
+        pheaders[i].SetCachedHash(vHashes[i]);
+}
+
+void CBlockHeader::GetHashCacheStats(uint64_t& nHits, uint64_t& nMisses)
+{
+    nHits = nHashCacheHits.load(std::memory_order_relaxed);
+    nMisses = nHashCacheMisses.load(std::memory_order_relaxed);
 }
 
 uint256 CBlock::BuildMerkleTree(bool* fMutated) const
@@ -55,32 +124,84 @@ uint256 CBlock::BuildMerkleTree(bool* fMutated) const
        known ways of changing the transactions without affecting the merkle
        root.
     */
+    InitMerkleTree();
+    HashMerkleLevels(0, std::numeric_limits<int>::max(), 0, vtx.size());
+    return FinishMerkleTree(fMutated);
+}
+
+/** Number of hashes in the Merkle tree of nTx transactions */
+static size_t MerkleTreeSize(size_t nTx)
+{
+    size_t nNodes = 0;
+    for (size_t nSize = nTx; nSize > 1; nSize = (nSize + 1) / 2)
+        nNodes += nSize;
+    return nTx == 0 ? 0 : nNodes + 1;
+}
+
+void CBlock::InitMerkleTree() const
+{
+    size_t nNodes = MerkleTreeSize(vtx.size());
     vMerkleTree.clear();
-    vMerkleTree.reserve(vtx.size() * 2 + 16); // Safe upper bound for the number of total nodes.
+    fMerkleTreeBuilt = false;
+    vMerkleTree.reserve(nNodes);
     for (std::vector<CTransaction>::const_iterator it(vtx.begin()); it != vtx.end(); ++it)
         vMerkleTree.push_back(it->GetHash());
+    vMerkleTree.resize(nNodes);
+}
+
+void CBlock::HashMerkleLevels(int nFromLevel, int nToLevel, int nBegin, int nEnd) const
+{
+    int j = 0;
+    int nLevel = 0;
+    for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2, nLevel++)
+    {
+        if (nLevel >= nToLevel)
+            break;
+        if (nLevel >= nFromLevel) {
+            // Adjacent pairs are contiguous 64-byte inputs, hash them all at once.
+            SHA256D64(vMerkleTree[j+nSize+nBegin/2].begin(), vMerkleTree[j+nBegin].begin(), (nEnd - nBegin) / 2);
+            if ((nEnd - nBegin) & 1) {
+                // An odd last hash is paired with itself.
+                vMerkleTree[j+nSize+nEnd/2] = Hash(BEGIN(vMerkleTree[j+nEnd-1]), END(vMerkleTree[j+nEnd-1]),
+                                                   BEGIN(vMerkleTree[j+nEnd-1]), END(vMerkleTree[j+nEnd-1]));
+            }
+            nBegin /= 2;
+            nEnd = (nEnd + 1) / 2;
+        }
+        j += nSize;
+    }
+}
+
+uint256 CBlock::FinishMerkleTree(bool* fMutated) const
+{
     int j = 0;
     bool mutated = false;
     for (int nSize = vtx.size(); nSize > 1; nSize = (nSize + 1) / 2)
     {
-        for (int i = 0; i < nSize; i += 2)
-        {
-            int i2 = std::min(i+1, nSize-1);
-            if (i2 == i + 1 && i2 + 1 == nSize && vMerkleTree[j+i] == vMerkleTree[j+i2]) {
-                // Two identical hashes at the end of the list at a particular level.
-                mutated = true;
-            }
-            vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
-                                       BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
+        if ((nSize & 1) == 0 && vMerkleTree[j+nSize-2] == vMerkleTree[j+nSize-1]) {
+            // Two identical hashes at the end of the list at a particular level.
+            mutated = true;
         }
         j += nSize;
     }
     if (fMutated) {
         *fMutated = mutated;
     }
+    fMerkleTreeBuilt = true;
     return (vMerkleTree.empty() ? uint256() : vMerkleTree.back());
 }
 
+bool CBlock::IsMerkleTreeBuilt() const
+{
+    if (!fMerkleTreeBuilt || vMerkleTree.size() != MerkleTreeSize(vtx.size()))
+        return false;
+    // The upper levels follow from the txids, which are cached by the transactions
+    for (unsigned int i = 0; i < vtx.size(); i++)
+        if (vMerkleTree[i] != vtx[i].GetHash())
+            return false;
+    return true;
+}
+
 std::vector<uint256> CBlock::GetMerkleBranch(int nIndex) const
 {
     if (vMerkleTree.empty())
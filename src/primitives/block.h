@@ -13,6 +13,8 @@
 #include "serialize.h"
 #include "uint256.h"
 
+#include <atomic>
+
 /** The maximum allowed size for a serialized block, in bytes (network rule) */
 static const unsigned int MAX_BLOCK_SIZE = 2000000;
 
@@ -35,11 +37,18 @@ public:
     uint32_t nBits;
     uint32_t nNonce;
 
-    CBlockHeader()
+    CBlockHeader() : nHashState(HASH_EMPTY)
     {
         SetNull();
     }
 
+    CBlockHeader(const CBlockHeader& other) : nHashState(HASH_EMPTY)
+    {
+        *this = other;
+    }
+
+    CBlockHeader& operator=(const CBlockHeader& other);
+
     ADD_SERIALIZE_METHODS;
 
     template <typename Stream, typename Operation>
@@ -61,6 +70,7 @@ public:
         nTime = 0;
         nBits = 0;
         nNonce = 0;
+        nHashState.store(HASH_EMPTY, std::memory_order_relaxed);
     }
 
     bool IsNull() const
@@ -74,6 +84,28 @@ public:
     {
         return (int64_t)nTime;
     }
+
+    /** Number of GetHash() calls answered from / missing the memoized hash */
+    static void GetHashCacheStats(uint64_t& nHits, uint64_t& nMisses);
+
+    /**
+     * Hash many headers at once through HashQuarkBatch and memoize the
+     * results, so the GetHash() calls made while validating them are hits.
+     */
+    static void PrecomputeHashes(const CBlockHeader* pheaders, size_t nCount);
+
+private:
+    enum { HASH_EMPTY, HASH_WRITING, HASH_READY };
+
+    // memory only: the last computed hash and the serialized header it was
+    // computed from, so that writes to any header field invalidate it. The
+    // memo is published with a release store of HASH_READY, and only one of
+    // the threads hashing a shared header at once gets to write it.
+    mutable std::atomic<int> nHashState;
+    mutable uint256 hashCached;
+    mutable unsigned char vchHashedHeader[80];
+
+    void SetCachedHash(const uint256& hash) const;
 };
 
 
@@ -89,6 +121,8 @@ public:
     // memory only
     mutable CScript payee;
     mutable std::vector<uint256> vMerkleTree;
+    // memory only: whether all levels of vMerkleTree have been filled in
+    mutable bool fMerkleTreeBuilt;
 
     CBlock()
     {
@@ -116,20 +150,15 @@ public:
         CBlockHeader::SetNull();
         vtx.clear();
         vMerkleTree.clear();
+        fMerkleTreeBuilt = false;
         payee = CScript();
         vchBlockSig.clear();
     }
 
     CBlockHeader GetBlockHeader() const
     {
-        CBlockHeader block;
-        block.nVersion       = nVersion;
-        block.hashPrevBlock  = hashPrevBlock;
-        block.hashMerkleRoot = hashMerkleRoot;
-        block.nTime          = nTime;
-        block.nBits          = nBits;
-        block.nNonce         = nNonce;
-        return block;
+        // slice, so the memoized header hash is carried over as well
+        return *this;
     }
 
     // ppcoin: two types of block: proof-of-work or proof-of-stake
@@ -157,6 +186,20 @@ public:
     // merkle root).
     uint256 BuildMerkleTree(bool* mutated = NULL) const;
 
+    // The steps of BuildMerkleTree, so that disjoint subtrees can be hashed on
+    // different threads. InitMerkleTree lays out the txids and sizes the tree.
+    // HashMerkleLevels fills in levels nFromLevel+1 to nToLevel above nodes
+    // [nBegin, nEnd) of level nFromLevel (level 0 being the txids); nBegin must
+    // be a multiple of 2^(nToLevel-nFromLevel). FinishMerkleTree checks for
+    // mutation and returns the root once all levels are filled in.
+    void InitMerkleTree() const;
+    void HashMerkleLevels(int nFromLevel, int nToLevel, int nBegin, int nEnd) const;
+    uint256 FinishMerkleTree(bool* mutated = NULL) const;
+
+    // Whether vMerkleTree was completely built from the current transactions,
+    // so FinishMerkleTree can return the root without hashing again.
+    bool IsMerkleTreeBuilt() const;
+
     std::vector<uint256> GetMerkleBranch(int nIndex) const;
     static uint256 CheckMerkleBranch(uint256 hash, const std::vector<uint256>& vMerkleBranch, int nIndex);
     std::string ToString() const;
@@ -14,10 +14,13 @@
 #include "txdb.h"
 #include "util.h"
 #include "utilmoneystr.h"
+#include "utxosnapshot.h"
 
 #include <stdint.h>
 #include <univalue.h>
 
+#include <boost/filesystem.hpp>
+
 using namespace std;
 
 extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry);
@@ -291,6 +294,9 @@ UniValue getblock(const UniValue& params, bool fHelp)
     CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
 
+    if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
+
     if (!ReadBlockFromDisk(block, pblockindex))
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
 
@@ -338,11 +344,9 @@ UniValue getblockheader(const UniValue& params, bool fHelp)
     if (mapBlockIndex.count(hash) == 0)
         throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
 
-    CBlock block;
+    // The header is kept in the block index, also for pruned blocks
     CBlockIndex* pblockindex = mapBlockIndex[hash];
-
-    if (!ReadBlockFromDisk(block, pblockindex))
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+    CBlock block(pblockindex->GetBlockHeader());
 
     if (!fVerbose) {
         CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
@@ -390,6 +394,48 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
     return ret;
 }
 
+UniValue dumptxoutset(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"filename\"\n"
+            "\nWrites the unspent transaction output set and the block index of the active chain to a snapshot file.\n"
+            "A new node can start from it with -prune and -loadutxosnapshot=<file> instead of downloading the whole chain,\n"
+            "once a release pins the snapshot block and its hash_serialized in the chain parameters.\n"
+            "Note this call may take some time.\n"
+            "\nArguments:\n"
+            "1. \"filename\"    (string, required) The snapshot file, relative to the data directory unless absolute\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"height\":n,     (numeric) The height of the snapshot block\n"
+            "  \"bestblock\": \"hex\",   (string) the snapshot block hash hex\n"
+            "  \"transactions\": n,      (numeric) The number of transactions\n"
+            "  \"hash_serialized\": \"hash\",   (string) The serialized hash, as in gettxoutsetinfo\n"
+            "  \"filename\": \"path\"    (string) The full path of the snapshot file\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("dumptxoutset", "\"utxo.dat\"") + HelpExampleRpc("dumptxoutset", "\"utxo.dat\""));
+
+    boost::filesystem::path path(params[0].get_str());
+    if (!path.is_complete())
+        path = GetDataDir() / path;
+    if (boost::filesystem::exists(path))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+
+    CUTXOSnapshotHeader header;
+    std::string strError;
+    if (!DumpUTXOSnapshot(path, *pcoinsdbview, header, strError))
+        throw JSONRPCError(RPC_MISC_ERROR, strError);
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("height", header.nHeight));
+    ret.push_back(Pair("bestblock", header.hashBlock.GetHex()));
+    ret.push_back(Pair("transactions", (int64_t)header.nTransactions));
+    ret.push_back(Pair("hash_serialized", header.hashSerialized.GetHex()));
+    ret.push_back(Pair("filename", path.string()));
+    return ret;
+}
+
 UniValue gettxout(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -504,6 +550,12 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
             "  \"difficulty\": xxxxxx,     (numeric) the current difficulty\n"
             "  \"verificationprogress\": xxxx, (numeric) estimate of verification progress [0..1]\n"
             "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"pruned\": xx,             (boolean) if the blocks are subject to pruning\n"
+            "  \"pruneheight\": xxxxxx,    (numeric) lowest-height block stored, only present if pruning is enabled\n"
+            "  \"headerhashcache\": {      (object) block header hash memoization counters\n"
+            "    \"hits\": xxxxxx,         (numeric) header hashes served from the cache\n"
+            "    \"misses\": xxxxxx        (numeric) header hashes that had to be computed\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n" +
             HelpExampleCli("getblockchaininfo", "") + HelpExampleRpc("getblockchaininfo", ""));
@@ -516,6 +568,21 @@ UniValue getblockchaininfo(const UniValue& params, bool fHelp)
     obj.push_back(Pair("difficulty", (double)GetDifficulty()));
     obj.push_back(Pair("verificationprogress", Checkpoints::GuessVerificationProgress(chainActive.Tip())));
     obj.push_back(Pair("chainwork", chainActive.Tip()->nChainWork.GetHex()));
+    obj.push_back(Pair("pruned", fPruneMode));
+    if (fPruneMode) {
+        CBlockIndex* block = chainActive.Tip();
+        while (block && block->pprev && (block->pprev->nStatus & BLOCK_HAVE_DATA))
+            block = block->pprev;
+
+        obj.push_back(Pair("pruneheight", block->nHeight));
+    }
+
+    uint64_t nHashCacheHits, nHashCacheMisses;
+    CBlockHeader::GetHashCacheStats(nHashCacheHits, nHashCacheMisses);
+    UniValue hashcache(UniValue::VOBJ);
+    hashcache.push_back(Pair("hits", nHashCacheHits));
+    hashcache.push_back(Pair("misses", nHashCacheMisses));
+    obj.push_back(Pair("headerhashcache", hashcache));
     return obj;
 }
 
@@ -713,6 +780,39 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     return ret;
 }
 
+UniValue getcoinscacheinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getcoinscacheinfo\n"
+            "\nReturns details on the in-memory cache of the unspent transaction output set.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"transactions\": xxxxx       (numeric) Number of transactions held in the cache\n"
+            "  \"usage\": xxxxx              (numeric) Memory used by the cache, in bytes\n"
+            "  \"limit\": xxxxx              (numeric) Usage at which the cache is written to disk, in bytes (see -dbcache)\n"
+            "  \"prefetch_hits\": xxxxx      (numeric, optional) Reads served by the coins prefetcher (see -coinsprefetch)\n"
+            "  \"prefetch_misses\": xxxxx    (numeric, optional) Reads that went past the coins prefetcher to disk\n"
+            "}\n"
+            "\nExamples:\n" +
+            HelpExampleCli("getcoinscacheinfo", "") + HelpExampleRpc("getcoinscacheinfo", ""));
+
+    LOCK(cs_main);
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("transactions", (int64_t)pcoinsTip->GetCacheSize()));
+    ret.push_back(Pair("usage", (int64_t)pcoinsTip->DynamicMemoryUsage()));
+    ret.push_back(Pair("limit", (int64_t)nCoinCacheUsage));
+    if (pcoinsPrefetch) {
+        uint64_t nHits, nMisses;
+        size_t nStaged;
+        pcoinsPrefetch->GetPrefetchStats(nHits, nMisses, nStaged);
+        ret.push_back(Pair("prefetch_hits", (int64_t)nHits));
+        ret.push_back(Pair("prefetch_misses", (int64_t)nMisses));
+    }
+
+    return ret;
+}
+
 UniValue invalidateblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -0,0 +1,125 @@
+// Copyright (c) 2018 The Hash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "clientversion.h"
+#include "main.h"
+#include "random.h"
+#include "streams.h"
+#include "utiltime.h"
+
+#include <stdio.h>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockimport_tests)
+
+// A block that fails validation, but is well formed
+static CBlock MakeBlock(const uint256& hashPrev)
+{
+    CBlock block;
+    block.hashPrevBlock = hashPrev;
+    block.nTime = GetTime();
+    block.nNonce = insecure_rand();
+    CMutableTransaction tx;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = insecure_rand() % 1000 + 1;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    block.vtx.push_back(tx);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+// The magic and the size, as in the block files
+static void WriteFrame(CDataStream& ss, unsigned int nSize)
+{
+    ss << FLATDATA(Params().MessageStart());
+    ss << nSize;
+}
+
+static void WriteBlock(CDataStream& ss, const CBlock& block)
+{
+    WriteFrame(ss, ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION));
+    ss << block;
+}
+
+static bool LoadBlocks(const CDataStream& ss, CUnknownParentBlocks* pUnknownParents)
+{
+    FILE* file = tmpfile();
+    BOOST_REQUIRE(file != NULL);
+    BOOST_REQUIRE_EQUAL(fwrite(&ss[0], 1, ss.size(), file), ss.size());
+    rewind(file);
+    return LoadExternalBlockFile(file, NULL, pUnknownParents);
+}
+
+BOOST_AUTO_TEST_CASE(blockimport_rewind)
+{
+    CBlock blockA = MakeBlock(GetRandHash());
+    CBlock blockB = MakeBlock(GetRandHash());
+    CBlock blockC = MakeBlock(GetRandHash());
+    CBlock blockD = MakeBlock(GetRandHash());
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    for (int i = 0; i < 50; i++)
+        ss << (unsigned char)(insecure_rand() % 256);
+    // A framed as longer than it is, with B inside its frame: the scan
+    // goes on right after A
+    CDataStream ssB(SER_DISK, CLIENT_VERSION);
+    WriteBlock(ssB, blockB);
+    WriteFrame(ss, ::GetSerializeSize(blockA, SER_DISK, CLIENT_VERSION) + ssB.size());
+    ss << blockA;
+    ss.write(&ssB[0], ssB.size());
+    // A corrupt block: the scan goes on right after its magic
+    WriteFrame(ss, 200);
+    for (int i = 0; i < 200; i++)
+        ss << (unsigned char)0xff;
+    WriteBlock(ss, blockC);
+    WriteBlock(ss, blockD);
+
+    // None of the parents are known, so all four wait for them
+    CUnknownParentBlocks unknownParents;
+    BOOST_CHECK(!LoadBlocks(ss, &unknownParents));
+    BOOST_CHECK_EQUAL(unknownParents.mapBlocks.size(), 4U);
+    uint64_t nBytes = 0;
+    const CBlock* vBlocks[] = {&blockA, &blockB, &blockC, &blockD};
+    for (int i = 0; i < 4; i++) {
+        BOOST_CHECK_EQUAL(unknownParents.mapBlocks.count(vBlocks[i]->hashPrevBlock), 1U);
+        std::multimap<uint256, CUnknownParentBlock>::const_iterator it = unknownParents.mapBlocks.find(vBlocks[i]->hashPrevBlock);
+        BOOST_CHECK(it->second.pblock && it->second.pblock->GetHash() == vBlocks[i]->GetHash());
+        nBytes += ::GetSerializeSize(*vBlocks[i], SER_DISK, CLIENT_VERSION);
+    }
+    BOOST_CHECK_EQUAL(unknownParents.nBytes, nBytes);
+
+    // Without a caller to keep them, they are dropped with the file
+    BOOST_CHECK(!LoadBlocks(ss, NULL));
+}
+
+BOOST_AUTO_TEST_CASE(blockimport_unknown_parent)
+{
+    // A child read in one file leaves the set when its parent comes in the
+    // next, whether or not either turns out valid
+    CBlock blockParent = MakeBlock(Params().HashGenesisBlock());
+    CBlock blockChild = MakeBlock(blockParent.GetHash());
+    CBlock blockOrphan = MakeBlock(GetRandHash());
+
+    CUnknownParentBlocks unknownParents;
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    WriteBlock(ss, blockChild);
+    WriteBlock(ss, blockOrphan);
+    LoadBlocks(ss, &unknownParents);
+    BOOST_CHECK_EQUAL(unknownParents.mapBlocks.size(), 2U);
+    BOOST_CHECK_EQUAL(unknownParents.mapBlocks.count(blockParent.GetHash()), 1U);
+
+    ss.clear();
+    WriteBlock(ss, blockParent);
+    LoadBlocks(ss, &unknownParents);
+    BOOST_CHECK_EQUAL(unknownParents.mapBlocks.size(), 1U);
+    BOOST_CHECK_EQUAL(unknownParents.mapBlocks.count(blockOrphan.hashPrevBlock), 1U);
+    BOOST_CHECK_EQUAL(unknownParents.nBytes, ::GetSerializeSize(blockOrphan, SER_DISK, CLIENT_VERSION));
+    BOOST_CHECK(!mapBlockIndex.count(blockParent.GetHash()));
+    BOOST_CHECK(!mapBlockIndex.count(blockChild.GetHash()));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
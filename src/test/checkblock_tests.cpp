@@ -10,9 +10,11 @@
 
 #include "clientversion.h"
 #include "main.h"
+#include "timedata.h"
 #include "utiltime.h"
 
 #include <cstdio>
+#include <limits>
 
 #include <boost/filesystem/operations.hpp>
 #include <boost/filesystem/path.hpp>
@@ -66,4 +68,132 @@ BOOST_AUTO_TEST_CASE(May15)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(merkle_subtrees)
+{
+    // CheckBlock may hash aligned subtrees of the Merkle tree on different
+    // threads, which must give the same tree as BuildMerkleTree
+    const int sizes[] = {1, 2, 3, 7, 8, 9, 255, 256, 257, 511, 600, 1024, 1025};
+    for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        for (int nLevels = 1; nLevels <= 4; nLevels++) {
+            for (int fDuplicate = 0; fDuplicate < 2; fDuplicate++) {
+                CBlock block;
+                for (int i = 0; i < sizes[s]; i++) {
+                    CMutableTransaction tx;
+                    tx.nLockTime = i;
+                    block.vtx.push_back(CTransaction(tx));
+                }
+                if (fDuplicate && sizes[s] % 2 == 0)
+                    block.vtx.back() = block.vtx[sizes[s] - 2];
+
+                bool mutated1, mutated2;
+                uint256 root1 = block.BuildMerkleTree(&mutated1);
+                std::vector<uint256> vBranch1 = block.GetMerkleBranch(sizes[s] - 1);
+
+                block.InitMerkleTree();
+                const int nSubtree = 1 << nLevels;
+                for (int i = 0; i < sizes[s]; i += nSubtree)
+                    block.HashMerkleLevels(0, nLevels, i, std::min(i + nSubtree, sizes[s]));
+                int nSize = sizes[s];
+                for (int i = 0; i < nLevels; i++)
+                    nSize = (nSize + 1) / 2;
+                block.HashMerkleLevels(nLevels, std::numeric_limits<int>::max(), 0, nSize);
+                uint256 root2 = block.FinishMerkleTree(&mutated2);
+
+                BOOST_CHECK(root1 == root2);
+                BOOST_CHECK_EQUAL(mutated1, mutated2);
+                BOOST_CHECK_EQUAL(mutated1, fDuplicate && sizes[s] % 2 == 0);
+                BOOST_CHECK(vBranch1 == block.GetMerkleBranch(sizes[s] - 1));
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(merkle_tree_memo)
+{
+    // A tree built ahead of CheckBlock, as by the block import workers, is
+    // only reused while it matches the transactions
+    CBlock block;
+    for (int i = 0; i < 6; i++) {
+        CMutableTransaction tx;
+        tx.nLockTime = i;
+        block.vtx.push_back(CTransaction(tx));
+    }
+    BOOST_CHECK(!block.IsMerkleTreeBuilt());
+    uint256 root = block.BuildMerkleTree();
+    BOOST_CHECK(block.IsMerkleTreeBuilt());
+    BOOST_CHECK(block.FinishMerkleTree() == root);
+
+    CBlock copy(block);
+    BOOST_CHECK(copy.IsMerkleTreeBuilt());
+
+    block.vtx.pop_back();
+    BOOST_CHECK(!block.IsMerkleTreeBuilt());
+    BOOST_CHECK(block.BuildMerkleTree() != root);
+
+    CMutableTransaction tx;
+    tx.nLockTime = 100;
+    copy.vtx[2] = CTransaction(tx);
+    BOOST_CHECK(!copy.IsMerkleTreeBuilt());
+
+    copy.InitMerkleTree();
+    BOOST_CHECK(!copy.IsMerkleTreeBuilt());
+}
+
+BOOST_AUTO_TEST_CASE(parallel_checks)
+{
+    // A proof-of-stake block, so the header check needs no proof of work
+    CBlock block;
+    block.nTime = GetAdjustedTime();
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].scriptSig = CScript() << 1 << OP_0;
+    coinbase.vout.resize(1);
+    coinbase.vout[0].SetEmpty();
+    block.vtx.push_back(CTransaction(coinbase));
+    for (int i = 1; i < 500; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(uint256(i), 0);
+        tx.vout.resize(i == 1 ? 2 : 1);
+        if (i == 1)
+            tx.vout[0].SetEmpty();
+        tx.vout.back().nValue = i;
+        tx.vout.back().scriptPubKey = CScript() << OP_TRUE;
+        block.vtx.push_back(CTransaction(tx));
+    }
+    BOOST_CHECK(block.IsProofOfStake());
+
+    // The script-checking threads must give the same result and the same
+    // (first) error as the serial checks
+    for (int nInvalid = 0; nInvalid < 3; nInvalid++) {
+        if (nInvalid) {
+            CMutableTransaction tx(block.vtx[nInvalid * 150]);
+            if (nInvalid == 1)
+                tx.vout[0].nValue = -1;
+            else
+                tx.vin.clear();
+            block.vtx[nInvalid * 150] = CTransaction(tx);
+        }
+        block.hashMerkleRoot = block.BuildMerkleTree();
+
+        CValidationState stateSerial, stateParallel;
+        fParallelCheckBlock = false;
+        bool fSerial = CheckBlock(block, stateSerial, false, true);
+        fParallelCheckBlock = true;
+        bool fParallel = CheckBlock(block, stateParallel, false, true);
+        BOOST_CHECK_EQUAL(fSerial, nInvalid == 0);
+        BOOST_CHECK_EQUAL(fParallel, fSerial);
+        BOOST_CHECK_EQUAL(stateParallel.GetRejectReason(), stateSerial.GetRejectReason());
+        std::string strExpected = nInvalid == 0 ? "" : "bad-txns-vout-negative";
+        BOOST_CHECK_EQUAL(stateSerial.GetRejectReason(), strExpected);
+
+        // A wrong Merkle root is still found
+        block.hashMerkleRoot = uint256();
+        CValidationState stateMerkle;
+        BOOST_CHECK(!CheckBlock(block, stateMerkle, false, true));
+        BOOST_CHECK_EQUAL(stateMerkle.GetRejectReason(), "bad-txnmrklroot");
+    }
+    fParallelCheckBlock = DEFAULT_PARALLEL_CHECKBLOCK;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
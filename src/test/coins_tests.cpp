@@ -2,9 +2,13 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "chainparams.h"
 #include "coins.h"
+#include "primitives/block.h"
 #include "random.h"
+#include "txdb.h"
 #include "uint256.h"
+#include "utiltime.h"
 
 #include <vector>
 #include <map>
@@ -43,21 +47,89 @@ public:
 
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     {
-        for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
+        // Like CCoinsViewDB, only modified entries are written, and all are
+        // left to the caller.
+        for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+            if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+                continue;
             map_[it->first] = it->second.coins;
             if (it->second.coins.IsPruned() && insecure_rand() % 3 == 0) {
                 // Randomly delete empty entries on write.
                 map_.erase(it->first);
             }
-            mapCoins.erase(it++);
         }
-        mapCoins.clear();
         hashBestBlock_ = hashBlock;
         return true;
     }
 
     bool GetStats(CCoinsStats& stats) const { return false; }
 };
+
+// Holds each write until it is released, to look at a write in flight
+class CCoinsViewBlockingTest : public CCoinsViewTest
+{
+    boost::mutex cs;
+    boost::condition_variable cond;
+    bool fWriting;
+    bool fReleased;
+
+public:
+    CCoinsViewBlockingTest() : fWriting(false), fReleased(false) {}
+
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            fWriting = true;
+            cond.notify_all();
+            while (!fReleased)
+                cond.wait(lock);
+            fWriting = false;
+        }
+        return CCoinsViewTest::BatchWrite(mapCoins, hashBlock);
+    }
+
+    void WaitForWriting()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (!fWriting)
+            cond.wait(lock);
+    }
+
+    void Release()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fReleased = true;
+        cond.notify_all();
+    }
+};
+
+class CCoinsViewCacheTest : public CCoinsViewCache
+{
+public:
+    CCoinsViewCacheTest(CCoinsView* base) : CCoinsViewCache(base) {}
+
+    void SelfTest() const
+    {
+        // Manually recompute the dynamic usage of the whole data, and compare it.
+        size_t ret = memusage::DynamicUsage(cacheCoins);
+        for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
+            ret += it->second.DynamicMemoryUsage();
+        }
+        BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
+    }
+
+    bool HaveCoinsInCache(const uint256& txid) const { return cacheCoins.count(txid) > 0; }
+};
+
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, true) {}
+
+    void WriteLegacyCoins(const uint256& txid, const CCoins& coins) { db.Write(std::make_pair('c', txid), coins); }
+    void WriteBestBlock(const uint256& hashBlock) { db.Write('B', hashBlock); }
+};
 }
 
 BOOST_AUTO_TEST_SUITE(coins_tests)
@@ -83,14 +155,15 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
+    bool synced_a_cache = false;
 
     // A simple map to track what we expect the cache stack to represent.
     std::map<uint256, CCoins> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
-    std::vector<CCoinsViewCache*> stack; // A stack of CCoinsViewCaches on top.
-    stack.push_back(new CCoinsViewCache(&base)); // Start with one cache.
+    std::vector<CCoinsViewCacheTest*> stack; // A stack of CCoinsViewCaches on top.
+    stack.push_back(new CCoinsViewCacheTest(&base)); // Start with one cache.
 
     // Use a limited set of random transaction ids, so we do test overwriting entries.
     std::vector<uint256> txids;
@@ -115,6 +188,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 coins.nVersion = insecure_rand();
                 coins.vout.resize(1);
                 coins.vout[0].nValue = insecure_rand();
+                coins.vout[0].scriptPubKey.assign(insecure_rand() & 0x3F, 0);
                 *entry = coins;
             } else {
                 coins.Clear();
@@ -135,10 +209,20 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                     missed_an_entry = true;
                 }
             }
+            BOOST_FOREACH (const CCoinsViewCacheTest* test, stack) {
+                test->SelfTest();
+            }
         }
 
         if (insecure_rand() % 100 == 0) {
             // Every 100 iterations, change the cache stack.
+            if (stack.size() > 0 && insecure_rand() % 4 == 0) {
+                // Write the tip through but keep (part of) its entries.
+                BOOST_CHECK(stack.back()->Sync());
+                stack.back()->Trim(stack.back()->DynamicMemoryUsage() * (insecure_rand() % 4) / 4);
+                stack.back()->SelfTest();
+                synced_a_cache = true;
+            }
             if (stack.size() > 0 && insecure_rand() % 2 == 0) {
                 stack.back()->Flush();
                 delete stack.back();
@@ -151,7 +235,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
                 } else {
                     removed_all_caches = true;
                 }
-                stack.push_back(new CCoinsViewCache(tip));
+                stack.push_back(new CCoinsViewCacheTest(tip));
                 if (stack.size() == 4) {
                     reached_4_caches = true;
                 }
@@ -173,6 +257,491 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
     BOOST_CHECK(missed_an_entry);
+    BOOST_CHECK(synced_a_cache);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_sync_trim_test)
+{
+    CCoinsViewTest base;
+    CCoinsViewCacheTest cache(&base);
+    std::vector<uint256> vTxids;
+    for (int i = 0; i < 100; i++) {
+        vTxids.push_back(GetRandHash());
+        CCoinsModifier coins = cache.ModifyCoins(vTxids.back());
+        coins->vout.resize(1 + i % 3);
+        coins->vout[0].nValue = i + 1;
+        coins->vout[0].scriptPubKey.assign(25, i);
+    }
+
+    // Syncing writes everything through and keeps the entries
+    BOOST_CHECK(cache.Sync());
+    cache.SelfTest();
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), vTxids.size());
+    for (size_t i = 0; i < vTxids.size(); i++) {
+        CCoins coins;
+        BOOST_CHECK(base.GetCoins(vTxids[i], coins));
+        BOOST_CHECK(cache.HaveCoinsInCache(vTxids[i]));
+    }
+
+    // Spending after a sync deletes the coins from the base on the next one
+    cache.ModifyCoins(vTxids[0])->Clear();
+    BOOST_CHECK(cache.Sync());
+    CCoins coins;
+    BOOST_CHECK(!base.GetCoins(vTxids[0], coins) || coins.IsPruned());
+    BOOST_CHECK(!cache.HaveCoinsInCache(vTxids[0]));
+
+    // Trimming keeps the most recently used entries, and modified ones
+    for (size_t i = vTxids.size() - 10; i < vTxids.size(); i++)
+        BOOST_CHECK(cache.AccessCoins(vTxids[i]));
+    cache.ModifyCoins(vTxids[1])->vout[0].nValue = 1000;
+    size_t nDropped = cache.Trim(0);
+    cache.SelfTest();
+    BOOST_CHECK_EQUAL(nDropped, vTxids.size() - 2);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 1U);
+    BOOST_CHECK(cache.HaveCoinsInCache(vTxids[1]));
+
+    BOOST_CHECK(cache.Sync());
+    cache.Trim(cache.DynamicMemoryUsage());
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), 1U);
+    size_t nUsage = cache.DynamicMemoryUsage();
+    for (size_t i = 2; i < vTxids.size(); i++)
+        BOOST_CHECK(cache.AccessCoins(vTxids[i]));
+    cache.Trim(nUsage + (cache.DynamicMemoryUsage() - nUsage) / 2);
+    for (size_t i = vTxids.size() - 10; i < vTxids.size(); i++)
+        BOOST_CHECK(cache.HaveCoinsInCache(vTxids[i]));
+    BOOST_CHECK(!cache.HaveCoinsInCache(vTxids[2]));
+    BOOST_CHECK(cache.AccessCoins(vTxids[1])->vout[0].nValue == 1000);
+}
+
+static size_t CountStaged(const CCoinsViewPrefetch& prefetch)
+{
+    uint64_t nHits, nMisses;
+    size_t nStaged;
+    prefetch.WaitForIdle();
+    prefetch.GetPrefetchStats(nHits, nMisses, nStaged);
+    return nStaged;
+}
+
+BOOST_AUTO_TEST_CASE(coins_prefetch_test)
+{
+    CCoinsViewTest base;
+    std::vector<uint256> vTxids;
+    {
+        CCoinsViewCache cache(&base);
+        for (int i = 0; i < 10; i++) {
+            vTxids.push_back(GetRandHash());
+            CCoinsModifier coins = cache.ModifyCoins(vTxids.back());
+            coins->vout.resize(2);
+            coins->vout[0].nValue = i + 1;
+            coins->vout[1].nValue = i + 100;
+            coins->nHeight = i;
+        }
+        BOOST_CHECK(cache.Flush());
+    }
+
+    // A block spending each coin, and one output created within the block
+    CBlock block;
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vout.resize(1);
+    block.vtx.push_back(coinbase);
+    for (size_t i = 0; i < vTxids.size(); i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(vTxids[i], 0);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = i;
+        block.vtx.push_back(tx);
+    }
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(block.vtx.back().GetHash(), 0);
+    block.vtx.push_back(txChild);
+
+    CCoinsViewPrefetch prefetch(&base, 2, 1 << 20);
+    prefetch.PrefetchBlock(block);
+    BOOST_CHECK_EQUAL(CountStaged(prefetch), vTxids.size());
+
+    // Staged entries are served once, and match the backing view
+    uint64_t nHits, nMisses;
+    size_t nStaged;
+    {
+        CCoinsViewCache cache(&prefetch);
+        for (size_t i = 0; i < vTxids.size(); i++) {
+            const CCoins* coins = cache.AccessCoins(vTxids[i]);
+            BOOST_CHECK(coins && coins->IsAvailable(0) && coins->vout[0].nValue == (CAmount)(i + 1));
+        }
+        prefetch.GetPrefetchStats(nHits, nMisses, nStaged);
+        BOOST_CHECK_EQUAL(nHits, vTxids.size());
+        BOOST_CHECK_EQUAL(nMisses, 0U);
+        BOOST_CHECK_EQUAL(nStaged, 0U);
+
+        // Writing coins back drops everything staged in the meantime
+        prefetch.PrefetchBlock(block);
+        BOOST_CHECK_EQUAL(CountStaged(prefetch), vTxids.size());
+        cache.ModifyCoins(vTxids[0])->Spend(0);
+        BOOST_CHECK(cache.Flush());
+        prefetch.GetPrefetchStats(nHits, nMisses, nStaged);
+        BOOST_CHECK_EQUAL(nStaged, 0U);
+    }
+
+    CCoinsViewCache cache(&prefetch);
+    BOOST_CHECK(!cache.AccessCoins(vTxids[0])->IsAvailable(0));
+    BOOST_CHECK(cache.AccessCoins(vTxids[0])->IsAvailable(1));
+
+    // Staging stops at the memory budget, reads past it go to the backing view
+    CCoinsViewPrefetch prefetchSmall(&base, 2, 1);
+    prefetchSmall.PrefetchBlock(block);
+    BOOST_CHECK_EQUAL(CountStaged(prefetchSmall), 0U);
+    CCoinsViewCache cacheSmall(&prefetchSmall);
+    for (size_t i = 1; i < vTxids.size(); i++)
+        BOOST_CHECK(cacheSmall.AccessCoins(vTxids[i])->vout[0].nValue == (CAmount)(i + 1));
+}
+
+BOOST_AUTO_TEST_CASE(coins_async_writer_test)
+{
+    CCoinsViewTest base;
+    CCoinsViewAsyncWriter writer(&base);
+    CCoinsViewCache cache(&writer);
+
+    std::vector<uint256> vTxids;
+    for (int i = 0; i < 50; i++) {
+        vTxids.push_back(GetRandHash());
+        CCoinsModifier coins = cache.ModifyCoins(vTxids.back());
+        coins->vout.resize(1);
+        coins->vout[0].nValue = i + 1;
+    }
+    uint256 hashBlock = GetRandHash();
+    cache.SetBestBlock(hashBlock);
+    BOOST_CHECK(cache.Flush());
+
+    // Whether or not the write is done, the view sees the new state
+    BOOST_CHECK(writer.GetBestBlock() == hashBlock);
+    for (size_t i = 0; i < vTxids.size(); i++) {
+        CCoins coins;
+        BOOST_CHECK(writer.GetCoins(vTxids[i], coins));
+        BOOST_CHECK(coins.IsAvailable(0) && coins.vout[0].nValue == (CAmount)(i + 1));
+        BOOST_CHECK(writer.HaveCoins(vTxids[i]));
+    }
+
+    BOOST_CHECK(writer.WaitForWrite());
+    BOOST_CHECK(base.GetBestBlock() == hashBlock);
+    for (size_t i = 0; i < vTxids.size(); i++) {
+        CCoins coins;
+        BOOST_CHECK(base.GetCoins(vTxids[i], coins));
+        BOOST_CHECK(coins.vout[0].nValue == (CAmount)(i + 1));
+    }
+
+    // A second batch waits for the first and supersedes it
+    cache.ModifyCoins(vTxids[0])->Spend(0);
+    BOOST_CHECK(cache.Flush());
+    BOOST_CHECK(!cache.HaveCoins(vTxids[0]));
+    BOOST_CHECK(writer.WaitForWrite());
+    CCoins coins;
+    BOOST_CHECK(!base.GetCoins(vTxids[0], coins) || coins.IsPruned());
+}
+
+BOOST_AUTO_TEST_CASE(coins_async_writer_in_flight_test)
+{
+    CCoinsViewBlockingTest base;
+    CCoinsViewAsyncWriter writer(&base);
+    CCoinsViewCache cache(&writer);
+
+    std::vector<uint256> vTxids;
+    for (int i = 0; i < 50; i++) {
+        vTxids.push_back(GetRandHash());
+        CCoinsModifier coins = cache.ModifyCoins(vTxids.back());
+        coins->vout.resize(1);
+        coins->vout[0].nValue = i + 1;
+    }
+    uint256 hashBlock = GetRandHash();
+    cache.SetBestBlock(hashBlock);
+    size_t nCacheUsage = cache.DynamicMemoryUsage();
+    BOOST_CHECK_EQUAL(writer.DynamicMemoryUsage(), 0U);
+    BOOST_CHECK(cache.Sync());
+
+    // The base holds the write: the batch is served from memory and counts
+    // as the writer's, while the cache keeps its entries
+    base.WaitForWriting();
+    BOOST_CHECK(base.GetBestBlock() != hashBlock);
+    BOOST_CHECK(writer.GetBestBlock() == hashBlock);
+    BOOST_CHECK(writer.DynamicMemoryUsage() > 0);
+    BOOST_CHECK_EQUAL(cache.GetCacheSize(), vTxids.size());
+    BOOST_CHECK_EQUAL(cache.DynamicMemoryUsage(), nCacheUsage);
+    for (size_t i = 0; i < vTxids.size(); i++) {
+        CCoins coins;
+        BOOST_CHECK(!base.HaveCoins(vTxids[i]));
+        BOOST_CHECK(writer.GetCoins(vTxids[i], coins));
+        BOOST_CHECK(coins.IsAvailable(0) && coins.vout[0].nValue == (CAmount)(i + 1));
+        BOOST_CHECK(writer.HaveCoins(vTxids[i]));
+        BOOST_CHECK(cache.AccessCoins(vTxids[i])->vout[0].nValue == (CAmount)(i + 1));
+    }
+    BOOST_CHECK(!writer.HaveCoins(GetRandHash()));
+
+    base.Release();
+    BOOST_CHECK(writer.WaitForWrite());
+    BOOST_CHECK_EQUAL(writer.DynamicMemoryUsage(), 0U);
+    BOOST_CHECK(base.GetBestBlock() == hashBlock);
+    for (size_t i = 0; i < vTxids.size(); i++) {
+        CCoins coins;
+        BOOST_CHECK(base.GetCoins(vTxids[i], coins));
+        BOOST_CHECK(coins.vout[0].nValue == (CAmount)(i + 1));
+    }
+}
+
+static CCoins RandomCoins(unsigned int nOutputs)
+{
+    CCoins coins;
+    coins.nVersion = 1;
+    coins.nHeight = insecure_rand() % 100000;
+    coins.fCoinStake = insecure_rand() % 2;
+    coins.vout.resize(nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        coins.vout[i].nValue = insecure_rand() % 1000000 + 1;
+        coins.vout[i].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << ToByteVector(GetRandHash()) << OP_EQUALVERIFY;
+    }
+    return coins;
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_per_output_test)
+{
+    CCoinsViewDBTest db;
+    uint256 txid = GetRandHash();
+    const CCoins coinsTx = RandomCoins(300);
+    CCoins coinsWide = coinsTx;
+    {
+        CCoinsViewCache cache(&db);
+        *cache.ModifyCoins(txid) = coinsWide;
+        BOOST_CHECK(cache.Flush());
+    }
+    CCoins coins;
+    BOOST_CHECK(db.GetCoins(txid, coins));
+    BOOST_CHECK(coins == coinsWide);
+
+    // Spending outputs erases only their records
+    {
+        CCoinsViewCache cache(&db);
+        cache.ModifyCoins(txid)->Spend(7);
+        cache.ModifyCoins(txid)->Spend(299);
+        BOOST_CHECK(cache.Flush());
+    }
+    coinsWide.Spend(7);
+    coinsWide.Spend(299);
+    BOOST_CHECK(db.GetCoins(txid, coins));
+    BOOST_CHECK(coins == coinsWide);
+    BOOST_CHECK(coins.vout.size() == 299 && !coins.IsAvailable(7));
+
+    // Through a block's cache on top of the tip's, and restoring an output
+    // as disconnecting a block does
+    {
+        CCoinsViewCache cacheTip(&db);
+        {
+            CCoinsViewCache cacheBlock(&cacheTip);
+            {
+                CCoinsModifier modified = cacheBlock.ModifyCoins(txid);
+                modified->vout.resize(300);
+                modified->vout[299] = coinsTx.vout[299];
+                modified->Spend(12);
+            }
+            BOOST_CHECK(cacheBlock.Flush());
+        }
+        BOOST_CHECK(cacheTip.Flush());
+    }
+    coinsWide.vout.resize(300);
+    coinsWide.vout[299] = coinsTx.vout[299];
+    coinsWide.Spend(12);
+    BOOST_CHECK(db.GetCoins(txid, coins));
+    BOOST_CHECK(coins == coinsWide);
+    BOOST_CHECK(coins.IsAvailable(299) && !coins.IsAvailable(12));
+
+    // A duplicate transaction at another height rewrites all outputs
+    CCoins coinsDup = coinsTx;
+    coinsDup.nHeight = coinsTx.nHeight + 1;
+    {
+        CCoinsViewCache cache(&db);
+        *cache.ModifyCoins(txid) = coinsDup;
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(db.GetCoins(txid, coins));
+    BOOST_CHECK(coins == coinsDup);
+
+    {
+        CCoinsViewCache cache(&db);
+        cache.ModifyCoins(txid)->Clear();
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(!db.GetCoins(txid, coins));
+    BOOST_CHECK(!db.HaveCoins(txid));
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_write_base_test)
+{
+    CCoinsViewDBTest db;
+    uint256 txid = GetRandHash();
+    CCoins coinsTx = RandomCoins(20);
+    {
+        CCoinsViewCache cache(&db);
+        *cache.ModifyCoins(txid) = coinsTx;
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(db.HaveCoins(txid));
+    BOOST_CHECK(!db.HaveCoins(GetRandHash()));
+
+    // An entry remembers the outputs stored when it first changed, across
+    // further changes, and forgets them once written
+    CCoinsViewCache cache(&db);
+    cache.ModifyCoins(txid)->Spend(3);
+    cache.ModifyCoins(txid)->Spend(4);
+    BOOST_CHECK(cache.Sync());
+    cache.ModifyCoins(txid)->Spend(5);
+    BOOST_CHECK(cache.Flush());
+    coinsTx.Spend(3);
+    coinsTx.Spend(4);
+    coinsTx.Spend(5);
+    CCoins coins;
+    BOOST_CHECK(db.GetCoins(txid, coins));
+    BOOST_CHECK(coins == coinsTx);
+
+    // An entry made outside a cache falls back to the stored records
+    CCoinsMap mapCoins;
+    CCoinsCacheEntry& entry = mapCoins[txid];
+    entry.coins = coinsTx;
+    entry.coins.Spend(0);
+    entry.flags = CCoinsCacheEntry::DIRTY;
+    BOOST_CHECK(db.BatchWrite(mapCoins, uint256(0)));
+    coinsTx.Spend(0);
+    BOOST_CHECK(db.GetCoins(txid, coins));
+    BOOST_CHECK(coins == coinsTx);
+
+    // A wrong record of the stored outputs is trusted: only the difference
+    // from it is written
+    entry.coins = coinsTx;
+    entry.coins.Spend(1);
+    entry.coins.Spend(2);
+    entry.flags = CCoinsCacheEntry::DIRTY;
+    entry.RecordBase();
+    BOOST_CHECK(!(entry.flags & CCoinsCacheEntry::BASE));
+    entry.flags = 0;
+    entry.RecordBase();
+    entry.flags |= CCoinsCacheEntry::DIRTY;
+    entry.vBaseUnspent[0] |= 1 << 1;
+    BOOST_CHECK(db.BatchWrite(mapCoins, uint256(0)));
+    BOOST_CHECK(db.GetCoins(txid, coins));
+    BOOST_CHECK(!coins.IsAvailable(1));
+    BOOST_CHECK(coins.IsAvailable(2));
+}
+
+BOOST_AUTO_TEST_CASE(coins_partial_spend_test)
+{
+    CCoinsViewDBTest db;
+    uint256 txid = GetRandHash();
+    CCoins coinsTx = RandomCoins(300);
+    {
+        CCoinsViewCache cache(&db);
+        *cache.ModifyCoins(txid) = coinsTx;
+        BOOST_CHECK(cache.Flush());
+    }
+
+    CCoinsViewAsyncWriter writer(&db);
+    CCoinsViewCacheTest cacheTip(&writer);
+
+    // Reading an output only loads that one
+    const CCoins* coinsOut = cacheTip.AccessOutput(COutPoint(txid, 250));
+    BOOST_CHECK(coinsOut && coinsOut->IsAvailable(250));
+    BOOST_CHECK(coinsOut->vout[250] == coinsTx.vout[250]);
+    BOOST_CHECK(!coinsOut->IsAvailable(249));
+    BOOST_CHECK(cacheTip.DynamicMemoryUsage() < coinsTx.DynamicMemoryUsage());
+    BOOST_CHECK(!cacheTip.AccessOutput(COutPoint(txid, 300)) || !cacheTip.AccessOutput(COutPoint(txid, 300))->IsAvailable(300));
+    cacheTip.SelfTest();
+
+    // Each spend gets an undo record that restores it on its own
+    {
+        CCoinsViewCache cacheBlock(&cacheTip);
+        CTxInUndo undo;
+        BOOST_CHECK(cacheBlock.SpendOutput(COutPoint(txid, 250), undo));
+        BOOST_CHECK(undo.txout == coinsTx.vout[250]);
+        BOOST_CHECK(undo.nHeight == (unsigned int)coinsTx.nHeight && undo.fCoinStake == coinsTx.fCoinStake);
+        BOOST_CHECK(undo.nVersion == coinsTx.nVersion);
+        BOOST_CHECK(!cacheBlock.SpendOutput(COutPoint(txid, 250), undo));
+        BOOST_CHECK(cacheBlock.SpendOutput(COutPoint(txid, 10), undo));
+        BOOST_CHECK(undo.txout == coinsTx.vout[10] && undo.nHeight == (unsigned int)coinsTx.nHeight);
+        BOOST_CHECK(cacheBlock.Flush());
+    }
+    coinsTx.Spend(250);
+    coinsTx.Spend(10);
+    BOOST_CHECK(!cacheTip.AccessOutput(COutPoint(txid, 10))->IsAvailable(10));
+    cacheTip.SelfTest();
+
+    // The pending write overlays the stored outputs
+    BOOST_CHECK(cacheTip.Sync());
+    CCoins coins;
+    BOOST_CHECK(writer.GetCoins(txid, coins));
+    BOOST_CHECK(coins == coinsTx);
+    BOOST_CHECK(writer.GetCoinsOutput(COutPoint(txid, 11), coins));
+    BOOST_CHECK(coins.vout[11] == coinsTx.vout[11]);
+    BOOST_CHECK(!writer.GetCoinsOutput(COutPoint(txid, 10), coins));
+    BOOST_CHECK(writer.HaveCoins(txid));
+    BOOST_CHECK(writer.WaitForWrite());
+    BOOST_CHECK(db.GetCoins(txid, coins));
+    BOOST_CHECK(coins == coinsTx);
+
+    // Reading the whole transaction completes a partial entry
+    BOOST_CHECK(cacheTip.AccessOutput(COutPoint(txid, 11))->IsAvailable(11));
+    BOOST_CHECK(!cacheTip.AccessOutput(COutPoint(txid, 11))->IsAvailable(12));
+    BOOST_CHECK(*cacheTip.AccessCoins(txid) == coinsTx);
+    cacheTip.SelfTest();
+
+    // A partial entry spent down to nothing removes the transaction
+    {
+        CCoinsViewCacheTest cacheOne(&db);
+        CTxInUndo undo;
+        uint256 txidOne = GetRandHash();
+        *cacheOne.ModifyCoins(txidOne) = RandomCoins(2);
+        BOOST_CHECK(cacheOne.Flush());
+        BOOST_CHECK(cacheOne.SpendOutput(COutPoint(txidOne, 0), undo));
+        BOOST_CHECK(cacheOne.SpendOutput(COutPoint(txidOne, 1), undo));
+        BOOST_CHECK(!cacheOne.HaveCoins(txidOne));
+        BOOST_CHECK(cacheOne.Flush());
+        BOOST_CHECK(!db.HaveCoins(txidOne));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(coins_db_upgrade_test)
+{
+    // The same coins in both formats
+    CCoinsViewDBTest dbLegacy, dbNew;
+    std::vector<std::pair<uint256, CCoins> > vCoins;
+    {
+        CCoinsViewCache cache(&dbNew);
+        for (int i = 0; i < 50; i++) {
+            vCoins.push_back(std::make_pair(GetRandHash(), RandomCoins(1 + i % 7)));
+            if (i % 3 == 0 && vCoins.back().second.vout.size() > 1)
+                vCoins.back().second.Spend(0);
+            dbLegacy.WriteLegacyCoins(vCoins.back().first, vCoins.back().second);
+            *cache.ModifyCoins(vCoins.back().first) = vCoins.back().second;
+        }
+        cache.SetBestBlock(Params().HashGenesisBlock());
+        BOOST_CHECK(cache.Flush());
+    }
+    dbLegacy.WriteBestBlock(Params().HashGenesisBlock());
+
+    CCoins coins;
+    BOOST_CHECK(!dbLegacy.GetCoins(vCoins[0].first, coins));
+    BOOST_CHECK(dbLegacy.Upgrade());
+    BOOST_CHECK(dbLegacy.Upgrade());
+    for (size_t i = 0; i < vCoins.size(); i++) {
+        BOOST_CHECK(dbLegacy.GetCoins(vCoins[i].first, coins));
+        BOOST_CHECK(coins == vCoins[i].second);
+    }
+
+    // The UTXO set statistics do not depend on the format
+    CCoinsStats statsLegacy, statsNew;
+    BOOST_CHECK(dbLegacy.GetStats(statsLegacy));
+    BOOST_CHECK(dbNew.GetStats(statsNew));
+    BOOST_CHECK(statsLegacy.hashSerialized == statsNew.hashSerialized);
+    BOOST_CHECK_EQUAL(statsLegacy.nTransactions, vCoins.size());
+    BOOST_CHECK_EQUAL(statsLegacy.nTransactionOutputs, statsNew.nTransactionOutputs);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -3,11 +3,15 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "hash.h"
+#include "primitives/block.h"
 #include "utilstrencodings.h"
 
+#include <string.h>
 #include <vector>
 
+#include <boost/bind.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 
@@ -46,4 +50,167 @@ BOOST_AUTO_TEST_CASE(murmurhash3)
 #undef T
 }
 
+static void HashSharedHeader(const CBlockHeader& header, uint256& hash)
+{
+    hash = header.GetHash();
+}
+
+BOOST_AUTO_TEST_CASE(blockheader_hash_cache)
+{
+    CBlockHeader header;
+    header.nVersion = 1;
+    header.hashPrevBlock = uint256S("0x0000000000000000000000000000000000000000000000000000000000000001");
+    header.hashMerkleRoot = uint256S("0x00000000000000000000000000000000000000000000000000000000000000ff");
+    header.nTime = 1500000000;
+    header.nBits = 0x1e0ffff0;
+    header.nNonce = 42;
+
+    uint64_t nHits, nMisses, nHitsBefore, nMissesBefore;
+    CBlockHeader::GetHashCacheStats(nHitsBefore, nMissesBefore);
+
+    // Second call is served from the cache
+    uint256 hash = header.GetHash();
+    BOOST_CHECK(hash == HashQuark(BEGIN(header.nVersion), END(header.nNonce)));
+    BOOST_CHECK(header.GetHash() == hash);
+    CBlockHeader::GetHashCacheStats(nHits, nMisses);
+    BOOST_CHECK_EQUAL(nHits - nHitsBefore, 1U);
+    BOOST_CHECK_EQUAL(nMisses - nMissesBefore, 1U);
+
+    // Any header field change invalidates the cached hash
+    header.nNonce++;
+    uint256 hash2 = header.GetHash();
+    BOOST_CHECK(hash2 != hash);
+    BOOST_CHECK(hash2 == HashQuark(BEGIN(header.nVersion), END(header.nNonce)));
+    header.nNonce--;
+    BOOST_CHECK(header.GetHash() == hash);
+
+    // Copies keep the cached hash, and still notice changes
+    CBlock block(header);
+    CBlockHeader::GetHashCacheStats(nHitsBefore, nMissesBefore);
+    BOOST_CHECK(block.GetHash() == hash);
+    BOOST_CHECK(block.GetBlockHeader().GetHash() == hash);
+    CBlockHeader::GetHashCacheStats(nHits, nMisses);
+    BOOST_CHECK_EQUAL(nHits - nHitsBefore, 2U);
+    BOOST_CHECK_EQUAL(nMisses - nMissesBefore, 0U);
+    block.nTime++;
+    BOOST_CHECK(block.GetHash() == HashQuark(BEGIN(block.nVersion), END(block.nNonce)));
+    BOOST_CHECK(header.GetHash() == hash);
+
+    // Threads hashing a shared header for the first time all get its hash
+    for (int i = 0; i < 20; i++) {
+        CBlockHeader shared(header);
+        shared.nNonce = 1000 + i;
+        uint256 expected = HashQuark(BEGIN(shared.nVersion), END(shared.nNonce));
+        std::vector<uint256> vHashes(4);
+        boost::thread_group threads;
+        for (size_t j = 0; j < vHashes.size(); j++)
+            threads.create_thread(boost::bind(&HashSharedHeader, boost::cref(shared), boost::ref(vHashes[j])));
+        threads.join_all();
+        for (size_t j = 0; j < vHashes.size(); j++)
+            BOOST_CHECK(vHashes[j] == expected);
+        BOOST_CHECK(shared.GetHash() == expected);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(quark_primitives)
+{
+    // The Quark*512 functions may use SIMD or AES-NI code, compare them to sph
+#define T(name, fn) do { \
+        sph_##name##_context ctx; \
+        sph_##name##_init(&ctx); \
+        sph_##name(&ctx, in, 64); \
+        sph_##name##_close(&ctx, expected); \
+        fn(out, in); \
+        BOOST_CHECK(memcmp(out, expected, 64) == 0); \
+        memcpy(out, in, 64); \
+        fn(out, out); \
+        BOOST_CHECK(memcmp(out, expected, 64) == 0); \
+    } while (0)
+
+    unsigned char in[64], out[64], expected[64];
+    for (int i = 0; i < 64; i++) {
+        for (int j = 0; j < 64; j++)
+            in[j] = (unsigned char)(i * 64 + j * 13);
+        T(bmw512, QuarkBmw512);
+        T(groestl512, QuarkGroestl512);
+        T(jh512, QuarkJh512);
+        T(keccak512, QuarkKeccak512);
+        T(skein512, QuarkSkein512);
+    }
+
+#undef T
+
+    // Blake-512 also hashes the raw input: single block lengths, block
+    // headers and the longer inputs left to sph
+    const size_t lengths[] = {0, 1, 63, 64, 80, 111, 112, 127, 128, 200};
+    std::vector<unsigned char> data(200);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = (unsigned char)(i * 29 + 3);
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        sph_blake512_context ctx;
+        sph_blake512_init(&ctx);
+        sph_blake512(&ctx, &data[0], lengths[l]);
+        sph_blake512_close(&ctx, expected);
+        QuarkBlake512(out, &data[0], lengths[l]);
+        BOOST_CHECK(memcmp(out, expected, 64) == 0);
+    }
+
+    // Main network genesis block
+    CBlockHeader header;
+    header.nVersion = 1;
+    header.hashMerkleRoot = uint256("0xe42f36769ebc4dbf65fc045e003c885c14e8df0de323c81da1c2ae35069de340");
+    header.nTime = 1545706297;
+    header.nBits = 0x1e0ffff0;
+    header.nNonce = 2012117;
+    BOOST_CHECK(HashQuark(BEGIN(header.nVersion), END(header.nNonce)) == uint256("0x000001bf7d704efe6fe7e87cad75e56b7ab10f2f828038dd596f4e22e70e1bda"));
+}
+
+BOOST_AUTO_TEST_CASE(quark_batch)
+{
+    // Lengths cover block headers, the 64-byte inner stages and inputs too
+    // long for the single block Blake-512 lanes; counts cover partial groups.
+    const size_t lengths[] = {0, 64, 80, 111, 112, 200};
+    for (size_t l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+        for (size_t nCount = 0; nCount <= 9; nCount++) {
+            std::vector<std::vector<unsigned char> > vData(nCount);
+            std::vector<const unsigned char*> vInputs(nCount);
+            for (size_t i = 0; i < nCount; i++) {
+                vData[i].resize(lengths[l] + 1);
+                for (size_t j = 0; j < vData[i].size(); j++)
+                    vData[i][j] = (unsigned char)(j * 31 + i * 7 + nCount + l);
+                vInputs[i] = &vData[i][0];
+            }
+
+            std::vector<uint256> vHashes(nCount + 1);
+            HashQuarkBatch(nCount ? &vInputs[0] : NULL, lengths[l], nCount, &vHashes[0]);
+            for (size_t i = 0; i < nCount; i++)
+                BOOST_CHECK(vHashes[i] == HashQuark(vData[i].begin(), vData[i].begin() + lengths[l]));
+            BOOST_CHECK(vHashes[nCount] == uint256());
+        }
+    }
+
+    // Precomputed header hashes are served from the memo
+    std::vector<CBlockHeader> vHeaders(5);
+    for (size_t i = 0; i < vHeaders.size(); i++) {
+        vHeaders[i].nTime = 1500000000 + i;
+        vHeaders[i].nNonce = i * 1000;
+    }
+    CBlockHeader::PrecomputeHashes(&vHeaders[0], vHeaders.size());
+    for (size_t i = 0; i < vHeaders.size(); i++)
+        BOOST_CHECK(vHeaders[i].GetHash() == HashQuark(BEGIN(vHeaders[i].nVersion), END(vHeaders[i].nNonce)));
+}
+
+BOOST_AUTO_TEST_CASE(siphash)
+{
+    // Test vectors of the SipHash paper, with the key and message bytes 00 01 02 ...
+    CSipHasher hasher(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x726fdb47dd0e0e31ull);
+    hasher.Write(0x0706050403020100ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x93f5f5799a932462ull);
+    hasher.Write(0x0F0E0D0C0B0A0908ULL);
+    BOOST_CHECK_EQUAL(hasher.Finalize(), 0x3f2acc7f57c29bdbull);
+
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL, uint256("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100")), 0x7127512f72f27cceull);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,117 @@
+// Copyright (c) 2018 The Hash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "hash.h"
+#include "kernel.h"
+#include "main.h"
+#include "random.h"
+#include "streams.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(kernel_tests)
+
+BOOST_AUTO_TEST_CASE(kernel_hash_serialization)
+{
+    // The kernel hash must stay the double SHA256 of the serialized fields
+    for (int i = 0; i < 20; i++) {
+        uint64_t nStakeModifier = ((uint64_t)insecure_rand() << 32) | insecure_rand();
+        unsigned int nTimeBlockFrom = insecure_rand();
+        COutPoint prevout(GetRandHash(), i < 10 ? i : insecure_rand());
+        unsigned int nTimeTx = nTimeBlockFrom + insecure_rand() % 100000;
+
+        CHash256 hasher;
+        InitStakeKernelHasher(nStakeModifier, nTimeBlockFrom, prevout, hasher);
+        for (unsigned int nDrift = 0; nDrift < 64; nDrift += 7) {
+            CDataStream ss(SER_GETHASH, 0);
+            ss << nStakeModifier << nTimeBlockFrom << prevout.n << prevout.hash << nTimeTx + nDrift;
+            BOOST_CHECK(GetStakeKernelHash(hasher, nTimeTx + nDrift) == Hash(ss.begin(), ss.end()));
+        }
+    }
+}
+
+// The kernel stake modifier of pindexFrom, found by walking the active chain
+static const CBlockIndex* WalkKernelModifier(const CBlockIndex* pindexFrom)
+{
+    int64_t nTime = pindexFrom->GetBlockTime();
+    const CBlockIndex* pindex = pindexFrom;
+    while (nTime < pindexFrom->GetBlockTime() + GetStakeModifierSelectionInterval()) {
+        pindex = chainActive.Next(pindex);
+        if (!pindex)
+            return NULL;
+        if (pindex->GeneratedStakeModifier())
+            nTime = pindex->GetBlockTime();
+    }
+    return pindex;
+}
+
+static void CheckKernelModifiers(bool fRecord)
+{
+    for (int nHeight = 0; nHeight <= chainActive.Height(); nHeight++) {
+        const CBlockIndex* pindexFrom = chainActive[nHeight];
+        const CBlockIndex* pindexExpected = WalkKernelModifier(pindexFrom);
+        uint64_t nStakeModifier;
+        int nStakeModifierHeight;
+        int64_t nStakeModifierTime;
+        bool fFound = GetKernelStakeModifier(pindexFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false, fRecord && nHeight % 2 == 0);
+        BOOST_CHECK_EQUAL(fFound, pindexExpected != NULL);
+        if (fFound && pindexExpected) {
+            BOOST_CHECK_EQUAL(nStakeModifierHeight, pindexExpected->nHeight);
+            BOOST_CHECK_EQUAL(nStakeModifier, pindexExpected->nStakeModifier);
+        }
+    }
+}
+
+static void ConnectKernelBlocks(CBlockIndex* vBlocks, int nFirst, int nLast)
+{
+    for (int nHeight = nFirst; nHeight <= nLast; nHeight++) {
+        chainActive.SetTip(&vBlocks[nHeight]);
+        UpdateKernelStakeModifiers(&vBlocks[nHeight]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(kernel_modifier_reorg)
+{
+    // The modifier table keeps pointers to the blocks, so they outlive the test
+    static CBlockIndex vMain[200];
+    static CBlockIndex vFork[240];
+    const int nForkHeight = 120;
+
+    int64_t nSpacing = GetStakeModifierSelectionInterval() / 30;
+    for (int i = 0; i < 200; i++) {
+        vMain[i].nHeight = i;
+        vMain[i].pprev = i ? &vMain[i - 1] : NULL;
+        vMain[i].nTime = 1500000000 + i * nSpacing;
+        vMain[i].SetStakeModifier(1000 + i, i % 3 == 0);
+    }
+    for (int i = nForkHeight + 1; i < 240; i++) {
+        vFork[i].nHeight = i;
+        vFork[i].pprev = i == nForkHeight + 1 ? &vMain[nForkHeight] : &vFork[i - 1];
+        vFork[i].nTime = vMain[nForkHeight].nTime + (i - nForkHeight) * nSpacing / 2;
+        vFork[i].SetStakeModifier(5000 + i, i % 4 == 1);
+    }
+
+    LOCK(cs_main);
+    CBlockIndex* pindexOld = chainActive.Tip();
+
+    // Cached and walked modifiers agree as the chain grows, as it is
+    // reorganized to the fork, and back
+    ConnectKernelBlocks(vMain, 0, 199);
+    CheckKernelModifiers(false);
+    CheckKernelModifiers(true);
+    CheckKernelModifiers(false);
+
+    ConnectKernelBlocks(vFork, nForkHeight + 1, 239);
+    CheckKernelModifiers(false);
+    CheckKernelModifiers(true);
+
+    ConnectKernelBlocks(vMain, nForkHeight + 1, 199);
+    CheckKernelModifiers(false);
+    CheckKernelModifiers(true);
+    CheckKernelModifiers(false);
+
+    chainActive.SetTip(pindexOld);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,102 @@
+// Copyright (c) 2018 The Hash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "masternode.h"
+#include "masternodeman.h"
+#include "random.h"
+#include "spork.h"
+#include "txmempool.h"
+
+#include <list>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(masternode_tests)
+
+BOOST_AUTO_TEST_CASE(masternode_collateral_tiers)
+{
+    // Without sporks, the first tier holds up to the last spork's default height
+    BOOST_CHECK_EQUAL(GetMasternodeCollateral(0), 10000 * COIN);
+    BOOST_CHECK_EQUAL(GetMasternodeCollateral(SPORK_29_COLLAT_11_DEFAULT), 10000 * COIN);
+    BOOST_CHECK_EQUAL(GetMasternodeCollateral(SPORK_29_COLLAT_11_DEFAULT + 1), 7500 * COIN);
+
+    // Each spork ends a tier at its height
+    mapSporksActive[SPORK_19_COLLAT_01].nValue = 100;
+    mapSporksActive[SPORK_20_COLLAT_02].nValue = 200;
+    BOOST_CHECK_EQUAL(GetMasternodeCollateral(100), 10000 * COIN);
+    BOOST_CHECK_EQUAL(GetMasternodeCollateral(101), 15000 * COIN);
+    BOOST_CHECK_EQUAL(GetMasternodeCollateral(200), 15000 * COIN);
+    BOOST_CHECK_EQUAL(GetMasternodeCollateral(201), 20000 * COIN);
+    mapSporksActive.erase(SPORK_19_COLLAT_01);
+    mapSporksActive.erase(SPORK_20_COLLAT_02);
+}
+
+static uint256 AddCollateralCoins(bool fCoinBase, int nHeight)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    if (!fCoinBase)
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vin[0].scriptSig = CScript() << insecure_rand();
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 10000 * COIN;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    CTransaction txConst(tx);
+    BOOST_CHECK_EQUAL(txConst.IsCoinBase(), fCoinBase);
+
+    LOCK(cs_main);
+    pcoinsTip->ModifyCoins(txConst.GetHash())->FromTx(txConst, nHeight);
+    return txConst.GetHash();
+}
+
+BOOST_AUTO_TEST_CASE(masternode_collateral_states)
+{
+    RegisterValidationInterface(&mnodeman);
+    int nHeight = chainActive.Height();
+
+    // An output of a regular transaction is available right away
+    COutPoint outpoint(AddCollateralCoins(false, nHeight), 0);
+    CMasternodeCollateral collateral;
+    BOOST_CHECK(mnodeman.GetCollateral(outpoint, collateral));
+    BOOST_CHECK(collateral.fAvailable);
+    BOOST_CHECK_EQUAL(collateral.nHeight, nHeight);
+    BOOST_CHECK_EQUAL(collateral.nValue, 10000 * COIN);
+
+    // A coinbase output is not, until it is mature
+    COutPoint outpointCoinBase(AddCollateralCoins(true, nHeight), 0);
+    BOOST_CHECK(mnodeman.GetCollateral(outpointCoinBase, collateral));
+    BOOST_CHECK(!collateral.fAvailable);
+
+    // Neither is an output spent in the mempool...
+    CMutableTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = outpoint;
+    txSpend.vout.resize(1);
+    txSpend.vout[0].nValue = 9999 * COIN;
+    CTransaction txSpendConst(txSpend);
+    mempool.addUnchecked(txSpendConst.GetHash(), CTxMemPoolEntry(txSpendConst, COIN, 0, 0, nHeight));
+    SyncWithWallets(txSpendConst);
+    BOOST_CHECK(mnodeman.GetCollateral(outpoint, collateral));
+    BOOST_CHECK(!collateral.fAvailable);
+
+    // ...until the spend leaves it again
+    std::list<CTransaction> removed;
+    mempool.remove(txSpendConst, removed);
+    BOOST_CHECK(mnodeman.GetCollateral(outpoint, collateral));
+    BOOST_CHECK(collateral.fAvailable);
+
+    // A missing output is not available
+    BOOST_CHECK(mnodeman.GetCollateral(COutPoint(GetRandHash(), 0), collateral));
+    BOOST_CHECK(!collateral.fAvailable);
+
+    UnregisterValidationInterface(&mnodeman);
+    LOCK(cs_main);
+    pcoinsTip->ModifyCoins(outpoint.hash)->Clear();
+    pcoinsTip->ModifyCoins(outpointCoinBase.hash)->Clear();
+    // Leave no collaterals cached for the suites that follow
+    mnodeman.Clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
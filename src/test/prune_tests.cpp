@@ -0,0 +1,155 @@
+// Copyright (c) 2018 The Hash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "masternode-budget.h"
+#include "random.h"
+#include "txdb.h"
+
+#include <set>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(prune_tests)
+
+static const uint64_t FILE_SIZE = 100 * 1024 * 1024;
+static const uint64_t UNDO_SIZE = 10 * 1024 * 1024;
+
+// Block files of 110 MiB each, file i holding heights 1000 * i up to 1000 * i + 999
+static std::vector<CBlockFileInfo> MakeBlockFiles(int nFiles)
+{
+    std::vector<CBlockFileInfo> vinfo(nFiles);
+    for (int i = 0; i < nFiles; i++) {
+        vinfo[i].AddBlock(1000 * i, 0);
+        vinfo[i].AddBlock(1000 * i + 999, 0);
+        vinfo[i].nSize = FILE_SIZE;
+        vinfo[i].nUndoSize = UNDO_SIZE;
+    }
+    return vinfo;
+}
+
+BOOST_AUTO_TEST_CASE(prune_find_files)
+{
+    const uint64_t nBuffer = BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE;
+    std::vector<CBlockFileInfo> vinfo = MakeBlockFiles(10);
+    std::set<int> setFiles;
+
+    // Under the target, nothing goes
+    FindFilesToPrune(vinfo, 9, 100000, 10 * (FILE_SIZE + UNDO_SIZE) + nBuffer + 1, setFiles);
+    BOOST_CHECK(setFiles.empty());
+
+    // Just the oldest files that bring the usage below the target go
+    FindFilesToPrune(vinfo, 9, 100000, 7 * (FILE_SIZE + UNDO_SIZE) + nBuffer, setFiles);
+    BOOST_CHECK_EQUAL(setFiles.size(), 4U);
+    for (int i = 0; i < 4; i++)
+        BOOST_CHECK(setFiles.count(i));
+
+    // The last file is never pruned, however far over the target
+    setFiles.clear();
+    FindFilesToPrune(vinfo, 9, 100000, 1, setFiles);
+    BOOST_CHECK_EQUAL(setFiles.size(), 9U);
+    BOOST_CHECK(!setFiles.count(9));
+
+    // Files with a block above the last prunable height are kept
+    setFiles.clear();
+    FindFilesToPrune(vinfo, 9, 2999, 1, setFiles);
+    BOOST_CHECK_EQUAL(setFiles.size(), 3U);
+    for (int i = 0; i < 3; i++)
+        BOOST_CHECK(setFiles.count(i));
+    setFiles.clear();
+    FindFilesToPrune(vinfo, 9, 2998, 1, setFiles);
+    BOOST_CHECK_EQUAL(setFiles.size(), 2U);
+    BOOST_CHECK(!setFiles.count(2));
+
+    // Files pruned before are skipped and do not count
+    vinfo[0].SetNull();
+    vinfo[1].SetNull();
+    setFiles.clear();
+    FindFilesToPrune(vinfo, 9, 100000, 6 * (FILE_SIZE + UNDO_SIZE) + nBuffer + 1, setFiles);
+    BOOST_CHECK_EQUAL(setFiles.size(), 2U);
+    BOOST_CHECK(setFiles.count(2));
+    BOOST_CHECK(setFiles.count(3));
+}
+
+BOOST_AUTO_TEST_CASE(prune_block_file_index)
+{
+    std::vector<uint256> vHashes(30);
+    std::vector<CBlockIndex> vBlocks(30);
+    BlockMap mapIndex;
+    for (int i = 0; i < 30; i++) {
+        vHashes[i] = GetRandHash();
+        vBlocks[i].phashBlock = &vHashes[i];
+        vBlocks[i].nHeight = i;
+        vBlocks[i].nFile = i / 10;
+        vBlocks[i].nDataPos = 8 + i * 1000;
+        vBlocks[i].nUndoPos = 8 + i * 100;
+        vBlocks[i].nStatus = BLOCK_VALID_SCRIPTS | BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO;
+        mapIndex[vHashes[i]] = &vBlocks[i];
+    }
+
+    std::vector<CBlockIndex*> vPruned;
+    PruneBlockFileIndex(mapIndex, 1, vPruned);
+    BOOST_CHECK_EQUAL(vPruned.size(), 10U);
+    std::set<CBlockIndex*> setPruned(vPruned.begin(), vPruned.end());
+    for (int i = 0; i < 30; i++) {
+        const CBlockIndex& block = vBlocks[i];
+        if (i / 10 == 1) {
+            // The block's data is gone, but its validity stays known
+            BOOST_CHECK(setPruned.count(&vBlocks[i]));
+            BOOST_CHECK(!(block.nStatus & BLOCK_HAVE_DATA));
+            BOOST_CHECK(!(block.nStatus & BLOCK_HAVE_UNDO));
+            BOOST_CHECK(block.IsValid(BLOCK_VALID_SCRIPTS));
+            BOOST_CHECK_EQUAL(block.nDataPos, 0U);
+            BOOST_CHECK_EQUAL(block.nUndoPos, 0U);
+        } else {
+            BOOST_CHECK(block.nStatus & BLOCK_HAVE_DATA);
+            BOOST_CHECK(block.nStatus & BLOCK_HAVE_UNDO);
+            BOOST_CHECK_EQUAL(block.nFile, i / 10);
+            BOOST_CHECK_EQUAL(block.nDataPos, 8U + i * 1000);
+        }
+    }
+
+    // Pruning a file again finds nothing left in it
+    vPruned.clear();
+    PruneBlockFileIndex(mapIndex, 2, vPruned);
+    BOOST_CHECK_EQUAL(vPruned.size(), 10U);
+    vPruned.clear();
+    PruneBlockFileIndex(mapIndex, 2, vPruned);
+    BOOST_CHECK(vPruned.empty());
+}
+
+BOOST_AUTO_TEST_CASE(prune_budget_collaterals)
+{
+    CMutableTransaction txFee;
+    txFee.vout.resize(2);
+    txFee.vout[0].nValue = PROPOSAL_FEE_TX;
+    txFee.vout[0].scriptPubKey = CScript() << OP_RETURN << ToByteVector(GetRandHash());
+    txFee.vout[1].nValue = 1 * COIN;
+    txFee.vout[1].scriptPubKey = CScript() << ToByteVector(GetRandHash()) << OP_CHECKSIG;
+    BOOST_CHECK(IsBudgetCollateralTx(txFee));
+
+    CMutableTransaction txSmall = txFee;
+    txSmall.vout[0].nValue = PROPOSAL_FEE_TX - 1;
+    BOOST_CHECK(!IsBudgetCollateralTx(txSmall));
+    CMutableTransaction txData = txFee;
+    txData.vout[0].scriptPubKey = CScript() << OP_RETURN << std::vector<unsigned char>(20, 1);
+    BOOST_CHECK(!IsBudgetCollateralTx(txData));
+
+    // Without a transaction index, the fee is found without its block
+    uint256 hashBlock = GetRandHash();
+    std::vector<CTransaction> vtx(1, txFee);
+    BOOST_CHECK(pblocktree->WriteBudgetCollaterals(vtx, hashBlock));
+    bool fTxIndexOld = fTxIndex;
+    fTxIndex = false;
+    CTransaction tx;
+    uint256 hashBlockOut;
+    BOOST_CHECK(GetTransaction(txFee.GetHash(), tx, hashBlockOut, false));
+    BOOST_CHECK(tx.GetHash() == txFee.GetHash());
+    BOOST_CHECK(hashBlockOut == hashBlock);
+    BOOST_CHECK(!GetTransaction(CTransaction(txSmall).GetHash(), tx, hashBlockOut, false));
+    fTxIndex = fTxIndexOld;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
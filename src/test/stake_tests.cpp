@@ -0,0 +1,183 @@
+// Copyright (c) 2018 The Hash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Unit tests for checking the stake of blocks before they are stored
+//
+
+#include "main.h"
+#include "pow.h"
+#include "random.h"
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/test/unit_test.hpp>
+
+// Tests these internal-to-main.cpp methods:
+extern bool AddStakePendingBlock(const CBlock& block, NodeId peer);
+extern void EraseStakePendingBlocksFor(NodeId peer);
+extern void ProcessStakePendingBlocks();
+extern unsigned int CountUnverifiedHeaders(std::vector<CBlockIndex*>& vHeaders);
+struct CStakePendingBlock {
+    boost::shared_ptr<CBlock> pblock;
+    NodeId fromPeer;
+};
+extern std::map<uint256, CStakePendingBlock> mapStakePendingBlocks;
+
+BOOST_AUTO_TEST_SUITE(stake_tests)
+
+// A proof-of-stake block staking an output nobody has
+static CBlock MakeStakeBlock(const CBlockIndex* pindexPrev)
+{
+    CBlock block;
+    block.hashPrevBlock = pindexPrev->GetBlockHash();
+    block.nTime = pindexPrev->GetBlockTime() + 60;
+    CMutableTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vout.resize(1);
+    txCoinBase.vout[0].SetEmpty();
+    CMutableTransaction txCoinStake;
+    txCoinStake.vin.resize(1);
+    txCoinStake.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txCoinStake.vout.resize(2);
+    txCoinStake.vout[0].SetEmpty();
+    txCoinStake.vout[1].nValue = 1000 * COIN;
+    txCoinStake.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    block.vtx.push_back(txCoinBase);
+    block.vtx.push_back(txCoinStake);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    block.nBits = GetNextWorkRequired(pindexPrev, &block);
+    return block;
+}
+
+// A header of another branch than the active chain, whose block we do not have
+struct ForkHeader {
+    uint256 hash;
+    CBlockIndex index;
+
+    ForkHeader(CBlockIndex* pindexPrev, const uint256& hashIn = GetRandHash())
+    {
+        hash = hashIn;
+        index.phashBlock = &hash;
+        index.pprev = pindexPrev;
+        index.nHeight = pindexPrev->nHeight + 1;
+        index.nTime = pindexPrev->nTime + 60;
+        index.nStatus = BLOCK_VALID_TREE;
+        mapBlockIndex[hash] = &index;
+    }
+
+    ~ForkHeader()
+    {
+        mapBlockIndex.erase(hash);
+    }
+};
+
+BOOST_AUTO_TEST_CASE(stake_checked_before_store)
+{
+    LOCK(cs_main);
+    CBlockIndex* pindexGenesis = chainActive.Genesis();
+    ForkHeader fork(pindexGenesis);
+
+    // On the active chain, a stake that does not check is rejected
+    CBlock block = MakeStakeBlock(pindexGenesis);
+    CValidationState state;
+    CBlockIndex* pindex = NULL;
+    BOOST_CHECK(!AcceptBlock(block, state, &pindex, NULL, true));
+    BOOST_CHECK(state.IsValid());
+    BOOST_CHECK(!mapBlockIndex.count(block.GetHash()));
+
+    // Off it, the block is handed back to wait for its parent, and not stored
+    CBlock blockFork = MakeStakeBlock(&fork.index);
+    state = CValidationState();
+    BOOST_CHECK(!AcceptBlock(blockFork, state, &pindex, NULL, true));
+    int nDoS = -1;
+    BOOST_CHECK(state.IsInvalid(nDoS));
+    BOOST_CHECK_EQUAL(nDoS, 0);
+    BOOST_CHECK_EQUAL(state.GetRejectReason(), "stake-pending");
+    BOOST_CHECK(!mapBlockIndex.count(blockFork.GetHash()));
+
+    // So is one whose header came first
+    {
+        ForkHeader header(&fork.index, blockFork.GetHash());
+        state = CValidationState();
+        pindex = NULL;
+        BOOST_CHECK(!AcceptBlock(blockFork, state, &pindex, NULL, true));
+        BOOST_CHECK_EQUAL(state.GetRejectReason(), "stake-pending");
+        BOOST_CHECK(!(header.index.nStatus & BLOCK_HAVE_DATA));
+        BOOST_CHECK_EQUAL(header.index.nTx, 0U);
+    }
+
+    // A wrong difficulty is no reason to wait
+    CBlock blockBits = MakeStakeBlock(&fork.index);
+    blockBits.nBits--;
+    state = CValidationState();
+    BOOST_CHECK(!AcceptBlock(blockBits, state, &pindex, NULL, true));
+    BOOST_CHECK(state.IsValid());
+}
+
+BOOST_AUTO_TEST_CASE(stake_pending_blocks)
+{
+    LOCK(cs_main);
+    CBlockIndex* pindexGenesis = chainActive.Genesis();
+    ForkHeader fork(pindexGenesis);
+    const NodeId peer = 1000;
+
+    // Each peer keeps a bounded number of blocks, as do all of them together
+    for (unsigned int i = 0; i < MAX_STAKE_PENDING_BLOCKS_PER_PEER; i++)
+        BOOST_CHECK(AddStakePendingBlock(MakeStakeBlock(&fork.index), peer));
+    BOOST_CHECK(!AddStakePendingBlock(MakeStakeBlock(&fork.index), peer));
+    CBlock block = MakeStakeBlock(&fork.index);
+    BOOST_CHECK(AddStakePendingBlock(block, peer + 1));
+    BOOST_CHECK(!AddStakePendingBlock(block, peer + 2));
+    for (NodeId id = peer + 2; mapStakePendingBlocks.size() < MAX_STAKE_PENDING_BLOCKS; id++)
+        BOOST_CHECK(AddStakePendingBlock(MakeStakeBlock(&fork.index), id));
+    BOOST_CHECK(!AddStakePendingBlock(MakeStakeBlock(&fork.index), peer + 100));
+
+    // Nothing is processed while the parents are not connected
+    ProcessStakePendingBlocks();
+    BOOST_CHECK_EQUAL(mapStakePendingBlocks.size(), MAX_STAKE_PENDING_BLOCKS);
+
+    // A block whose parent is connected is processed, and dropped here
+    EraseStakePendingBlocksFor(peer);
+    BOOST_CHECK_EQUAL(mapStakePendingBlocks.size(), MAX_STAKE_PENDING_BLOCKS - MAX_STAKE_PENDING_BLOCKS_PER_PEER);
+    CBlock blockTip = MakeStakeBlock(pindexGenesis);
+    BOOST_CHECK(AddStakePendingBlock(blockTip, peer));
+    ProcessStakePendingBlocks();
+    BOOST_CHECK(!mapStakePendingBlocks.count(blockTip.GetHash()));
+    BOOST_CHECK_EQUAL(mapStakePendingBlocks.size(), MAX_STAKE_PENDING_BLOCKS - MAX_STAKE_PENDING_BLOCKS_PER_PEER);
+    BOOST_CHECK(!mapBlockIndex.count(blockTip.GetHash()));
+
+    // As are the blocks of a branch found invalid
+    fork.index.nStatus |= BLOCK_FAILED_VALID;
+    ProcessStakePendingBlocks();
+    BOOST_CHECK(mapStakePendingBlocks.empty());
+}
+
+BOOST_AUTO_TEST_CASE(stake_unverified_headers)
+{
+    std::vector<CBlockIndex> vIndex(10);
+    std::vector<CBlockIndex*> vHeaders;
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+        vHeaders.push_back(&vIndex[i]);
+    BOOST_CHECK_EQUAL(CountUnverifiedHeaders(vHeaders), 10U);
+
+    // Headers leave once their block was checked, even if pruned since, or
+    // once they are found invalid
+    vIndex[2].nTx = 1;
+    vIndex[2].nStatus = BLOCK_VALID_TRANSACTIONS | BLOCK_HAVE_DATA;
+    vIndex[5].nStatus = BLOCK_VALID_TREE | BLOCK_FAILED_VALID;
+    vIndex[7].nTx = 3;
+    vIndex[7].nStatus = BLOCK_VALID_SCRIPTS;
+    BOOST_CHECK_EQUAL(CountUnverifiedHeaders(vHeaders), 7U);
+    BOOST_CHECK(std::find(vHeaders.begin(), vHeaders.end(), &vIndex[2]) == vHeaders.end());
+    BOOST_CHECK(std::find(vHeaders.begin(), vHeaders.end(), &vIndex[5]) == vHeaders.end());
+    BOOST_CHECK(std::find(vHeaders.begin(), vHeaders.end(), &vIndex[7]) == vHeaders.end());
+    BOOST_CHECK(vHeaders.front() == &vIndex[0] && vHeaders.back() == &vIndex[9]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,8 @@
 
 #define BOOST_TEST_MODULE Hash Test Suite
 
+#include "crypto/quark.h"
+#include "crypto/sha256.h"
 #include "main.h"
 #include "random.h"
 #include "txdb.h"
@@ -31,6 +33,8 @@ struct TestingSetup {
 
     TestingSetup() {
         SetupEnvironment();
+        QuarkAutoDetect();
+        SHA256AutoDetect();
         fPrintToDebugLog = false; // don't want to write to debug.log file
         fCheckBlockIndex = true;
         SelectParams(CBaseChainParams::UNITTEST);
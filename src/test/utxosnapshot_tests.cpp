@@ -0,0 +1,148 @@
+// Copyright (c) 2018 The Hash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "coins.h"
+#include "main.h"
+#include "masternode-budget.h"
+#include "random.h"
+#include "txdb.h"
+#include "util.h"
+#include "utxosnapshot.h"
+
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(utxosnapshot_tests)
+
+static bool LoadSnapshot(const boost::filesystem::path& path, CCoinsViewDB& coinsdb)
+{
+    CBlockTreeDB blocktree(1 << 20, true);
+    std::string strError;
+    return LoadUTXOSnapshot(path, coinsdb, blocktree, strError);
+}
+
+BOOST_AUTO_TEST_CASE(utxosnapshot_roundtrip)
+{
+    // A coin database at the tip, the genesis block here
+    CCoinsViewDB dbSource(1 << 20, true);
+    std::map<uint256, CCoins> mapExpected;
+    {
+        CCoinsViewCache cache(&dbSource);
+        for (int i = 0; i < 40; i++) {
+            uint256 txid = GetRandHash();
+            {
+                CCoinsModifier coins = cache.ModifyCoins(txid);
+                coins->nVersion = 1;
+                coins->nHeight = i;
+                coins->fCoinBase = i % 5 == 0;
+                coins->vout.resize(i % 3 + 1);
+                for (unsigned int n = 0; n < coins->vout.size(); n++) {
+                    coins->vout[n].nValue = insecure_rand() % 1000000 + 1;
+                    coins->vout[n].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << ToByteVector(GetRandHash()) << OP_EQUALVERIFY;
+                }
+                if (coins->vout.size() > 1 && i % 4 == 0)
+                    coins->Spend(0);
+            }
+            mapExpected[txid] = *cache.AccessCoins(txid);
+        }
+        cache.SetBestBlock(chainActive.Tip()->GetBlockHash());
+        BOOST_CHECK(cache.Flush());
+    }
+    CCoinsStats stats;
+    BOOST_CHECK(dbSource.GetStats(stats));
+
+    // A budget fee paid in the active chain comes along, one paid elsewhere
+    // does not
+    CMutableTransaction txFee;
+    txFee.vout.resize(1);
+    txFee.vout[0].nValue = PROPOSAL_FEE_TX;
+    txFee.vout[0].scriptPubKey = CScript() << OP_RETURN << ToByteVector(GetRandHash());
+    CMutableTransaction txFeeOrphan = txFee;
+    txFeeOrphan.vout[0].scriptPubKey = CScript() << OP_RETURN << ToByteVector(GetRandHash());
+    BOOST_CHECK(pblocktree->WriteBudgetCollaterals(std::vector<CTransaction>(1, txFee), chainActive.Tip()->GetBlockHash()));
+    BOOST_CHECK(pblocktree->WriteBudgetCollaterals(std::vector<CTransaction>(1, txFeeOrphan), GetRandHash()));
+
+    boost::filesystem::path path = GetDataDir() / "utxosnapshot_roundtrip.dat";
+    CUTXOSnapshotHeader header;
+    std::string strError;
+    BOOST_CHECK(DumpUTXOSnapshot(path, dbSource, header, strError));
+    BOOST_CHECK(header.hashBlock == chainActive.Tip()->GetBlockHash());
+    BOOST_CHECK_EQUAL(header.nHeight, chainActive.Height());
+    BOOST_CHECK_EQUAL(header.nTransactions, 40U);
+    BOOST_CHECK(header.hashSerialized == stats.hashSerialized);
+    BOOST_CHECK_EQUAL(header.nBudgetCollaterals, 1U);
+
+    // Only a snapshot pinned with both its hashes is loaded
+    {
+        CCoinsViewDB db(1 << 20, true);
+        BOOST_CHECK(!LoadSnapshot(path, db));
+        MapSnapshotAnchors mapAnchors;
+        mapAnchors[header.nHeight] = CSnapshotAnchor(header.hashBlock, GetRandHash(), header.hashIndex);
+        ModifiableParams()->setSnapshotAnchors(mapAnchors);
+        BOOST_CHECK(!LoadSnapshot(path, db));
+        mapAnchors[header.nHeight] = CSnapshotAnchor(header.hashBlock, header.hashSerialized, GetRandHash());
+        ModifiableParams()->setSnapshotAnchors(mapAnchors);
+        BOOST_CHECK(!LoadSnapshot(path, db));
+        BOOST_CHECK(db.GetBestBlock() == uint256(0));
+    }
+    MapSnapshotAnchors mapAnchors;
+    mapAnchors[header.nHeight] = CSnapshotAnchor(header.hashBlock, header.hashSerialized, header.hashIndex);
+    ModifiableParams()->setSnapshotAnchors(mapAnchors);
+
+    {
+        CCoinsViewDB db(1 << 20, true);
+        CBlockTreeDB blocktree(1 << 20, true);
+        std::string strError;
+        BOOST_CHECK(LoadUTXOSnapshot(path, db, blocktree, strError));
+        BOOST_CHECK(db.GetBestBlock() == header.hashBlock);
+        bool fFromSnapshot = false;
+        BOOST_CHECK(blocktree.ReadFlag("utxosnapshot", fFromSnapshot) && fFromSnapshot);
+        CTransaction tx;
+        uint256 hashBlock;
+        BOOST_CHECK(blocktree.ReadBudgetCollateral(txFee.GetHash(), tx, hashBlock));
+        BOOST_CHECK(tx.GetHash() == txFee.GetHash());
+        BOOST_CHECK(hashBlock == header.hashBlock);
+        BOOST_CHECK(!blocktree.ReadBudgetCollateral(CTransaction(txFeeOrphan).GetHash(), tx, hashBlock));
+        for (std::map<uint256, CCoins>::const_iterator it = mapExpected.begin(); it != mapExpected.end(); it++) {
+            CCoins coins;
+            BOOST_CHECK(db.GetCoins(it->first, coins));
+            BOOST_CHECK(coins == it->second);
+        }
+        CCoinsStats statsLoaded;
+        BOOST_CHECK(db.GetStats(statsLoaded));
+        BOOST_CHECK(statsLoaded.hashSerialized == stats.hashSerialized);
+        BOOST_CHECK_EQUAL(statsLoaded.nTransactionOutputs, stats.nTransactionOutputs);
+    }
+
+    // A changed output does not match the pinned hash
+    std::vector<char> vData;
+    {
+        std::ifstream file(path.string().c_str(), std::ios::binary);
+        vData.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    BOOST_REQUIRE(vData.size() > 20);
+    vData[vData.size() - 10] ^= 1;
+    boost::filesystem::path pathCorrupt = GetDataDir() / "utxosnapshot_corrupt.dat";
+    {
+        std::ofstream file(pathCorrupt.string().c_str(), std::ios::binary);
+        file.write(&vData[0], vData.size());
+    }
+    {
+        CCoinsViewDB db(1 << 20, true);
+        BOOST_CHECK(!LoadSnapshot(pathCorrupt, db));
+        BOOST_CHECK(db.GetBestBlock() == uint256(0));
+    }
+
+    ModifiableParams()->setSnapshotAnchors(MapSnapshotAnchors());
+    boost::filesystem::remove(path);
+    boost::filesystem::remove(pathCorrupt);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -6,24 +6,172 @@
 
 #include "txdb.h"
 
+#include "init.h"
 #include "main.h"
+#include "memusage.h"
 #include "pow.h"
+#include "ui_interface.h"
 #include "uint256.h"
+#include "util.h"
 
+#include <set>
 #include <stdint.h>
 
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
 
-void static BatchWriteCoins(CLevelDBBatch& batch, const uint256& hash, const CCoins& coins)
+/** Number of block index entries read from disk and hashed together */
+static const size_t BLOCK_INDEX_LOAD_BATCH = 1024;
+
+namespace
 {
-    if (coins.IsPruned())
-        batch.Erase(make_pair('c', hash));
-    else
-        batch.Write(make_pair('c', hash), coins);
+/**
+ * Key of one unspent output in the coin database: 'C', the txid and
+ * VARINT(n). All outputs of a transaction share the ('C', txid) prefix.
+ */
+struct CCoinKey {
+    char chType;
+    uint256 txid;
+    uint32_t n;
+
+    CCoinKey() : chType('C'), n(0) {}
+    CCoinKey(const uint256& txidIn, uint32_t nIn) : chType('C'), txid(txidIn), n(nIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(chType);
+        READWRITE(txid);
+        READWRITE(VARINT(n));
+    }
+};
+
+/**
+ * Value of one unspent output in the coin database. It repeats the
+ * metadata of its transaction, so that spending an output only erases
+ * its own record:
+ * - VARINT(nVersion)
+ * - VARINT(nCode), nHeight * 4 + fCoinStake * 2 + fCoinBase
+ * - the output (via CTxOutCompressor)
+ */
+struct CCoinRecord {
+    int nTxVersion;
+    unsigned int nCode;
+    CTxOut out;
+
+    CCoinRecord() : nTxVersion(0), nCode(0) {}
+    CCoinRecord(const CCoins& coins, unsigned int n) : nTxVersion(coins.nVersion), out(coins.vout[n])
+    {
+        nCode = coins.nHeight * 4 + (coins.fCoinStake ? 2 : 0) + (coins.fCoinBase ? 1 : 0);
+    }
+
+    bool operator==(const CCoinRecord& other) const
+    {
+        return nTxVersion == other.nTxVersion && nCode == other.nCode && out == other.out;
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(VARINT(nTxVersion));
+        READWRITE(VARINT(nCode));
+        READWRITE(REF(CTxOutCompressor(out)));
+    }
+
+    void AddTo(CCoins& coins, unsigned int n) const
+    {
+        coins.nVersion = nTxVersion;
+        coins.nHeight = nCode / 4;
+        coins.fCoinStake = (nCode & 2) != 0;
+        coins.fCoinBase = (nCode & 1) != 0;
+        if (coins.vout.size() <= n)
+            coins.vout.resize(n + 1);
+        coins.vout[n] = out;
+    }
+};
+
+/** Whether slKey is the key of an output record under ssPrefix */
+bool IsCoinRecordKey(const leveldb::Slice& slKey, const CDataStream& ssPrefix)
+{
+    return slKey.size() > ssPrefix.size() && memcmp(slKey.data(), &ssPrefix[0], ssPrefix.size()) == 0;
 }
 
+/** Read the records of txid, seeking pcursor to them; returns whether there were any */
+bool ReadCoinRecords(leveldb::Iterator* pcursor, const uint256& txid, CCoins& coins)
+{
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << make_pair('C', txid);
+    coins.Clear();
+    bool fFound = false;
+    for (pcursor->Seek(leveldb::Slice(&ssPrefix[0], ssPrefix.size())); pcursor->Valid(); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        if (!IsCoinRecordKey(slKey, ssPrefix))
+            break;
+        CDataStream ssKey(slKey.data() + ssPrefix.size(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+        uint32_t n;
+        ssKey >> VARINT(n);
+        leveldb::Slice slValue = pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+        CCoinRecord record;
+        ssValue >> record;
+        record.AddTo(coins, n);
+        fFound = true;
+    }
+    HandleError(pcursor->status());
+    return fFound;
+}
+
+/** Add the changes from the stored outputs of txid (coinsOld) to coins to the batch */
+void BatchWriteCoins(CLevelDBBatch& batch, const uint256& txid, const CCoins& coinsOld, const CCoins& coins, size_t& nWritten, size_t& nErased)
+{
+    // Outputs never change once created, but a duplicate transaction may
+    // carry different metadata.
+    bool fSameMetadata = coins.nVersion == coinsOld.nVersion && coins.nHeight == coinsOld.nHeight &&
+                         coins.fCoinBase == coinsOld.fCoinBase && coins.fCoinStake == coinsOld.fCoinStake;
+    for (unsigned int i = 0; i < std::max(coins.vout.size(), coinsOld.vout.size()); i++) {
+        bool fOld = coinsOld.IsAvailable(i);
+        if (coins.IsAvailable(i)) {
+            if (!fOld || !fSameMetadata || coins.vout[i] != coinsOld.vout[i]) {
+                batch.Write(CCoinKey(txid, i), CCoinRecord(coins, i));
+                nWritten++;
+            }
+        } else if (fOld) {
+            batch.Erase(CCoinKey(txid, i));
+            nErased++;
+        }
+    }
+}
+
+/** Add the changes from the outputs the entry recorded as stored (see CCoinsCacheEntry::RecordBase) to the batch */
+void BatchWriteCoins(CLevelDBBatch& batch, const uint256& txid, const CCoinsCacheEntry& entry, size_t& nWritten, size_t& nErased)
+{
+    const CCoins& coins = entry.coins;
+    // The outputs of a txid never change, but a duplicate transaction comes
+    // at another height.
+    bool fSameHeight = coins.nHeight == entry.nBaseHeight;
+    for (unsigned int i = 0; i < std::max(coins.vout.size(), entry.vBaseUnspent.size() * 8); i++) {
+        bool fOld = entry.IsBaseUnspent(i);
+        if (coins.IsAvailable(i)) {
+            if (!fOld || !fSameHeight) {
+                batch.Write(CCoinKey(txid, i), CCoinRecord(coins, i));
+                nWritten++;
+            }
+        } else if (fOld) {
+            batch.Erase(CCoinKey(txid, i));
+            nErased++;
+        }
+    }
+}
+} // namespace
+
 void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
 {
     batch.Write('B', hash);
@@ -35,12 +183,30 @@ CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(Get
 
 bool CCoinsViewDB::GetCoins(const uint256& txid, CCoins& coins) const
 {
-    return db.Read(make_pair('c', txid), coins);
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewReadIterator());
+    return ReadCoinRecords(pcursor.get(), txid, coins);
+}
+
+bool CCoinsViewDB::GetCoinsOutput(const COutPoint& out, CCoins& coins) const
+{
+    CCoinRecord record;
+    if (!db.Read(CCoinKey(out.hash, out.n), record))
+        return false;
+    coins.Clear();
+    record.AddTo(coins, out.n);
+    return true;
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256& txid) const
 {
-    return db.Exists(make_pair('c', txid));
+    // A single seek finds whether any output of txid is stored
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewReadIterator());
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << make_pair('C', txid);
+    pcursor->Seek(leveldb::Slice(&ssPrefix[0], ssPrefix.size()));
+    bool fFound = pcursor->Valid() && IsCoinRecordKey(pcursor->key(), ssPrefix);
+    HandleError(pcursor->status());
+    return fFound;
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const
@@ -54,24 +220,465 @@ uint256 CCoinsViewDB::GetBestBlock() const
 bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
 {
     CLevelDBBatch batch;
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewReadIterator());
     size_t count = 0;
     size_t changed = 0;
+    size_t nWritten = 0;
+    size_t nErased = 0;
+    const CCoins coinsNone;
+    // The entries are only read, so the caller keeps all of them
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            BatchWriteCoins(batch, it->first, it->second.coins);
+            // Fresh entries have no records yet; for the others, only the
+            // outputs that differ from the stored ones are written. The
+            // entries know which outputs are stored, unless they were made
+            // outside a cache; only then are the records read.
+            if (it->second.flags & CCoinsCacheEntry::FRESH) {
+                BatchWriteCoins(batch, it->first, coinsNone, it->second.coins, nWritten, nErased);
+            } else if (it->second.flags & CCoinsCacheEntry::BASE) {
+                BatchWriteCoins(batch, it->first, it->second, nWritten, nErased);
+            } else {
+                CCoins coinsOld;
+                ReadCoinRecords(pcursor.get(), it->first, coinsOld);
+                BatchWriteCoins(batch, it->first, coinsOld, it->second.coins, nWritten, nErased);
+            }
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
+        it++;
     }
     if (hashBlock != uint256(0))
         BatchWriteHashBestChain(batch, hashBlock);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database: %u outputs written, %u erased...\n", (unsigned int)changed, (unsigned int)count, (unsigned int)nWritten, (unsigned int)nErased);
     return db.WriteBatch(batch);
 }
 
+bool CCoinsViewDB::Upgrade()
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << 'c';
+    pcursor->Seek(leveldb::Slice(&ssPrefix[0], ssPrefix.size()));
+    if (!pcursor->Valid() || pcursor->key()[0] != 'c')
+        return true;
+
+    LogPrintf("Upgrading the coin database to one record per output...\n");
+    uiInterface.InitMessage(_("Upgrading coin database..."));
+    size_t nTransactions = 0;
+    size_t nOutputs = 0;
+    while (pcursor->Valid() && pcursor->key()[0] == 'c') {
+        // Each batch converts some transactions and erases their old
+        // records together, so an interrupted upgrade resumes where it stopped.
+        CLevelDBBatch batch;
+        size_t nBatchOutputs = 0;
+        for (; pcursor->Valid() && pcursor->key()[0] == 'c' && nBatchOutputs < COINS_UPGRADE_BATCH; pcursor->Next()) {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            uint256 txid;
+            ssKey >> chType >> txid;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            CCoins coins;
+            ssValue >> coins;
+            for (unsigned int i = 0; i < coins.vout.size(); i++) {
+                if (coins.IsAvailable(i)) {
+                    batch.Write(CCoinKey(txid, i), CCoinRecord(coins, i));
+                    nBatchOutputs++;
+                }
+            }
+            batch.Erase(make_pair('c', txid));
+            nTransactions++;
+        }
+        db.WriteBatch(batch);
+        nOutputs += nBatchOutputs;
+        if (ShutdownRequested()) {
+            LogPrintf("Coin database upgrade interrupted after %u transactions\n", (unsigned int)nTransactions);
+            return false;
+        }
+    }
+    HandleError(pcursor->status());
+    LogPrintf("Upgraded %u transactions to %u output records in the coin database\n", (unsigned int)nTransactions, (unsigned int)nOutputs);
+    return true;
+}
+
+/** Memory taken by a staged entry */
+static size_t StagedUsage(const CCoins& coins)
+{
+    return memusage::MallocUsage(sizeof(memusage::stl_tree_node<std::pair<const uint256, CCoins> >)) + coins.DynamicMemoryUsage();
+}
+
+CCoinsViewPrefetch::CCoinsViewPrefetch(CCoinsView* viewIn, int nThreads, size_t nMaxStagedUsageIn) : CCoinsViewBacked(viewIn), fStop(false), nBusy(0), nStagedUsage(0), nMaxStagedUsage(nMaxStagedUsageIn), nHits(0), nMisses(0)
+{
+    for (int i = 0; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&CCoinsViewPrefetch::ThreadPrefetch, this));
+}
+
+CCoinsViewPrefetch::~CCoinsViewPrefetch()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fStop = true;
+    }
+    cond.notify_all();
+    threadGroup.join_all();
+}
+
+void CCoinsViewPrefetch::ThreadPrefetch()
+{
+    RenameThread("hash-prefetch");
+    bool fWasBusy = false;
+    while (true) {
+        CDiskBlockPos pos;
+        uint256 txid;
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            if (fWasBusy) {
+                nBusy--;
+                fWasBusy = false;
+                if (nBusy == 0 && queueBlocks.empty() && queueTxids.empty())
+                    condIdle.notify_all();
+            }
+            while (!fStop && queueBlocks.empty() && queueTxids.empty())
+                cond.wait(lock);
+            if (fStop)
+                return;
+            // Finish the inputs of the earliest block before expanding the next one
+            if (!queueTxids.empty()) {
+                txid = queueTxids.front();
+                queueTxids.pop_front();
+            } else {
+                pos = queueBlocks.front();
+                queueBlocks.pop_front();
+            }
+            nBusy++;
+            fWasBusy = true;
+            if (pos.IsNull() && (mapStaged.count(txid) || nStagedUsage >= nMaxStagedUsage))
+                continue;
+        }
+
+        if (!pos.IsNull()) {
+            CBlock block;
+            if (ReadBlockFromDisk(block, pos))
+                PrefetchBlock(block);
+            continue;
+        }
+
+        // BatchWrite may not change the database between the read and the
+        // staging, or a stale entry could be served afterwards.
+        boost::shared_lock<boost::shared_mutex> lockWrite(csWrite);
+        CCoins coins;
+        if (!base->GetCoins(txid, coins))
+            continue;
+        boost::unique_lock<boost::mutex> lock(cs);
+        size_t nUsage = StagedUsage(coins);
+        if (nStagedUsage + nUsage <= nMaxStagedUsage && !mapStaged.count(txid)) {
+            mapStaged[txid].swap(coins);
+            nStagedUsage += nUsage;
+        }
+    }
+}
+
+void CCoinsViewPrefetch::WaitForIdle() const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (nBusy > 0 || !queueBlocks.empty() || !queueTxids.empty())
+        condIdle.wait(lock);
+}
+
+void CCoinsViewPrefetch::ClearStaged() const
+{
+    mapStaged.clear();
+    nStagedUsage = 0;
+}
+
+void CCoinsViewPrefetch::PrefetchBlock(const CBlock& block)
+{
+    // Outputs created within the block are not in the database yet
+    std::set<uint256> setCreated;
+    std::vector<uint256> vTxids;
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        setCreated.insert(tx.GetHash());
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+            if (!setCreated.count(txin.prevout.hash))
+                vTxids.push_back(txin.prevout.hash);
+        }
+    }
+    if (vTxids.empty())
+        return;
+
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        BOOST_FOREACH (const uint256& txid, vTxids) {
+            if (queueTxids.size() >= MAX_QUEUED)
+                break;
+            queueTxids.push_back(txid);
+        }
+    }
+    cond.notify_all();
+}
+
+void CCoinsViewPrefetch::PrefetchBlocks(const std::vector<CDiskBlockPos>& vpos)
+{
+    if (vpos.empty())
+        return;
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        queueBlocks.insert(queueBlocks.end(), vpos.begin(), vpos.end());
+    }
+    cond.notify_all();
+}
+
+void CCoinsViewPrefetch::GetPrefetchStats(uint64_t& nHitsOut, uint64_t& nMissesOut, size_t& nStagedOut) const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    nHitsOut = nHits;
+    nMissesOut = nMisses;
+    nStagedOut = mapStaged.size();
+}
+
+bool CCoinsViewPrefetch::GetCoins(const uint256& txid, CCoins& coins) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        std::map<uint256, CCoins>::iterator it = mapStaged.find(txid);
+        if (it != mapStaged.end()) {
+            // The cache above keeps its own copy from now on
+            nStagedUsage -= StagedUsage(it->second);
+            coins.swap(it->second);
+            mapStaged.erase(it);
+            nHits++;
+            return true;
+        }
+        nMisses++;
+    }
+    return base->GetCoins(txid, coins);
+}
+
+bool CCoinsViewPrefetch::GetCoinsOutput(const COutPoint& out, CCoins& coins) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        std::map<uint256, CCoins>::const_iterator it = mapStaged.find(out.hash);
+        if (it != mapStaged.end()) {
+            nHits++;
+            if (!it->second.IsAvailable(out.n))
+                return false;
+            coins.FromOutput(it->second, out.n);
+            return true;
+        }
+        nMisses++;
+    }
+    return base->GetCoinsOutput(out, coins);
+}
+
+bool CCoinsViewPrefetch::HaveCoins(const uint256& txid) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (mapStaged.count(txid))
+            return true;
+    }
+    return base->HaveCoins(txid);
+}
+
+bool CCoinsViewPrefetch::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+{
+    boost::unique_lock<boost::shared_mutex> lockWrite(csWrite);
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        LogPrint("coindb", "Coins prefetch: %u hits, %u misses, %u entries dropped\n", nHits, nMisses, mapStaged.size());
+        ClearStaged();
+    }
+    return base->BatchWrite(mapCoins, hashBlock);
+}
+
+CCoinsViewAsyncWriter::CCoinsViewAsyncWriter(CCoinsView* viewIn) : CCoinsViewBacked(viewIn), fStop(false), nPendingUsage(0), fPending(false), fFailed(false)
+{
+    thread = boost::thread(boost::bind(&CCoinsViewAsyncWriter::ThreadWrite, this));
+}
+
+CCoinsViewAsyncWriter::~CCoinsViewAsyncWriter()
+{
+    WaitForWrite();
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fStop = true;
+    }
+    cond.notify_all();
+    thread.join();
+}
+
+void CCoinsViewAsyncWriter::ThreadWrite()
+{
+    RenameThread("hash-coinswrite");
+    while (true) {
+        uint256 hashWrite;
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            while (!fStop && !fPending)
+                cond.wait(lock);
+            if (fStop)
+                return;
+            hashWrite = hashPending;
+        }
+
+        // The batch does not change until it is written, and the base only
+        // reads it, like the readers do; so it is shared with them in place.
+        int64_t nStart = GetTimeMicros();
+        bool fOk = false;
+        try {
+            fOk = base->BatchWrite(mapPending, hashWrite);
+        } catch (const std::exception& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+        }
+        LogPrint("coindb", "Background coins write took %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
+
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            if (fOk) {
+                mapPending.clear();
+                nPendingUsage = 0;
+                fPending = false;
+            } else {
+                // Keep serving the batch from memory; the node is shutting down
+                fFailed = true;
+            }
+        }
+        cond.notify_all();
+        if (!fOk) {
+            AbortNode("Failed to write to coin database");
+            return;
+        }
+    }
+}
+
+bool CCoinsViewAsyncWriter::WaitForWrite() const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (fPending && !fFailed)
+        cond.wait(lock);
+    return !fFailed;
+}
+
+size_t CCoinsViewAsyncWriter::DynamicMemoryUsage() const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    return nPendingUsage;
+}
+
+bool CCoinsViewAsyncWriter::GetCoins(const uint256& txid, CCoins& coins) const
+{
+    CCoinsCacheEntry entryPartial;
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (fPending) {
+            CCoinsMap::const_iterator it = mapPending.find(txid);
+            if (it != mapPending.end()) {
+                if (!(it->second.flags & CCoinsCacheEntry::PARTIAL)) {
+                    coins = it->second.coins;
+                    return true;
+                }
+                entryPartial = it->second;
+            }
+        }
+    }
+    if (!(entryPartial.flags & CCoinsCacheEntry::PARTIAL))
+        return base->GetCoins(txid, coins);
+    if (!base->GetCoins(txid, coins))
+        coins.Clear();
+    // A partial entry only knows the outputs it spent; the base has the
+    // others, whether or not it has the batch yet
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        if (entryPartial.IsBaseUnspent(i) && !entryPartial.coins.IsAvailable(i))
+            coins.vout[i].SetNull();
+    }
+    coins.Cleanup();
+    return true;
+}
+
+bool CCoinsViewAsyncWriter::GetCoinsOutput(const COutPoint& out, CCoins& coins) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (fPending) {
+            CCoinsMap::const_iterator it = mapPending.find(out.hash);
+            if (it != mapPending.end() && it->second.HasOutput(out.n)) {
+                if (!it->second.coins.IsAvailable(out.n))
+                    return false;
+                coins.FromOutput(it->second.coins, out.n);
+                return true;
+            }
+        }
+    }
+    return base->GetCoinsOutput(out, coins);
+}
+
+bool CCoinsViewAsyncWriter::HaveCoins(const uint256& txid) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (fPending) {
+            CCoinsMap::const_iterator it = mapPending.find(txid);
+            if (it != mapPending.end()) {
+                if (!(it->second.flags & CCoinsCacheEntry::PARTIAL) || !it->second.coins.IsPruned())
+                    return !it->second.coins.IsPruned();
+                // Its other outputs may be unspent
+                lock.unlock();
+                CCoins coins;
+                return GetCoins(txid, coins) && !coins.IsPruned();
+            }
+        }
+    }
+    return base->HaveCoins(txid);
+}
+
+uint256 CCoinsViewAsyncWriter::GetBestBlock() const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (fPending && hashPending != uint256(0))
+            return hashPending;
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewAsyncWriter::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+{
+    if (!WaitForWrite())
+        return false;
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        // Only modified entries are written, like CCoinsViewDB does. They
+        // are copied, so the caller keeps them, and a cache that syncs into
+        // this view stays warm with its most recently modified coins.
+        size_t nUsage = 0;
+        for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+            if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+                CCoinsCacheEntry& entry = mapPending[it->first];
+                entry = it->second;
+                nUsage += entry.DynamicMemoryUsage();
+            }
+        }
+        nPendingUsage = nUsage + memusage::DynamicUsage(mapPending);
+        hashPending = hashBlock;
+        fPending = true;
+    }
+    cond.notify_all();
+    return true;
+}
+
+bool CCoinsViewAsyncWriter::GetStats(CCoinsStats& stats) const
+{
+    if (!WaitForWrite())
+        return false;
+    return base->GetStats(stats);
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe)
 {
 }
@@ -81,6 +688,14 @@ bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
     return Write(make_pair('b', blockindex.GetBlockHash()), blockindex);
 }
 
+bool CBlockTreeDB::WriteBlockIndex(const std::vector<CDiskBlockIndex>& vIndex)
+{
+    CLevelDBBatch batch;
+    for (std::vector<CDiskBlockIndex>::const_iterator it = vIndex.begin(); it != vIndex.end(); it++)
+        batch.Write(make_pair('b', it->GetBlockHash()), *it);
+    return WriteBatch(batch);
+}
+
 bool CBlockTreeDB::WriteBlockFileInfo(int nFile, const CBlockFileInfo& info)
 {
     return Write(make_pair('f', nFile), info);
@@ -115,57 +730,93 @@ bool CBlockTreeDB::ReadLastBlockFile(int& nFile)
     return Read('l', nFile);
 }
 
-bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
+void UpdateCoinsStats(CCoinsStats& stats, CHashWriter& ss, const uint256& txid, const CCoins& coins)
 {
-    /* It seems that there are no "const iterators" for LevelDB.  Since we
-       only need read operations on it, use a const-cast to get around
-       that restriction.  */
-    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
+    ss << txid;
+    ss << VARINT(coins.nVersion);
+    ss << (coins.fCoinBase ? 'c' : 'n');
+    ss << VARINT(coins.nHeight);
+    stats.nTransactions++;
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        const CTxOut& out = coins.vout[i];
+        if (!out.IsNull()) {
+            stats.nTransactionOutputs++;
+            ss << VARINT(i + 1);
+            ss << out;
+            stats.nTotalAmount += out.nValue;
+        }
+    }
+    ss << VARINT(0);
+}
 
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock();
-    ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
+CCoinsViewDBCursor* CCoinsViewDB::Cursor() const
+{
+    CCoinsViewDBCursor* pcursor = new CCoinsViewDBCursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
+    // The iterator reads a snapshot of the database; take the best block
+    // from it too, so that it matches the coins.
+    CDataStream ssBestBlock(SER_DISK, CLIENT_VERSION);
+    ssBestBlock << 'B';
+    pcursor->pcursor->Seek(leveldb::Slice(&ssBestBlock[0], ssBestBlock.size()));
+    if (pcursor->pcursor->Valid() && pcursor->pcursor->key() == leveldb::Slice(&ssBestBlock[0], ssBestBlock.size())) {
+        leveldb::Slice slValue = pcursor->pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+        ssValue >> pcursor->hashBestBlock;
+    }
+    CDataStream ssPrefix(SER_DISK, CLIENT_VERSION);
+    ssPrefix << 'C';
+    pcursor->pcursor->Seek(leveldb::Slice(&ssPrefix[0], ssPrefix.size()));
+    pcursor->Next();
+    return pcursor;
+}
+
+void CCoinsViewDBCursor::Next()
+{
+    // The outputs of a transaction are adjacent; collect them so callers
+    // see whole transactions, as before the upgrade.
+    fValid = false;
+    coins.Clear();
+    nSerializedSize = 0;
     while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CCoins coins;
-                ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
-                ss << txhash;
-                ss << VARINT(coins.nVersion);
-                ss << (coins.fCoinBase ? 'c' : 'n');
-                ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
-                for (unsigned int i = 0; i < coins.vout.size(); i++) {
-                    const CTxOut& out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i + 1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + slValue.size();
-                ss << VARINT(0);
-            }
-            pcursor->Next();
-        } catch (std::exception& e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() == 0 || slKey[0] != 'C')
+            break;
+        CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+        CCoinKey key;
+        ssKey >> key;
+        if (fValid && key.txid != txid)
+            break;
+        leveldb::Slice slValue = pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+        CCoinRecord record;
+        ssValue >> record;
+        if (!fValid) {
+            txid = key.txid;
+            fValid = true;
         }
+        record.AddTo(coins, key.n);
+        nSerializedSize += slKey.size() + slValue.size();
+        pcursor->Next();
     }
-    stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
+    HandleError(pcursor->status());
+}
+
+bool CCoinsViewDB::GetStats(CCoinsStats& stats) const
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    try {
+        boost::scoped_ptr<CCoinsViewDBCursor> pcursor(Cursor());
+        stats.hashBlock = pcursor->GetBestBlock();
+        ss << stats.hashBlock;
+        for (; pcursor->Valid(); pcursor->Next()) {
+            boost::this_thread::interruption_point();
+            UpdateCoinsStats(stats, ss, pcursor->GetTxid(), pcursor->GetCoins());
+            stats.nSerializedSize += pcursor->GetSerializedSize();
+        }
+    } catch (std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
@@ -182,6 +833,51 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::ReadBudgetCollateral(const uint256& txid, CTransaction& tx, uint256& hashBlock)
+{
+    std::pair<uint256, CTransaction> record;
+    if (!Read(make_pair('c', txid), record))
+        return false;
+    hashBlock = record.first;
+    tx = record.second;
+    return true;
+}
+
+bool CBlockTreeDB::WriteBudgetCollaterals(const std::vector<CTransaction>& vtx, const uint256& hashBlock)
+{
+    CLevelDBBatch batch;
+    for (std::vector<CTransaction>::const_iterator it = vtx.begin(); it != vtx.end(); it++)
+        batch.Write(make_pair('c', it->GetHash()), make_pair(hashBlock, *it));
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadBudgetCollaterals(std::vector<std::pair<uint256, CTransaction> >& vRecords)
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('c', uint256(0));
+    pcursor->Seek(ssKeySet.str());
+
+    try {
+        for (; pcursor->Valid(); pcursor->Next()) {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            ssKey >> chType;
+            if (chType != 'c')
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            vRecords.push_back(std::pair<uint256, CTransaction>());
+            ssValue >> vRecords.back();
+        }
+    } catch (std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    return true;
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string& name, bool fValue)
 {
     return Write(std::make_pair('F', name), fValue ? '1' : '0');
@@ -214,23 +910,46 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     ssKeySet << make_pair('b', uint256(0));
     pcursor->Seek(ssKeySet.str());
 
-    // Load mapBlockIndex
+    // Load mapBlockIndex, a batch of entries at a time so that their header
+    // hashes can be computed together
     uint256 nPreviousCheckpoint;
-    while (pcursor->Valid()) {
+    std::vector<CDiskBlockIndex> vDiskIndex;
+    std::vector<CBlockHeader> vHeaders;
+    bool fDone = false;
+    while (!fDone) {
         boost::this_thread::interruption_point();
         try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'b') {
+            vDiskIndex.clear();
+            while (vDiskIndex.size() < BLOCK_INDEX_LOAD_BATCH) {
+                if (!pcursor->Valid()) {
+                    fDone = true;
+                    break;
+                }
+                leveldb::Slice slKey = pcursor->key();
+                CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
+                ssKey >> chType;
+                if (chType != 'b') {
+                    fDone = true;
+                    break; // finished loading block index
+                }
                 leveldb::Slice slValue = pcursor->value();
                 CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
+                vDiskIndex.push_back(CDiskBlockIndex());
+                ssValue >> vDiskIndex.back();
+                pcursor->Next();
+            }
+
+            vHeaders.resize(vDiskIndex.size());
+            for (size_t i = 0; i < vDiskIndex.size(); i++)
+                vHeaders[i] = vDiskIndex[i].GetBlockHeader();
+            CBlockHeader::PrecomputeHashes(vHeaders.data(), vHeaders.size());
+
+            for (size_t i = 0; i < vDiskIndex.size(); i++) {
+                const CDiskBlockIndex& diskindex = vDiskIndex[i];
 
                 // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
+                CBlockIndex* pindexNew = InsertBlockIndex(vHeaders[i].GetHash());
                 pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
                 pindexNew->pnext = InsertBlockIndex(diskindex.hashNext);
                 pindexNew->nHeight = diskindex.nHeight;
@@ -261,10 +980,6 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
                 // ppcoin: build setStakeSeen
                 if (pindexNew->IsProofOfStake())
                     setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
             }
         } catch (std::exception& e) {
             return error("%s : Deserialize or I/O error - %s", __func__, e.what());
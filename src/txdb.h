@@ -10,12 +10,22 @@
 #include "leveldbwrapper.h"
 #include "main.h"
 
+#include <deque>
 #include <map>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+class CBlock;
+class CBlockIndex;
 class CCoins;
+class CHashWriter;
 class uint256;
 
 //! -dbcache default (MiB)
@@ -24,8 +34,28 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 4096 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! Outputs converted per batch when upgrading the coin database
+static const size_t COINS_UPGRADE_BATCH = 100000;
+//! -coinsprefetch default (threads)
+static const int DEFAULT_COINS_PREFETCH_THREADS = 4;
+//! max. -coinsprefetch
+static const int MAX_COINS_PREFETCH_THREADS = 16;
+//! Part of -dbcache given to the coins staged by the prefetcher, at most 64 MiB
+static const int COINS_PREFETCH_CACHE_DIVISOR = 8;
+static const size_t MAX_COINS_PREFETCH_CACHE = 64 << 20;
+//! -asyncflush default
+static const bool DEFAULT_ASYNC_FLUSH = true;
+
+class CCoinsViewDBCursor;
+
+/** Add the unspent outputs of one transaction to the statistics and the hash of a UTXO set */
+void UpdateCoinsStats(CCoinsStats& stats, CHashWriter& ss, const uint256& txid, const CCoins& coins);
 
-/** CCoinsView backed by the LevelDB coin database (chainstate/) */
+/**
+ * CCoinsView backed by the LevelDB coin database (chainstate/). Each unspent
+ * output is stored as its own record, so spending one output of a wide
+ * transaction does not rewrite the others.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
@@ -35,10 +65,148 @@ public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
     bool GetCoins(const uint256& txid, CCoins& coins) const;
+    //! Reads the one record of the output
+    bool GetCoinsOutput(const COutPoint& out, CCoins& coins) const;
     bool HaveCoins(const uint256& txid) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
     bool GetStats(CCoinsStats& stats) const;
+
+    //! Convert records from the old one per transaction format; returns false if interrupted
+    bool Upgrade();
+
+    //! Iterate over all transactions with unspent outputs, in txid order; throws on corrupted records
+    CCoinsViewDBCursor* Cursor() const;
+};
+
+/** Reads a CCoinsViewDB sequentially, one transaction's unspent outputs at a time */
+class CCoinsViewDBCursor
+{
+public:
+    bool Valid() const { return fValid; }
+    const uint256& GetTxid() const { return txid; }
+    const CCoins& GetCoins() const { return coins; }
+    //! Size of the database records of the current transaction
+    size_t GetSerializedSize() const { return nSerializedSize; }
+    //! Best block of the database state the cursor reads, which later writes do not change
+    const uint256& GetBestBlock() const { return hashBestBlock; }
+
+    //! Move to the next transaction; throws on corrupted records
+    void Next();
+
+private:
+    CCoinsViewDBCursor(leveldb::Iterator* pcursorIn) : pcursor(pcursorIn), fValid(false), nSerializedSize(0), hashBestBlock(0) {}
+
+    boost::scoped_ptr<leveldb::Iterator> pcursor;
+    bool fValid;
+    uint256 txid;
+    CCoins coins;
+    size_t nSerializedSize;
+    uint256 hashBestBlock;
+
+    friend class CCoinsViewDB;
+};
+
+/**
+ * CCoinsView that reads the coins spent by upcoming blocks from its backing
+ * view on a small pool of threads, so ConnectBlock finds them in memory
+ * instead of waiting for one database read per input. Entries are staged
+ * until the cache above asks for them; they are moved out on the first
+ * GetCoins and dropped whenever coins are written back.
+ */
+class CCoinsViewPrefetch : public CCoinsViewBacked
+{
+private:
+    //! Maximum number of queued txids
+    static const size_t MAX_QUEUED = 100000;
+
+    //! Protects the queues, the staging map and the counters
+    mutable boost::mutex cs;
+    boost::condition_variable cond;
+    //! Signalled when the queues run empty and no worker is busy
+    mutable boost::condition_variable condIdle;
+    //! Held shared by the workers around a read and its staging, exclusively by BatchWrite
+    boost::shared_mutex csWrite;
+    boost::thread_group threadGroup;
+    bool fStop;
+
+    //! Blocks are queued by position, so the block index may go away under the workers
+    std::deque<CDiskBlockPos> queueBlocks;
+    std::deque<uint256> queueTxids;
+    //! Workers between taking an item off a queue and finishing it
+    int nBusy;
+    mutable std::map<uint256, CCoins> mapStaged;
+    //! Memory used by the staged entries, kept within nMaxStagedUsage
+    mutable size_t nStagedUsage;
+    size_t nMaxStagedUsage;
+    mutable uint64_t nHits;
+    mutable uint64_t nMisses;
+
+    void ThreadPrefetch();
+    void ClearStaged() const;
+
+public:
+    CCoinsViewPrefetch(CCoinsView* viewIn, int nThreads, size_t nMaxStagedUsageIn);
+    ~CCoinsViewPrefetch();
+
+    bool GetCoins(const uint256& txid, CCoins& coins) const;
+    //! Served from a staged entry without moving it out, as other outputs of it may be read next
+    bool GetCoinsOutput(const COutPoint& out, CCoins& coins) const;
+    bool HaveCoins(const uint256& txid) const;
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+
+    //! Queue the inputs of a block that is about to be connected
+    void PrefetchBlock(const CBlock& block);
+    //! Queue blocks on disk, in connection order; they are read by the workers
+    void PrefetchBlocks(const std::vector<CDiskBlockPos>& vpos);
+    //! Wait until everything queued has been read and staged
+    void WaitForIdle() const;
+    //! Number of reads served from and past the staged entries, and the entries currently staged
+    void GetPrefetchStats(uint64_t& nHitsOut, uint64_t& nMissesOut, size_t& nStagedOut) const;
+};
+
+/**
+ * CCoinsView that writes batches of coins to its backing view on a
+ * dedicated thread, so flushing the chainstate does not hold up validation.
+ * Until a batch is on disk, reads of its entries are answered from memory.
+ * One batch is written at a time; a second BatchWrite waits for the first.
+ * The batch is a copy of the modified entries, which the caller keeps.
+ * The backing view must only read the batch, as CCoinsViewDB does.
+ */
+class CCoinsViewAsyncWriter : public CCoinsViewBacked
+{
+private:
+    //! Protects everything below
+    mutable boost::mutex cs;
+    mutable boost::condition_variable cond;
+    boost::thread thread;
+    bool fStop;
+
+    //! The batch being written, its memory usage, and the block it moves the view to
+    CCoinsMap mapPending;
+    size_t nPendingUsage;
+    uint256 hashPending;
+    bool fPending;
+    bool fFailed;
+
+    void ThreadWrite();
+
+public:
+    CCoinsViewAsyncWriter(CCoinsView* viewIn);
+    ~CCoinsViewAsyncWriter();
+
+    bool GetCoins(const uint256& txid, CCoins& coins) const;
+    bool GetCoinsOutput(const COutPoint& out, CCoins& coins) const;
+    bool HaveCoins(const uint256& txid) const;
+    uint256 GetBestBlock() const;
+    //! Take over the entries of mapCoins and start writing them
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+    bool GetStats(CCoinsStats& stats) const;
+
+    //! Wait until the batch being written, if any, is on disk. Returns false if any write failed.
+    bool WaitForWrite() const;
+    //! Memory used by the batch being written, which counts against the coins cache
+    size_t DynamicMemoryUsage() const;
 };
 
 /** Access to the block database (blocks/index/) */
@@ -53,6 +221,7 @@ private:
 
 public:
     bool WriteBlockIndex(const CDiskBlockIndex& blockindex);
+    bool WriteBlockIndex(const std::vector<CDiskBlockIndex>& vIndex);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo& fileinfo);
     bool WriteBlockFileInfo(int nFile, const CBlockFileInfo& fileinfo);
     bool ReadLastBlockFile(int& nFile);
@@ -61,6 +230,9 @@ public:
     bool ReadReindexing(bool& fReindex);
     bool ReadTxIndex(const uint256& txid, CDiskTxPos& pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >& list);
+    bool ReadBudgetCollateral(const uint256& txid, CTransaction& tx, uint256& hashBlock);
+    bool WriteBudgetCollaterals(const std::vector<CTransaction>& vtx, const uint256& hashBlock);
+    bool ReadBudgetCollaterals(std::vector<std::pair<uint256, CTransaction> >& vRecords);
     bool WriteFlag(const std::string& name, bool fValue);
     bool ReadFlag(const std::string& name, bool& fValue);
     bool WriteInt(const std::string& name, int nValue);
@@ -0,0 +1,262 @@
+// Copyright (c) 2018 The Hash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "utxosnapshot.h"
+
+#include "chainparams.h"
+#include "checkpoints.h"
+#include "clientversion.h"
+#include "hash.h"
+#include "init.h"
+#include "main.h"
+#include "streams.h"
+#include "txdb.h"
+#include "ui_interface.h"
+#include "util.h"
+
+#include <string.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/scoped_ptr.hpp>
+
+/** Number of block index entries or transactions written to the databases at once */
+static const size_t UTXO_SNAPSHOT_BATCH = 100000;
+
+CUTXOSnapshotHeader::CUTXOSnapshotHeader() : nFormatVersion(UTXO_SNAPSHOT_VERSION), hashBlock(0), nHeight(-1), nTransactions(0), nBudgetCollaterals(0), hashSerialized(0), hashIndex(0)
+{
+    memcpy(pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE);
+}
+
+bool DumpUTXOSnapshot(const boost::filesystem::path& path, CCoinsViewDB& coinsdb, CUTXOSnapshotHeader& header, std::string& strError)
+{
+    header = CUTXOSnapshotHeader();
+    boost::scoped_ptr<CCoinsViewDBCursor> pcursor;
+    std::vector<CDiskBlockIndex> vIndex;
+    std::vector<std::pair<uint256, CTransaction> > vCollaterals;
+    {
+        // Only flushing and taking the snapshot hold up the node; the cursor
+        // reads the database as it was then, however the chain moves on.
+        LOCK(cs_main);
+        FlushStateToDisk();
+        pcursor.reset(coinsdb.Cursor());
+        header.hashBlock = pcursor->GetBestBlock();
+        BlockMap::iterator mi = mapBlockIndex.find(header.hashBlock);
+        if (mi == mapBlockIndex.end() || mi->second != chainActive.Tip()) {
+            strError = "The coin database is not at the chain tip";
+            return false;
+        }
+        header.nHeight = chainActive.Height();
+        vIndex.reserve(header.nHeight + 1);
+        for (int nHeight = 0; nHeight <= header.nHeight; nHeight++) {
+            vIndex.push_back(CDiskBlockIndex(chainActive[nHeight]));
+            vIndex.back().nStatus &= BLOCK_VALID_MASK;
+        }
+        // A node bootstrapped from the snapshot never sees the blocks of
+        // the budget fees, so they come along
+        std::vector<std::pair<uint256, CTransaction> > vRecords;
+        if (!pblocktree->ReadBudgetCollaterals(vRecords)) {
+            strError = "Failed to read the budget collaterals";
+            return false;
+        }
+        for (size_t i = 0; i < vRecords.size(); i++) {
+            BlockMap::iterator mi = mapBlockIndex.find(vRecords[i].first);
+            if (mi != mapBlockIndex.end() && chainActive.Contains(mi->second))
+                vCollaterals.push_back(vRecords[i]);
+        }
+        header.nBudgetCollaterals = vCollaterals.size();
+    }
+
+    CAutoFile file(fopen(path.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        strError = strprintf("Unable to open %s for writing", path.string());
+        return false;
+    }
+
+    try {
+        // Written again at the end, once the hashes are known
+        file << header;
+
+        CHashWriter ssIndex(SER_GETHASH, PROTOCOL_VERSION);
+        BOOST_FOREACH (const CDiskBlockIndex& diskindex, vIndex) {
+            file << diskindex;
+            ssIndex << diskindex;
+        }
+        for (size_t i = 0; i < vCollaterals.size(); i++) {
+            file << vCollaterals[i];
+            ssIndex << vCollaterals[i];
+        }
+
+        CCoinsStats stats;
+        CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+        ss << header.hashBlock;
+        for (; pcursor->Valid(); pcursor->Next()) {
+            file << pcursor->GetTxid();
+            file << pcursor->GetCoins();
+            UpdateCoinsStats(stats, ss, pcursor->GetTxid(), pcursor->GetCoins());
+        }
+
+        header.nTransactions = stats.nTransactions;
+        header.hashSerialized = ss.GetHash();
+        header.hashIndex = ssIndex.GetHash();
+        if (fseek(file.Get(), 0, SEEK_SET) != 0)
+            throw std::runtime_error("seek failed");
+        file << header;
+        FileCommit(file.Get());
+    } catch (const std::exception& e) {
+        file.fclose();
+        boost::filesystem::remove(path);
+        strError = strprintf("Error writing %s: %s", path.string(), e.what());
+        return false;
+    }
+
+    LogPrintf("Wrote UTXO snapshot of block %s (height %d, %u transactions, hash %s) to %s\n",
+        header.hashBlock.ToString(), header.nHeight, header.nTransactions, header.hashSerialized.ToString(), path.string());
+    return true;
+}
+
+bool LoadUTXOSnapshot(const boost::filesystem::path& path, CCoinsViewDB& coinsdb, CBlockTreeDB& blocktree, std::string& strError)
+{
+    CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        strError = strprintf(_("Unable to open %s"), path.string());
+        return false;
+    }
+
+    try {
+        CUTXOSnapshotHeader header;
+        file >> header;
+        if (memcmp(header.pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE) != 0) {
+            strError = _("The snapshot is for a different network");
+            return false;
+        }
+        if (header.nFormatVersion != UTXO_SNAPSHOT_VERSION) {
+            strError = strprintf(_("Unsupported snapshot version %d"), header.nFormatVersion);
+            return false;
+        }
+        if (header.nHeight < 0) {
+            strError = _("The snapshot's header is invalid");
+            return false;
+        }
+        // The history below the snapshot is never validated here, so only
+        // a snapshot pinned in the chain parameters is trusted
+        MapSnapshotAnchors::const_iterator itAnchor = Params().SnapshotAnchors().find(header.nHeight);
+        if (itAnchor == Params().SnapshotAnchors().end() || itAnchor->second.hashBlock != header.hashBlock ||
+            itAnchor->second.hashSerialized != header.hashSerialized || itAnchor->second.hashIndex != header.hashIndex) {
+            strError = strprintf(_("The snapshot of block %s is not one this version accepts"), header.hashBlock.ToString());
+            return false;
+        }
+        LogPrintf("Loading UTXO snapshot %s of block %s (height %d, %u transactions, hash %s)\n",
+            path.string(), header.hashBlock.ToString(), header.nHeight, header.nTransactions, header.hashSerialized.ToString());
+
+        // The block index entries must link the genesis block to the
+        // snapshot block and agree with the checkpoints. Their proof of work
+        // is checked when the block index is loaded.
+        CHashWriter ssIndex(SER_GETHASH, PROTOCOL_VERSION);
+        std::vector<CDiskBlockIndex> vIndex;
+        uint256 hashPrev;
+        for (int nHeight = 0; nHeight <= header.nHeight; nHeight++) {
+            vIndex.push_back(CDiskBlockIndex());
+            CDiskBlockIndex& diskindex = vIndex.back();
+            file >> diskindex;
+            ssIndex << diskindex;
+            uint256 hash = diskindex.GetBlockHash();
+            bool fLinked = nHeight == 0 ? hash == Params().HashGenesisBlock() : diskindex.hashPrev == hashPrev;
+            if (!fLinked || diskindex.nHeight != nHeight || diskindex.nTx == 0 ||
+                (diskindex.nStatus & ~BLOCK_VALID_MASK) || !Checkpoints::CheckBlock(nHeight, hash)) {
+                strError = strprintf(_("The snapshot's block index is invalid at height %d"), nHeight);
+                return false;
+            }
+            hashPrev = hash;
+
+            if (vIndex.size() == UTXO_SNAPSHOT_BATCH || nHeight == header.nHeight) {
+                if (!blocktree.WriteBlockIndex(vIndex)) {
+                    strError = _("Failed to write to block index");
+                    return false;
+                }
+                vIndex.clear();
+                if (ShutdownRequested())
+                    return false;
+            }
+        }
+        if (hashPrev != header.hashBlock) {
+            strError = _("The snapshot's block index does not match its header");
+            return false;
+        }
+
+        for (uint64_t i = 0; i < header.nBudgetCollaterals; i++) {
+            std::pair<uint256, CTransaction> record;
+            file >> record;
+            ssIndex << record;
+            std::vector<CTransaction> vtx(1, record.second);
+            if (!blocktree.WriteBudgetCollaterals(vtx, record.first)) {
+                strError = _("Failed to write to block index");
+                return false;
+            }
+        }
+        if (ssIndex.GetHash() != header.hashIndex) {
+            strError = _("The snapshot's block index does not match its header");
+            return false;
+        }
+
+        // The unspent outputs go in as fresh entries, so the coin database
+        // writes them without looking up existing records.
+        CCoinsStats stats;
+        CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+        ss << header.hashBlock;
+        CCoinsMap mapCoins;
+        uint256 txidPrev;
+        for (uint64_t i = 0; i < header.nTransactions; i++) {
+            uint256 txid;
+            file >> txid;
+            // Stored in database key order, which also rules out duplicates
+            if (i > 0 && memcmp(txidPrev.begin(), txid.begin(), txid.size()) >= 0) {
+                strError = _("The snapshot's transactions are not in order");
+                return false;
+            }
+            txidPrev = txid;
+            CCoinsCacheEntry& entry = mapCoins[txid];
+            file >> entry.coins;
+            entry.flags = CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH;
+            UpdateCoinsStats(stats, ss, txid, entry.coins);
+
+            if (mapCoins.size() == UTXO_SNAPSHOT_BATCH || i + 1 == header.nTransactions) {
+                if (!coinsdb.BatchWrite(mapCoins, uint256(0))) {
+                    strError = _("Failed to write to coin database");
+                    return false;
+                }
+                mapCoins.clear();
+                uiInterface.ShowProgress(_("Loading UTXO snapshot..."), (int)((i + 1) * 100 / header.nTransactions));
+                if (ShutdownRequested())
+                    return false;
+            }
+        }
+        uiInterface.ShowProgress("", 100);
+        if (ss.GetHash() != header.hashSerialized) {
+            strError = _("The snapshot's unspent outputs do not match its hash");
+            return false;
+        }
+
+        // The history below the snapshot is missing, as after pruning, but
+        // the node need not go on pruning
+        if (!blocktree.WriteFlag("txindex", false) || !blocktree.WriteFlag("prunedblockfiles", true) ||
+            !blocktree.WriteFlag("utxosnapshot", true) || !blocktree.Sync()) {
+            strError = _("Failed to write to block index");
+            return false;
+        }
+
+        // Setting the best block commits the snapshot; until then, loading
+        // it again overwrites the same entries.
+        CCoinsMap mapEmpty;
+        if (!coinsdb.BatchWrite(mapEmpty, header.hashBlock)) {
+            strError = _("Failed to write to coin database");
+            return false;
+        }
+        LogPrintf("Loaded UTXO snapshot: %u transactions, %u outputs\n", stats.nTransactions, stats.nTransactionOutputs);
+    } catch (const std::exception& e) {
+        strError = strprintf(_("Error reading %s: %s"), path.string(), e.what());
+        return false;
+    }
+    return true;
+}
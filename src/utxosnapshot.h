@@ -0,0 +1,77 @@
+// Copyright (c) 2018 The Hash developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_UTXOSNAPSHOT_H
+#define BITCOIN_UTXOSNAPSHOT_H
+
+#include "protocol.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <stdint.h>
+#include <string>
+
+#include <boost/filesystem/path.hpp>
+
+class CBlockTreeDB;
+class CCoinsViewDB;
+
+/** Version of the UTXO snapshot file format */
+static const int UTXO_SNAPSHOT_VERSION = 2;
+
+/**
+ * Header of a UTXO set snapshot file. It is followed by the block index
+ * entries of the active chain from the genesis block up to hashBlock, without
+ * their disk positions, by nBudgetCollaterals (block hash, transaction) pairs
+ * of the budget fees paid in that chain, and then by nTransactions (txid,
+ * CCoins) pairs in txid order.
+ */
+class CUTXOSnapshotHeader
+{
+public:
+    unsigned char pchMessageStart[MESSAGE_START_SIZE];
+    int nFormatVersion;
+    uint256 hashBlock;
+    int nHeight;
+    uint64_t nTransactions;
+    uint64_t nBudgetCollaterals;
+    //! Hash of the unspent outputs at hashBlock, as hash_serialized in gettxoutsetinfo
+    uint256 hashSerialized;
+    //! Hash of the block index entries and budget collaterals
+    uint256 hashIndex;
+
+    CUTXOSnapshotHeader();
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion)
+    {
+        READWRITE(FLATDATA(pchMessageStart));
+        READWRITE(nFormatVersion);
+        READWRITE(hashBlock);
+        READWRITE(nHeight);
+        READWRITE(nTransactions);
+        READWRITE(nBudgetCollaterals);
+        READWRITE(hashSerialized);
+        READWRITE(hashIndex);
+    }
+};
+
+/**
+ * Flush the chain state and write the coin database and the active chain's
+ * block index to a snapshot file. Takes cs_main only until the database
+ * snapshot is taken, at the tip.
+ */
+bool DumpUTXOSnapshot(const boost::filesystem::path& path, CCoinsViewDB& coinsdb, CUTXOSnapshotHeader& header, std::string& strError);
+
+/**
+ * Import a snapshot into empty block tree and coin databases. Only snapshots
+ * pinned in the chain parameters are accepted. The snapshot block becomes
+ * the tip; blocks below it have no data, as on a pruned node.
+ * Returns false on errors and when interrupted by a shutdown request.
+ */
+bool LoadUTXOSnapshot(const boost::filesystem::path& path, CCoinsViewDB& coinsdb, CBlockTreeDB& blocktree, std::string& strError);
+
+#endif // BITCOIN_UTXOSNAPSHOT_H
@@ -11,7 +11,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 71319;
+static const int PROTOCOL_VERSION = 71321;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 210;
@@ -36,5 +36,11 @@ static const int MEMPOOL_GD_VERSION = 60002;
 //! "filter*" commands are disabled without NODE_BLOOM after and including this version
 static const int NO_BLOOM_VERSION = 70005;
 
+//! "getheaders" is answered with "headers", and blocks are synced headers-first, starting with this version
+static const int HEADERS_FIRST_VERSION = 71320;
+
+//! "cmpctblock", "getblocktxn" and "blocktxn" messages, for compact block relay, starting with this version
+static const int COMPACT_BLOCKS_VERSION = 71321;
+
 
 #endif // BITCOIN_VERSION_H
@@ -160,7 +160,8 @@ private:
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
 public:
-    bool MintableCoins();
+    /** Whether a coin can stake now, else when one first can, if any */
+    bool MintableCoins(int64_t* pnMintableTime = NULL);
     bool SelectStakeCoins(std::set<std::pair<const CWalletTx*, unsigned int> >& setCoins, CAmount nTargetAmount) const;
     int CountInputsWithAmount(CAmount nInputAmount);
 